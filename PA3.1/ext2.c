@@ -1,3 +1,6 @@
+// For O_DIRECT
+#define _GNU_SOURCE
+
 #include "ext2.h"
 
 #include <stdio.h>
@@ -12,9 +15,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #define EXT2_OFFSET_SUPERBLOCK 1024
 
+// Identifier of the next volume opened (see volume_t.id)
+static _Atomic uint32_t next_volume_id = 1;
+
 /* open_volume_file: Opens the specified file and reads the initial
    EXT2 data contained in the file, including the boot sector, file
    allocation table and root directory.
@@ -39,7 +46,57 @@ void *checkMalloc(int size){
 
 volume_t *open_volume_file(const char *filename) {
 
-    int fd = open(filename, O_RDONLY);
+    return open_volume_file_flags(filename, 0);
+}
+
+/* open_volume_file_flags: Same as open_volume_file, with options on
+   how the volume file is accessed.
+
+   Parameters:
+     filename: Name of the file containing the volume data.
+     flags: 0 (zero), or a combination of:
+       EXT2_OPEN_DIRECT: Open the file with O_DIRECT, bypassing the
+                         host page cache, so data cached by the
+                         volume's cache pool is the only cached copy.
+                         All reads go through a pool of aligned
+                         buffers owned by the volume.
+       EXT2_OPEN_HUGEPAGES: With EXT2_OPEN_DIRECT, back the aligned
+                            buffers with huge pages if available.
+       EXT2_OPEN_INODE_TABLE: Keep the inodes read in a compact
+                              table (see ext2itable.c) instead of
+                              the volume's cache pool. read_inode
+                              then only fills the hot fields.
+       EXT2_OPEN_VERIFY: Verify every block read from the file
+                         against the checksum sidecar named after
+                         it (see ext2crc.c); blocks that do not
+                         match fail to read with EIO.
+       EXT2_OPEN_WRITE: Open the file for writing, so the volume can
+                        be changed with the functions of ext2write.c.
+                        Changes are held in a write-back cache (see
+                        ext2writeback.c) until flushed, at the latest
+                        when the volume is closed.
+   The file may also be a compressed image (see ext2zimage.c), read
+   through the image's own cache; compressed images cannot be opened
+   with EXT2_OPEN_DIRECT.
+   Returns:
+     Same as open_volume_file. If EXT2_OPEN_DIRECT is given and the
+     file does not support O_DIRECT, returns NULL with errno set to
+     EINVAL, as when EXT2_OPEN_VERIFY is given and the sidecar does
+     not match the volume, or EXT2_OPEN_WRITE is given with
+     EXT2_OPEN_DIRECT or EXT2_OPEN_VERIFY, or for a compressed image.
+     If EXT2_OPEN_WRITE is given and the volume uses features that
+     cannot be written, sets errno to EROFS.
+ */
+volume_t *open_volume_file_flags(const char *filename, int flags) {
+
+    // Changes are written a block at a time, and the checksums would not follow them
+    if ((flags & EXT2_OPEN_WRITE) && (flags & (EXT2_OPEN_DIRECT | EXT2_OPEN_VERIFY))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(filename, ((flags & EXT2_OPEN_WRITE) ? O_RDWR : O_RDONLY) |
+                  ((flags & EXT2_OPEN_DIRECT) ? O_DIRECT : 0));
     if (fd == -1) return NULL;
 
     struct stat vol_st;
@@ -49,77 +106,317 @@ volume_t *open_volume_file(const char *filename) {
         return NULL;
     }
 
-
     volume_t *volume = checkMalloc(sizeof(volume_t) * 1);
     superblock_t *superBlock = checkMalloc(sizeof(superblock_t) * 1);
 
     volume->fd = fd;
+    volume->flags = flags;
     volume->volume_size = vol_st.st_size;
-//    volume->block_size = vol_st.st_blksize;
+    volume->group_blocks = NULL;
+    volume->symlinks = NULL;
+    volume->cache = NULL;
+    volume->buffers = NULL;
+    volume->inodes = NULL;
+    volume->profile = NULL;
+    volume->zimage = NULL;
+    volume->checksums = NULL;
+    volume->writeback = NULL;
+    volume->allocator = NULL;
+    atomic_init(&volume->generation, 0);
+
+    // Compressed images hold their own cache of data, so O_DIRECT does not apply to them
+    if (!(flags & EXT2_OPEN_DIRECT)) {
+        int compressed = zimage_open(fd, &volume->zimage);
+        if (compressed < 0) goto fail;
+        if (compressed && (flags & EXT2_OPEN_WRITE)) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if (compressed) volume->volume_size = zimage_size(volume->zimage);
+    }
 
-    if (volume->volume_size < EXT2_OFFSET_SUPERBLOCK * 2) {
-        free(superBlock);
-        return NULL;
+    if (volume->volume_size < EXT2_OFFSET_SUPERBLOCK * 2) goto fail;
+
+    if (flags & EXT2_OPEN_DIRECT) {
+        volume->buffers = buffer_pool_create(EXT2_DIRECT_BUFFER_SIZE, EXT2_DIRECT_BUFFERS,
+                                             flags & EXT2_OPEN_HUGEPAGES);
+        if (!volume->buffers) goto fail;
     }
 
     //https://www.nongnu.org/ext2-doc/ext2.html
 
-    lseek(fd, EXT2_OFFSET_SUPERBLOCK, SEEK_SET);
+    if (volume_pread(volume, superBlock, sizeof(superblock_t) * 1, EXT2_OFFSET_SUPERBLOCK)
+        != sizeof(superblock_t))
+        goto fail;
 
-    if (read(fd, superBlock, sizeof(superblock_t) * 1) < 0) {
-        free(superBlock);
-        return NULL;
-    }
+    if (EXT2_SUPER_MAGIC != superBlock->s_magic) goto fail;
 
-    if (EXT2_SUPER_MAGIC != superBlock->s_magic) {
-        free(superBlock);
-        return NULL;
-    }
+    // Block sizes range from 1 KiB to 64 KiB
+    if (superBlock->s_log_block_size > 6) goto fail;
 
     volume->super = *superBlock;
     volume->block_size = EXT2_OFFSET_SUPERBLOCK << superBlock->s_log_block_size;
-    volume->volume_size = superBlock->s_blocks_count * volume->block_size;
+    volume->block_bits = 10 + superBlock->s_log_block_size;
+    volume->ops = block_ops_select(volume->block_size);
+    volume->id = atomic_fetch_add(&next_volume_id, 1);
+
+    // Revision 0 has no s_inode_size; later revisions use a power of two of at least 128 bytes
+    volume->inode_size = superBlock->s_rev_level ? superBlock->s_inode_size : sizeof(inode_t);
+    if (volume->inode_size < sizeof(inode_t) || volume->inode_size > volume->block_size ||
+        (volume->inode_size & (volume->inode_size - 1)))
+        goto fail;
+
+    if (!superBlock->s_blocks_count || !superBlock->s_blocks_per_group || !superBlock->s_inodes_per_group)
+        goto fail;
+
+    volume->volume_size = (uint64_t) superBlock->s_blocks_count * volume->block_size;
     volume->num_groups = 1 + (superBlock->s_blocks_count - 1) / superBlock->s_blocks_per_group;
 
     //  printf("block size: %d\n", volume->block_size);
     //  printf("volume size: %d\n", volume->volume_size);
     //  printf("num groups: %d\n", volume->num_groups);
 
-    group_desc_t *groupDescription = checkMalloc(sizeof(group_desc_t) * volume->num_groups);
+    /* Group descriptors are read one block at a time, the first time
+       one of them is needed (see get_group_desc), so opening a volume
+       costs the same whatever its size. */
+    volume->descs_per_block = volume->block_size / sizeof(group_desc_t);
+    volume->group_blocks = calloc((volume->num_groups - 1) / volume->descs_per_block + 1,
+                                  sizeof(*volume->group_blocks));
+    if (!volume->group_blocks) goto fail;
+
+    if (flags & EXT2_OPEN_VERIFY) {
+        size_t length = strlen(filename) + sizeof(EXT2_CHECKSUM_SUFFIX);
+        char *sidecar = malloc(length);
+        if (!sidecar) goto fail;
+        snprintf(sidecar, length, "%s%s", filename, EXT2_CHECKSUM_SUFFIX);
+        int rv = checksums_attach(volume, sidecar);
+        free(sidecar);
+        if (rv < 0) goto fail;
+
+        // The superblock was read before the checksums were known
+        if (volume_pread(volume, superBlock, sizeof(superblock_t), EXT2_OFFSET_SUPERBLOCK) != sizeof(superblock_t) ||
+            memcmp(superBlock, &volume->super, sizeof(superblock_t)))
+            goto fail;
+    }
 
-    if (volume->block_size != 1024)
-        lseek(fd, volume->block_size, SEEK_SET);
-    else
-        lseek(fd, volume->block_size * 2, SEEK_SET);
+    volume->symlinks = symlink_cache_create();
 
-    if (read(fd, groupDescription, sizeof(group_desc_t) * volume->num_groups) < 0) {
-        free(superBlock);
-        free(groupDescription);
-        return NULL;
+    if (flags & EXT2_OPEN_INODE_TABLE) {
+        volume->inodes = inode_table_create(superBlock->s_inodes_count);
+        if (!volume->inodes) goto fail;
     }
 
-    volume->groups = groupDescription;
-
-    /* TO BE COMPLETED BY THE STUDENT */
+    if (flags & EXT2_OPEN_WRITE) {
+        // Only directory file types are known among the features required to write
+        if ((superBlock->s_rev_level && (superBlock->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE)) ||
+            (superBlock->s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER |
+                                                 EXT2_FEATURE_RO_COMPAT_LARGE_FILE))) {
+            errno = EROFS;
+            goto fail;
+        }
+        if (writeback_attach(volume) < 0 || alloc_attach(volume) < 0) goto fail;
+    }
 
-//    free(groupDescription);
     free(superBlock);
     return volume;
+
+ fail:
+    alloc_detach(volume);
+    writeback_detach(volume);
+    checksums_detach(volume);
+    zimage_close(volume->zimage);
+    close(fd);
+    buffer_pool_destroy(volume->buffers);
+    symlink_cache_destroy(volume->symlinks);
+    inode_table_destroy(volume->inodes);
+    free(volume->group_blocks);
+    free(superBlock);
+    free(volume);
+    return NULL;
 }
 
 /* close_volume_file: Frees and closes all resources used by a EXT2 volume.
+   Changes still held in the write-back cache of a writable volume
+   are flushed first.
 
    Parameters:
      volume: pointer to volume to be freed.
  */
 void close_volume_file(volume_t *volume) {
 
+    if (volume->writeback && writeback_flush(volume, 1) < 0)
+        perror("Cannot write changes to volume");
+    alloc_detach(volume);
+    writeback_detach(volume);
+    profile_detach(volume);
+    cache_detach_volume(volume);
+    checksums_detach(volume);
+    zimage_close(volume->zimage);
     close(volume->fd);
-    free(volume->groups);
+    symlink_cache_destroy(volume->symlinks);
+    buffer_pool_destroy(volume->buffers);
+    inode_table_destroy(volume->inodes);
+    for (uint32_t i = 0; i < (volume->num_groups - 1) / volume->descs_per_block + 1; i++)
+        free(volume->group_blocks[i]);
+    free(volume->group_blocks);
     free(volume);
 
 }
 
+/* raw_pread: Reads data from the volume file, or from the chunks of a
+   compressed image, as volume_pread does, without verifying it.
+ */
+static ssize_t raw_pread(volume_t *volume, void *buffer, size_t size, off_t offset) {
+
+    if (volume->zimage)
+        return zimage_pread(volume->zimage, buffer, size, offset);
+
+    if (!volume->buffers)
+        return pread(volume->fd, buffer, size, offset);
+
+    // Requests that are already aligned go straight to the caller's buffer
+    if (((uintptr_t) buffer | (uintptr_t) offset | size) % EXT2_DIRECT_ALIGN == 0)
+        return pread(volume->fd, buffer, size, offset);
+
+    size_t chunkSize = buffer_pool_buffer_size(volume->buffers);
+    char *aligned = buffer_pool_get(volume->buffers);
+    size_t done = 0;
+
+    while (done < size) {
+        off_t position = offset + done;
+        off_t alignedStart = position - position % EXT2_DIRECT_ALIGN;
+        size_t skip = position - alignedStart;
+        size_t length = skip + (size - done);
+
+        length = (length + EXT2_DIRECT_ALIGN - 1) / EXT2_DIRECT_ALIGN * EXT2_DIRECT_ALIGN;
+        if (length > chunkSize) length = chunkSize;
+
+        ssize_t rv = pread(volume->fd, aligned, length, alignedStart);
+        if (rv < 0) {
+            buffer_pool_put(volume->buffers, aligned);
+            return -1;
+        }
+        if (rv <= skip) break;
+
+        size_t useful = rv - skip < size - done ? rv - skip : size - done;
+        memcpy((char *) buffer + done, aligned + skip, useful);
+        done += useful;
+
+        if (rv < length) break;
+    }
+
+    buffer_pool_put(volume->buffers, aligned);
+    return done;
+}
+
+/* verify_read: Checks the bytes read from the volume file starting at
+   a block against the checksums. A last block cut short, at the end of
+   the file, is checked as if padded with zeros, in scratch (allocated
+   on first use, block_size bytes).
+
+   Returns:
+     0 if the data matches, or -1 otherwise.
+ */
+static int verify_read(volume_t *volume, uint64_t block_no, char *data, size_t bytes, char **scratch) {
+
+    size_t full = bytes >> volume->block_bits;
+    size_t rest = bytes & (volume->block_size - 1);
+
+    if (full && checksums_verify(volume, block_no, data, full) < 0) return -1;
+    if (!rest) return 0;
+
+    if (!*scratch && !(*scratch = malloc(volume->block_size))) return -1;
+    memmove(*scratch, data + (full << volume->block_bits), rest);
+    memset(*scratch + rest, 0, volume->block_size - rest);
+    return checksums_verify(volume, block_no + full, *scratch, 1);
+}
+
+/* verified_pread: Reads like raw_pread, verifying every block touched.
+   Runs of whole blocks are read straight into the caller's buffer and
+   verified together; blocks only partly requested are read whole into
+   a scratch buffer first.
+ */
+static ssize_t verified_pread(volume_t *volume, void *buffer, size_t size, off_t offset) {
+
+    uint32_t mask = volume->block_size - 1;
+    char *scratch = NULL;
+    size_t done = 0;
+
+    while (done < size) {
+        uint64_t position = offset + done;
+        uint64_t block_no = position >> volume->block_bits;
+        size_t inBlock = position & mask;
+        char *target = (char *) buffer + done;
+
+        if (!inBlock && size - done > mask) {
+            size_t length = (size - done) & ~(size_t) mask;
+            ssize_t rv = raw_pread(volume, target, length, position);
+            if (rv < 0 || verify_read(volume, block_no, target, rv, &scratch) < 0) goto fail;
+            done += rv;
+            if (rv < length) break;
+            continue;
+        }
+
+        if (!scratch && !(scratch = malloc(volume->block_size))) goto fail;
+        ssize_t rv = raw_pread(volume, scratch, volume->block_size, block_no << volume->block_bits);
+        if (rv < 0 || verify_read(volume, block_no, scratch, rv, &scratch) < 0) goto fail;
+        if (rv <= inBlock) break;
+
+        size_t useful = rv - inBlock < size - done ? rv - inBlock : size - done;
+        memcpy(target, scratch + inBlock, useful);
+        done += useful;
+        if (rv < volume->block_size) break;
+    }
+
+    free(scratch);
+    return done;
+
+ fail:
+    free(scratch);
+    return -1;
+}
+
+/* volume_pread: Reads raw data from the volume file. For volumes
+   opened with EXT2_OPEN_DIRECT, the data is read in aligned chunks
+   into buffers of the volume's buffer pool and copied out, so callers
+   may use any offset, size and buffer. For compressed images, the
+   data is decompressed from the chunks holding it. For volumes with
+   checksums, every block the data comes from is read whole and
+   verified. For writable volumes, blocks changed and not yet written
+   are taken from the write-back cache, and the volume reads as zeros
+   past the end of a file shorter than the volume.
+
+   Parameters:
+     volume: pointer to volume.
+     buffer: Pointer to location where data is to be stored.
+     size: Number of bytes to read.
+     offset: Position in the volume file to read from.
+
+   Returns:
+     The number of bytes read, which is smaller than size only at the
+     end of the file, or -1 in case of error (with errno set to EIO if
+     a block does not match its checksum).
+ */
+ssize_t volume_pread(volume_t *volume, void *buffer, size_t size, off_t offset) {
+
+    if (volume->checksums)
+        return verified_pread(volume, buffer, size, offset);
+    if (!volume->writeback)
+        return raw_pread(volume, buffer, size, offset);
+
+    ssize_t rv = raw_pread(volume, buffer, size, offset);
+    if (rv < 0) return -1;
+
+    // Blocks may have been allocated past the end of the file, and not flushed yet
+    if (rv < size && offset + rv < volume->volume_size) {
+        size_t extended = volume->volume_size - offset < size ? volume->volume_size - offset : size;
+        memset((char *) buffer + rv, 0, extended - rv);
+        rv = extended;
+    }
+    writeback_overlay(volume, buffer, rv, offset);
+    return rv;
+}
+
 /* read_block: Reads data from one or more blocks. Saves the resulting
    data in buffer 'buffer'. This function also supports sparse data,
    where a block number equal to 0 sets the value of the corresponding
@@ -139,20 +436,106 @@ void close_volume_file(volume_t *volume) {
  */
 ssize_t read_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer) {
 
-    /* TO BE COMPLETED BY THE STUDENT */
-
-    unsigned int actualOffset = volume->block_size * block_no + offset;
+    if (block_no == EXT2_INVALID_BLOCK_NUMBER) return -1;
 
     if (block_no == 0)  {
-        memset(buffer, 0, size); // <-- Better implementation
+        memset(buffer, 0, size);
         return size;
     }
-    else if (actualOffset + size >= volume->volume_size) {
+
+    uint64_t actualOffset = (uint64_t) volume->block_size * block_no + offset;
+
+    if (actualOffset >= volume->volume_size) return 0;
+    if (actualOffset + size > volume->volume_size)
         size = volume->volume_size - actualOffset;
-        if (size == 0) return 0;
+
+    uint32_t blocks = (offset % volume->block_size + size + volume->block_size - 1) / volume->block_size;
+    trace_blocks += blocks;
+    if (volume->profile)
+        profile_record_blocks(volume, block_no + offset / volume->block_size, blocks);
+
+    if (!volume->cache)
+        return volume_pread(volume, buffer, size, actualOffset);
+
+    /* Cached volumes are read one whole block at a time, so that the
+       cache only ever holds complete blocks. */
+    char *blockBuffer = NULL;
+    uint32_t done = 0;
+
+    while (done < size) {
+        uint32_t current = block_no + (offset + done) / volume->block_size;
+        uint32_t inBlock = (offset + done) % volume->block_size;
+        uint32_t chunk = volume->block_size - inBlock;
+        if (chunk > size - done) chunk = size - done;
+
+        // Full blocks go straight to the caller's buffer
+        char *target = (char *) buffer + done;
+        if (chunk != volume->block_size) {
+            if (!blockBuffer && !(blockBuffer = malloc(volume->block_size))) return -1;
+            target = blockBuffer;
+        }
+
+        if (!cache_lookup(volume, EXT2_CACHE_BLOCK, current, target, volume->block_size)) {
+            ssize_t rv = volume_pread(volume, target, volume->block_size,
+                                      (uint64_t) current * volume->block_size);
+            if (rv < 0) {
+                free(blockBuffer);
+                return -1;
+            }
+            // The last block of the volume may be cut short
+            if (rv < volume->block_size) {
+                memset(target + rv, 0, volume->block_size - rv);
+            } else {
+                cache_insert(volume, EXT2_CACHE_BLOCK, current, target, volume->block_size);
+            }
+        }
+
+        if (target == blockBuffer)
+            memcpy((char *) buffer + done, blockBuffer + inBlock, chunk);
+        done += chunk;
     }
 
-    lseek(volume->fd, actualOffset, SEEK_SET);
-    return (block_no == EXT2_INVALID_BLOCK_NUMBER) ?
-           -1 : read(volume->fd, buffer, size);
-}
\ No newline at end of file
+    free(blockBuffer);
+    return done;
+}
+
+/* get_group_desc: Returns the descriptor of a block group. The block
+   of the descriptor table holding it is read the first time one of
+   its descriptors is needed, and kept until the volume is closed.
+
+   Parameters:
+     volume: pointer to volume.
+     group: Number of the block group.
+
+   Returns:
+     A pointer to the descriptor, valid until the volume is closed,
+     or NULL if the group number is out of range or the descriptor
+     cannot be read.
+ */
+const group_desc_t *get_group_desc(volume_t *volume, uint32_t group) {
+
+    if (group >= volume->num_groups) return NULL;
+
+    _Atomic(group_desc_t *) *slot = &volume->group_blocks[group / volume->descs_per_block];
+    group_desc_t *descs = atomic_load_explicit(slot, memory_order_acquire);
+
+    if (!descs) {
+        // The table starts in the block after the superblock
+        uint64_t block_no = volume->super.s_first_data_block + 1 + group / volume->descs_per_block;
+        group_desc_t *expected = NULL;
+
+        descs = malloc(volume->block_size);
+        if (!descs) return NULL;
+        if (volume_pread(volume, descs, volume->block_size, block_no << volume->block_bits) != volume->block_size) {
+            free(descs);
+            return NULL;
+        }
+
+        // Another thread may have read the same block meanwhile
+        if (!atomic_compare_exchange_strong(slot, &expected, descs)) {
+            free(descs);
+            descs = expected;
+        }
+    }
+    return &descs[group % volume->descs_per_block];
+}
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 typedef struct superblock {
@@ -57,18 +58,48 @@ typedef struct group_desc {
   char     bg_reserved[12];      // Reserved for future use
 } group_desc_t;
 
+typedef struct symlink_cache symlink_cache_t;
+typedef struct cache_pool cache_pool_t;
+typedef struct cache_share cache_share_t;
+typedef struct buffer_pool buffer_pool_t;
+typedef struct block_ops block_ops_t;
+typedef struct inode_table inode_table_t;
+typedef struct profile profile_t;
+typedef struct zimage zimage_t;
+typedef struct checksums checksums_t;
+typedef struct writeback writeback_t;
+typedef struct allocator allocator_t;
+
 typedef struct ext2volume {
   
   int fd;
+  int flags; // EXT2_OPEN_* flags the volume was opened with
   
   superblock_t super;
 
   // Values obtained from other fields, saved here for easier computation
   uint32_t block_size;
-  uint32_t volume_size;
+  uint32_t block_bits; // log2(block_size)
+  uint32_t inode_size; // Size of an on-disk inode (s_inode_size, or 128 for revision 0)
+  uint64_t volume_size;
 
   uint32_t num_groups;
-  group_desc_t *groups;
+  uint32_t descs_per_block;              // Group descriptors in a block of the descriptor table
+  _Atomic(group_desc_t *) *group_blocks; // Blocks of the descriptor table read so far (see get_group_desc)
+
+  symlink_cache_t *symlinks; // Targets of symbolic links stored in data blocks
+  cache_share_t *cache;      // Share of a cache pool, or NULL if not cached
+  buffer_pool_t *buffers;    // Aligned buffers for EXT2_OPEN_DIRECT, or NULL
+  inode_table_t *inodes;     // Compact copies of the inodes read, for EXT2_OPEN_INODE_TABLE, or NULL
+  profile_t *profile;        // Access profile being recorded, or NULL (see ext2profile.c)
+  zimage_t *zimage;          // Chunks of a compressed image, or NULL (see ext2zimage.c)
+  checksums_t *checksums;    // Checksums of the blocks, verified on every read, or NULL (see ext2crc.c)
+  writeback_t *writeback;    // Blocks changed and not yet written, for EXT2_OPEN_WRITE, or NULL (see ext2writeback.c)
+  allocator_t *allocator;    // Free space and preallocations, for EXT2_OPEN_WRITE, or NULL (see ext2alloc.c)
+
+  uint32_t id;               // Unique among the volumes opened by this process, never 0
+  const block_ops_t *ops;    // Kernels specialized for the block size (see ext2blocks.c)
+  _Atomic uint32_t generation; // Changed whenever a metadata block is rewritten (see ext2blocks.c)
 } volume_t;
 
 
@@ -119,6 +150,19 @@ typedef struct dir_entry {
   char     de_name[256]; // name string
 } dir_entry_t;
 
+// Size of the fixed part of a directory entry (everything but de_name)
+#define EXT2_DIR_ENTRY_HEADER_LEN 8
+
+// Per-block-size kernels, selected once per volume
+struct block_ops {
+  const char *name;
+  // Same as get_inode_block_no
+  uint32_t (*map_block)(volume_t *volume, inode_t *inode, uint64_t block_idx);
+  // Decodes up to 'count' entries of a directory block in memory, from byte *pos
+  ssize_t (*parse_directory_block)(const char *block, uint32_t len, uint32_t *pos, off_t base,
+                                   dir_entry_t *entries, off_t *next_offsets, size_t count);
+};
+
 // Value for s_magic
 #define EXT2_SUPER_MAGIC 0xEF53
 
@@ -138,6 +182,9 @@ typedef struct dir_entry {
 #define EXT2_OS_FREEBSD 3
 #define EXT2_OS_LITES   4
 
+// Values for s_feature_incompat
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002 // Directory entries record the file type
+
 // Values for s_feature_ro_compat
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001 // Sparse Superblock
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002 // Large file support, 64-bit file size
@@ -172,25 +219,590 @@ typedef struct dir_entry {
 
 #define EXT2_INVALID_BLOCK_NUMBER ((uint32_t) -1)
 
+// Number of direct block numbers in an inode
+#define EXT2_NDIR_BLOCKS 12
+
+// Flags for open_volume_file_flags
+#define EXT2_OPEN_DIRECT      0x1 // Bypass the host page cache (O_DIRECT)
+#define EXT2_OPEN_HUGEPAGES   0x2 // Back the O_DIRECT buffers with huge pages
+#define EXT2_OPEN_INODE_TABLE 0x4 // Keep the inodes read in a compact table instead of the cache pool
+#define EXT2_OPEN_VERIFY      0x8 // Verify the blocks read against the checksum sidecar of the file
+#define EXT2_OPEN_WRITE       0x10 // Allow changes to the volume (see ext2write.c)
+
+#define EXT2_DIRECT_ALIGN       4096        // Alignment of O_DIRECT offsets, sizes and buffers
+#define EXT2_DIRECT_BUFFER_SIZE (64 * 1024) // Size of each O_DIRECT buffer
+#define EXT2_DIRECT_BUFFERS     32          // Number of O_DIRECT buffers per volume (2 MiB)
+
+// Flags for resolve_path
+#define EXT2_RESOLVE_FOLLOW        0x1 // Follow symbolic links found in the path
+#define EXT2_RESOLVE_NOFOLLOW_LAST 0x2 // With EXT2_RESOLVE_FOLLOW, keep a final symlink itself (as lstat)
+
+// Maximum number of symbolic links followed while resolving one path
+#define EXT2_MAX_SYMLINK_FOLLOWS 40
+
+// Values for de_file_type
+#define EXT2_FT_UNKNOWN  0
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR      2
+#define EXT2_FT_CHRDEV   3
+#define EXT2_FT_BLKDEV   4
+#define EXT2_FT_FIFO     5
+#define EXT2_FT_SOCK     6
+#define EXT2_FT_SYMLINK  7
+
+// Kinds of objects kept in a cache pool
+#define EXT2_CACHE_BLOCK  0 // Block contents, keyed by block number
+#define EXT2_CACHE_INODE  1 // inode_t, keyed by inode number
+#define EXT2_CACHE_DENTRY 2 // Result of a name lookup in a directory
+#define EXT2_CACHE_KINDS  3
+
+typedef struct cache_stats {
+  uint64_t used;   // Bytes of the pool used by the volume
+  uint64_t demand; // Recent number of lookups
+  uint64_t hits[EXT2_CACHE_KINDS];
+  uint64_t misses[EXT2_CACHE_KINDS];
+} cache_stats_t;
+
+// Memory use of a cache under a memory governor (see ext2mem.c)
+typedef struct mem_usage {
+  uint64_t bytes;       // Memory used
+  uint64_t budget;      // Memory the cache may use
+  uint64_t ghost_hits;  // Misses on data dropped to stay within the budget, since creation
+  uint64_t ghost_bytes; // Memory used by the dropped data still remembered
+} mem_usage_t;
+
 // For ext2.c
 volume_t *open_volume_file(const char *filename);
+volume_t *open_volume_file_flags(const char *filename, int flags);
 void close_volume_file(volume_t *volume);
+ssize_t volume_pread(volume_t *volume, void *buffer, size_t size, off_t offset);
 
 ssize_t read_block(volume_t *volume, uint32_t block_no, uint32_t offset, uint32_t size, void *buffer);
+const group_desc_t *get_group_desc(volume_t *volume, uint32_t group);
+
+// For ext2blocks.c
+extern const block_ops_t block_ops_generic;
+const block_ops_t *block_ops_select(uint32_t block_size);
+
+// For ext2buffer.c
+buffer_pool_t *buffer_pool_create(size_t buffer_size, size_t count, int hugepages);
+void buffer_pool_destroy(buffer_pool_t *pool);
+void *buffer_pool_get(buffer_pool_t *pool);
+void buffer_pool_put(buffer_pool_t *pool, void *buffer);
+size_t buffer_pool_buffer_size(buffer_pool_t *pool);
+
+// Visitor for walk_inode_blocks: level is 0 for data blocks, 1-3 for indirect blocks
+typedef int (*block_visitor_t)(void *ctx, uint64_t block_idx, uint32_t block_no, int level);
 
 // For ext2file.c
 ssize_t read_inode(volume_t *volume, uint32_t inode_no, inode_t *buffer);
+ssize_t read_inodes(volume_t *volume, const uint32_t *inode_nos, size_t count, inode_t *buffers);
+ssize_t read_inode_full(volume_t *volume, uint32_t inode_no, inode_t *buffer);
 uint32_t get_inode_block_no(volume_t *volume, inode_t *inode, uint64_t block_idx);
+int walk_inode_blocks(volume_t *volume, inode_t *inode, block_visitor_t visit, void *ctx);
 ssize_t read_file_block(volume_t *volume, inode_t *inode, uint64_t offset, uint64_t max_size, void *buffer);
 ssize_t read_file_content(volume_t *volume, inode_t *inode, uint64_t offset, uint64_t max_size, void *buffer);
+int write_inode(volume_t *volume, uint32_t inode_no, const inode_t *inode);
+int clear_inode(volume_t *volume, uint32_t inode_no);
+
+// For ext2itable.c
+inode_table_t *inode_table_create(uint32_t num_inodes);
+void inode_table_destroy(inode_table_t *table);
+int inode_table_get(inode_table_t *table, uint32_t inode_no, inode_t *buffer);
+void inode_table_store(inode_table_t *table, uint32_t first_inode_no, const void *raw,
+                       uint32_t count, uint32_t stride);
+void inode_table_forget(inode_table_t *table, uint32_t inode_no);
+void inode_table_usage(inode_table_t *table, uint64_t *inodes, uint64_t *bytes);
+void inode_table_memory(inode_table_t *table, mem_usage_t *usage);
+void inode_table_resize(inode_table_t *table, uint64_t budget);
+
+// Visitor for walk_directory_tree
+typedef int (*tree_visitor_t)(void *ctx, const char *path, uint32_t inode_no, inode_t *inode);
 
 // For ext2dir.c
 int64_t next_directory_entry(volume_t *volume, inode_t *dir_inode, off_t *offset, dir_entry_t *dir_entry);
+ssize_t read_directory_entries(volume_t *volume, inode_t *dir_inode, off_t *offset,
+                               dir_entry_t *entries, off_t *next_offsets, size_t count);
 int64_t find_file_in_directory(volume_t *volume, inode_t *inode, const char *name, dir_entry_t *buffer);
 uint32_t find_file_from_path(volume_t *volume, const char *path, inode_t *dest_inode);
+uint32_t resolve_path(volume_t *volume, const char *path, inode_t *dest_inode, int flags);
+int64_t lookup_in_directory(volume_t *volume, uint32_t dir_no, inode_t *dir_inode, const char *name);
+void forget_directory_entry(volume_t *volume, uint32_t dir_no, const char *name);
+int walk_directory_tree(volume_t *volume, const char *root, tree_visitor_t visit, void *ctx);
+
+typedef struct path_result {
+  uint32_t inode_no; // Inode number of the file, or 0 (zero) if not found
+  int error;         // If not found, errno value as set by resolve_path
+  inode_t inode;
+} path_result_t;
+
+// For ext2resolve.c
+ssize_t resolve_paths(volume_t *volume, const char *const *paths, size_t count, int flags,
+                      unsigned int num_threads, path_result_t *results);
 
 // For ext2symlink.c
 int32_t read_symlink_target(volume_t *volume, inode_t *inode, char *buffer, size_t size);
+symlink_cache_t *symlink_cache_create(void);
+void symlink_cache_destroy(symlink_cache_t *cache);
+
+// Operations for asynchronous requests (ext2_request_t.op)
+#define EXT2_ASYNC_READ_BLOCK 1 // read_block(volume, block_no, block_offset, size, buffer)
+#define EXT2_ASYNC_READ_INODE 2 // read_inode(volume, inode_no, &inode)
+#define EXT2_ASYNC_READ_FILE  3 // read_file_content(volume, &inode, offset, size, buffer)
+#define EXT2_ASYNC_FIND_PATH  4 // find_file_from_path(volume, path, &inode); result is the inode number
+#define EXT2_ASYNC_READ_PATH  5 // Path lookup, then read_file_content of the file found
+
+typedef struct ext2_async ext2_async_t;
+typedef struct ext2_request ext2_request_t;
+typedef void (*ext2_callback_t)(ext2_request_t *request);
+
+typedef struct ext2_request {
+  // Set by the caller before submitting
+  int op;                   // One of EXT2_ASYNC_*
+  volume_t *volume;
+  uint32_t block_no;        // READ_BLOCK
+  uint32_t block_offset;    // READ_BLOCK
+  uint32_t inode_no;        // READ_INODE; set to the inode found by FIND_PATH and READ_PATH
+  const char *path;         // FIND_PATH, READ_PATH
+  uint64_t offset;          // READ_FILE, READ_PATH
+  uint64_t size;            // READ_BLOCK, READ_FILE, READ_PATH
+  void *buffer;             // READ_BLOCK, READ_FILE, READ_PATH
+  inode_t inode;            // Input of READ_FILE; output of the other inode and path operations
+  ext2_callback_t callback; // Optional, called by ext2_async_reap
+  void *user_data;          // Not used by the library
+
+  // Set when the request completes
+  ssize_t result;           // Same as the return value of the synchronous call, or -1
+  int error;                // 0, or errno value describing the error
+
+  // Internal state
+  int step;
+  uint64_t done;
+  char *path_copy;
+  char *cursor;
+  ext2_request_t *next;
+} ext2_request_t;
+
+// Operations recorded in trace files; ext2replay replays the reads (the first four)
+#define EXT2_TRACE_GETATTR  1
+#define EXT2_TRACE_READDIR  2
+#define EXT2_TRACE_READ     3
+#define EXT2_TRACE_READLINK 4
+#define EXT2_TRACE_CREATE   5
+#define EXT2_TRACE_WRITE    6
+#define EXT2_TRACE_TRUNCATE 7
+#define EXT2_TRACE_MKDIR    8
+#define EXT2_TRACE_UNLINK   9
+#define EXT2_TRACE_RMDIR    10
+#define EXT2_TRACE_RENAME   11
+#define EXT2_TRACE_OPEN     12
+
+#define EXT2_TRACE_MAGIC   "E2TR"
+#define EXT2_TRACE_VERSION 1
+
+typedef struct trace_header {
+  char     magic[4];          // EXT2_TRACE_MAGIC
+  uint32_t version;           // EXT2_TRACE_VERSION
+  uint64_t start_realtime_ns; // Wall-clock time the trace started
+} trace_header_t;
+
+// Each record is followed by path_len bytes of path (not null-terminated)
+typedef struct trace_record {
+  uint64_t start_ns;   // Start of the operation, relative to the start of the trace
+  uint64_t latency_ns; // Duration of the operation
+  uint64_t offset;     // Offset (read, readdir)
+  uint64_t size;       // Size requested (read, readlink)
+  uint32_t inode_no;   // Inode of the file, or 0 if unknown
+  uint32_t blocks;     // Number of blocks touched by read_block
+  int32_t  result;     // Value returned to FUSE
+  uint16_t path_len;
+  uint8_t  op;         // One of EXT2_TRACE_*
+  uint8_t  pad;
+} trace_record_t;
+
+typedef struct trace_span {
+  uint64_t start_ns;
+  uint64_t blocks;
+} trace_span_t;
+
+// For ext2cache.c
+cache_pool_t *cache_pool_create(uint64_t budget);
+void cache_pool_destroy(cache_pool_t *pool);
+int cache_attach_volume(cache_pool_t *pool, volume_t *volume);
+void cache_detach_volume(volume_t *volume);
+uint32_t cache_lookup(volume_t *volume, uint32_t kind, uint64_t key, void *buffer, uint32_t size);
+void cache_insert(volume_t *volume, uint32_t kind, uint64_t key, const void *data, uint32_t size);
+void cache_invalidate(volume_t *volume, uint32_t kind, uint64_t key);
+int cache_volume_stats(volume_t *volume, cache_stats_t *stats);
+void cache_pool_memory(cache_pool_t *pool, mem_usage_t *usage);
+void cache_pool_resize(cache_pool_t *pool, uint64_t budget);
+
+// For ext2epoch.c
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *object);
+void epoch_synchronize(void);
+
+typedef struct mem_governor mem_governor_t;
+
+typedef struct mem_consumer_stats {
+  char name[32];     // Kind of cache, followed by the volume it belongs to
+  mem_usage_t usage;
+  double rate;       // Ghost hits per MiB remembered, over the last rebalance interval
+} mem_consumer_stats_t;
+
+typedef struct mem_governor_stats {
+  uint64_t limit;      // Configured limit of the resident memory of the process
+  uint64_t rss;        // Resident memory at the last rebalance
+  uint64_t max_rss;    // Largest resident memory seen at a rebalance
+  uint64_t available;  // Memory the caches were allowed at the last rebalance
+  uint64_t rebalances;
+  uint64_t shrinks;    // Rebalances that had to shrink the caches, and explicit shrinks
+  uint64_t moved;      // Bytes of budget moved from one cache to another
+} mem_governor_stats_t;
+
+// For ext2mem.c
+mem_governor_t *mem_governor_create(uint64_t limit);
+void mem_governor_destroy(mem_governor_t *gov);
+int mem_attach_pool(mem_governor_t *gov, cache_pool_t *pool);
+int mem_attach_volume(mem_governor_t *gov, volume_t *volume);
+void mem_detach_volume(mem_governor_t *gov, volume_t *volume);
+void mem_governor_rebalance(mem_governor_t *gov);
+void mem_governor_shrink(mem_governor_t *gov);
+void mem_governor_stats(mem_governor_t *gov, mem_governor_stats_t *stats);
+size_t mem_governor_consumers(mem_governor_t *gov, mem_consumer_stats_t *consumers, size_t max);
+uint64_t mem_process_rss(void);
+
+// For ext2async.c
+ext2_async_t *ext2_async_create(unsigned int num_threads);
+void ext2_async_destroy(ext2_async_t *ctx);
+int ext2_async_fd(ext2_async_t *ctx);
+int ext2_async_submit(ext2_async_t *ctx, ext2_request_t *request);
+int ext2_async_reap(ext2_async_t *ctx, ext2_request_t **completed, int max, int min);
+size_t ext2_async_in_flight(ext2_async_t *ctx);
+
+// Classes of operations of a scheduler
+#define EXT2_SCHED_META    0 // getattr, readdir, readlink and path lookups
+#define EXT2_SCHED_BULK    1 // Pieces of file data reads
+#define EXT2_SCHED_CLASSES 2
+
+// Number of buckets of the histogram of waiting times (powers of two of microseconds)
+#define EXT2_SCHED_HISTOGRAM 32
+
+typedef struct ext2_sched ext2_sched_t;
+
+typedef struct sched_stats {
+  uint64_t granted;     // Operations admitted (pieces, for bulk reads)
+  uint64_t waited;      // Of which had to queue
+  uint32_t running;     // Currently admitted
+  uint32_t queued;      // Currently queued
+  uint32_t max_queued;  // Largest number queued at once
+  uint64_t wait_ns;     // Total time spent queued
+  uint64_t max_wait_ns;
+  uint64_t wait_histogram[EXT2_SCHED_HISTOGRAM]; // Bucket 0 is under 1 us, bucket i under 2^i us
+} sched_stats_t;
+
+// For ext2sched.c
+ext2_sched_t *sched_create(unsigned int slots, unsigned int bulk_slots, uint32_t chunk_size);
+void sched_destroy(ext2_sched_t *sched);
+void sched_enter(ext2_sched_t *sched, int class, uint64_t flow);
+void sched_exit(ext2_sched_t *sched, int class);
+ssize_t sched_read_file_content(ext2_sched_t *sched, uint64_t flow, volume_t *volume, uint32_t inode_no,
+                                inode_t *inode, uint64_t offset, uint64_t size, void *buffer,
+                                pthread_rwlock_t *lock);
+void sched_stats(ext2_sched_t *sched, int class, sched_stats_t *stats);
+uint64_t sched_wait_percentile(const sched_stats_t *stats, double fraction);
+
+// For ext2trace.c
+extern int trace_enabled;
+extern __thread uint64_t trace_blocks; // Blocks accessed by read_block in this thread
+int trace_start(const char *filename);
+uint64_t trace_stop(void);
+void trace_span_begin(trace_span_t *span);
+void trace_span_end(trace_span_t *span, int op, const char *path, uint32_t inode_no,
+                    uint64_t offset, uint64_t size, int32_t result);
+FILE *trace_open(const char *filename, trace_header_t *header);
+int trace_read_record(FILE *file, trace_record_t *record, char *path, size_t path_size);
+
+// Kinds of access profile entries
+#define EXT2_PROFILE_INODE  1 // value is an inode number
+#define EXT2_PROFILE_BLOCKS 2 // value is the first of 'length' blocks
+
+#define EXT2_PROFILE_MAGIC   "E2PF"
+#define EXT2_PROFILE_VERSION 1
+
+// A profile file is a header followed by num_entries entries
+typedef struct profile_header {
+  char     magic[4];    // EXT2_PROFILE_MAGIC
+  uint32_t version;     // EXT2_PROFILE_VERSION
+  uint8_t  uuid[16];    // s_uuid of the volume profiled
+  uint32_t block_size;
+  uint32_t num_entries;
+} profile_header_t;
+
+typedef struct profile_entry {
+  uint32_t value;
+  uint32_t weight; // Number of accesses recorded
+  uint16_t length; // Number of blocks (EXT2_PROFILE_BLOCKS), or 1
+  uint8_t  kind;   // One of EXT2_PROFILE_*
+  uint8_t  pad;
+} profile_entry_t;
+
+typedef struct profile_warm_stats {
+  uint64_t entries;   // Entries in the profile
+  uint64_t inodes;    // Inodes read
+  uint64_t blocks;    // Blocks read
+  uint64_t deferrals; // Times warming waited for foreground reads to stop
+  int completed;      // Every entry was warmed
+  double seconds;
+} profile_warm_stats_t;
+
+// For ext2profile.c
+int profile_attach(volume_t *volume);
+void profile_detach(volume_t *volume);
+void profile_record_inode(volume_t *volume, uint32_t inode_no);
+void profile_record_blocks(volume_t *volume, uint32_t block_no, uint32_t count);
+ssize_t profile_save(volume_t *volume, const char *filename);
+ssize_t profile_load(volume_t *volume, const char *filename, profile_entry_t **entries);
+int profile_warm_start(volume_t *volume, const char *filename);
+int profile_warm_wait(volume_t *volume, profile_warm_stats_t *stats);
+
+#define EXT2_ZIMAGE_MAGIC   "E2ZI"
+#define EXT2_ZIMAGE_VERSION 1
+
+// Limits of the chunk size of compressed images (a power of two)
+#define EXT2_ZIMAGE_MIN_CHUNK 4096
+#define EXT2_ZIMAGE_MAX_CHUNK (16 << 20)
+
+// A compressed image is a header, the compressed chunks, then the
+// index: num_chunks + 1 uint64_t offsets of the chunks in the file
+typedef struct zimage_header {
+  char     magic[4];     // EXT2_ZIMAGE_MAGIC
+  uint32_t version;      // EXT2_ZIMAGE_VERSION
+  uint32_t chunk_size;   // Bytes of the volume file per chunk
+  uint32_t pad;
+  uint64_t image_size;   // Size of the volume file
+  uint64_t num_chunks;
+  uint64_t index_offset; // Position of the index in the file
+} zimage_header_t;
+
+typedef struct zimage_stats {
+  uint64_t hits;        // Reads served by a cached chunk
+  uint64_t misses;      // Chunks decompressed for a reader
+  uint64_t prefetched;  // Chunks decompressed ahead of readers
+  uint64_t cache_bytes; // Memory used by decompressed chunks
+} zimage_stats_t;
+
+// For ext2zimage.c
+int zimage_open(int fd, zimage_t **image);
+void zimage_close(zimage_t *image);
+uint64_t zimage_size(zimage_t *image);
+ssize_t zimage_pread(zimage_t *image, void *buffer, size_t size, off_t offset);
+void zimage_stats(zimage_t *image, zimage_stats_t *stats);
+void zimage_memory(zimage_t *image, mem_usage_t *usage);
+void zimage_resize(zimage_t *image, uint64_t budget);
+
+#define EXT2_CHECKSUM_MAGIC   "E2CS"
+#define EXT2_CHECKSUM_VERSION 1
+#define EXT2_CHECKSUM_SUFFIX  ".crc" // Appended to the volume file name for EXT2_OPEN_VERIFY
+
+// A checksum sidecar is a header followed by num_blocks uint32_t: the
+// CRC32C of each block of the volume, in order
+typedef struct checksum_header {
+  char     magic[4];   // EXT2_CHECKSUM_MAGIC
+  uint32_t version;    // EXT2_CHECKSUM_VERSION
+  uint32_t block_size;
+  uint32_t pad;
+  uint64_t num_blocks; // s_blocks_count of the volume
+} checksum_header_t;
+
+typedef struct checksum_stats {
+  uint64_t verified;    // Blocks read that matched their checksum
+  uint64_t failed;      // Reads that failed verification
+  uint64_t last_failed; // Block that failed verification last
+} checksum_stats_t;
+
+// For ext2crc.c
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+void crc32c_blocks(const void *data, size_t block_size, size_t count, uint32_t *crcs);
+const char *crc32c_implementation(void);
+int checksums_attach(volume_t *volume, const char *filename);
+void checksums_detach(volume_t *volume);
+int checksums_verify(volume_t *volume, uint64_t first_block, const void *data, size_t count);
+int checksums_stats(volume_t *volume, checksum_stats_t *stats);
+
+// Kinds of blocks held by a write-back cache, written in this order by writeback_flush
+#define EXT2_WRITEBACK_DATA   0 // Data of regular files
+#define EXT2_WRITEBACK_BITMAP 1 // Block and inode bitmaps
+#define EXT2_WRITEBACK_META   2 // Inode tables, indirect blocks and directories
+#define EXT2_WRITEBACK_KINDS  3
+
+// Dirty data held before the operations of ext2write.c flush it (see writeback_over_limit)
+#define EXT2_WRITEBACK_LIMIT (64 << 20)
+
+// Runs of whole blocks of file data written straight to the volume file (see writeback_write_through)
+#define EXT2_WRITE_THROUGH_MIN (64 << 10)
+
+typedef struct writeback_stats {
+  uint64_t dirty_blocks;   // Blocks changed and not written yet
+  uint64_t flushes;
+  uint64_t blocks_written; // Blocks written, descriptors and superblock included
+  uint64_t writes;         // System calls made, each writing a run of adjacent blocks
+} writeback_stats_t;
+
+// For ext2writeback.c
+int writeback_attach(volume_t *volume);
+void writeback_detach(volume_t *volume);
+void *writeback_block(volume_t *volume, uint32_t block_no, int kind, int fill);
+void writeback_forget(volume_t *volume, uint32_t block_no);
+int writeback_write_through(volume_t *volume, uint32_t block_no, uint32_t count, const void *data);
+group_desc_t *writeback_group_desc(volume_t *volume, uint32_t group);
+void writeback_super(volume_t *volume);
+void writeback_overlay(volume_t *volume, void *buffer, size_t size, off_t offset);
+int writeback_over_limit(volume_t *volume);
+int writeback_flush(volume_t *volume, int sync);
+int writeback_stats(volume_t *volume, writeback_stats_t *stats);
+
+// Preallocation windows of the allocator, held in memory for files written at their end
+#define EXT2_ALLOC_MIN_WINDOW 8    // Blocks a window keeps when space runs short
+#define EXT2_ALLOC_MAX_WINDOW 2048 // Shortest free run a new window is placed in, if any
+#define EXT2_ALLOC_WINDOWS    64   // Files with a window at once
+
+// For ext2alloc.c
+int alloc_attach(volume_t *volume);
+void alloc_detach(volume_t *volume);
+uint32_t alloc_inode(volume_t *volume, uint32_t parent_no, int directory);
+int free_inode(volume_t *volume, uint32_t inode_no, int directory);
+uint32_t alloc_goal(volume_t *volume, uint32_t inode_no);
+uint32_t alloc_blocks(volume_t *volume, uint32_t inode_no, uint32_t goal, uint32_t wanted, int streaming,
+                      uint32_t *count);
+int free_blocks(volume_t *volume, uint32_t block_no, uint32_t count);
+void alloc_release(volume_t *volume, uint32_t inode_no);
+
+// For ext2write.c
+uint32_t create_file(volume_t *volume, const char *path, uint16_t mode, uint32_t uid, uint32_t gid);
+uint32_t make_directory(volume_t *volume, const char *path, uint16_t mode, uint32_t uid, uint32_t gid);
+ssize_t write_file_content(volume_t *volume, uint32_t inode_no, uint64_t offset, uint64_t size, const void *buffer);
+int truncate_file(volume_t *volume, uint32_t inode_no, uint64_t size);
+int unlink_file(volume_t *volume, const char *path);
+int remove_directory(volume_t *volume, const char *path);
+int rename_file(volume_t *volume, const char *from, const char *to);
+
+typedef struct check_stats {
+  uint64_t problems;    // Number of problems found
+  uint64_t inodes;      // Number of inodes in use checked
+  uint64_t directories; // Number of directories checked
+  uint64_t blocks;      // Number of blocks owned by metadata or inodes
+} check_stats_t;
+
+// For ext2check.c
+int check_volume(volume_t *volume, unsigned int num_threads, FILE *report, check_stats_t *stats);
+
+// Number of power-of-two buckets in layout histograms (bucket i counts values in [2^i, 2^(i+1)))
+#define EXT2_LAYOUT_BUCKETS 32
+
+// Run of physically contiguous blocks of a file. The run may include
+// the file's own indirect blocks, placed inline with the data.
+typedef struct extent {
+  uint64_t logical;  // Index of the first data block in the file
+  uint32_t physical; // Number of the first block on the volume
+  uint32_t blocks;   // Number of blocks in the run
+} extent_t;
+
+typedef struct file_layout {
+  uint32_t inode_no;
+  uint16_t mode;
+  uint64_t size;
+  uint64_t data_blocks;      // Data blocks allocated (holes excluded)
+  uint64_t indirect_blocks;  // Indirect blocks allocated
+  uint32_t num_extents;
+  uint32_t groups;           // Number of block groups the data is spread over
+  double indirect_distance;  // Mean distance, in blocks, from indirect blocks to the first block they map
+  extent_t *extents;
+} file_layout_t;
+
+typedef struct layout_summary {
+  uint64_t files;
+  uint64_t fragmented_files; // Files with more than one extent
+  uint64_t data_blocks;
+  uint64_t indirect_blocks;
+  uint64_t extents;
+  uint64_t extent_count_histogram[EXT2_LAYOUT_BUCKETS];  // Files by number of extents
+  uint64_t extent_length_histogram[EXT2_LAYOUT_BUCKETS]; // Extents by length in blocks
+  uint64_t groups_histogram[EXT2_LAYOUT_BUCKETS];        // Files by number of groups spanned
+  file_layout_t *worst;      // Worst laid out files, worst first (array provided by the caller)
+  size_t num_worst;
+  size_t max_worst;
+} layout_summary_t;
+
+typedef void (*layout_callback_t)(void *ctx, file_layout_t *layout);
+
+// For ext2layout.c
+int analyze_file_layout(volume_t *volume, uint32_t inode_no, inode_t *inode, file_layout_t *layout);
+int analyze_volume_layout(volume_t *volume, unsigned int num_threads, layout_summary_t *summary,
+                          layout_callback_t callback, void *ctx);
+
+// Flags for hash_volume_files
+#define EXT2_HASH_BLOCKS 0x1 // Keep the hash of every block in the result
+
+typedef struct file_hash {
+  uint32_t inode_no;
+  uint64_t size;
+  uint64_t hash;           // Hash of the content (same content and size, same hash)
+  uint64_t num_blocks;     // Number of blocks of data, holes included
+  uint64_t *block_hashes;  // With EXT2_HASH_BLOCKS, hash of each block, or NULL
+} file_hash_t;
+
+typedef struct hash_result {
+  file_hash_t *files;
+  size_t num_files;
+  uint64_t total_blocks;   // Blocks of data of all files, holes included
+  uint64_t bytes_read;     // Bytes read from the volume (holes are never read)
+} hash_result_t;
+
+// For ext2hash.c
+uint64_t ext2_hash64(const void *data, size_t len, uint64_t seed);
+int hash_volume_files(volume_t *volume, unsigned int num_threads, int flags, hash_result_t *result);
+void hash_result_free(hash_result_t *result);
+
+// Kinds of differences reported by compare_volumes (diff_entry_t.change)
+#define EXT2_DIFF_ADDED   'A' // Only on the second volume
+#define EXT2_DIFF_DELETED 'D' // Only on the first volume
+#define EXT2_DIFF_CHANGED 'C' // On both volumes, with the fields that differ
+
+// Fields of a changed file that differ (diff_entry_t.fields)
+#define EXT2_DIFF_MODE    0x01 // Permission bits
+#define EXT2_DIFF_OWNER   0x02 // User or group
+#define EXT2_DIFF_SIZE    0x04
+#define EXT2_DIFF_MTIME   0x08
+#define EXT2_DIFF_LINKS   0x10 // Number of hard links
+#define EXT2_DIFF_CONTENT 0x20 // Data, symbolic link target or device number
+
+// Flags for compare_volumes
+#define EXT2_COMPARE_CONTENT 0x1 // Compare the data of regular files even if their metadata match
+
+typedef struct diff_entry {
+  char change;             // One of EXT2_DIFF_ADDED, _DELETED or _CHANGED
+  const char *path;
+  uint32_t fields;         // For EXT2_DIFF_CHANGED, EXT2_DIFF_* bits of the fields that differ
+  uint16_t mode_a, mode_b; // i_mode on each volume, 0 (zero) where the file does not exist
+  uint64_t size_a, size_b;
+  int compared;            // The data of a regular file was read and compared
+  uint64_t changed_blocks; // If compared, number of blocks of data that differ
+} diff_entry_t;
+
+typedef struct compare_stats {
+  uint64_t directories; // Pairs of directories compared
+  uint64_t inodes;      // Inodes compared or reported
+  uint64_t files_read;  // Pairs of files whose data was compared
+  uint64_t bytes_read;  // Bytes of data read from both volumes
+} compare_stats_t;
+
+typedef void (*diff_callback_t)(void *ctx, const diff_entry_t *entry);
+
+// For ext2compare.c
+int compare_volumes(volume_t *a, volume_t *b, unsigned int num_threads, int flags,
+                    diff_callback_t callback, void *ctx, compare_stats_t *stats);
 
 static inline int inode_is_regular_file(inode_t *inode) {
   return (inode->i_mode & S_IFMT) == S_IFREG;
@@ -204,6 +816,23 @@ static inline int inode_is_symlink(inode_t *inode) {
   return (inode->i_mode & S_IFMT) == S_IFLNK;
 }
 
+/* inode_is_fast_symlink: Checks if the target of a symbolic link is
+   stored inline in the inode (i_symlink_target) instead of in a data
+   block. Such links have no blocks allocated other than, possibly,
+   one block of extended attributes.
+ */
+static inline int inode_is_fast_symlink(volume_t *volume, inode_t *inode) {
+  uint32_t acl_blocks = inode->i_file_acl ? volume->block_size / 512 : 0;
+  return inode_is_symlink(inode) && inode->i_blocks == acl_blocks &&
+         inode->i_size <= sizeof(inode->i_symlink_target);
+}
+
+// Checks if i_block holds block numbers (and not a symlink target or device number)
+static inline int inode_has_blocks(volume_t *volume, inode_t *inode) {
+  return inode_is_regular_file(inode) || inode_is_directory(inode) ||
+         (inode_is_symlink(inode) && !inode_is_fast_symlink(volume, inode));
+}
+
 static inline uint64_t inode_file_size(volume_t *volume, inode_t *inode) {
   // If file system supports large file sizes and file is a regular file
   if ((volume->super.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE) &&
@@ -0,0 +1,559 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* The allocator hands out the blocks and inodes of a writable volume,
+   keeping the bitmaps, the free counts of the group descriptors and
+   those of the superblock in step, all through the write-back cache
+   (see ext2writeback.c).
+
+   Blocks are allocated near a goal: the block after the previous
+   block of the file, or the start of the block group of the file's
+   inode for its first block. If the goal is taken, the first free run
+   of at least EXT2_ALLOC_MAX_WINDOW blocks is used, so a file started
+   in a fragmented area moves to free space where it can grow in one
+   piece.
+
+   A file written at its end gets a preallocation window: the whole
+   free run its next blocks were taken from, reserved for it in
+   memory. The window is not marked in the bitmaps, so the free counts
+   stay exact and nothing is lost if the volume is not closed, but
+   other files pass it by when they look for blocks, so files written
+   at once grow side by side, each in one piece, rather than taking
+   turns in the same run. A file that uses up its window goes on right
+   after it if the blocks there are free. The window is given back
+   when the file is closed or truncated, when it is taken over by
+   another file (at most EXT2_ALLOC_WINDOWS files have one at a time),
+   or when the file is written elsewhere than at its end.
+
+   When no free block is left outside the windows, the windows of the
+   other files shrink to as many blocks as each file has written in
+   it (between EXT2_ALLOC_MIN_WINDOW and EXT2_ALLOC_MAX_WINDOW), and
+   then, if that is not enough, are given up, so a volume only fills
+   up when its bitmaps do.
+
+   New directories below the root are placed in the group of their
+   parent; directories in the root are spread over the groups with
+   more free inodes and blocks than average, picking the one with the
+   fewest directories (as the Orlov allocator of Linux does). Other
+   inodes go to the group of their directory if it has free inodes
+   and blocks, or to the next group that does.
+
+   Like every change to a volume, the allocator must not be used
+   concurrently with any other operation on the volume (see
+   ext2write.c).
+ */
+
+typedef struct alloc_window {
+    uint32_t inode_no; // File the window belongs to, 0 if unused
+    uint32_t start;    // First block of the window
+    uint32_t next;     // First block of the window not used yet
+    uint32_t end;      // Block after the window
+    uint64_t used;     // Time of the last use, to replace the least recently used window
+} alloc_window_t;
+
+struct allocator {
+    alloc_window_t windows[EXT2_ALLOC_WINDOWS];
+    uint64_t clock;
+    uint8_t *bitmap; // Scratch copy of a bitmap block being searched
+};
+
+static inline uint32_t group_of_block(volume_t *volume, uint32_t block_no) {
+    return (block_no - volume->super.s_first_data_block) / volume->super.s_blocks_per_group;
+}
+
+static inline uint32_t group_first_block(volume_t *volume, uint32_t group) {
+    return volume->super.s_first_data_block + group * volume->super.s_blocks_per_group;
+}
+
+// Number of blocks in a group; the last group may be shorter
+static inline uint32_t group_num_blocks(volume_t *volume, uint32_t group) {
+    uint32_t left = volume->super.s_blocks_count - group_first_block(volume, group);
+    return left < volume->super.s_blocks_per_group ? left : volume->super.s_blocks_per_group;
+}
+
+static inline int test_bit(const uint8_t *bitmap, uint32_t bit) {
+    return bitmap[bit >> 3] & (1 << (bit & 7));
+}
+
+// Sets 'count' bits of a bitmap, starting at 'bit'
+static void set_bits(uint8_t *bitmap, uint32_t bit, uint32_t count) {
+
+    for (; count && (bit & 7); bit++, count--) bitmap[bit >> 3] |= 1 << (bit & 7);
+    memset(bitmap + (bit >> 3), 0xFF, count >> 3);
+    bit += count & ~7u;
+    for (count &= 7; count; bit++, count--) bitmap[bit >> 3] |= 1 << (bit & 7);
+}
+
+/* alloc_attach: Creates the allocator of a volume opened with
+   EXT2_OPEN_WRITE. Nothing is read until the first allocation.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted.
+ */
+int alloc_attach(volume_t *volume) {
+
+    allocator_t *al = calloc(1, sizeof(allocator_t));
+    if (!al) return -1;
+
+    if (!(al->bitmap = malloc(volume->block_size))) {
+        free(al);
+        return -1;
+    }
+    volume->allocator = al;
+    return 0;
+}
+
+/* alloc_detach: Frees the allocator of a volume. Does nothing if the
+   volume has no allocator.
+ */
+void alloc_detach(volume_t *volume) {
+
+    allocator_t *al = volume->allocator;
+    if (!al) return;
+
+    free(al->bitmap);
+    free(al);
+    volume->allocator = NULL;
+}
+
+/* Reads the bitmap of a group into the scratch buffer of the
+   allocator, with the changes not yet written, and marks the blocks
+   held by windows other than 'own' as used in it. */
+static int load_bitmap(volume_t *volume, uint32_t group, const group_desc_t *desc, const alloc_window_t *own) {
+
+    allocator_t *al = volume->allocator;
+    uint32_t first = group_first_block(volume, group), last = first + group_num_blocks(volume, group);
+
+    if (read_block(volume, desc->bg_block_bitmap, 0, volume->block_size, al->bitmap) != volume->block_size)
+        return -1;
+
+    for (int i = 0; i < EXT2_ALLOC_WINDOWS; i++) {
+        const alloc_window_t *window = &al->windows[i];
+        uint32_t from = window->next > first ? window->next : first;
+        uint32_t to = window->end < last ? window->end : last;
+        if (window->inode_no && window != own && from < to) set_bits(al->bitmap, from - first, to - from);
+    }
+    return 0;
+}
+
+/* Finds the first run of free bits in [start, end) of a bitmap of at
+   least min_len bits (or 'want' bits, if fewer). Returns its
+   first bit, with its length (up to 'want') in *len, or UINT32_MAX if
+   there is none. */
+static uint32_t find_run(const uint8_t *bitmap, uint32_t start, uint32_t end, uint32_t min_len,
+                         uint32_t want, uint32_t *len) {
+
+    uint32_t bit = start;
+
+    while (bit < end) {
+        // Whole bytes of used blocks are skipped at once
+        if (!(bit & 7) && bitmap[bit >> 3] == 0xFF) {
+            bit += 8;
+            continue;
+        }
+        if (test_bit(bitmap, bit)) {
+            bit++;
+            continue;
+        }
+
+        uint32_t length = 1;
+        while (length < want && bit + length < end && !test_bit(bitmap, bit + length)) length++;
+        if (length >= min_len || length == want) {
+            *len = length;
+            return bit;
+        }
+        bit += length;
+    }
+    return UINT32_MAX;
+}
+
+/* Marks 'count' blocks of a group, starting at 'bit', as used or free
+   in the bitmap and free counts. Returns the number of blocks whose
+   state changed, or -1 in case of error. */
+static int64_t mark_blocks(volume_t *volume, uint32_t group, uint32_t bit, uint32_t count, int used) {
+
+    group_desc_t *desc = writeback_group_desc(volume, group);
+    if (!desc) return -1;
+
+    uint8_t *bitmap = writeback_block(volume, desc->bg_block_bitmap, EXT2_WRITEBACK_BITMAP, 1);
+    if (!bitmap) return -1;
+
+    uint32_t changed = 0;
+    for (uint32_t i = bit; i < bit + count; i++) {
+        if (!test_bit(bitmap, i) != !used) {
+            bitmap[i >> 3] ^= 1 << (i & 7);
+            changed++;
+        }
+    }
+
+    if (used) {
+        desc->bg_free_blocks_count -= changed;
+        volume->super.s_free_blocks_count -= changed;
+    } else {
+        desc->bg_free_blocks_count += changed;
+        volume->super.s_free_blocks_count += changed;
+    }
+    writeback_super(volume);
+    return changed;
+}
+
+/* Searches the groups for a run of at least min_len free blocks (or
+   as many as a group has free) outside the windows of other files,
+   starting at the goal and wrapping around to it. Returns the first
+   block, with the length of the run (up to 'want') in *len, or 0
+   (zero) if there is none. */
+static uint32_t search_run(volume_t *volume, const alloc_window_t *own, uint32_t goal, uint32_t min_len,
+                           uint32_t want, uint32_t *len) {
+
+    uint32_t goal_group = group_of_block(volume, goal);
+
+    for (uint32_t n = 0; n <= volume->num_groups; n++) {
+        uint32_t group = (goal_group + n) % volume->num_groups;
+        const group_desc_t *desc = get_group_desc(volume, group);
+        if (!desc || !desc->bg_free_blocks_count) continue;
+
+        // The goal group is searched from the goal first, and from its start last
+        uint32_t start = n == 0 ? goal - group_first_block(volume, group) : 0;
+        uint32_t end = n == volume->num_groups ? goal - group_first_block(volume, group) :
+                       group_num_blocks(volume, group);
+        if (start >= end || load_bitmap(volume, group, desc, own) < 0) continue;
+
+        uint32_t bit = find_run(volume->allocator->bitmap, start, end,
+                                min_len < desc->bg_free_blocks_count ? min_len : desc->bg_free_blocks_count,
+                                want, len);
+        if (bit != UINT32_MAX)
+            return group_first_block(volume, group) + bit;
+    }
+    return 0;
+}
+
+/* Finds a run of up to 'want' free blocks outside the windows of
+   other files, as close to the goal as possible: right at the goal if
+   it is free, else in the first run long enough for min_len blocks,
+   else wherever blocks are free. Returns the first block, with the
+   length of the run in *len, or 0 (zero). */
+static uint32_t find_blocks(volume_t *volume, const alloc_window_t *own, uint32_t goal, uint32_t want,
+                            uint32_t min_len, uint32_t *len) {
+
+    uint32_t group = group_of_block(volume, goal);
+    const group_desc_t *desc = get_group_desc(volume, group);
+    uint32_t first = 0;
+
+    // Continuing right after the previous block beats a longer run elsewhere
+    uint32_t bit = goal - group_first_block(volume, group);
+    if (desc && desc->bg_free_blocks_count && load_bitmap(volume, group, desc, own) == 0 &&
+        find_run(volume->allocator->bitmap, bit, group_num_blocks(volume, group), 1, want, len) == bit)
+        first = goal;
+
+    if (!first && min_len > 1) first = search_run(volume, own, goal, min_len, want, len);
+    if (!first) first = search_run(volume, own, goal, 1, want, len);
+    return first;
+}
+
+/* Shrinks the windows of the files other than that of 'own', to the
+   number of blocks each file has written in its window, or, with
+   'all', to nothing. Returns 1 if a window shrank. */
+static int shrink_windows(allocator_t *al, const alloc_window_t *own, int all) {
+
+    int shrunk = 0;
+
+    for (int i = 0; i < EXT2_ALLOC_WINDOWS; i++) {
+        alloc_window_t *window = &al->windows[i];
+        if (!window->inode_no || window == own) continue;
+
+        uint32_t keep = all ? 0 : window->next - window->start;
+        if (!all && keep < EXT2_ALLOC_MIN_WINDOW) keep = EXT2_ALLOC_MIN_WINDOW;
+        if (!all && keep > EXT2_ALLOC_MAX_WINDOW) keep = EXT2_ALLOC_MAX_WINDOW;
+        if (window->end - window->next > keep) {
+            window->end = window->next + keep;
+            shrunk = 1;
+        }
+    }
+    return shrunk;
+}
+
+/* Finds blocks like find_blocks, shrinking the windows of other files
+   if no free block is left outside them. Returns the first block,
+   with the length of the run in *len, or 0 (zero) with errno set to
+   ENOSPC or EIO. */
+static uint32_t reserve_run(volume_t *volume, const alloc_window_t *own, uint32_t goal, uint32_t want,
+                            uint32_t min_len, uint32_t *len) {
+
+    allocator_t *al = volume->allocator;
+    uint32_t first = find_blocks(volume, own, goal, want, min_len, len);
+
+    if (!first && shrink_windows(al, own, 0)) first = find_blocks(volume, own, goal, want, min_len, len);
+    if (!first && shrink_windows(al, own, 1)) first = find_blocks(volume, own, goal, want, min_len, len);
+    if (!first) errno = volume->super.s_free_blocks_count ? EIO : ENOSPC;
+    return first;
+}
+
+/* Returns the window of a file, or NULL if it has none. */
+static alloc_window_t *find_window(allocator_t *al, uint32_t inode_no) {
+
+    for (int i = 0; i < EXT2_ALLOC_WINDOWS; i++)
+        if (al->windows[i].inode_no == inode_no) return &al->windows[i];
+    return NULL;
+}
+
+/* alloc_goal: Returns where the first block of a file should go: the
+   start of the block group of its inode.
+ */
+uint32_t alloc_goal(volume_t *volume, uint32_t inode_no) {
+
+    uint32_t group = (inode_no - 1) / volume->super.s_inodes_per_group;
+    return group_first_block(volume, group < volume->num_groups ? group : 0);
+}
+
+/* alloc_blocks: Allocates a run of adjacent blocks for a file.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     inode_no: Inode of the file the blocks are for.
+     goal: Where the run should start; see alloc_goal.
+     wanted: Number of blocks wanted, at least 1.
+     streaming: 1 if the file is being written at its end, so a
+                preallocation window is kept for what follows.
+     count: Set to the number of blocks allocated, between 1 and
+            'wanted'; fewer blocks are allocated when the run at the
+            goal is shorter.
+
+   Returns:
+     The first block of the run, or 0 (zero) with errno set to ENOSPC
+     if the volume is full, EROFS if the volume is not writable, or
+     EIO.
+ */
+uint32_t alloc_blocks(volume_t *volume, uint32_t inode_no, uint32_t goal, uint32_t wanted, int streaming,
+                      uint32_t *count) {
+
+    allocator_t *al = volume->allocator;
+    uint32_t first, length;
+
+    if (!al) {
+        errno = EROFS;
+        return 0;
+    }
+    if (wanted == 0) wanted = 1;
+    if (goal < volume->super.s_first_data_block || goal >= volume->super.s_blocks_count)
+        goal = volume->super.s_first_data_block;
+
+    alloc_window_t *window = find_window(al, inode_no);
+    if (window) {
+        window->used = ++al->clock;
+        // Written elsewhere than where the window is
+        if (!streaming || window->next != goal) window->start = window->next = window->end = goal;
+    }
+
+    if (window && window->next < window->end) {
+        // The blocks of a window are free: other files never take them
+        first = window->next;
+        length = window->end - first;
+    } else if (!streaming) {
+        first = reserve_run(volume, window, goal, wanted, wanted, &length);
+    } else {
+        // The whole run becomes the window, so the file can grow in it
+        first = reserve_run(volume, window, goal, volume->super.s_blocks_per_group, EXT2_ALLOC_MAX_WINDOW,
+                            &length);
+    }
+    if (!first) return 0;
+
+    *count = wanted < length ? wanted : length;
+    uint32_t group = group_of_block(volume, first);
+    if (mark_blocks(volume, group, first - group_first_block(volume, group), *count, 1) != *count) {
+        errno = EIO;
+        return 0;
+    }
+    if (!streaming) return first;
+
+    if (!window) {
+        // Take over the least recently used window
+        window = &al->windows[0];
+        for (int i = 1; i < EXT2_ALLOC_WINDOWS && window->inode_no; i++)
+            if (!al->windows[i].inode_no || al->windows[i].used < window->used) window = &al->windows[i];
+        window->inode_no = inode_no;
+        window->used = ++al->clock;
+        window->start = first;
+    } else if (first != window->next) {
+        window->start = first;
+    }
+    window->next = first + *count;
+    window->end = first + length;
+    return first;
+}
+
+/* free_blocks: Frees a run of adjacent blocks, and drops the changes
+   to them not yet written.
+
+   Returns:
+     0 on success, or -1 in case of error.
+ */
+int free_blocks(volume_t *volume, uint32_t block_no, uint32_t count) {
+
+    if (block_no < volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count ||
+        count > volume->super.s_blocks_count - block_no) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        writeback_forget(volume, block_no + i);
+
+    while (count) {
+        uint32_t group = group_of_block(volume, block_no);
+        uint32_t bit = block_no - group_first_block(volume, group);
+        uint32_t length = group_num_blocks(volume, group) - bit;
+        if (length > count) length = count;
+
+        if (mark_blocks(volume, group, bit, length, 0) < 0) return -1;
+        block_no += length;
+        count -= length;
+    }
+    return 0;
+}
+
+/* alloc_release: Gives up the preallocation window of a file, once it
+   is closed or truncated, so other files may use its blocks.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Inode of the file, or 0 (zero) for the windows of all
+               files.
+ */
+void alloc_release(volume_t *volume, uint32_t inode_no) {
+
+    allocator_t *al = volume->allocator;
+    if (!al) return;
+
+    for (int i = 0; i < EXT2_ALLOC_WINDOWS; i++)
+        if (al->windows[i].inode_no && (!inode_no || al->windows[i].inode_no == inode_no))
+            memset(&al->windows[i], 0, sizeof(alloc_window_t));
+}
+
+/* Picks the group of a new inode (see the top of this file). Returns
+   the group, or UINT32_MAX if no group has free inodes. */
+static uint32_t pick_inode_group(volume_t *volume, uint32_t parent_no, int directory) {
+
+    uint32_t parent_group = (parent_no - 1) / volume->super.s_inodes_per_group;
+    uint32_t groups = volume->num_groups;
+    uint32_t best = UINT32_MAX;
+
+    if (parent_group >= groups) parent_group = 0;
+
+    if (directory && parent_no == EXT2_ROOT_INO) {
+        uint32_t avg_inodes = volume->super.s_free_inodes_count / groups;
+        uint32_t avg_blocks = volume->super.s_free_blocks_count / groups;
+        const group_desc_t *chosen = NULL;
+
+        for (uint32_t group = 0; group < groups; group++) {
+            const group_desc_t *desc = get_group_desc(volume, group);
+            if (!desc || !desc->bg_free_inodes_count || desc->bg_free_inodes_count < avg_inodes ||
+                desc->bg_free_blocks_count < avg_blocks)
+                continue;
+            if (!chosen || desc->bg_used_dirs_count < chosen->bg_used_dirs_count) {
+                chosen = desc;
+                best = group;
+            }
+        }
+        if (best != UINT32_MAX) return best;
+    }
+
+    // The parent's group, then the next groups with free inodes and blocks, then any with free inodes
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t n = 0; n < groups; n++) {
+            uint32_t group = (parent_group + n) % groups;
+            const group_desc_t *desc = get_group_desc(volume, group);
+            if (desc && desc->bg_free_inodes_count && (pass || desc->bg_free_blocks_count))
+                return group;
+        }
+    }
+    return UINT32_MAX;
+}
+
+/* alloc_inode: Allocates an inode, and zeroes it on disk.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     parent_no: Inode of the directory the new file goes in.
+     directory: 1 if the inode is for a directory.
+
+   Returns:
+     The inode number, or 0 (zero) with errno set to ENOSPC if there
+     is no free inode, EROFS if the volume is not writable, or EIO.
+ */
+uint32_t alloc_inode(volume_t *volume, uint32_t parent_no, int directory) {
+
+    if (!volume->allocator) {
+        errno = EROFS;
+        return 0;
+    }
+
+    uint32_t group = pick_inode_group(volume, parent_no, directory);
+    if (group == UINT32_MAX) {
+        errno = ENOSPC;
+        return 0;
+    }
+
+    group_desc_t *desc = writeback_group_desc(volume, group);
+    uint8_t *bitmap = desc ? writeback_block(volume, desc->bg_inode_bitmap, EXT2_WRITEBACK_BITMAP, 1) : NULL;
+    if (!bitmap) {
+        errno = EIO;
+        return 0;
+    }
+
+    // The first inodes of the volume are reserved
+    uint32_t first_ino = volume->super.s_rev_level ? volume->super.s_first_ino : 11;
+    uint32_t base = group * volume->super.s_inodes_per_group;
+    uint32_t bit = base + 1 < first_ino ? first_ino - 1 - base : 0;
+
+    while (bit < volume->super.s_inodes_per_group && test_bit(bitmap, bit)) bit++;
+    if (bit >= volume->super.s_inodes_per_group) {
+        // The descriptor's count was wrong
+        errno = EIO;
+        return 0;
+    }
+
+    bitmap[bit >> 3] |= 1 << (bit & 7);
+    desc->bg_free_inodes_count--;
+    if (directory) desc->bg_used_dirs_count++;
+    volume->super.s_free_inodes_count--;
+    writeback_super(volume);
+
+    uint32_t inode_no = base + bit + 1;
+    if (clear_inode(volume, inode_no) < 0) return 0;
+    return inode_no;
+}
+
+/* free_inode: Frees an inode.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     inode_no: Number of the inode.
+     directory: 1 if the inode was a directory.
+
+   Returns:
+     0 on success, or -1 in case of error.
+ */
+int free_inode(volume_t *volume, uint32_t inode_no, int directory) {
+
+    if (inode_no == 0 || inode_no > volume->super.s_inodes_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t group = (inode_no - 1) / volume->super.s_inodes_per_group;
+    uint32_t bit = (inode_no - 1) % volume->super.s_inodes_per_group;
+    group_desc_t *desc = writeback_group_desc(volume, group);
+    uint8_t *bitmap = desc ? writeback_block(volume, desc->bg_inode_bitmap, EXT2_WRITEBACK_BITMAP, 1) : NULL;
+    if (!bitmap) return -1;
+
+    if (!test_bit(bitmap, bit)) return 0;
+    bitmap[bit >> 3] &= ~(1 << (bit & 7));
+    desc->bg_free_inodes_count++;
+    if (directory) desc->bg_used_dirs_count--;
+    volume->super.s_free_inodes_count++;
+    writeback_super(volume);
+    return 0;
+}
@@ -0,0 +1,370 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/* Requests are executed by a small pool of worker threads as a
+   sequence of short steps: one path component lookup, one inode read,
+   or one chunk of file data. After each step the request goes back to
+   the end of the run queue, so the workers interleave the steps of
+   all requests in flight and a long read or deep path never holds a
+   worker for long. The submitting thread never blocks; it collects
+   completed requests with ext2_async_reap, typically after the
+   context's eventfd becomes readable.
+ */
+
+// Maximum number of bytes of file data read by one step
+#define EXT2_ASYNC_CHUNK (64 * 1024)
+
+// Internal states of a request
+#define STEP_START  0
+#define STEP_LOOKUP 1 // Looking up the next path component
+#define STEP_DATA   2 // Reading file data
+
+struct ext2_async {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t completed;
+    ext2_request_t *run_head, *run_tail;   // Requests with a step ready to run
+    ext2_request_t *done_head, *done_tail; // Completed requests not yet reaped
+    size_t in_flight;
+    int event_fd;
+    int stop;
+    unsigned int num_threads;
+    pthread_t *threads;
+};
+
+static void push(ext2_request_t **head, ext2_request_t **tail, ext2_request_t *request) {
+
+    request->next = NULL;
+    if (*tail) (*tail)->next = request;
+    else *head = request;
+    *tail = request;
+}
+
+static ext2_request_t *pop(ext2_request_t **head, ext2_request_t **tail) {
+
+    ext2_request_t *request = *head;
+    if (request) {
+        *head = request->next;
+        if (!*head) *tail = NULL;
+    }
+    return request;
+}
+
+static void complete(ext2_request_t *request, ssize_t result, int error) {
+
+    request->result = result;
+    request->error = error;
+    free(request->path_copy);
+    request->path_copy = NULL;
+}
+
+/* run_step: Executes one step of a request.
+
+   Returns:
+     1 if the request has more steps to run, or 0 if it completed.
+ */
+static int run_step(ext2_request_t *request) {
+
+    volume_t *volume = request->volume;
+    ssize_t rv;
+
+    switch (request->step) {
+    case STEP_START:
+        switch (request->op) {
+        case EXT2_ASYNC_READ_BLOCK:
+            rv = read_block(volume, request->block_no, request->block_offset, request->size, request->buffer);
+            complete(request, rv, rv < 0 ? EIO : 0);
+            return 0;
+
+        case EXT2_ASYNC_READ_INODE:
+            rv = read_inode(volume, request->inode_no, &request->inode);
+            complete(request, rv, rv <= 0 ? EIO : 0);
+            return 0;
+
+        case EXT2_ASYNC_READ_FILE:
+            request->done = 0;
+            request->step = STEP_DATA;
+            return 1;
+
+        case EXT2_ASYNC_FIND_PATH:
+        case EXT2_ASYNC_READ_PATH:
+            request->path_copy = strdup(request->path);
+            if (!request->path_copy) {
+                complete(request, -1, ENOMEM);
+                return 0;
+            }
+            request->cursor = request->path_copy;
+            request->inode_no = EXT2_ROOT_INO;
+            if (read_inode(volume, EXT2_ROOT_INO, &request->inode) <= 0) {
+                complete(request, -1, EIO);
+                return 0;
+            }
+            request->step = STEP_LOOKUP;
+            return 1;
+        }
+        complete(request, -1, EINVAL);
+        return 0;
+
+    case STEP_LOOKUP: {
+        char *name = request->cursor + strspn(request->cursor, "/");
+
+        if (!*name) {
+            // Path fully resolved
+            if (request->op == EXT2_ASYNC_FIND_PATH) {
+                complete(request, request->inode_no, 0);
+                return 0;
+            }
+            if (inode_is_directory(&request->inode)) {
+                complete(request, -1, EISDIR);
+                return 0;
+            }
+            free(request->path_copy);
+            request->path_copy = NULL;
+            request->done = 0;
+            request->step = STEP_DATA;
+            return 1;
+        }
+
+        char *end = name + strcspn(name, "/");
+        request->cursor = *end ? end + 1 : end;
+        *end = '\0';
+
+        if (!inode_is_directory(&request->inode)) {
+            complete(request, -1, ENOTDIR);
+            return 0;
+        }
+
+        int64_t child = lookup_in_directory(volume, request->inode_no, &request->inode, name);
+        if (child <= 0) {
+            complete(request, -1, child == 0 ? ENOENT : EIO);
+            return 0;
+        }
+        if (read_inode(volume, child, &request->inode) <= 0) {
+            complete(request, -1, EIO);
+            return 0;
+        }
+        request->inode_no = child;
+        return 1;
+    }
+
+    case STEP_DATA: {
+        uint64_t left = request->size - request->done;
+        if (left > EXT2_ASYNC_CHUNK) left = EXT2_ASYNC_CHUNK;
+
+        rv = left ? read_file_content(volume, &request->inode, request->offset + request->done,
+                                      left, (char *) request->buffer + request->done) : 0;
+        if (rv < 0) {
+            complete(request, -1, EIO);
+            return 0;
+        }
+        request->done += rv;
+
+        // A short read means the end of the file was reached
+        if (rv < left || request->done == request->size) {
+            complete(request, request->done, 0);
+            return 0;
+        }
+        return 1;
+    }
+    }
+
+    complete(request, -1, EINVAL);
+    return 0;
+}
+
+static void *worker(void *arg) {
+
+    ext2_async_t *ctx = arg;
+    ext2_request_t *request;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (!ctx->stop && !ctx->run_head)
+            pthread_cond_wait(&ctx->work_ready, &ctx->lock);
+        if (ctx->stop) break;
+
+        request = pop(&ctx->run_head, &ctx->run_tail);
+        pthread_mutex_unlock(&ctx->lock);
+
+        int more = run_step(request);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (more) {
+            push(&ctx->run_head, &ctx->run_tail, request);
+        } else {
+            push(&ctx->done_head, &ctx->done_tail, request);
+            ctx->in_flight--;
+            pthread_cond_broadcast(&ctx->completed);
+            if (write(ctx->event_fd, &one, sizeof(one)) < 0) { /* counter saturated; still readable */ }
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* ext2_async_create: Creates a context for asynchronous requests.
+
+   Parameters:
+     num_threads: Number of worker threads executing requests. The
+                  number of requests in flight is not limited by the
+                  number of threads.
+
+   Returns:
+     A pointer to the new context, or NULL in case of error.
+ */
+ext2_async_t *ext2_async_create(unsigned int num_threads) {
+
+    ext2_async_t *ctx = calloc(1, sizeof(ext2_async_t));
+    if (!ctx) return NULL;
+
+    if (num_threads == 0) num_threads = 1;
+    ctx->threads = calloc(num_threads, sizeof(pthread_t));
+    ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!ctx->threads || ctx->event_fd < 0) {
+        if (ctx->event_fd >= 0) close(ctx->event_fd);
+        free(ctx->threads);
+        free(ctx);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->work_ready, NULL);
+    pthread_cond_init(&ctx->completed, NULL);
+
+    for (ctx->num_threads = 0; ctx->num_threads < num_threads; ctx->num_threads++)
+        if (pthread_create(&ctx->threads[ctx->num_threads], NULL, worker, ctx) != 0)
+            break;
+
+    if (ctx->num_threads == 0) {
+        ext2_async_destroy(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/* ext2_async_destroy: Stops the worker threads and frees a context.
+   Requests still in flight are abandoned without completing, so all
+   submitted requests should be reaped first.
+ */
+void ext2_async_destroy(ext2_async_t *ctx) {
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stop = 1;
+    pthread_cond_broadcast(&ctx->work_ready);
+    pthread_mutex_unlock(&ctx->lock);
+
+    for (unsigned int i = 0; i < ctx->num_threads; i++)
+        pthread_join(ctx->threads[i], NULL);
+
+    for (ext2_request_t *request; (request = pop(&ctx->run_head, &ctx->run_tail)); )
+        free(request->path_copy);
+
+    pthread_cond_destroy(&ctx->completed);
+    pthread_cond_destroy(&ctx->work_ready);
+    pthread_mutex_destroy(&ctx->lock);
+    close(ctx->event_fd);
+    free(ctx->threads);
+    free(ctx);
+}
+
+/* ext2_async_fd: Returns a file descriptor that becomes readable
+   (POLLIN) whenever completed requests are waiting to be reaped. The
+   descriptor is owned by the context and must not be read or closed
+   by the caller.
+ */
+int ext2_async_fd(ext2_async_t *ctx) {
+
+    return ctx->event_fd;
+}
+
+/* ext2_async_submit: Queues a request for execution and returns
+   immediately. The caller fills in the operation and its parameters
+   (see ext2_request_t); the request structure, and any path and
+   buffer it points to, must remain valid until it is reaped.
+
+   Returns:
+     0 on success, or -1 if the operation is invalid.
+ */
+int ext2_async_submit(ext2_async_t *ctx, ext2_request_t *request) {
+
+    if (request->op < EXT2_ASYNC_READ_BLOCK || request->op > EXT2_ASYNC_READ_PATH || !request->volume)
+        return -1;
+
+    request->step = STEP_START;
+    request->path_copy = NULL;
+    request->result = -1;
+    request->error = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    push(&ctx->run_head, &ctx->run_tail, request);
+    ctx->in_flight++;
+    pthread_cond_signal(&ctx->work_ready);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/* ext2_async_reap: Collects completed requests. The callback of each
+   collected request, if any, is called from this function, in the
+   calling thread.
+
+   Parameters:
+     ctx: Context the requests were submitted to.
+     completed: If not NULL, array where up to 'max' pointers to
+                completed requests are stored.
+     max: Maximum number of requests to collect.
+     min: Minimum number of requests to collect; the function waits
+          until that many have completed. Use 0 (zero) to never wait.
+
+   Returns:
+     The number of requests collected.
+ */
+int ext2_async_reap(ext2_async_t *ctx, ext2_request_t **completed, int max, int min) {
+
+    uint64_t counter;
+    int count = 0;
+
+    if (min > max) min = max;
+
+    // Reset the eventfd before taking requests, so no completion goes unnoticed
+    if (read(ctx->event_fd, &counter, sizeof(counter)) < 0) { /* nothing pending */ }
+
+    while (count < max) {
+        pthread_mutex_lock(&ctx->lock);
+        while (count < min && !ctx->done_head && ctx->in_flight > 0)
+            pthread_cond_wait(&ctx->completed, &ctx->lock);
+        ext2_request_t *request = pop(&ctx->done_head, &ctx->done_tail);
+        int more = ctx->done_head != NULL;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (!request) break;
+
+        if (completed) completed[count] = request;
+        count++;
+        if (request->callback) request->callback(request);
+
+        // Leave the eventfd readable if completions remain after this call
+        if (count == max && more) {
+            uint64_t one = 1;
+            if (write(ctx->event_fd, &one, sizeof(one)) < 0) { /* already readable */ }
+        }
+    }
+    return count;
+}
+
+/* ext2_async_in_flight: Returns the number of submitted requests that
+   have not completed yet.
+ */
+size_t ext2_async_in_flight(ext2_async_t *ctx) {
+
+    pthread_mutex_lock(&ctx->lock);
+    size_t in_flight = ctx->in_flight;
+    pthread_mutex_unlock(&ctx->lock);
+    return in_flight;
+}
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ext2.h"
+
+/* ext2attrbench: Measures how getattr throughput scales with the
+   number of threads. The paths of a volume (or those listed in a
+   file) are looked up once to warm a cache pool; then, for 1, 2, 4,
+   ... up to the given number of threads, every thread looks up random
+   paths with find_file_from_path, as ext2fs does for getattr, for a
+   fixed time. The lookups of each round are checked against the
+   warm-up, and the throughput and speedup over a single thread are
+   reported.
+ */
+
+// Default memory budget of the cache pool, in MiB
+#define DEFAULT_CACHE_MB 256
+
+// Maximum number of paths collected from the volume
+#define MAX_PATHS (1 << 20)
+
+// Aligned so the counters of different threads do not share cache lines
+typedef struct worker {
+  _Alignas(64) pthread_t thread;
+  uint64_t seed;
+  uint64_t lookups;
+  uint64_t mismatches;
+} worker_t;
+
+static volume_t *volume;
+static char **paths;
+static uint32_t *expected; // Inode number of each path, from the warm-up
+static size_t num_paths, max_paths;
+static _Atomic int stop;
+
+static int collect_path(void *ctx, const char *path, uint32_t inode_no, inode_t *inode) {
+
+  if (num_paths == MAX_PATHS) return 1;
+  if (num_paths == max_paths) {
+    size_t capacity = max_paths ? max_paths * 2 : 1024;
+    char **grown = realloc(paths, sizeof(char *) * capacity);
+    if (!grown) return 1;
+    paths = grown;
+    max_paths = capacity;
+  }
+  if (!(paths[num_paths] = strdup(path))) return 1;
+  num_paths++;
+  return 0;
+}
+
+static void read_paths(FILE *file) {
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &size, file)) >= 0) {
+    if (len && line[len - 1] == '\n') line[--len] = '\0';
+    if (len && collect_path(NULL, line, 0, NULL)) break;
+  }
+  free(line);
+}
+
+static void *getattr_worker(void *arg) {
+
+  worker_t *worker = arg;
+  uint64_t seed = worker->seed;
+
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    // A batch between checks of the stop flag keeps the flag off the hot path
+    for (int i = 0; i < 64; i++) {
+      seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+      size_t index = seed % num_paths;
+      inode_t inode;
+
+      uint32_t inode_no = find_file_from_path(volume, paths[index], &inode);
+      if (inode_no != expected[index])
+        worker->mismatches++;
+      worker->lookups++;
+    }
+  }
+  return NULL;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-t threads] [-s seconds] [-c cache_mb] volume_file [path_list]\n"
+          "  -t threads   largest number of threads, doubled from 1 (default: 64)\n"
+          "  -s seconds   duration of each round (default: 2)\n"
+          "  -c cache_mb  memory budget of the cache pool, in MiB (default: %d)\n", name, DEFAULT_CACHE_MB);
+}
+
+int main(int argc, char *argv[]) {
+
+  int max_threads = 64, opt, status = 0;
+  double seconds = 2;
+  long cache_mb = DEFAULT_CACHE_MB;
+
+  while ((opt = getopt(argc, argv, "t:s:c:")) != -1) {
+    switch (opt) {
+    case 't': max_threads = atoi(optarg); break;
+    case 's': seconds = atof(optarg); break;
+    case 'c': cache_mb = atol(optarg); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind < 1 || argc - optind > 2 || max_threads < 1 || seconds <= 0 || cache_mb < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+
+  cache_pool_t *pool = cache_pool_create((uint64_t) cache_mb << 20);
+  if (!pool || cache_attach_volume(pool, volume) < 0) {
+    fprintf(stderr, "Not enough memory for the cache pool.\n");
+    cache_pool_destroy(pool);
+    close_volume_file(volume);
+    return 1;
+  }
+
+  if (argc - optind == 2) {
+    FILE *list = fopen(argv[optind + 1], "r");
+    if (!list) {
+      perror(argv[optind + 1]);
+      cache_detach_volume(volume);
+      cache_pool_destroy(pool);
+      close_volume_file(volume);
+      return 1;
+    }
+    read_paths(list);
+    fclose(list);
+  } else {
+    walk_directory_tree(volume, "/", collect_path, NULL);
+  }
+
+  expected = malloc(sizeof(uint32_t) * (num_paths ? num_paths : 1));
+  worker_t *workers = calloc(max_threads, sizeof(worker_t));
+  if (!num_paths || !expected || !workers) {
+    fprintf(stderr, num_paths ? "Not enough memory for %zu paths.\n" : "No paths to look up.\n", num_paths);
+    status = 1;
+    goto finish;
+  }
+
+  for (size_t i = 0; i < num_paths; i++) {
+    inode_t inode;
+    expected[i] = find_file_from_path(volume, paths[i], &inode);
+  }
+
+  printf("%zu paths, %.1f s per round\n%8s %14s %14s %8s %11s\n", num_paths, seconds, "threads", "lookups/s",
+         "per thread", "speedup", "efficiency");
+
+  double base = 0;
+  for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+    struct timespec start, end, pause = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    int started = 0;
+
+    atomic_store(&stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; started < threads; started++) {
+      workers[started] = (worker_t) { .seed = 0x9e3779b97f4a7c15ULL * (started + 1) };
+      if (pthread_create(&workers[started].thread, NULL, getattr_worker, &workers[started]) != 0)
+        break;
+    }
+    nanosleep(&pause, NULL);
+    atomic_store(&stop, 1);
+
+    uint64_t lookups = 0, mismatches = 0;
+    for (int t = 0; t < started; t++) {
+      pthread_join(workers[t].thread, NULL);
+      lookups += workers[t].lookups;
+      mismatches += workers[t].mismatches;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double rate = lookups / elapsed;
+    if (threads == 1) base = rate;
+
+    printf("%8d %14.0f %14.0f %7.2fx %10.0f%%\n", started, rate, rate / started, rate / base,
+           100 * rate / base / started);
+    if (started < threads) {
+      fprintf(stderr, "Only %d of %d threads could be started.\n", started, threads);
+      status = 1;
+      break;
+    }
+    if (mismatches) {
+      fprintf(stderr, "%" PRIu64 " lookups differ from the warm-up.\n", mismatches);
+      status = 1;
+    }
+    if (threads == max_threads) break;
+  }
+
+  cache_stats_t stats;
+  if (cache_volume_stats(volume, &stats) == 0)
+    printf("cache: %" PRIu64 " bytes, %" PRIu64 "/%" PRIu64 " inode and %" PRIu64 "/%" PRIu64 " dentry hits\n",
+           stats.used, stats.hits[EXT2_CACHE_INODE], stats.hits[EXT2_CACHE_INODE] + stats.misses[EXT2_CACHE_INODE],
+           stats.hits[EXT2_CACHE_DENTRY], stats.hits[EXT2_CACHE_DENTRY] + stats.misses[EXT2_CACHE_DENTRY]);
+
+ finish:
+  for (size_t i = 0; i < num_paths; i++)
+    free(paths[i]);
+  free(paths);
+  free(expected);
+  free(workers);
+  cache_detach_volume(volume);
+  cache_pool_destroy(pool);
+  close_volume_file(volume);
+  return status;
+}
@@ -0,0 +1,189 @@
+#include "ext2.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <stdatomic.h>
+
+/* Hot per-block kernels, specialized by block size. Each kernel is
+   written once, as an always-inlined function taking the block size
+   (as a shift) as a parameter, and instantiated for 1 KiB, 2 KiB and
+   4 KiB blocks with a constant shift, so every index split, range
+   limit and bound becomes a shift, mask or constant compare. A generic
+   instantiation takes the shift from the volume and serves other block
+   sizes. open_volume_file picks the table for the volume's block size
+   once, and callers go through volume->ops.
+
+   Mapping a block index reads at most one pointer from each level of
+   indirect blocks. Each thread keeps the last indirect block it read
+   at each level (for block sizes up to EXT2_MAP_MEMO_SIZE), so mapping
+   consecutive indices reads each indirect block once instead of once
+   per index. The copy is dropped whenever the volume's generation
+   changes, i.e. when a metadata block of a writable volume is
+   rewritten (see writeback_block).
+ */
+
+// Largest block size whose indirect blocks are remembered by the mapping kernels
+#define EXT2_MAP_MEMO_SIZE 4096
+
+typedef struct map_memo {
+    uint32_t volume_id; // Volume the block belongs to (0 if the memo is empty)
+    uint32_t generation; // Generation of the volume when the block was read
+    uint32_t block_no;
+    uint32_t pointers[EXT2_MAP_MEMO_SIZE / sizeof(uint32_t)];
+} map_memo_t;
+
+// Last indirect block read by this thread at each level (0: singly, 1: doubly, 2: triply)
+static __thread map_memo_t map_memo[3];
+
+/* Returns the pointer at 'index' in indirect block 'block_no', which
+   sits at 'level' (1 to 3) of the tree. */
+static inline __attribute__((always_inline))
+uint32_t read_pointer(volume_t *volume, uint32_t block_no, uint32_t index, int level, const unsigned bits) {
+
+    // A hole in the tree maps a hole
+    if (block_no == 0) return 0;
+    if (block_no == EXT2_INVALID_BLOCK_NUMBER) return EXT2_INVALID_BLOCK_NUMBER;
+
+    uint32_t block_size = 4u << bits;
+
+    if (block_size > EXT2_MAP_MEMO_SIZE) {
+        uint32_t pointer;
+        return read_block(volume, block_no, index << 2, sizeof(pointer), &pointer) == sizeof(pointer) ?
+               pointer : EXT2_INVALID_BLOCK_NUMBER;
+    }
+
+    map_memo_t *memo = &map_memo[level - 1];
+    uint32_t generation = atomic_load_explicit(&volume->generation, memory_order_acquire);
+    if (memo->volume_id != volume->id || memo->block_no != block_no || memo->generation != generation) {
+        if (read_block(volume, block_no, 0, block_size, memo->pointers) != block_size) {
+            memo->volume_id = 0;
+            return EXT2_INVALID_BLOCK_NUMBER;
+        }
+        memo->volume_id = volume->id;
+        memo->generation = generation;
+        memo->block_no = block_no;
+    }
+    return memo->pointers[index];
+}
+
+/* Kernel of get_inode_block_no. 'bits' is log2 of the number of block
+   pointers in an indirect block (block_size / 4). */
+static inline __attribute__((always_inline))
+uint32_t map_block(volume_t *volume, inode_t *inode, uint64_t block_idx, const unsigned bits) {
+
+    const uint64_t mask = (1u << bits) - 1;
+
+    if (block_idx < EXT2_NDIR_BLOCKS)
+        return inode->i_block[block_idx];
+    block_idx -= EXT2_NDIR_BLOCKS;
+
+    if (block_idx < (1ULL << bits))
+        return read_pointer(volume, inode->i_block_1ind, block_idx, 1, bits);
+    block_idx -= 1ULL << bits;
+
+    if (block_idx < (1ULL << 2 * bits)) {
+        uint32_t block_no = read_pointer(volume, inode->i_block_2ind, block_idx >> bits, 2, bits);
+        return read_pointer(volume, block_no, block_idx & mask, 1, bits);
+    }
+    block_idx -= 1ULL << 2 * bits;
+
+    if (block_idx < (1ULL << 3 * bits)) {
+        uint32_t block_no = read_pointer(volume, inode->i_block_3ind, block_idx >> 2 * bits, 3, bits);
+        block_no = read_pointer(volume, block_no, (block_idx >> bits) & mask, 2, bits);
+        return read_pointer(volume, block_no, block_idx & mask, 1, bits);
+    }
+    return EXT2_INVALID_BLOCK_NUMBER;
+}
+
+/* Kernel of read_directory_entries: decodes the entries of a directory
+   block held in memory, starting at byte *pos, and stores at most
+   'count' of them, skipping unused entries. 'len' is the number of
+   valid bytes in the block, at most the block size (4 << bits); the
+   specialized variants are only called on full blocks, so the bound
+   is a constant. On return, *pos is the position after the last entry
+   decoded, or 'len' if the block was finished.
+
+   Returns the number of entries stored, or -1 if an entry is invalid.
+ */
+static inline __attribute__((always_inline))
+ssize_t parse_directory_block(const char *block, uint32_t len, uint32_t *pos, off_t base,
+                              dir_entry_t *entries, off_t *next_offsets, size_t count) {
+
+    uint32_t p = *pos;
+    size_t found = 0;
+
+    while (found < count && p + EXT2_DIR_ENTRY_HEADER_LEN <= len) {
+        dir_entry_t *entry = &entries[found];
+
+        // The fixed part of an entry is read with a single 8-byte load
+        memcpy(entry, block + p, EXT2_DIR_ENTRY_HEADER_LEN);
+        if (entry->de_rec_len < EXT2_DIR_ENTRY_HEADER_LEN || p + entry->de_rec_len > len ||
+            EXT2_DIR_ENTRY_HEADER_LEN + entry->de_name_len > entry->de_rec_len) {
+            *pos = p;
+            return -1;
+        }
+
+        uint32_t name = p + EXT2_DIR_ENTRY_HEADER_LEN;
+        p += entry->de_rec_len;
+
+        // Unused entries (inode 0) only pad out the block
+        if (entry->de_inode_no == 0) continue;
+
+        memcpy(entry->de_name, block + name, entry->de_name_len);
+        entry->de_name[entry->de_name_len] = '\0';
+        if (next_offsets) next_offsets[found] = base + p;
+        found++;
+    }
+
+    // Skip any slack at the end of the block
+    if (p + EXT2_DIR_ENTRY_HEADER_LEN > len) p = len;
+    *pos = p;
+    return found;
+}
+
+#define DEFINE_BLOCK_OPS(suffix, size, bits)                                                        \
+    static uint32_t map_block_##suffix(volume_t *volume, inode_t *inode, uint64_t block_idx) {      \
+        return map_block(volume, inode, block_idx, bits);                                           \
+    }                                                                                               \
+    static ssize_t parse_directory_block_##suffix(const char *block, uint32_t len, uint32_t *pos,   \
+                                                  off_t base, dir_entry_t *entries,                 \
+                                                  off_t *next_offsets, size_t count) {              \
+        if (len != size)                                                                            \
+            return parse_directory_block(block, len, pos, base, entries, next_offsets, count);      \
+        return parse_directory_block(block, size, pos, base, entries, next_offsets, count);         \
+    }                                                                                               \
+    static const block_ops_t block_ops_##suffix = {                                                 \
+        #suffix, map_block_##suffix, parse_directory_block_##suffix                                 \
+    };
+
+DEFINE_BLOCK_OPS(1k, 1024, 8)
+DEFINE_BLOCK_OPS(2k, 2048, 9)
+DEFINE_BLOCK_OPS(4k, 4096, 10)
+
+static uint32_t map_block_generic(volume_t *volume, inode_t *inode, uint64_t block_idx) {
+
+    return map_block(volume, inode, block_idx, volume->block_bits - 2);
+}
+
+static ssize_t parse_directory_block_generic(const char *block, uint32_t len, uint32_t *pos, off_t base,
+                                             dir_entry_t *entries, off_t *next_offsets, size_t count) {
+
+    return parse_directory_block(block, len, pos, base, entries, next_offsets, count);
+}
+
+const block_ops_t block_ops_generic = {
+    "generic", map_block_generic, parse_directory_block_generic
+};
+
+/* block_ops_select: Returns the kernels specialized for a block size,
+   or the generic kernels if there is no specialized variant.
+ */
+const block_ops_t *block_ops_select(uint32_t block_size) {
+
+    switch (block_size) {
+    case 1024: return &block_ops_1k;
+    case 2048: return &block_ops_2k;
+    case 4096: return &block_ops_4k;
+    default:   return &block_ops_generic;
+    }
+}
@@ -0,0 +1,115 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* A buffer pool hands out fixed-size buffers carved from a single
+   aligned memory region, for I/O that requires aligned memory such as
+   reads from files opened with O_DIRECT. The region is mapped with
+   huge pages when requested and available, and with regular pages
+   otherwise. Threads asking for a buffer while all are in use wait
+   for one to be returned.
+ */
+
+struct buffer_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    char *region;
+    size_t region_size;
+    size_t buffer_size;
+    size_t num_free;
+    void **free_buffers;
+};
+
+/* buffer_pool_create: Allocates a pool of aligned buffers.
+
+   Parameters:
+     buffer_size: Size of each buffer. Must be a multiple of the
+                  page size.
+     count: Number of buffers in the pool.
+     hugepages: If non-zero, try to back the pool with huge pages.
+
+   Returns:
+     A pointer to the new pool, or NULL if memory is exhausted. Every
+     buffer is aligned to at least the page size.
+ */
+buffer_pool_t *buffer_pool_create(size_t buffer_size, size_t count, int hugepages) {
+
+    buffer_pool_t *pool = calloc(1, sizeof(buffer_pool_t));
+    if (!pool) return NULL;
+
+    pool->buffer_size = buffer_size;
+    pool->region_size = buffer_size * count;
+    pool->region = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (hugepages)
+        pool->region = mmap(NULL, pool->region_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (pool->region == MAP_FAILED)
+        pool->region = mmap(NULL, pool->region_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    pool->free_buffers = malloc(sizeof(void *) * count);
+    if (pool->region == MAP_FAILED || !pool->free_buffers) {
+        if (pool->region != MAP_FAILED) munmap(pool->region, pool->region_size);
+        free(pool->free_buffers);
+        free(pool);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        pool->free_buffers[i] = pool->region + i * buffer_size;
+    pool->num_free = count;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    return pool;
+}
+
+/* buffer_pool_destroy: Frees a pool and all its buffers. No buffer
+   may be in use.
+ */
+void buffer_pool_destroy(buffer_pool_t *pool) {
+
+    if (!pool) return;
+    pthread_cond_destroy(&pool->available);
+    pthread_mutex_destroy(&pool->lock);
+    munmap(pool->region, pool->region_size);
+    free(pool->free_buffers);
+    free(pool);
+}
+
+/* buffer_pool_get: Takes a buffer from the pool, waiting until one is
+   available.
+ */
+void *buffer_pool_get(buffer_pool_t *pool) {
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->num_free == 0)
+        pthread_cond_wait(&pool->available, &pool->lock);
+    void *buffer = pool->free_buffers[--pool->num_free];
+    pthread_mutex_unlock(&pool->lock);
+    return buffer;
+}
+
+/* buffer_pool_put: Returns a buffer obtained with buffer_pool_get to
+   the pool.
+ */
+void buffer_pool_put(buffer_pool_t *pool, void *buffer) {
+
+    pthread_mutex_lock(&pool->lock);
+    pool->free_buffers[pool->num_free++] = buffer;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* buffer_pool_buffer_size: Returns the size of the buffers of a pool.
+ */
+size_t buffer_pool_buffer_size(buffer_pool_t *pool) {
+
+    return pool->buffer_size;
+}
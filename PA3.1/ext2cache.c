@@ -0,0 +1,571 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* The cache pool keeps blocks, inodes and directory entries of any
+   number of volumes under a single memory budget. Every volume
+   attached to the pool owns a share with its own eviction list. When
+   the budget is exceeded, entries are evicted from the volume that is
+   furthest above its fair share, where the fair share of a volume is
+   proportional to its recent demand (number of lookups, halved every
+   EXT2_CACHE_DECAY_PERIOD lookups across the pool).
+
+   Lookups take no lock, so the hit path scales with the number of
+   threads. Entries are immutable once published in their hash chain;
+   writers (cache_insert, cache_invalidate, cache_detach_volume)
+   serialize on the pool lock, unlink entries with release stores, and
+   retire them with epoch_retire, which frees them only after every
+   lookup that may still read them has finished. A lookup writes
+   nothing shared but the entry's reference bit, and only when it is
+   clear, and counters striped over EXT2_CACHE_STRIPES cache lines.
+   Instead of moving hit entries to the front of an LRU list, eviction
+   gives entries whose reference bit is set a second chance (CLOCK).
+   Demand is summed from the striped counters, and decayed, when a
+   victim is picked.
+
+   The pool remembers the last objects evicted to stay within the
+   budget, as fingerprints in a table of EXT2_CACHE_GHOSTS slots. A
+   lookup that misses on a remembered object counts a ghost hit: a
+   hit the pool would have had with more memory. A memory governor
+   (see ext2mem.c) compares ghost hits across caches to decide which
+   one deserves a larger budget.
+ */
+
+// Number of lookups in the pool after which the demand of every volume is halved
+#define EXT2_CACHE_DECAY_PERIOD (1 << 16)
+
+// Minimum number of hash buckets in a pool
+#define EXT2_CACHE_MIN_BUCKETS 1024
+
+// Number of sets of lookup counters per volume, each on its own cache line
+#define EXT2_CACHE_STRIPES 16
+
+// Maximum number of referenced entries given a second chance per eviction
+#define EXT2_CACHE_MAX_SECOND_CHANCES 64
+
+// Number of evicted objects remembered to count ghost hits (a power of two)
+#define EXT2_CACHE_GHOSTS 4096
+
+typedef struct cache_entry {
+    _Atomic(struct cache_entry *) hash_next;
+    struct cache_entry *lru_prev; // Towards the most recently inserted entry
+    struct cache_entry *lru_next; // Towards the next entry to be considered for eviction
+    cache_share_t *share;
+    uint64_t key;
+    uint32_t kind;
+    uint32_t size;
+    _Atomic uint8_t referenced;   // Set by lookups, cleared by eviction
+    char data[];
+} cache_entry_t;
+
+typedef struct cache_counters {
+    _Alignas(64) _Atomic uint64_t lookups;
+    _Atomic uint64_t hits[EXT2_CACHE_KINDS];
+    _Atomic uint64_t misses[EXT2_CACHE_KINDS];
+    _Atomic uint64_t ghost_hits;
+} cache_counters_t;
+
+struct cache_share {
+    cache_pool_t *pool;
+    uint32_t id;
+    uint64_t used;    // Bytes charged to this volume
+    uint64_t demand;  // Lookups since the last decay (halved periodically)
+    uint64_t counted; // Lookups already added to demand
+    cache_entry_t *lru_head; // Most recently inserted entry
+    cache_entry_t *lru_tail; // Next entry considered for eviction
+    cache_share_t *next;
+    cache_counters_t counters[EXT2_CACHE_STRIPES];
+};
+
+struct cache_pool {
+    pthread_mutex_t lock; // Serializes writers; lookups take no lock
+    _Atomic uint64_t budget;
+    uint64_t used;
+    uint64_t accesses;
+    uint32_t next_id;
+    size_t num_buckets;
+    _Atomic(cache_entry_t *) *buckets;
+    cache_share_t *shares;
+
+    _Atomic uint64_t ghosts[EXT2_CACHE_GHOSTS]; // Fingerprints of evicted objects, 0 if none
+    uint32_t ghost_sizes[EXT2_CACHE_GHOSTS];    // Charge of each remembered object
+    uint64_t ghost_bytes;
+    uint64_t detached_ghost_hits;               // Ghost hits of volumes no longer attached
+};
+
+static _Atomic unsigned int next_stripe;
+static __thread unsigned int thread_stripe; // 1 + stripe of the calling thread, 0 if not assigned yet
+
+static inline size_t entry_charge(uint32_t size) {
+    return sizeof(cache_entry_t) + size;
+}
+
+static inline size_t bucket_of(cache_pool_t *pool, uint32_t id, uint32_t kind, uint64_t key) {
+
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    h ^= ((uint64_t) id << 32 | kind) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+    return h & (pool->num_buckets - 1);
+}
+
+// Never 0, which marks an empty ghost slot
+static inline uint64_t fingerprint_of(uint32_t id, uint32_t kind, uint64_t key) {
+
+    uint64_t h = (key ^ ((uint64_t) id << 40 | (uint64_t) kind << 32)) * 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+    return h | 1;
+}
+
+static inline cache_counters_t *counters_of(cache_share_t *share) {
+
+    if (!thread_stripe)
+        thread_stripe = atomic_fetch_add_explicit(&next_stripe, 1, memory_order_relaxed) % EXT2_CACHE_STRIPES + 1;
+    return &share->counters[thread_stripe - 1];
+}
+
+static void lru_unlink(cache_share_t *share, cache_entry_t *entry) {
+
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else share->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else share->lru_tail = entry->lru_prev;
+}
+
+static void lru_push_front(cache_share_t *share, cache_entry_t *entry) {
+
+    entry->lru_prev = NULL;
+    entry->lru_next = share->lru_head;
+    if (share->lru_head) share->lru_head->lru_prev = entry;
+    share->lru_head = entry;
+    if (!share->lru_tail) share->lru_tail = entry;
+}
+
+/* Unlinks an entry from its hash chain and eviction list, and retires
+   it. Must be called with the pool lock held. */
+static void remove_entry(cache_pool_t *pool, cache_entry_t *entry) {
+
+    cache_share_t *share = entry->share;
+    _Atomic(cache_entry_t *) *link = &pool->buckets[bucket_of(pool, share->id, entry->kind, entry->key)];
+    cache_entry_t *current;
+
+    while ((current = atomic_load_explicit(link, memory_order_relaxed)) != entry)
+        link = &current->hash_next;
+
+    // Lookups already past the link may still read the entry until it is reclaimed
+    atomic_store_explicit(link, atomic_load_explicit(&entry->hash_next, memory_order_relaxed),
+                          memory_order_release);
+
+    lru_unlink(share, entry);
+    share->used -= entry_charge(entry->size);
+    pool->used -= entry_charge(entry->size);
+    epoch_retire(entry);
+}
+
+/* Remembers an object, replacing whichever object shared its ghost
+   slot, or forgets it if remember is 0 and it is the one remembered.
+   Must be called with the pool lock held. */
+static void set_ghost(cache_pool_t *pool, cache_share_t *share, uint32_t kind, uint64_t key, uint32_t size,
+                      int remember) {
+
+    uint64_t fingerprint = fingerprint_of(share->id, kind, key);
+    size_t slot = fingerprint & (EXT2_CACHE_GHOSTS - 1);
+    uint64_t current = atomic_load_explicit(&pool->ghosts[slot], memory_order_relaxed);
+
+    if (!remember && current != fingerprint) return;
+
+    if (current) pool->ghost_bytes -= pool->ghost_sizes[slot];
+    atomic_store_explicit(&pool->ghosts[slot], remember ? fingerprint : 0, memory_order_relaxed);
+    pool->ghost_sizes[slot] = remember ? entry_charge(size) : 0;
+    pool->ghost_bytes += pool->ghost_sizes[slot];
+}
+
+/* Evicts the first entry of a volume not looked up since it was last
+   considered, clearing the reference bit of the entries it passes, and
+   remembers it as a ghost. Must be called with the pool lock held. */
+static void evict_one(cache_pool_t *pool, cache_share_t *share) {
+
+    for (int chances = 0; chances < EXT2_CACHE_MAX_SECOND_CHANCES && share->lru_tail != share->lru_head; chances++) {
+        cache_entry_t *entry = share->lru_tail;
+        if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) break;
+
+        atomic_store_explicit(&entry->referenced, 0, memory_order_relaxed);
+        lru_unlink(share, entry);
+        lru_push_front(share, entry);
+    }
+
+    cache_entry_t *victim = share->lru_tail;
+    set_ghost(pool, share, victim->kind, victim->key, victim->size, 1);
+    remove_entry(pool, victim);
+}
+
+/* Adds the lookups counted since the last call to the demand of each
+   volume, halving all demands every EXT2_CACHE_DECAY_PERIOD lookups.
+   Must be called with the pool lock held. */
+static void update_demand(cache_pool_t *pool) {
+
+    for (cache_share_t *share = pool->shares; share; share = share->next) {
+        uint64_t lookups = 0;
+        for (int i = 0; i < EXT2_CACHE_STRIPES; i++)
+            lookups += atomic_load_explicit(&share->counters[i].lookups, memory_order_relaxed);
+
+        share->demand += lookups - share->counted;
+        pool->accesses += lookups - share->counted;
+        share->counted = lookups;
+    }
+
+    for (; pool->accesses >= EXT2_CACHE_DECAY_PERIOD; pool->accesses -= EXT2_CACHE_DECAY_PERIOD)
+        for (cache_share_t *share = pool->shares; share; share = share->next) share->demand >>= 1;
+}
+
+/* Picks the volume whose usage exceeds its fair share by the largest
+   amount. Must be called with the pool lock held. */
+static cache_share_t *pick_victim(cache_pool_t *pool) {
+
+    uint64_t total_demand = 0;
+    uint32_t num_shares = 0;
+    cache_share_t *victim = NULL;
+    int64_t worst = INT64_MIN;
+
+    for (cache_share_t *share = pool->shares; share; share = share->next) {
+        total_demand += share->demand;
+        num_shares++;
+    }
+
+    for (cache_share_t *share = pool->shares; share; share = share->next) {
+        if (!share->lru_tail) continue;
+
+        uint64_t fair = total_demand ?
+                        (uint64_t) ((double) pool->budget * share->demand / total_demand) :
+                        pool->budget / num_shares;
+        int64_t excess = (int64_t) share->used - (int64_t) fair;
+
+        if (excess > worst) {
+            worst = excess;
+            victim = share;
+        }
+    }
+    return victim;
+}
+
+/* cache_pool_create: Allocates a cache pool with the given memory
+   budget. All volumes attached to the pool share the budget.
+
+   Parameters:
+     budget: Maximum number of bytes used by cached data, including
+             per-entry bookkeeping. A budget of 0 (zero) disables
+             caching.
+
+   Returns:
+     A pointer to the new pool, or NULL if memory is exhausted.
+ */
+cache_pool_t *cache_pool_create(uint64_t budget) {
+
+    cache_pool_t *pool = calloc(1, sizeof(cache_pool_t));
+    if (!pool) return NULL;
+
+    // Roughly one bucket per 4 KiB block the budget can hold
+    pool->num_buckets = EXT2_CACHE_MIN_BUCKETS;
+    while (pool->num_buckets < budget / 4096) pool->num_buckets <<= 1;
+
+    pool->buckets = calloc(pool->num_buckets, sizeof(*pool->buckets));
+    if (!pool->buckets) {
+        free(pool);
+        return NULL;
+    }
+
+    atomic_init(&pool->budget, budget);
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/* cache_pool_destroy: Frees a pool. All volumes must have been
+   detached from the pool before calling this function.
+ */
+void cache_pool_destroy(cache_pool_t *pool) {
+
+    if (!pool) return;
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->buckets);
+    free(pool);
+}
+
+/* cache_attach_volume: Starts caching the data of a volume in a
+   pool. Once attached, read_block, read_inode and path lookups on the
+   volume are served from the pool whenever possible.
+
+   Parameters:
+     pool: Pool the volume's data is cached in.
+     volume: Pointer to volume. Must not be attached to any pool.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted.
+ */
+int cache_attach_volume(cache_pool_t *pool, volume_t *volume) {
+
+    // The counters must not share cache lines with anything else
+    cache_share_t *share = aligned_alloc(_Alignof(cache_share_t), sizeof(cache_share_t));
+    if (!share) return -1;
+
+    memset(share, 0, sizeof(cache_share_t));
+    share->pool = pool;
+
+    pthread_mutex_lock(&pool->lock);
+    share->id = pool->next_id++;
+    share->next = pool->shares;
+    pool->shares = share;
+    pthread_mutex_unlock(&pool->lock);
+
+    volume->cache = share;
+    return 0;
+}
+
+/* cache_detach_volume: Stops caching a volume and releases all data
+   cached for it. Does nothing if the volume is not attached.
+ */
+void cache_detach_volume(volume_t *volume) {
+
+    cache_share_t *share = volume->cache;
+    if (!share) return;
+
+    cache_pool_t *pool = share->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (share->lru_head) remove_entry(pool, share->lru_head);
+    for (int i = 0; i < EXT2_CACHE_STRIPES; i++)
+        pool->detached_ghost_hits += atomic_load_explicit(&share->counters[i].ghost_hits, memory_order_relaxed);
+
+    cache_share_t **link = &pool->shares;
+    while (*link != share) link = &(*link)->next;
+    *link = share->next;
+    pthread_mutex_unlock(&pool->lock);
+
+    free(share);
+    volume->cache = NULL;
+}
+
+/* cache_lookup: Searches the cache for an object of a volume.
+
+   Parameters:
+     volume: Pointer to volume.
+     kind: Type of object (EXT2_CACHE_BLOCK, EXT2_CACHE_INODE or
+           EXT2_CACHE_DENTRY).
+     key: Identifier of the object, unique within the kind.
+     buffer: Location where the cached data is copied to.
+     size: Size of the buffer. At most 'size' bytes are copied.
+
+   Returns:
+     The size of the cached object if found, or 0 (zero) if the object
+     is not cached or the volume is not attached to a pool. Takes no
+     lock, and may run concurrently with any other cache function but
+     cache_detach_volume on the same volume.
+ */
+uint32_t cache_lookup(volume_t *volume, uint32_t kind, uint64_t key, void *buffer, uint32_t size) {
+
+    cache_share_t *share = volume->cache;
+    uint32_t found = 0;
+
+    if (!share) return 0;
+
+    cache_pool_t *pool = share->pool;
+    cache_counters_t *counters = counters_of(share);
+
+    atomic_fetch_add_explicit(&counters->lookups, 1, memory_order_relaxed);
+
+    epoch_enter();
+
+    cache_entry_t *entry = atomic_load_explicit(&pool->buckets[bucket_of(pool, share->id, kind, key)],
+                                                memory_order_acquire);
+    while (entry && !(entry->share == share && entry->kind == kind && entry->key == key))
+        entry = atomic_load_explicit(&entry->hash_next, memory_order_acquire);
+
+    if (entry) {
+        memcpy(buffer, entry->data, entry->size < size ? entry->size : size);
+        found = entry->size;
+        // Only the first hit since the last eviction pass dirties the entry's cache line
+        if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+            atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+    }
+
+    epoch_exit();
+
+    if (found) {
+        atomic_fetch_add_explicit(&counters->hits[kind], 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&counters->misses[kind], 1, memory_order_relaxed);
+
+        uint64_t fingerprint = fingerprint_of(share->id, kind, key);
+        if (atomic_load_explicit(&pool->ghosts[fingerprint & (EXT2_CACHE_GHOSTS - 1)], memory_order_relaxed) ==
+            fingerprint)
+            atomic_fetch_add_explicit(&counters->ghost_hits, 1, memory_order_relaxed);
+    }
+    return found;
+}
+
+/* cache_insert: Stores a copy of an object of a volume in the cache,
+   replacing any previous copy and evicting objects of the volumes
+   furthest above their fair share as needed to stay within the
+   budget. Does nothing if the volume is not attached to a pool, or
+   if the object alone exceeds the budget.
+
+   Parameters:
+     volume: Pointer to volume.
+     kind: Type of object (see cache_lookup).
+     key: Identifier of the object, unique within the kind.
+     data: Data to be cached.
+     size: Number of bytes in 'data'.
+ */
+void cache_insert(volume_t *volume, uint32_t kind, uint64_t key, const void *data, uint32_t size) {
+
+    cache_share_t *share = volume->cache;
+    if (!share) return;
+
+    cache_pool_t *pool = share->pool;
+    if (entry_charge(size) > atomic_load_explicit(&pool->budget, memory_order_relaxed)) return;
+
+    cache_entry_t *entry = malloc(entry_charge(size));
+    if (!entry) return;
+
+    entry->share = share;
+    entry->kind = kind;
+    entry->key = key;
+    entry->size = size;
+    atomic_init(&entry->referenced, 0);
+    memcpy(entry->data, data, size);
+
+    pthread_mutex_lock(&pool->lock);
+
+    _Atomic(cache_entry_t *) *bucket = &pool->buckets[bucket_of(pool, share->id, kind, key)];
+    for (cache_entry_t *old = atomic_load_explicit(bucket, memory_order_relaxed); old;
+         old = atomic_load_explicit(&old->hash_next, memory_order_relaxed)) {
+        if (old->share == share && old->kind == kind && old->key == key) {
+            remove_entry(pool, old);
+            break;
+        }
+    }
+    set_ghost(pool, share, kind, key, size, 0);
+
+    if (pool->used + entry_charge(size) > pool->budget) update_demand(pool);
+    while (pool->used + entry_charge(size) > pool->budget) {
+        cache_share_t *victim = pick_victim(pool);
+        if (!victim) break;
+        evict_one(pool, victim);
+    }
+
+    // The release store publishes the entry's contents along with it
+    atomic_init(&entry->hash_next, atomic_load_explicit(bucket, memory_order_relaxed));
+    atomic_store_explicit(bucket, entry, memory_order_release);
+    lru_push_front(share, entry);
+    share->used += entry_charge(size);
+    pool->used += entry_charge(size);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* cache_invalidate: Drops the cached copy of an object of a volume,
+   once the object changed. Does nothing if the object is not cached,
+   or the volume is not attached to a pool. A lookup already past the
+   entry may still return the old copy; callers changing a volume keep
+   lookups out while they do (see ext2write.c).
+
+   Parameters:
+     volume: Pointer to volume.
+     kind: Type of object (see cache_lookup).
+     key: Identifier of the object, unique within the kind.
+ */
+void cache_invalidate(volume_t *volume, uint32_t kind, uint64_t key) {
+
+    cache_share_t *share = volume->cache;
+    if (!share) return;
+
+    cache_pool_t *pool = share->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (cache_entry_t *entry = atomic_load_explicit(&pool->buckets[bucket_of(pool, share->id, kind, key)],
+                                                     memory_order_relaxed); entry;
+         entry = atomic_load_explicit(&entry->hash_next, memory_order_relaxed)) {
+        if (entry->share == share && entry->kind == kind && entry->key == key) {
+            remove_entry(pool, entry);
+            break;
+        }
+    }
+    // Not evicted for lack of memory, so a later miss is no ghost hit
+    set_ghost(pool, share, kind, key, 0, 0);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* cache_volume_stats: Reports cache usage of a volume.
+
+   Parameters:
+     volume: Pointer to volume.
+     stats: Filled with the bytes used by the volume, and its hit and
+            miss counts for each kind of object since it was attached.
+
+   Returns:
+     0 on success, or -1 if the volume is not attached to a pool.
+ */
+int cache_volume_stats(volume_t *volume, cache_stats_t *stats) {
+
+    cache_share_t *share = volume->cache;
+    if (!share) return -1;
+
+    pthread_mutex_lock(&share->pool->lock);
+    update_demand(share->pool);
+    stats->used = share->used;
+    stats->demand = share->demand;
+    for (int kind = 0; kind < EXT2_CACHE_KINDS; kind++) {
+        stats->hits[kind] = stats->misses[kind] = 0;
+        for (int i = 0; i < EXT2_CACHE_STRIPES; i++) {
+            stats->hits[kind] += atomic_load_explicit(&share->counters[i].hits[kind], memory_order_relaxed);
+            stats->misses[kind] += atomic_load_explicit(&share->counters[i].misses[kind], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&share->pool->lock);
+    return 0;
+}
+
+/* cache_pool_memory: Reports the memory used by a pool, for a memory
+   governor.
+
+   Parameters:
+     pool: Pointer to pool.
+     usage: Filled with the bytes used by cached data and the pool's
+            budget, and the ghost hits of all volumes ever attached.
+ */
+void cache_pool_memory(cache_pool_t *pool, mem_usage_t *usage) {
+
+    pthread_mutex_lock(&pool->lock);
+    usage->bytes = pool->used;
+    usage->budget = pool->budget;
+    usage->ghost_hits = pool->detached_ghost_hits;
+    for (cache_share_t *share = pool->shares; share; share = share->next)
+        for (int i = 0; i < EXT2_CACHE_STRIPES; i++)
+            usage->ghost_hits += atomic_load_explicit(&share->counters[i].ghost_hits, memory_order_relaxed);
+    usage->ghost_bytes = pool->ghost_bytes;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* cache_pool_resize: Changes the memory budget of a pool, evicting
+   objects of the volumes furthest above their fair share until the
+   pool fits in the new budget.
+
+   Parameters:
+     pool: Pointer to pool.
+     budget: New budget, as for cache_pool_create. The number of hash
+             buckets is not changed.
+ */
+void cache_pool_resize(cache_pool_t *pool, uint64_t budget) {
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store_explicit(&pool->budget, budget, memory_order_relaxed);
+
+    if (pool->used > budget) update_demand(pool);
+    while (pool->used > budget) {
+        cache_share_t *victim = pick_victim(pool);
+        if (!victim) break;
+        evict_one(pool, victim);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
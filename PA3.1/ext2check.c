@@ -0,0 +1,494 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* The consistency check runs in two passes over the block groups, each
+   split across worker threads that take groups one at a time. The
+   first pass reads the bitmaps and inode table of a group, walks the
+   block map of every inode in use and the entries of every directory,
+   and records cross-group information in compact shared tables: one
+   bit per block claimed by metadata or an inode, one bit per inode in
+   use, and a count of directory entries referencing each inode. The
+   second pass, once every group is done, compares those tables against
+   each group's bitmaps and the inodes' link counts. Nothing is ever
+   written to the volume.
+ */
+
+typedef struct check {
+    volume_t *volume;
+    FILE *report;
+    pthread_mutex_t report_lock;
+    unsigned int num_threads;
+
+    _Atomic uint64_t *claimed;     // One bit per block owned by metadata or an inode
+    _Atomic uint64_t *inodes_used; // One bit per inode marked in use in its group
+    _Atomic uint32_t *refs;        // Number of directory entries referencing each inode
+    uint16_t *links;               // i_links_count of each inode in use
+
+    int pass;                      // Pass being run by the workers (0 or 1)
+    _Atomic uint32_t next_group;
+    _Atomic uint64_t free_blocks;  // Sum of bg_free_blocks_count
+    _Atomic uint64_t free_inodes;  // Sum of bg_free_inodes_count
+    _Atomic int failed;            // Set if the volume could not be read
+
+    _Atomic uint64_t problems, inodes_checked, directories_checked, blocks_claimed;
+} check_t;
+
+// State of the walk of one inode's blocks
+typedef struct inode_walk {
+    check_t *check;
+    uint32_t inode_no;
+    inode_t *inode;
+    uint64_t num_blocks; // Blocks mapped, including indirect blocks
+    char *block;         // Buffer for directory blocks
+} inode_walk_t;
+
+static void problem(check_t *check, const char *format, ...) {
+
+    atomic_fetch_add(&check->problems, 1);
+    if (!check->report) return;
+
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&check->report_lock);
+    vfprintf(check->report, format, args);
+    fputc('\n', check->report);
+    pthread_mutex_unlock(&check->report_lock);
+    va_end(args);
+}
+
+static inline int bitset_test_and_set(_Atomic uint64_t *bits, uint64_t i) {
+
+    uint64_t mask = 1ULL << (i & 63);
+    return (atomic_fetch_or_explicit(&bits[i >> 6], mask, memory_order_relaxed) & mask) != 0;
+}
+
+static inline int bitset_test(_Atomic uint64_t *bits, uint64_t i) {
+
+    return (atomic_load_explicit(&bits[i >> 6], memory_order_relaxed) >> (i & 63)) & 1;
+}
+
+static inline int bitmap_test(const uint8_t *bitmap, uint32_t i) {
+
+    return (bitmap[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline uint64_t bitset_words(uint64_t bits) {
+
+    return (bits + 63) / 64;
+}
+
+/* Checks if a group holds a copy of the superblock and group
+   descriptors. With the sparse superblock feature, only groups 0, 1
+   and powers of 3, 5 and 7 do. */
+static int group_has_super(volume_t *volume, uint32_t group) {
+
+    if (group <= 1 || !(volume->super.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return 1;
+
+    for (uint32_t base = 3; base <= 7; base += 2) {
+        uint64_t power = base;
+        while (power < group) power *= base;
+        if (power == group) return 1;
+    }
+    return 0;
+}
+
+static inline uint32_t group_first_block(volume_t *volume, uint32_t group) {
+
+    return volume->super.s_first_data_block + group * volume->super.s_blocks_per_group;
+}
+
+static inline uint32_t group_num_blocks(volume_t *volume, uint32_t group) {
+
+    uint32_t left = volume->super.s_blocks_count - group_first_block(volume, group);
+    return left < volume->super.s_blocks_per_group ? left : volume->super.s_blocks_per_group;
+}
+
+static inline uint32_t inode_table_blocks(volume_t *volume) {
+
+    return ((uint64_t) volume->super.s_inodes_per_group * volume->inode_size + volume->block_size - 1) /
+           volume->block_size;
+}
+
+/* Marks a block as claimed by 'owner' (a description used in reports),
+   reporting blocks outside the volume and blocks claimed twice.
+
+   Returns:
+     1 if the block is inside the volume, 0 otherwise.
+ */
+static int claim_block(check_t *check, uint32_t block_no, const char *owner, uint32_t inode_no) {
+
+    volume_t *volume = check->volume;
+
+    if (block_no < volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count) {
+        problem(check, "inode %u: %s %u is outside the volume", inode_no, owner, block_no);
+        return 0;
+    }
+    atomic_fetch_add_explicit(&check->blocks_claimed, 1, memory_order_relaxed);
+    if (bitset_test_and_set(check->claimed, block_no)) {
+        if (inode_no)
+            problem(check, "block %u: claimed more than once (%s of inode %u)", block_no, owner, inode_no);
+        else
+            problem(check, "block %u: claimed more than once (%s)", block_no, owner);
+    }
+    return 1;
+}
+
+/* Checks the chain of entries in one directory block: every rec_len
+   must be aligned, large enough for its name, and the last entry must
+   end exactly at the end of the block. Each valid entry adds a
+   reference to the inode it names. */
+static void check_directory_block(inode_walk_t *walk, uint64_t block_idx, uint32_t block_no) {
+
+    check_t *check = walk->check;
+    volume_t *volume = check->volume;
+    uint32_t offset = 0;
+    int index = 0;
+
+    if (read_block(volume, block_no, 0, volume->block_size, walk->block) != volume->block_size) {
+        atomic_store(&check->failed, 1);
+        return;
+    }
+
+    while (offset < volume->block_size) {
+        dir_entry_t *entry = (dir_entry_t *) (walk->block + offset);
+        uint32_t left = volume->block_size - offset;
+
+        if (left < EXT2_DIR_ENTRY_HEADER_LEN || entry->de_rec_len < EXT2_DIR_ENTRY_HEADER_LEN ||
+            entry->de_rec_len % 4 || entry->de_rec_len > left ||
+            EXT2_DIR_ENTRY_HEADER_LEN + entry->de_name_len > entry->de_rec_len) {
+            problem(check, "inode %u: directory block %" PRIu64 " (block %u) has an invalid entry at offset %u",
+                    walk->inode_no, block_idx, block_no, offset);
+            return;
+        }
+
+        if (entry->de_inode_no) {
+            if (block_idx == 0 && index < 2) {
+                const char *expected = index == 0 ? "." : "..";
+                if (entry->de_name_len != strlen(expected) || memcmp(entry->de_name, expected, entry->de_name_len))
+                    problem(check, "inode %u: directory entry %d is not '%s'", walk->inode_no, index, expected);
+                else if (index == 0 && entry->de_inode_no != walk->inode_no)
+                    problem(check, "inode %u: '.' refers to inode %u", walk->inode_no, entry->de_inode_no);
+            }
+
+            if (entry->de_inode_no > volume->super.s_inodes_count)
+                problem(check, "inode %u: entry '%.*s' refers to invalid inode %u", walk->inode_no,
+                        entry->de_name_len, entry->de_name, entry->de_inode_no);
+            else
+                atomic_fetch_add_explicit(&check->refs[entry->de_inode_no], 1, memory_order_relaxed);
+        }
+
+        index++;
+        offset += entry->de_rec_len;
+    }
+}
+
+static int visit_inode_block(void *ctx, uint64_t block_idx, uint32_t block_no, int level) {
+
+    inode_walk_t *walk = ctx;
+    check_t *check = walk->check;
+    static const char *owners[] = { "data block", "indirect block", "doubly indirect block",
+                                    "triply indirect block" };
+
+    walk->num_blocks++;
+    if (!claim_block(check, block_no, owners[level], walk->inode_no))
+        return 0;
+
+    if (level == 0 && inode_is_directory(walk->inode)) {
+        if (block_idx * check->volume->block_size >= walk->inode->i_size)
+            problem(check, "inode %u: directory block %" PRIu64 " is past the end of the directory",
+                    walk->inode_no, block_idx);
+        else
+            check_directory_block(walk, block_idx, block_no);
+    }
+    return 0;
+}
+
+/* Checks one inode in use: its mode and link count, and its block map,
+   whose blocks are claimed in the shared block set. */
+static void check_inode(check_t *check, uint32_t inode_no, inode_t *inode, char *block) {
+
+    volume_t *volume = check->volume;
+
+    atomic_fetch_add_explicit(&check->inodes_checked, 1, memory_order_relaxed);
+    check->links[inode_no] = inode->i_links_count;
+
+    int reserved = inode_no < volume->super.s_first_ino && inode_no != EXT2_ROOT_INO;
+    if (!reserved) {
+        if (!inode->i_mode)
+            problem(check, "inode %u: in use but has no mode", inode_no);
+        if (inode->i_dtime)
+            problem(check, "inode %u: in use but has a deletion time", inode_no);
+    }
+    if (inode_no == EXT2_ROOT_INO && !inode_is_directory(inode))
+        problem(check, "inode %u: root is not a directory", inode_no);
+
+    inode_walk_t walk = { check, inode_no, inode, 0, block };
+
+    if (inode_is_directory(inode)) {
+        atomic_fetch_add_explicit(&check->directories_checked, 1, memory_order_relaxed);
+        if (inode->i_size % volume->block_size)
+            problem(check, "inode %u: directory size %u is not a multiple of the block size",
+                    inode_no, inode->i_size);
+    }
+
+    if (walk_inode_blocks(volume, inode, visit_inode_block, &walk) < 0)
+        atomic_store(&check->failed, 1);
+
+    // Extended attribute blocks may be shared between inodes, so are not checked for double claims
+    if (inode->i_file_acl) {
+        walk.num_blocks++;
+        if (inode->i_file_acl < volume->super.s_first_data_block ||
+            inode->i_file_acl >= volume->super.s_blocks_count)
+            problem(check, "inode %u: extended attribute block %u is outside the volume",
+                    inode_no, inode->i_file_acl);
+        else if (!bitset_test_and_set(check->claimed, inode->i_file_acl))
+            atomic_fetch_add_explicit(&check->blocks_claimed, 1, memory_order_relaxed);
+    }
+
+    uint64_t sectors = walk.num_blocks * (volume->block_size / 512);
+    if (inode_has_blocks(volume, inode) && sectors != inode->i_blocks)
+        problem(check, "inode %u: i_blocks is %u, but %" PRIu64 " blocks are mapped (%" PRIu64 " sectors)",
+                inode_no, inode->i_blocks, walk.num_blocks, sectors);
+}
+
+/* First pass over a group: bitmap free counts, metadata blocks, and
+   every inode in use. */
+static void check_group_inodes(check_t *check, uint32_t group, uint8_t *block_bitmap,
+                               uint8_t *inode_bitmap, char *table, char *block) {
+
+    volume_t *volume = check->volume;
+    const group_desc_t *desc = get_group_desc(volume, group);
+    uint32_t first = group_first_block(volume, group), count = group_num_blocks(volume, group);
+    uint32_t ipg = volume->super.s_inodes_per_group;
+    uint32_t inode_size = volume->inode_size;
+    uint32_t table_blocks = inode_table_blocks(volume);
+
+    if (!desc ||
+        read_block(volume, desc->bg_block_bitmap, 0, volume->block_size, block_bitmap) != volume->block_size ||
+        read_block(volume, desc->bg_inode_bitmap, 0, volume->block_size, inode_bitmap) != volume->block_size ||
+        read_block(volume, desc->bg_inode_table, 0, table_blocks * volume->block_size, table) !=
+            table_blocks * volume->block_size) {
+        problem(check, "group %u: descriptor, bitmaps or inode table cannot be read", group);
+        atomic_store(&check->failed, 1);
+        return;
+    }
+
+    // Free counts in the descriptor against the bitmaps
+    uint32_t free_blocks = 0, free_inodes = 0, used_dirs = 0;
+    for (uint32_t i = 0; i < count; i++)
+        free_blocks += !bitmap_test(block_bitmap, i);
+    for (uint32_t i = 0; i < ipg; i++)
+        free_inodes += !bitmap_test(inode_bitmap, i);
+
+    if (free_blocks != desc->bg_free_blocks_count)
+        problem(check, "group %u: %u free blocks in descriptor, %u in bitmap", group,
+                desc->bg_free_blocks_count, free_blocks);
+    if (free_inodes != desc->bg_free_inodes_count)
+        problem(check, "group %u: %u free inodes in descriptor, %u in bitmap", group,
+                desc->bg_free_inodes_count, free_inodes);
+    atomic_fetch_add(&check->free_blocks, desc->bg_free_blocks_count);
+    atomic_fetch_add(&check->free_inodes, desc->bg_free_inodes_count);
+
+    // Metadata blocks
+    if (group_has_super(volume, group)) {
+        uint32_t desc_blocks = (volume->num_groups * sizeof(group_desc_t) + volume->block_size - 1) /
+                               volume->block_size;
+        for (uint32_t i = 0; i <= desc_blocks; i++)
+            claim_block(check, first + i, i ? "group descriptor block" : "superblock", 0);
+    }
+    claim_block(check, desc->bg_block_bitmap, "block bitmap", 0);
+    claim_block(check, desc->bg_inode_bitmap, "inode bitmap", 0);
+    for (uint32_t i = 0; i < table_blocks; i++)
+        claim_block(check, desc->bg_inode_table + i, "inode table", 0);
+
+    // Inodes in use
+    for (uint32_t i = 0; i < ipg; i++) {
+        uint32_t inode_no = group * ipg + i + 1;
+        if (inode_no > volume->super.s_inodes_count || !bitmap_test(inode_bitmap, i))
+            continue;
+
+        inode_t inode;
+        memcpy(&inode, table + (size_t) i * inode_size, sizeof(inode));
+        bitset_test_and_set(check->inodes_used, inode_no);
+        if (inode_is_directory(&inode)) used_dirs++;
+        check_inode(check, inode_no, &inode, block);
+    }
+
+    if (used_dirs != desc->bg_used_dirs_count)
+        problem(check, "group %u: %u directories in descriptor, %u found", group,
+                desc->bg_used_dirs_count, used_dirs);
+}
+
+/* Second pass over a group: claimed blocks against the block bitmap,
+   and directory references against link counts. */
+static void check_group_references(check_t *check, uint32_t group, uint8_t *block_bitmap) {
+
+    volume_t *volume = check->volume;
+    const group_desc_t *desc = get_group_desc(volume, group);
+    uint32_t first = group_first_block(volume, group), count = group_num_blocks(volume, group);
+    uint32_t ipg = volume->super.s_inodes_per_group;
+
+    if (!desc || read_block(volume, desc->bg_block_bitmap, 0, volume->block_size, block_bitmap) != volume->block_size) {
+        atomic_store(&check->failed, 1);
+        return;
+    }
+
+    // Report mismatches as ranges of consecutive blocks
+    for (uint32_t i = 0; i < count; ) {
+        int used = bitmap_test(block_bitmap, i), claimed = bitset_test(check->claimed, first + i);
+        if (used == claimed) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        while (i < count && bitmap_test(block_bitmap, i) == used && bitset_test(check->claimed, first + i) == claimed)
+            i++;
+        if (i - start == 1)
+            problem(check, "block %u: %s", first + start,
+                    used ? "marked in use in bitmap but not owned" : "owned but marked free in bitmap");
+        else
+            problem(check, "blocks %u-%u: %s", first + start, first + i - 1,
+                    used ? "marked in use in bitmap but not owned" : "owned but marked free in bitmap");
+    }
+
+    for (uint32_t i = 0; i < ipg; i++) {
+        uint32_t inode_no = group * ipg + i + 1;
+        if (inode_no > volume->super.s_inodes_count) break;
+
+        uint32_t refs = atomic_load_explicit(&check->refs[inode_no], memory_order_relaxed);
+        if (!bitset_test(check->inodes_used, inode_no)) {
+            if (refs)
+                problem(check, "inode %u: referenced by %u directory entries but free in bitmap", inode_no, refs);
+        } else if (inode_no >= volume->super.s_first_ino || inode_no == EXT2_ROOT_INO) {
+            if (refs != check->links[inode_no])
+                problem(check, "inode %u: link count is %u, but %u directory entries refer to it", inode_no,
+                        check->links[inode_no], refs);
+        }
+    }
+}
+
+static void *check_worker(void *arg) {
+
+    check_t *check = arg;
+    volume_t *volume = check->volume;
+    int pass = check->pass;
+
+    uint8_t *block_bitmap = malloc(volume->block_size);
+    uint8_t *inode_bitmap = malloc(volume->block_size);
+    char *block = malloc(volume->block_size);
+    char *table = pass ? NULL : malloc((size_t) inode_table_blocks(volume) * volume->block_size);
+
+    if (!block_bitmap || !inode_bitmap || !block || (!pass && !table)) {
+        atomic_store(&check->failed, 1);
+    } else {
+        uint32_t group;
+        while ((group = atomic_fetch_add(&check->next_group, 1)) < volume->num_groups) {
+            if (pass)
+                check_group_references(check, group, block_bitmap);
+            else
+                check_group_inodes(check, group, block_bitmap, inode_bitmap, table, block);
+        }
+    }
+
+    free(block_bitmap);
+    free(inode_bitmap);
+    free(block);
+    free(table);
+    return NULL;
+}
+
+/* Runs one pass of the check over all groups with the worker threads.
+   The calling thread is one of the workers. */
+static void run_pass(check_t *check, int pass) {
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * check->num_threads);
+    unsigned int started = 0;
+
+    check->pass = pass;
+    atomic_store(&check->next_group, 0);
+
+    if (threads)
+        for (; started + 1 < check->num_threads; started++)
+            if (pthread_create(&threads[started], NULL, check_worker, check) != 0)
+                break;
+
+    check_worker(check);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+/* check_volume: Checks the consistency of a volume without modifying
+   it: block maps of inodes in use against the block bitmaps, blocks
+   claimed more than once, directory entry chains, link counts against
+   directory entries, and free counts in group descriptors and the
+   superblock against the bitmaps. Block groups are checked in
+   parallel.
+
+   Parameters:
+     volume: Pointer to volume.
+     num_threads: Number of threads used for the check (at least 1).
+     report: If not NULL, file where a line describing each problem
+             found is written.
+     stats: If not NULL, filled with the number of problems found and
+            of objects checked.
+
+   Returns:
+     0 if the volume is consistent, 1 if problems were found, or -1 if
+     the check could not be completed (memory exhausted or read
+     errors).
+ */
+int check_volume(volume_t *volume, unsigned int num_threads, FILE *report, check_stats_t *stats) {
+
+    check_t check = { .volume = volume, .report = report, .num_threads = num_threads ? num_threads : 1 };
+    uint64_t num_inodes = (uint64_t) volume->super.s_inodes_count + 1;
+    int rv = -1;
+
+    pthread_mutex_init(&check.report_lock, NULL);
+    check.claimed = calloc(bitset_words(volume->super.s_blocks_count), sizeof(uint64_t));
+    check.inodes_used = calloc(bitset_words(num_inodes), sizeof(uint64_t));
+    check.refs = calloc(num_inodes, sizeof(uint32_t));
+    check.links = calloc(num_inodes, sizeof(uint16_t));
+    if (!check.claimed || !check.inodes_used || !check.refs || !check.links)
+        goto done;
+
+    // Block 0 of volumes with 1 KiB blocks is the boot block, before the first group
+    for (uint32_t i = 0; i < volume->super.s_first_data_block; i++)
+        bitset_test_and_set(check.claimed, i);
+
+    run_pass(&check, 0);
+    if (atomic_load(&check.failed)) goto done;
+
+    if (atomic_load(&check.free_blocks) != volume->super.s_free_blocks_count)
+        problem(&check, "superblock: %u free blocks, %" PRIu64 " in group descriptors",
+                volume->super.s_free_blocks_count, atomic_load(&check.free_blocks));
+    if (atomic_load(&check.free_inodes) != volume->super.s_free_inodes_count)
+        problem(&check, "superblock: %u free inodes, %" PRIu64 " in group descriptors",
+                volume->super.s_free_inodes_count, atomic_load(&check.free_inodes));
+
+    run_pass(&check, 1);
+    if (atomic_load(&check.failed)) goto done;
+
+    rv = atomic_load(&check.problems) ? 1 : 0;
+
+done:
+    if (stats) {
+        stats->problems = atomic_load(&check.problems);
+        stats->inodes = atomic_load(&check.inodes_checked);
+        stats->directories = atomic_load(&check.directories_checked);
+        stats->blocks = atomic_load(&check.blocks_claimed);
+    }
+    free(check.claimed);
+    free(check.inodes_used);
+    free(check.refs);
+    free(check.links);
+    pthread_mutex_destroy(&check.report_lock);
+    return rv;
+}
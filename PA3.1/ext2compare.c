@@ -0,0 +1,521 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Structural comparison of two volumes, typically two versions of
+   the same image. Both trees are walked together, a pair of
+   directories at a time, by several threads. The entries of each pair
+   of directories are matched by name, and the inodes of the entries
+   found on both sides are compared field by field, so unchanged files
+   cost an inode read, and not a read of their data.
+
+   Like rsync's quick check, a regular file with the same size, times
+   and block pointers on both sides is taken as unchanged. Files whose
+   metadata cannot settle the question (same size, but different times
+   or block pointers) are compared block by block once the walk is
+   done, sorted by their location on the first volume so the data is
+   read front to back. With EXT2_COMPARE_CONTENT, every regular file of
+   the same size is compared this way.
+ */
+
+// Number of directory entries (or inodes) read per batch
+#define EXT2_COMPARE_BATCH 256
+
+// Number of blocks of each file read per step when comparing contents
+#define EXT2_COMPARE_RUN_BLOCKS 64
+
+typedef struct dir_pair {
+    struct dir_pair *next;
+    char *path;
+    inode_t inode_a, inode_b;
+} dir_pair_t;
+
+typedef struct name_entry {
+    char *name;
+    uint32_t inode_no;
+} name_entry_t;
+
+typedef struct content_pair {
+    char *path;
+    uint32_t location; // First data block on the first volume
+    uint32_t fields;   // Fields known to differ already
+    inode_t inode_a, inode_b;
+} content_pair_t;
+
+typedef struct comparer {
+    volume_t *a, *b;
+    int flags;
+    diff_callback_t callback;
+    void *ctx;
+
+    pthread_mutex_t lock;    // Protects pending, busy, the content pairs and the callback
+    pthread_cond_t ready;    // A directory pair was queued, or the walk is over
+    dir_pair_t *pending;
+    unsigned int busy;       // Threads comparing a pair of directories
+    content_pair_t *contents;
+    size_t num_contents, max_contents;
+    _Atomic size_t next;
+    _Atomic int failed;
+
+    _Atomic uint64_t directories, inodes, files_read, bytes_read;
+} comparer_t;
+
+static void report(comparer_t *comparer, diff_entry_t *entry) {
+
+    pthread_mutex_lock(&comparer->lock);
+    comparer->callback(comparer->ctx, entry);
+    pthread_mutex_unlock(&comparer->lock);
+}
+
+static char *join_path(const char *dir, const char *name) {
+
+    size_t len = strlen(dir), nameLen = strlen(name);
+    if (len + 1 + nameLen >= PATH_MAX) return NULL;
+
+    char *path = malloc(len + 1 + nameLen + 1);
+    if (!path) return NULL;
+    memcpy(path, dir, len);
+    if (len == 0 || dir[len - 1] != '/') path[len++] = '/';
+    memcpy(path + len, name, nameLen + 1);
+    return path;
+}
+
+typedef struct side_walk {
+    comparer_t *comparer;
+    volume_t *volume;
+    char change;
+} side_walk_t;
+
+static int report_side(void *ctx, const char *path, uint32_t inode_no, inode_t *inode) {
+
+    side_walk_t *walk = ctx;
+    diff_entry_t entry = { .change = walk->change, .path = path };
+
+    if (walk->change == EXT2_DIFF_ADDED) {
+        entry.mode_b = inode->i_mode;
+        entry.size_b = inode_file_size(walk->volume, inode);
+    } else {
+        entry.mode_a = inode->i_mode;
+        entry.size_a = inode_file_size(walk->volume, inode);
+    }
+    atomic_fetch_add_explicit(&walk->comparer->inodes, 1, memory_order_relaxed);
+    report(walk->comparer, &entry);
+    return 0;
+}
+
+/* Reports a file found on one side only and, for a directory,
+   everything below it. */
+static void report_one_side(comparer_t *comparer, volume_t *volume, char change, const char *path,
+                            inode_t *inode) {
+
+    side_walk_t walk = { comparer, volume, change };
+
+    if (!inode_is_directory(inode)) {
+        report_side(&walk, path, 0, inode);
+        return;
+    }
+    if (walk_directory_tree(volume, path, report_side, &walk) < 0)
+        atomic_store(&comparer->failed, 1);
+}
+
+static int compare_names(const void *x, const void *y) {
+
+    return strcmp(((const name_entry_t *) x)->name, ((const name_entry_t *) y)->name);
+}
+
+/* Reads the entries of a directory, except "." and "..", sorted by
+   name. Returns the number of entries, or -1 on error. */
+static ssize_t read_names(volume_t *volume, inode_t *dir, name_entry_t **names, dir_entry_t *entries) {
+
+    size_t count = 0, capacity = 0;
+    off_t offset = 0;
+    ssize_t found;
+
+    *names = NULL;
+    while ((found = read_directory_entries(volume, dir, &offset, entries, NULL, EXT2_COMPARE_BATCH)) > 0) {
+        for (ssize_t i = 0; i < found; i++) {
+            if (!strcmp(entries[i].de_name, ".") || !strcmp(entries[i].de_name, "..")) continue;
+
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                name_entry_t *grown = realloc(*names, sizeof(name_entry_t) * capacity);
+                if (!grown) goto fail;
+                *names = grown;
+            }
+            if (!((*names)[count].name = strdup(entries[i].de_name))) goto fail;
+            (*names)[count++].inode_no = entries[i].de_inode_no;
+        }
+    }
+    if (found < 0) goto fail;
+
+    if (count) qsort(*names, count, sizeof(name_entry_t), compare_names);
+    return count;
+
+ fail:
+    for (size_t i = 0; i < count; i++)
+        free((*names)[i].name);
+    free(*names);
+    *names = NULL;
+    return -1;
+}
+
+static void free_names(name_entry_t *names, ssize_t count) {
+
+    for (ssize_t i = 0; i < count; i++)
+        free(names[i].name);
+    free(names);
+}
+
+static void queue_directory(comparer_t *comparer, char *path, inode_t *inode_a, inode_t *inode_b) {
+
+    dir_pair_t *pair = malloc(sizeof(dir_pair_t));
+    if (!pair) {
+        atomic_store(&comparer->failed, 1);
+        free(path);
+        return;
+    }
+    pair->path = path;
+    pair->inode_a = *inode_a;
+    pair->inode_b = *inode_b;
+
+    pthread_mutex_lock(&comparer->lock);
+    pair->next = comparer->pending;
+    comparer->pending = pair;
+    pthread_cond_signal(&comparer->ready);
+    pthread_mutex_unlock(&comparer->lock);
+}
+
+static void queue_content(comparer_t *comparer, char *path, uint32_t fields, inode_t *inode_a, inode_t *inode_b) {
+
+    pthread_mutex_lock(&comparer->lock);
+    if (comparer->num_contents == comparer->max_contents) {
+        size_t capacity = comparer->max_contents ? comparer->max_contents * 2 : 256;
+        content_pair_t *grown = realloc(comparer->contents, sizeof(content_pair_t) * capacity);
+        if (!grown) {
+            pthread_mutex_unlock(&comparer->lock);
+            atomic_store(&comparer->failed, 1);
+            free(path);
+            return;
+        }
+        comparer->contents = grown;
+        comparer->max_contents = capacity;
+    }
+    content_pair_t *pair = &comparer->contents[comparer->num_contents++];
+    pair->path = path;
+    pair->fields = fields;
+    pair->inode_a = *inode_a;
+    pair->inode_b = *inode_b;
+    pthread_mutex_unlock(&comparer->lock);
+}
+
+/* Compares the inodes of a file found on both sides. Directories are
+   queued for the walk, and regular files whose metadata does not
+   settle whether the data changed are queued for a content
+   comparison. 'path' is owned by this function. */
+static void compare_inodes(comparer_t *comparer, char *path, inode_t *x, inode_t *y) {
+
+    volume_t *a = comparer->a, *b = comparer->b;
+    diff_entry_t entry = { .change = EXT2_DIFF_CHANGED, .path = path, .mode_a = x->i_mode, .mode_b = y->i_mode,
+                           .size_a = inode_file_size(a, x), .size_b = inode_file_size(b, y) };
+
+    atomic_fetch_add_explicit(&comparer->inodes, 1, memory_order_relaxed);
+
+    if ((x->i_mode & S_IFMT) != (y->i_mode & S_IFMT)) {
+        // A change of type replaces the file (and everything below a directory)
+        report_one_side(comparer, a, EXT2_DIFF_DELETED, path, x);
+        report_one_side(comparer, b, EXT2_DIFF_ADDED, path, y);
+        free(path);
+        return;
+    }
+
+    if ((x->i_mode & 07777) != (y->i_mode & 07777)) entry.fields |= EXT2_DIFF_MODE;
+    if (x->i_uid != y->i_uid || x->l_i_uid_high != y->l_i_uid_high ||
+        x->i_gid != y->i_gid || x->l_i_gid_high != y->l_i_gid_high)
+        entry.fields |= EXT2_DIFF_OWNER;
+    if (entry.size_a != entry.size_b) entry.fields |= EXT2_DIFF_SIZE | EXT2_DIFF_CONTENT;
+    if (x->i_mtime != y->i_mtime) entry.fields |= EXT2_DIFF_MTIME;
+    if (x->i_links_count != y->i_links_count) entry.fields |= EXT2_DIFF_LINKS;
+
+    if (inode_is_directory(x)) {
+        // Entries added or removed show up below; the directory's own size is not a change
+        entry.fields &= ~(EXT2_DIFF_SIZE | EXT2_DIFF_CONTENT);
+        if (entry.fields) report(comparer, &entry);
+        queue_directory(comparer, path, x, y);
+        return;
+    }
+
+    if (!(entry.fields & EXT2_DIFF_CONTENT)) {
+        if (inode_is_regular_file(x)) {
+            int same_layout = a->block_size == b->block_size && x->i_ctime == y->i_ctime &&
+                              x->i_mtime == y->i_mtime && !memcmp(x->i_block, y->i_block, sizeof(x->i_block));
+
+            if (!same_layout || (comparer->flags & EXT2_COMPARE_CONTENT)) {
+                queue_content(comparer, path, entry.fields, x, y);
+                return;
+            }
+        } else if (inode_is_symlink(x)) {
+            char target_a[PATH_MAX], target_b[PATH_MAX];
+            int32_t len_a = read_symlink_target(a, x, target_a, sizeof(target_a));
+            int32_t len_b = read_symlink_target(b, y, target_b, sizeof(target_b));
+
+            if (len_a <= 0 || len_b <= 0) atomic_store(&comparer->failed, 1);
+            else if (len_a != len_b || memcmp(target_a, target_b, len_a)) entry.fields |= EXT2_DIFF_CONTENT;
+        } else if (x->i_block[0] != y->i_block[0] || x->i_block[1] != y->i_block[1]) {
+            // Device numbers
+            entry.fields |= EXT2_DIFF_CONTENT;
+        }
+    }
+
+    if (entry.fields) report(comparer, &entry);
+    free(path);
+}
+
+/* Compares the entries of a pair of directories. */
+static void compare_directories(comparer_t *comparer, dir_pair_t *pair, dir_entry_t *entries,
+                                uint32_t *inode_nos, inode_t *inodes_a, inode_t *inodes_b) {
+
+    name_entry_t *names_a, *names_b;
+    ssize_t count_a = read_names(comparer->a, &pair->inode_a, &names_a, entries);
+    ssize_t count_b = read_names(comparer->b, &pair->inode_b, &names_b, entries);
+    ssize_t i = 0, j = 0;
+
+    atomic_fetch_add_explicit(&comparer->directories, 1, memory_order_relaxed);
+    if (count_a < 0 || count_b < 0) {
+        atomic_store(&comparer->failed, 1);
+        goto done;
+    }
+
+    while (i < count_a || j < count_b) {
+        uint32_t both[EXT2_COMPARE_BATCH][2];
+        size_t matched = 0;
+
+        // Collect up to a batch of names found on both sides, reporting the others
+        while ((i < count_a || j < count_b) && matched < EXT2_COMPARE_BATCH) {
+            int order = i == count_a ? 1 : j == count_b ? -1 : strcmp(names_a[i].name, names_b[j].name);
+
+            if (order == 0) {
+                both[matched][0] = i++;
+                both[matched][1] = j++;
+                matched++;
+                continue;
+            }
+
+            name_entry_t *only = order < 0 ? &names_a[i++] : &names_b[j++];
+            volume_t *volume = order < 0 ? comparer->a : comparer->b;
+            char *path = join_path(pair->path, only->name);
+            inode_t inode;
+
+            if (!path || read_inode(volume, only->inode_no, &inode) <= 0) {
+                atomic_store(&comparer->failed, 1);
+                free(path);
+                continue;
+            }
+            report_one_side(comparer, volume, order < 0 ? EXT2_DIFF_DELETED : EXT2_DIFF_ADDED, path, &inode);
+            free(path);
+        }
+        if (matched == 0) continue;
+
+        for (size_t k = 0; k < matched; k++)
+            inode_nos[k] = names_a[both[k][0]].inode_no;
+        ssize_t read_a = read_inodes(comparer->a, inode_nos, matched, inodes_a);
+        for (size_t k = 0; k < matched; k++)
+            inode_nos[k] = names_b[both[k][1]].inode_no;
+        ssize_t read_b = read_inodes(comparer->b, inode_nos, matched, inodes_b);
+
+        if (read_a != matched || read_b != matched) {
+            atomic_store(&comparer->failed, 1);
+            continue;
+        }
+
+        for (size_t k = 0; k < matched; k++) {
+            char *path = join_path(pair->path, names_a[both[k][0]].name);
+            if (!path) {
+                atomic_store(&comparer->failed, 1);
+                continue;
+            }
+            compare_inodes(comparer, path, &inodes_a[k], &inodes_b[k]);
+        }
+    }
+
+ done:
+    if (count_a > 0) free_names(names_a, count_a);
+    if (count_b > 0) free_names(names_b, count_b);
+}
+
+/* Compares the data of a pair of regular files of the same size, and
+   reports them if anything differs. */
+static void compare_content(comparer_t *comparer, content_pair_t *pair, char *buffer_a, char *buffer_b) {
+
+    volume_t *a = comparer->a, *b = comparer->b;
+    uint64_t size = inode_file_size(a, &pair->inode_a), changed = 0;
+    size_t step = (size_t) EXT2_COMPARE_RUN_BLOCKS * a->block_size;
+
+    for (uint64_t offset = 0; offset < size; offset += step) {
+        size_t length = size - offset < step ? size - offset : step;
+        ssize_t read_a = read_file_content(a, &pair->inode_a, offset, length, buffer_a);
+        ssize_t read_b = read_file_content(b, &pair->inode_b, offset, length, buffer_b);
+
+        if (read_a != length || read_b != length) {
+            atomic_store(&comparer->failed, 1);
+            return;
+        }
+        atomic_fetch_add_explicit(&comparer->bytes_read, 2 * length, memory_order_relaxed);
+
+        for (size_t done = 0; done < length; done += a->block_size) {
+            size_t piece = length - done < a->block_size ? length - done : a->block_size;
+            changed += memcmp(buffer_a + done, buffer_b + done, piece) != 0;
+        }
+    }
+    atomic_fetch_add_explicit(&comparer->files_read, 1, memory_order_relaxed);
+
+    diff_entry_t entry = { .change = EXT2_DIFF_CHANGED, .path = pair->path, .fields = pair->fields,
+                           .mode_a = pair->inode_a.i_mode, .mode_b = pair->inode_b.i_mode,
+                           .size_a = size, .size_b = size, .compared = 1,
+                           .changed_blocks = changed };
+    if (changed) entry.fields |= EXT2_DIFF_CONTENT;
+    if (entry.fields) report(comparer, &entry);
+}
+
+static void *walk_worker(void *arg) {
+
+    comparer_t *comparer = arg;
+    dir_entry_t *entries = malloc(sizeof(dir_entry_t) * EXT2_COMPARE_BATCH);
+    uint32_t *inode_nos = malloc(sizeof(uint32_t) * EXT2_COMPARE_BATCH);
+    inode_t *inodes_a = malloc(sizeof(inode_t) * EXT2_COMPARE_BATCH);
+    inode_t *inodes_b = malloc(sizeof(inode_t) * EXT2_COMPARE_BATCH);
+    int usable = entries && inode_nos && inodes_a && inodes_b;
+
+    if (!usable) atomic_store(&comparer->failed, 1);
+
+    pthread_mutex_lock(&comparer->lock);
+    for (;;) {
+        while (!comparer->pending && comparer->busy)
+            pthread_cond_wait(&comparer->ready, &comparer->lock);
+
+        dir_pair_t *pair = comparer->pending;
+        if (!pair) break;
+        comparer->pending = pair->next;
+        comparer->busy++;
+        pthread_mutex_unlock(&comparer->lock);
+
+        if (usable) compare_directories(comparer, pair, entries, inode_nos, inodes_a, inodes_b);
+        free(pair->path);
+        free(pair);
+
+        pthread_mutex_lock(&comparer->lock);
+        if (--comparer->busy == 0 && !comparer->pending) pthread_cond_broadcast(&comparer->ready);
+    }
+    pthread_mutex_unlock(&comparer->lock);
+
+    free(entries);
+    free(inode_nos);
+    free(inodes_a);
+    free(inodes_b);
+    return NULL;
+}
+
+static void *content_worker(void *arg) {
+
+    comparer_t *comparer = arg;
+    size_t step = (size_t) EXT2_COMPARE_RUN_BLOCKS * comparer->a->block_size;
+    char *buffer_a = malloc(step), *buffer_b = malloc(step);
+    size_t next;
+
+    if (!buffer_a || !buffer_b) atomic_store(&comparer->failed, 1);
+    else
+        while ((next = atomic_fetch_add(&comparer->next, 1)) < comparer->num_contents)
+            compare_content(comparer, &comparer->contents[next], buffer_a, buffer_b);
+
+    free(buffer_a);
+    free(buffer_b);
+    return NULL;
+}
+
+/* Runs a worker function in several threads, the calling thread
+   being one of them. */
+static void run_workers(comparer_t *comparer, unsigned int num_threads, void *(*worker)(void *)) {
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    unsigned int started = 0;
+
+    if (threads)
+        for (; started + 1 < num_threads; started++)
+            if (pthread_create(&threads[started], NULL, worker, comparer) != 0)
+                break;
+
+    worker(comparer);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+static int compare_location(const void *x, const void *y) {
+
+    uint32_t a = ((const content_pair_t *) x)->location, b = ((const content_pair_t *) y)->location;
+    return a < b ? -1 : a > b;
+}
+
+/* compare_volumes: Reports every difference between the trees of two
+   volumes (see above). Differences are reported through a callback,
+   called by one thread at a time, in no particular order.
+
+   Parameters:
+     a: Pointer to the first (old) volume.
+     b: Pointer to the second (new) volume.
+     num_threads: Number of threads used (at least 1).
+     flags: 0 (zero), or EXT2_COMPARE_CONTENT to compare the data of
+            every regular file of the same size on both sides.
+     callback: Function called with 'ctx' for each difference. The
+               entry, and the path in it, are only valid during the
+               call.
+     ctx: Pointer passed to the callback.
+     stats: If not NULL, filled with the amount of work done.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted or either volume cannot
+     be read, in which case some differences may not be reported.
+ */
+int compare_volumes(volume_t *a, volume_t *b, unsigned int num_threads, int flags,
+                    diff_callback_t callback, void *ctx, compare_stats_t *stats) {
+
+    comparer_t comparer = { .a = a, .b = b, .flags = flags, .callback = callback, .ctx = ctx };
+    inode_t root_a, root_b;
+
+    if (!num_threads) num_threads = 1;
+    if (read_inode(a, EXT2_ROOT_INO, &root_a) <= 0 || read_inode(b, EXT2_ROOT_INO, &root_b) <= 0)
+        return -1;
+
+    pthread_mutex_init(&comparer.lock, NULL);
+    pthread_cond_init(&comparer.ready, NULL);
+
+    char *root = strdup("/");
+    if (root) compare_inodes(&comparer, root, &root_a, &root_b);
+    else atomic_store(&comparer.failed, 1);
+
+    run_workers(&comparer, num_threads, walk_worker);
+
+    for (size_t i = 0; i < comparer.num_contents; i++)
+        comparer.contents[i].location = get_inode_block_no(a, &comparer.contents[i].inode_a, 0);
+    if (comparer.num_contents)
+        qsort(comparer.contents, comparer.num_contents, sizeof(content_pair_t), compare_location);
+
+    run_workers(&comparer, num_threads, content_worker);
+
+    for (size_t i = 0; i < comparer.num_contents; i++)
+        free(comparer.contents[i].path);
+    free(comparer.contents);
+    pthread_cond_destroy(&comparer.ready);
+    pthread_mutex_destroy(&comparer.lock);
+
+    if (stats) {
+        stats->directories = atomic_load(&comparer.directories);
+        stats->inodes = atomic_load(&comparer.inodes);
+        stats->files_read = atomic_load(&comparer.files_read);
+        stats->bytes_read = atomic_load(&comparer.bytes_read);
+    }
+    return atomic_load(&comparer.failed) ? -1 : 0;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "ext2.h"
+
+/* ext2compress: Converts a volume file into a compressed image (see
+   ext2zimage.c), which every tool and ext2fs open like the volume
+   file itself, or with -d, a compressed image back into a volume
+   file. Chunks are compressed in parallel, a batch at a time, and
+   written in order. Chunks of zeros take no space in the image, and
+   are left as holes in volume files written back with -d.
+ */
+
+// Chunks compressed by each thread in a batch
+#define CHUNKS_PER_THREAD 16
+
+// Maximum size of the data read for a batch, unless each thread gets a single chunk
+#define MAX_BATCH_BYTES (64 << 20)
+
+typedef struct batch {
+  const char *input;      // count chunks of chunk_size bytes, the last one possibly shorter
+  size_t last_size;
+  uint32_t chunk_size;
+  int level;
+  size_t count;
+  char **output;          // Compressed chunks, each compressBound(chunk_size) bytes
+  size_t *output_size;    // 0 for chunks of zeros, chunk size for chunks stored as is
+  _Atomic size_t next;
+  _Atomic int failed;
+} batch_t;
+
+static double now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int is_zero(const char *data, size_t size) {
+
+  return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+static int write_fully(int fd, const void *buffer, size_t size, off_t offset) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t rv = pwrite(fd, (const char *) buffer + done, size - done, offset + done);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv <= 0) return -1;
+    done += rv;
+  }
+  return 0;
+}
+
+static void *compress_thread(void *arg) {
+
+  batch_t *batch = arg;
+  size_t i;
+
+  while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+    const char *data = batch->input + i * batch->chunk_size;
+    size_t size = i == batch->count - 1 ? batch->last_size : batch->chunk_size;
+
+    if (is_zero(data, size)) {
+      batch->output_size[i] = 0;
+      continue;
+    }
+
+    uLongf length = compressBound(batch->chunk_size);
+    int rv = compress2((Bytef *) batch->output[i], &length, (const Bytef *) data, size, batch->level);
+    if (rv != Z_OK) {
+      atomic_store(&batch->failed, 1);
+      continue;
+    }
+
+    // Chunks that do not shrink are stored as is
+    if (length >= size) {
+      memcpy(batch->output[i], data, size);
+      length = size;
+    }
+    batch->output_size[i] = length;
+  }
+  return NULL;
+}
+
+static int compress_image(int in, int out, uint64_t image_size, uint32_t chunk_size, int level,
+                          unsigned int num_threads, uint64_t *compressed_size) {
+
+  zimage_header_t header = { .version = EXT2_ZIMAGE_VERSION, .chunk_size = chunk_size, .image_size = image_size };
+  memcpy(header.magic, EXT2_ZIMAGE_MAGIC, sizeof(header.magic));
+  header.num_chunks = (image_size + chunk_size - 1) / chunk_size;
+
+  size_t batch_chunks = (size_t) num_threads * CHUNKS_PER_THREAD;
+  if (batch_chunks * chunk_size > MAX_BATCH_BYTES)
+    batch_chunks = MAX_BATCH_BYTES / chunk_size > num_threads ? MAX_BATCH_BYTES / chunk_size : num_threads;
+  uint64_t *index = malloc((header.num_chunks + 1) * sizeof(uint64_t));
+  char *input = malloc(batch_chunks * chunk_size);
+  char **output = calloc(batch_chunks, sizeof(char *));
+  size_t *output_size = calloc(batch_chunks, sizeof(size_t));
+  pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+  int status = -1;
+
+  if (!index || !input || !output || !output_size || !threads) goto finish;
+  for (size_t i = 0; i < batch_chunks; i++)
+    if (!(output[i] = malloc(compressBound(chunk_size)))) goto finish;
+
+  uint64_t position = sizeof(header);
+
+  for (uint64_t first = 0; first < header.num_chunks; first += batch_chunks) {
+    uint64_t start = first * chunk_size;
+    size_t bytes = image_size - start < batch_chunks * chunk_size ? image_size - start : batch_chunks * chunk_size;
+    size_t done = 0;
+
+    while (done < bytes) {
+      ssize_t rv = pread(in, input + done, bytes - done, start + done);
+      if (rv < 0 && errno == EINTR) continue;
+      if (rv <= 0) goto finish;
+      done += rv;
+    }
+
+    batch_t batch = { .input = input, .chunk_size = chunk_size, .level = level, .output = output,
+                      .output_size = output_size };
+    batch.count = (bytes + chunk_size - 1) / chunk_size;
+    batch.last_size = bytes - (batch.count - 1) * chunk_size;
+
+    unsigned int started = 0;
+    while (started < num_threads && pthread_create(&threads[started], NULL, compress_thread, &batch) == 0)
+      started++;
+    if (started == 0) compress_thread(&batch);
+    for (unsigned int t = 0; t < started; t++)
+      pthread_join(threads[t], NULL);
+    if (atomic_load(&batch.failed)) goto finish;
+
+    for (size_t i = 0; i < batch.count; i++) {
+      index[first + i] = position;
+      if (write_fully(out, output[i], output_size[i], position) < 0) goto finish;
+      position += output_size[i];
+    }
+  }
+
+  index[header.num_chunks] = position;
+  header.index_offset = position;
+  if (write_fully(out, index, (header.num_chunks + 1) * sizeof(uint64_t), position) < 0) goto finish;
+
+  // The header goes last, so an interrupted conversion is not mistaken for an image
+  if (write_fully(out, &header, sizeof(header), 0) < 0) goto finish;
+
+  *compressed_size = position + (header.num_chunks + 1) * sizeof(uint64_t);
+  status = 0;
+
+ finish:
+  if (output)
+    for (size_t i = 0; i < batch_chunks; i++)
+      free(output[i]);
+  free(output);
+  free(output_size);
+  free(input);
+  free(index);
+  free(threads);
+  return status;
+}
+
+static int decompress_image(zimage_t *image, int out, uint64_t chunk_size) {
+
+  uint64_t image_size = zimage_size(image);
+  char *buffer = malloc(chunk_size);
+  int status = -1;
+
+  if (!buffer) return -1;
+
+  for (uint64_t position = 0; position < image_size; position += chunk_size) {
+    size_t size = image_size - position < chunk_size ? image_size - position : chunk_size;
+
+    if (zimage_pread(image, buffer, size, position) != size) goto finish;
+    if (is_zero(buffer, size)) continue;
+    if (write_fully(out, buffer, size, position) < 0) goto finish;
+  }
+
+  // Trailing chunks of zeros are holes too
+  if (ftruncate(out, image_size) < 0) goto finish;
+  status = 0;
+
+ finish:
+  free(buffer);
+  return status;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-c chunk_kib] [-l level] [-j threads] [-d] input output\n"
+          "  -c chunk_kib  size of the chunks, in KiB, a power of two from %d to %d (default: 64)\n"
+          "  -l level      zlib compression level, 1 (fastest) to 9 (smallest) (default: 6)\n"
+          "  -j threads    number of threads compressing chunks (default: number of CPUs)\n"
+          "  -d            convert a compressed image back into a volume file\n", name,
+          EXT2_ZIMAGE_MIN_CHUNK >> 10, EXT2_ZIMAGE_MAX_CHUNK >> 10);
+}
+
+int main(int argc, char *argv[]) {
+
+  long chunk_kib = 64, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int level = 6, decompress = 0, threads = cpus > 0 ? cpus : 1, opt;
+
+  while ((opt = getopt(argc, argv, "c:l:j:d")) != -1) {
+    switch (opt) {
+    case 'c': chunk_kib = atol(optarg); break;
+    case 'l': level = atoi(optarg); break;
+    case 'j': threads = atoi(optarg); break;
+    case 'd': decompress = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 2 || threads < 1 || level < 1 || level > 9 ||
+      chunk_kib < EXT2_ZIMAGE_MIN_CHUNK >> 10 || chunk_kib > EXT2_ZIMAGE_MAX_CHUNK >> 10 ||
+      (chunk_kib & (chunk_kib - 1))) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *input = argv[optind], *output = argv[optind + 1];
+  int in = open(input, O_RDONLY);
+  struct stat st;
+
+  if (in < 0 || fstat(in, &st) < 0) {
+    perror(input);
+    return 1;
+  }
+
+  zimage_t *image = NULL;
+  int compressed = zimage_open(in, &image);
+  if (compressed < 0 || compressed != decompress) {
+    fprintf(stderr, compressed < 0 ? "Invalid compressed image: %s.\n" :
+            compressed ? "Already a compressed image: %s.\n" : "Not a compressed image: %s.\n", input);
+    zimage_close(image);
+    close(in);
+    return 1;
+  }
+
+  int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror(output);
+    zimage_close(image);
+    close(in);
+    return 1;
+  }
+
+  double start = now();
+  uint64_t in_size = st.st_size, out_size = 0;
+  int status;
+
+  if (decompress) {
+    status = decompress_image(image, out, chunk_kib << 10);
+    out_size = zimage_size(image);
+  } else
+    status = compress_image(in, out, in_size, chunk_kib << 10, level, threads, &out_size);
+
+  if (status < 0)
+    fprintf(stderr, "Cannot convert %s to %s.\n", input, output);
+  else
+    printf("%s: %" PRIu64 " bytes -> %s: %" PRIu64 " bytes (%.1f%%) in %.2f s\n", input, in_size, output, out_size,
+           in_size ? 100.0 * out_size / in_size : 0.0, now() - start);
+
+  if (close(out) < 0 && status == 0) {
+    perror(output);
+    status = -1;
+  }
+  zimage_close(image);
+  close(in);
+  return status < 0;
+}
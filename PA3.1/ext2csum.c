@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2csum: Writes the checksum sidecar of a volume file (see
+   ext2crc.c), which ext2fs --verify and volumes opened with
+   EXT2_OPEN_VERIFY check every block read against. With -c, reads the
+   whole volume through its sidecar instead, and lists the blocks that
+   do not match; with -b as well, the volume is read once without
+   verification first, and the throughput of both passes is compared.
+ */
+
+// Default size of each read, in KiB
+#define DEFAULT_READ_KIB 128
+
+static double now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_fully(int fd, const void *buffer, size_t size, off_t offset) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t rv = pwrite(fd, (const char *) buffer + done, size - done, offset + done);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv <= 0) return -1;
+    done += rv;
+  }
+  return 0;
+}
+
+static int write_sidecar(volume_t *volume, int out, size_t read_size) {
+
+  checksum_header_t header = { .version = EXT2_CHECKSUM_VERSION, .block_size = volume->block_size,
+                               .num_blocks = volume->super.s_blocks_count };
+  memcpy(header.magic, EXT2_CHECKSUM_MAGIC, sizeof(header.magic));
+
+  size_t run = read_size >> volume->block_bits;
+  char *buffer = malloc(run << volume->block_bits);
+  uint32_t *crcs = malloc(run * sizeof(uint32_t));
+  off_t position = sizeof(header);
+  int status = -1;
+
+  if (!buffer || !crcs) goto finish;
+
+  for (uint64_t block = 0; block < header.num_blocks; block += run) {
+    size_t count = header.num_blocks - block < run ? header.num_blocks - block : run;
+    size_t bytes = count << volume->block_bits;
+    ssize_t rv = volume_pread(volume, buffer, bytes, block << volume->block_bits);
+    if (rv < 0) goto finish;
+
+    // A volume file cut short reads as zeros past its end
+    memset(buffer + rv, 0, bytes - rv);
+    crc32c_blocks(buffer, volume->block_size, count, crcs);
+    if (write_fully(out, crcs, count * sizeof(uint32_t), position) < 0) goto finish;
+    position += count * sizeof(uint32_t);
+  }
+
+  // The header goes last, so an interrupted run is not mistaken for a sidecar
+  if (write_fully(out, &header, sizeof(header), 0) < 0) goto finish;
+  status = 0;
+
+ finish:
+  free(buffer);
+  free(crcs);
+  return status;
+}
+
+/* Reads every block of the volume, in reads of read_size bytes. A read
+   failing verification is retried a block at a time, listing the
+   blocks that do not match. Returns the number of blocks that could
+   not be read, or -1 if memory is exhausted. */
+static int64_t read_volume(volume_t *volume, size_t read_size, int report) {
+
+  char *buffer = malloc(read_size);
+  int64_t bad = 0;
+
+  if (!buffer) return -1;
+
+  for (uint64_t offset = 0; offset < volume->volume_size; offset += read_size) {
+    size_t size = volume->volume_size - offset < read_size ? volume->volume_size - offset : read_size;
+    if (volume_pread(volume, buffer, size, offset) >= 0) continue;
+
+    for (uint64_t at = offset; at < offset + size; at += volume->block_size) {
+      if (volume_pread(volume, buffer, volume->block_size, at) >= 0) continue;
+      if (report)
+        printf("block %" PRIu64 ": %s\n", at >> volume->block_bits, errno == EIO ? "checksum mismatch" :
+               strerror(errno));
+      bad++;
+    }
+  }
+  free(buffer);
+  return bad;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-c] [-b] [-r read_kib] [-o sidecar] volume_file\n"
+          "  -c           check the volume against its sidecar instead of writing it\n"
+          "  -b           with -c, also read the volume without verification, and compare\n"
+          "  -r read_kib  size of each read, in KiB (default: %d)\n"
+          "  -o sidecar   name of the sidecar (default: volume_file%s)\n", name, DEFAULT_READ_KIB,
+          EXT2_CHECKSUM_SUFFIX);
+}
+
+int main(int argc, char *argv[]) {
+
+  int check = 0, bench = 0, opt, status = 0;
+  long read_kib = DEFAULT_READ_KIB;
+  const char *sidecar = NULL;
+
+  while ((opt = getopt(argc, argv, "cbr:o:")) != -1) {
+    switch (opt) {
+    case 'c': check = 1; break;
+    case 'b': bench = 1; break;
+    case 'r': read_kib = atol(optarg); break;
+    case 'o': sidecar = optarg; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 1 || read_kib < 1 || (bench && !check)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *filename = argv[optind];
+  char *defaultSidecar = NULL;
+  if (!sidecar) {
+    size_t length = strlen(filename) + sizeof(EXT2_CHECKSUM_SUFFIX);
+    if (!(defaultSidecar = malloc(length))) {
+      fprintf(stderr, "Not enough memory.\n");
+      return 1;
+    }
+    snprintf(defaultSidecar, length, "%s%s", filename, EXT2_CHECKSUM_SUFFIX);
+    sidecar = defaultSidecar;
+  }
+
+  volume_t *volume = open_volume_file(filename);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", filename);
+    free(defaultSidecar);
+    return 1;
+  }
+
+  // Reads cover whole blocks
+  size_t read_size = ((size_t) read_kib << 10) < volume->block_size ? volume->block_size :
+                     ((size_t) read_kib << 10) & ~(size_t) (volume->block_size - 1);
+  double mib = volume->volume_size / 1048576.0, start = now();
+
+  if (!check) {
+    int out = open(sidecar, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+      perror(sidecar);
+      status = 1;
+    } else {
+      if (write_sidecar(volume, out, read_size) < 0) {
+        fprintf(stderr, "Cannot write %s.\n", sidecar);
+        status = 1;
+      }
+      if (close(out) < 0 && !status) {
+        perror(sidecar);
+        status = 1;
+      }
+      if (!status)
+        printf("%s: %" PRIu32 " blocks summed with %s in %.2f s\n", sidecar, volume->super.s_blocks_count,
+               crc32c_implementation(), now() - start);
+    }
+    goto finish;
+  }
+
+  double plain = 0;
+  if (bench) {
+    if (read_volume(volume, read_size, 0) != 0) {
+      fprintf(stderr, "Cannot read %s.\n", filename);
+      status = 1;
+      goto finish;
+    }
+    plain = now() - start;
+  }
+
+  if (checksums_attach(volume, sidecar) < 0) {
+    fprintf(stderr, errno == EINVAL ? "Checksum sidecar does not match the volume: %s.\n" :
+            "Cannot read checksum sidecar: %s.\n", sidecar);
+    status = 1;
+    goto finish;
+  }
+
+  start = now();
+  int64_t bad = read_volume(volume, read_size, 1);
+  double verified = now() - start;
+  checksum_stats_t stats;
+  checksums_stats(volume, &stats);
+
+  if (bad < 0) {
+    fprintf(stderr, "Not enough memory.\n");
+    status = 1;
+    goto finish;
+  }
+  printf("%" PRIu64 " blocks verified with %s, %" PRId64 " bad, %.1f MiB/s\n", stats.verified,
+         crc32c_implementation(), bad, mib / verified);
+  if (bench)
+    printf("without verification: %.1f MiB/s (verified reads at %.1f%%)\n", mib / plain, 100 * plain / verified);
+  if (bad) status = 1;
+
+ finish:
+  close_volume_file(volume);
+  free(defaultSidecar);
+  return status;
+}
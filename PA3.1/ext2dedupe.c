@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2dedupe: Hashes the content of every regular file of a volume
+   file without mounting it, and lists the groups of identical files.
+   With -b, also counts the blocks whose content appears more than
+   once across all files.
+ */
+
+// Number of most repeated blocks listed with -b
+#define DEDUPE_TOP_BLOCKS 10
+
+typedef struct block_ref {
+  uint64_t hash;
+  size_t file;
+  uint64_t block_idx;
+} block_ref_t;
+
+static volume_t *volume;
+static char **paths; // First path of each inode, indexed by inode number
+
+static int compare_files(const void *a, const void *b) {
+
+  const file_hash_t *x = a, *y = b;
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  if (x->size != y->size) return x->size < y->size ? -1 : 1;
+  return x->inode_no < y->inode_no ? -1 : x->inode_no > y->inode_no;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+
+  const block_ref_t *x = a, *y = b;
+  return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static const char *path_of(uint32_t inode_no) {
+
+  return paths[inode_no] ? paths[inode_no] : "(unlinked)";
+}
+
+static int record_path(void *ctx, const char *path, uint32_t inode_no, inode_t *inode) {
+
+  if (inode_no <= volume->super.s_inodes_count && !paths[inode_no])
+    paths[inode_no] = strdup(path);
+  return 0;
+}
+
+static void report_blocks(hash_result_t *result) {
+
+  char *zeros = calloc(1, volume->block_size);
+  uint64_t zero_hash = ext2_hash64(zeros, volume->block_size, 0);
+  block_ref_t *blocks = malloc(sizeof(block_ref_t) * (result->total_blocks + 1));
+  size_t count = 0;
+
+  free(zeros);
+  if (!blocks) {
+    fprintf(stderr, "Not enough memory to compare blocks.\n");
+    return;
+  }
+
+  // Blocks of zeros (holes included) are not worth reporting
+  for (size_t i = 0; i < result->num_files; i++)
+    for (uint64_t j = 0; j < result->files[i].num_blocks; j++)
+      if (result->files[i].block_hashes[j] != zero_hash)
+        blocks[count++] = (block_ref_t) { result->files[i].block_hashes[j], i, j };
+
+  qsort(blocks, count, sizeof(block_ref_t), compare_blocks);
+
+  uint64_t distinct = 0, duplicates = 0;
+  size_t top[DEDUPE_TOP_BLOCKS], top_len[DEDUPE_TOP_BLOCKS], num_top = 0;
+
+  for (size_t i = 0, j; i < count; i = j) {
+    for (j = i + 1; j < count && blocks[j].hash == blocks[i].hash; j++);
+    if (j - i < 2) continue;
+
+    distinct++;
+    duplicates += j - i - 1;
+
+    // Keep the most repeated blocks, most repeated first
+    size_t pos = num_top < DEDUPE_TOP_BLOCKS ? num_top++ : DEDUPE_TOP_BLOCKS;
+    if (pos == DEDUPE_TOP_BLOCKS) {
+      if (j - i <= top_len[DEDUPE_TOP_BLOCKS - 1]) continue;
+      pos--;
+    }
+    for (; pos > 0 && j - i > top_len[pos - 1]; pos--) {
+      top[pos] = top[pos - 1];
+      top_len[pos] = top_len[pos - 1];
+    }
+    top[pos] = i;
+    top_len[pos] = j - i;
+  }
+
+  printf("\n%" PRIu64 " distinct blocks appear more than once, in %" PRIu64 " extra copies (%" PRIu64 " bytes)\n",
+         distinct, duplicates, duplicates * volume->block_size);
+  for (size_t t = 0; t < num_top; t++) {
+    block_ref_t *block = &blocks[top[t]];
+    printf("  %016" PRIx64 ": %zu copies, e.g. block %" PRIu64 " of %s\n", block->hash, top_len[t],
+           block->block_idx, path_of(result->files[block->file].inode_no));
+  }
+  free(blocks);
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-t threads] [-b] volume_file\n"
+          "  -t threads number of threads reading and hashing (default: one per processor)\n"
+          "  -b         also report blocks whose content appears more than once\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int blocks = 0, opt;
+
+  while ((opt = getopt(argc, argv, "t:b")) != -1) {
+    switch (opt) {
+    case 't': num_threads = atol(optarg); break;
+    case 'b': blocks = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 1 || num_threads < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+
+  struct timespec start, end;
+  hash_result_t result;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int rv = hash_volume_files(volume, num_threads, blocks ? EXT2_HASH_BLOCKS : 0, &result);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (rv < 0) {
+    fprintf(stderr, "Files could not be hashed: volume cannot be read or memory is exhausted.\n");
+    hash_result_free(&result);
+    close_volume_file(volume);
+    return 1;
+  }
+
+  double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Hashed %zu files (%" PRIu64 " blocks, %" PRIu64 " bytes read) in %.3f s, %.1f MB/s, %ld thread(s)\n",
+         result.num_files, result.total_blocks, result.bytes_read, elapsed,
+         result.bytes_read / 1e6 / (elapsed > 0 ? elapsed : 1e-9), num_threads);
+
+  paths = calloc((size_t) volume->super.s_inodes_count + 1, sizeof(char *));
+  walk_directory_tree(volume, "/", record_path, NULL);
+
+  if (blocks)
+    report_blocks(&result);
+
+  // Empty files are all identical, and not worth reporting
+  qsort(result.files, result.num_files, sizeof(file_hash_t), compare_files);
+
+  uint64_t groups = 0, wasted = 0;
+  for (size_t i = 0, j; i < result.num_files; i = j) {
+    for (j = i + 1; j < result.num_files && result.files[j].hash == result.files[i].hash &&
+                    result.files[j].size == result.files[i].size; j++);
+    if (j - i < 2 || !result.files[i].size) continue;
+
+    if (!groups++) printf("\nIdentical files:\n");
+    wasted += (j - i - 1) * result.files[i].size;
+    printf("  %016" PRIx64 " (%" PRIu64 " bytes, %zu copies):\n", result.files[i].hash, result.files[i].size, j - i);
+    for (size_t k = i; k < j; k++)
+      printf("    %s\n", path_of(result.files[k].inode_no));
+  }
+  printf("\n%" PRIu64 " groups of identical files, %" PRIu64 " bytes in extra copies\n", groups, wasted);
+
+  for (uint64_t i = 0; i <= volume->super.s_inodes_count; i++)
+    free(paths[i]);
+  free(paths);
+  hash_result_free(&result);
+  close_volume_file(volume);
+  return 0;
+}
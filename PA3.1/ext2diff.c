@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2diff: Lists the differences between the trees of two volume
+   files, without mounting them (see compare_volumes). Each difference
+   is printed on a line of its own, sorted by path:
+
+     change type fields blocks path
+
+   where change is A (added), D (deleted) or C (changed); type is the
+   type of the file (f, d, l, c, b, p or s) on the second volume, or on
+   the first one for deletions; fields lists the fields that differ,
+   separated by commas (mode, owner, size, mtime, links, content), or
+   is "-"; and blocks is the number of blocks of data that differ, or
+   "-" if the data was not compared. Like diff, the exit status is 0
+   if the trees are the same, 1 if they differ, and 2 on errors.
+ */
+
+typedef struct change {
+  char *path;
+  char change;
+  char type;
+  uint32_t fields;
+  uint64_t changed_blocks;
+  int compared; // The data was read
+} change_t;
+
+static change_t *changes;
+static size_t num_changes, max_changes;
+static int out_of_memory;
+
+static const struct {
+  uint32_t field;
+  const char *name;
+} field_names[] = {
+  { EXT2_DIFF_MODE, "mode" },
+  { EXT2_DIFF_OWNER, "owner" },
+  { EXT2_DIFF_SIZE, "size" },
+  { EXT2_DIFF_MTIME, "mtime" },
+  { EXT2_DIFF_LINKS, "links" },
+  { EXT2_DIFF_CONTENT, "content" },
+};
+
+static char type_of(uint16_t mode) {
+
+  switch (mode & S_IFMT) {
+  case S_IFREG: return 'f';
+  case S_IFDIR: return 'd';
+  case S_IFLNK: return 'l';
+  case S_IFCHR: return 'c';
+  case S_IFBLK: return 'b';
+  case S_IFIFO: return 'p';
+  case S_IFSOCK: return 's';
+  default: return '?';
+  }
+}
+
+static double now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_change(void *ctx, const diff_entry_t *entry) {
+
+  if (num_changes == max_changes) {
+    size_t capacity = max_changes ? max_changes * 2 : 1024;
+    change_t *grown = realloc(changes, sizeof(change_t) * capacity);
+    if (!grown) {
+      out_of_memory = 1;
+      return;
+    }
+    changes = grown;
+    max_changes = capacity;
+  }
+
+  change_t *change = &changes[num_changes];
+  if (!(change->path = strdup(entry->path))) {
+    out_of_memory = 1;
+    return;
+  }
+  change->change = entry->change;
+  change->type = type_of(entry->change == EXT2_DIFF_DELETED ? entry->mode_a : entry->mode_b);
+  change->fields = entry->fields;
+  change->changed_blocks = entry->changed_blocks;
+  change->compared = entry->compared;
+  num_changes++;
+}
+
+static int compare_changes(const void *a, const void *b) {
+
+  const change_t *x = a, *y = b;
+  int order = strcmp(x->path, y->path);
+
+  // A file replaced by one of another type is deleted first
+  return order ? order : (x->change == EXT2_DIFF_ADDED) - (y->change == EXT2_DIFF_ADDED);
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-t threads] [-c] [-s] old_volume_file new_volume_file\n"
+          "  -t threads  number of threads comparing the volumes (default: 1)\n"
+          "  -c          compare the data of files even if their metadata match\n"
+          "  -s          print statistics on the comparison to stderr\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  int threads = 1, flags = 0, statistics = 0, opt;
+
+  while ((opt = getopt(argc, argv, "t:cs")) != -1) {
+    switch (opt) {
+    case 't': threads = atoi(optarg); break;
+    case 'c': flags |= EXT2_COMPARE_CONTENT; break;
+    case 's': statistics = 1; break;
+    default: usage(argv[0]); return 2;
+    }
+  }
+  if (argc - optind != 2 || threads < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  volume_t *a = open_volume_file(argv[optind]);
+  if (!a) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 2;
+  }
+  volume_t *b = open_volume_file(argv[optind + 1]);
+  if (!b) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind + 1]);
+    close_volume_file(a);
+    return 2;
+  }
+
+  compare_stats_t stats = { 0 };
+  double start = now();
+  int rv = compare_volumes(a, b, threads, flags, record_change, NULL, &stats);
+  double seconds = now() - start;
+
+  if (num_changes) qsort(changes, num_changes, sizeof(change_t), compare_changes);
+
+  for (size_t i = 0; i < num_changes; i++) {
+    change_t *change = &changes[i];
+    char fields[64] = "-";
+    size_t len = 0;
+
+    for (size_t f = 0; f < sizeof(field_names) / sizeof(field_names[0]); f++)
+      if (change->fields & field_names[f].field)
+        len += snprintf(fields + len, sizeof(fields) - len, "%s%s", len ? "," : "", field_names[f].name);
+
+    if (change->compared)
+      printf("%c %c %s %" PRIu64 " %s\n", change->change, change->type, fields, change->changed_blocks, change->path);
+    else
+      printf("%c %c %s - %s\n", change->change, change->type, fields, change->path);
+    free(change->path);
+  }
+  free(changes);
+
+  if (rv < 0 || out_of_memory)
+    fprintf(stderr, "Cannot compare %s and %s; some differences may be missing.\n", argv[optind], argv[optind + 1]);
+  if (statistics)
+    fprintf(stderr, "%zu difference(s); %" PRIu64 " directories and %" PRIu64 " inodes compared, %" PRIu64
+            " files (%" PRIu64 " bytes) read in %.3f s with %d thread(s)\n", num_changes, stats.directories,
+            stats.inodes, stats.files_read, stats.bytes_read, seconds, threads);
+
+  close_volume_file(a);
+  close_volume_file(b);
+  return rv < 0 || out_of_memory ? 2 : num_changes > 0;
+}
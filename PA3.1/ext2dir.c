@@ -4,6 +4,15 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+
+typedef struct dentry_record {
+    uint32_t dir_no;   // Directory searched
+    uint32_t inode_no; // Inode found, or 0 if the name does not exist
+    char name[256];    // Name searched, null-terminated
+} dentry_record_t;
 
 /* next_directory_entry: Reads and returns one entry in a
    directory. Can be called repeatedly for the same inode to obtain
@@ -31,26 +40,96 @@
 int64_t next_directory_entry(volume_t *volume, inode_t *dir_inode,
                              off_t *offset, dir_entry_t *dir_entry) {
 
-    /* TO BE COMPLETED BY THE STUDENT */
-    //15   11   7    3  0
-    //0004 0000 0000 0000
-    if (inode_is_regular_file(dir_inode) || !inode_is_directory(dir_inode)) return -1;
-    if (dir_inode->i_mode >> 12 != 0x4) return -1;
+    if (!inode_is_directory(dir_inode)) return -1;
+
+    uint64_t dirSize = inode_file_size(volume, dir_inode);
+
+    while (*offset < dirSize) {
+        // Entries never span blocks, so never read past the current block
+        uint32_t blockLeft = volume->block_size - (*offset & (volume->block_size - 1));
+        uint32_t toRead = blockLeft < sizeof(dir_entry_t) ? blockLeft : sizeof(dir_entry_t);
 
-    ssize_t readBytes = read_file_content(volume, dir_inode, *offset, sizeof(dir_entry_t), dir_entry);
+        ssize_t readBytes = read_file_content(volume, dir_inode, *offset, toRead, dir_entry);
+        if (readBytes < EXT2_DIR_ENTRY_HEADER_LEN) return -1;
 
-    if (readBytes <= 0) return 0;
-    dir_entry->de_name[dir_entry->de_name_len] = '\0';
+        if (dir_entry->de_rec_len < EXT2_DIR_ENTRY_HEADER_LEN || dir_entry->de_rec_len > blockLeft ||
+            EXT2_DIR_ENTRY_HEADER_LEN + dir_entry->de_name_len > dir_entry->de_rec_len)
+            return -1;
 
-    *offset += dir_entry->de_rec_len;
-    if (inode_file_size(volume, dir_inode) == 0)
         *offset += dir_entry->de_rec_len;
 
-    // offset < 1024
-    if (*offset >= inode_file_size(volume, dir_inode))
-        *offset -= *offset % inode_file_size(volume, dir_inode);
+        // Unused entries (inode 0) only pad out the block
+        if (dir_entry->de_inode_no == 0) continue;
+
+        dir_entry->de_name[dir_entry->de_name_len] = '\0';
+        return dir_entry->de_inode_no;
+    }
 
-    return (*offset <= inode_file_size(volume, dir_inode)) ? dir_entry->de_inode_no : 0;
+    return 0;
+}
+
+/* read_directory_entries: Reads consecutive entries of a directory
+   in bulk. Each directory block is read from disk once, and all
+   requested entries stored in it are decoded from memory. The offset
+   is the byte position of the entry in the directory data, so a
+   listing can be resumed in constant time from any offset previously
+   returned in 'next_offsets'.
+
+   Parameters:
+     volume: Pointer to volume.
+     dir_inode: Pointer to inode structure for the directory.
+     offset: Pointer to the position of the first entry to read; must
+             be zero for the first call. Updated to the position right
+             after the last entry returned.
+     entries: Array where up to 'count' directory entries are stored,
+              with null-terminated names.
+     next_offsets: If not NULL, array where the position right after
+                   each returned entry is stored, i.e., the offset at
+                   which a listing continuing after entries[i] would
+                   resume.
+     count: Maximum number of entries to return.
+
+   Returns:
+     On success returns the number of entries read, which is 0 (zero)
+     if there are no more entries in the directory. If the inode is
+     not a directory, or there is an error reading the directory data,
+     returns -1.
+ */
+ssize_t read_directory_entries(volume_t *volume, inode_t *dir_inode, off_t *offset,
+                               dir_entry_t *entries, off_t *next_offsets, size_t count) {
+
+    if (!inode_is_directory(dir_inode)) return -1;
+
+    uint64_t dirSize = inode_file_size(volume, dir_inode);
+    char *block = malloc(volume->block_size);
+    size_t found = 0;
+
+    if (block == NULL) return -1;
+
+    while (found < count && *offset < dirSize) {
+        uint64_t blockStart = *offset & ~(uint64_t) (volume->block_size - 1);
+        ssize_t blockLen = read_file_content(volume, dir_inode, blockStart, volume->block_size, block);
+
+        if (blockLen <= 0) {
+            free(block);
+            return -1;
+        }
+
+        uint32_t pos = *offset - blockStart;
+        ssize_t parsed = volume->ops->parse_directory_block(block, blockLen, &pos, blockStart,
+                                                            entries + found,
+                                                            next_offsets ? next_offsets + found : NULL,
+                                                            count - found);
+        if (parsed < 0) {
+            free(block);
+            return -1;
+        }
+        found += parsed;
+        *offset = blockStart + pos;
+    }
+
+    free(block);
+    return found;
 }
 
 /* find_file_in_directory: Searches for a file in a directory.
@@ -74,30 +153,81 @@ int64_t next_directory_entry(volume_t *volume, inode_t *dir_inode,
  */
 int64_t find_file_in_directory(volume_t *volume, inode_t *inode, const char *name, dir_entry_t *buffer) {
 
-    /* TO BE COMPLETED BY THE STUDENT */
     off_t offset = 0;
+    dir_entry_t entry;
+    int64_t inode_no;
 
-    if (inode->i_mode >> 12 != 0x4) return -1;
+    if (!inode_is_directory(inode)) return -1;
 
-    if (buffer == NULL) return 0;
+    while ((inode_no = next_directory_entry(volume, inode, &offset, &entry)) > 0) {
+        if (strcmp(entry.de_name, name) == 0) {
+            if (buffer) memcpy(buffer, &entry, sizeof(dir_entry_t));
+            return inode_no;
+        }
+    }
 
-    while (next_directory_entry(volume, inode, &offset, buffer) > 0){
-        char *bufferName = malloc(sizeof(char) * buffer->de_name_len + 1);
+    return inode_no;
+}
 
-        strcpy(bufferName, buffer->de_name);
-        bufferName[buffer->de_name_len] = '\0';
+static uint64_t dentry_key(uint32_t dir_no, const char *name) {
 
-        if (strcmp(buffer->de_name, name) == 0) return buffer->de_inode_no;
+    // FNV-1a over the name, seeded with the directory's inode number
+    uint64_t hash = 0xCBF29CE484222325ULL ^ dir_no;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 0x100000001B3ULL;
     }
+    return hash;
+}
+
+/* lookup_in_directory: Searches for a file in a directory, like
+   find_file_in_directory, but checks the volume's dentry cache first
+   and caches the result, including names that do not exist.
 
-//    buffer = NULL;
-//    memset(buffer, 0, sizeof(dir_entry_t));
-    return next_directory_entry(volume, inode, &offset, buffer);
+   Parameters:
+     volume: Pointer to volume.
+     dir_no: Inode number of the directory.
+     dir_inode: Pointer to inode structure for the directory.
+     name: NULL-terminated name of the file.
+
+   Returns:
+     Same as find_file_in_directory.
+ */
+int64_t lookup_in_directory(volume_t *volume, uint32_t dir_no, inode_t *dir_inode, const char *name) {
+
+    dentry_record_t record;
+    size_t nameLen = strlen(name);
+    uint64_t key = dentry_key(dir_no, name);
+
+    if (nameLen >= sizeof(record.name))
+        return find_file_in_directory(volume, dir_inode, name, NULL);
+
+    if (cache_lookup(volume, EXT2_CACHE_DENTRY, key, &record, sizeof(record)) &&
+        record.dir_no == dir_no && strcmp(record.name, name) == 0)
+        return record.inode_no;
+
+    int64_t inode_no = find_file_in_directory(volume, dir_inode, name, NULL);
+    if (inode_no >= 0) {
+        record.dir_no = dir_no;
+        record.inode_no = inode_no;
+        memcpy(record.name, name, nameLen + 1);
+        cache_insert(volume, EXT2_CACHE_DENTRY, key, &record, offsetof(dentry_record_t, name) + nameLen + 1);
+    }
+    return inode_no;
 }
 
-int freeTriple(dir_entry_t *directoryEntry, char *sourcePath, inode_t *sourceInode, int value) {
-    free(directoryEntry); free(sourcePath); free(sourceInode);
-    return value;
+/* forget_directory_entry: Drops the cached result of looking up a
+   name in a directory, once an entry of that name was added to the
+   directory or removed from it.
+
+   Parameters:
+     volume: Pointer to volume.
+     dir_no: Inode number of the directory.
+     name: NULL-terminated name of the entry.
+ */
+void forget_directory_entry(volume_t *volume, uint32_t dir_no, const char *name) {
+
+    cache_invalidate(volume, EXT2_CACHE_DENTRY, dentry_key(dir_no, name));
 }
 
 /* find_file_from_path: Searches for a file based on its full path.
@@ -120,40 +250,216 @@ int freeTriple(dir_entry_t *directoryEntry, char *sourcePath, inode_t *sourceIno
      any directory or inode in the path, returns 0 (zero).
  */
 uint32_t find_file_from_path(volume_t *volume, const char *path, inode_t *dest_inode) {
-/* TO BE COMPLETED BY THE STUDENT -dj*/
-    inode_t *sourceInode = malloc(sizeof(inode_t));
-    char *sourcePath = malloc(sizeof(char) * strlen(path) +1);
-    dir_entry_t *directoryEntry = malloc(sizeof(dir_entry_t));
-    int currentNode = EXT2_ROOT_INO;
 
-    read_inode(volume, EXT2_ROOT_INO, sourceInode);
+    return resolve_path(volume, path, dest_inode, 0);
+}
 
-    strcpy(sourcePath, path);
-    sourcePath[strlen(path)] = '\0';
+/* resolve_path: Searches for a file based on its full path,
+   optionally following symbolic links found along the way. Relative
+   link targets are resolved from the directory containing the link,
+   absolute ones from the root directory. Resolution fails once more
+   than EXT2_MAX_SYMLINK_FOLLOWS links have been followed, which
+   catches symlink loops.
 
-    char *tokenizer = strtok(sourcePath, "/");
+   Parameters:
+     volume: Pointer to volume.
+     path: NULL-terminated string for the full absolute path of the
+           file, as in find_file_from_path.
+     dest_inode: If the file is found, and this pointer is set to a
+                 non-NULL value, this buffer is set to the inode of
+                 the file. Otherwise it is unmodified.
+     flags: 0 (zero) to treat symbolic links as regular path
+            components, as in find_file_from_path, or a combination
+            of EXT2_RESOLVE_* flags.
 
-    if (tokenizer == NULL) {
-        memcpy(dest_inode, sourceInode, volume->super.s_inode_size);
-        return freeTriple(directoryEntry, sourcePath, sourceInode, EXT2_ROOT_INO);
+   Returns:
+     If the file exists, returns the inode number associated to the
+     file. Otherwise returns 0 (zero) and sets errno to ENOENT (a
+     component does not exist), ENOTDIR (a component used as a
+     directory is not a directory), ELOOP (too many symbolic links)
+     or EIO (error reading the volume).
+ */
+uint32_t resolve_path(volume_t *volume, const char *path, inode_t *dest_inode, int flags) {
+
+    inode_t currentInode;
+    uint32_t currentNode = EXT2_ROOT_INO;
+    int followed = 0;
+    char *work = strdup(path);
+    char *cursor = work;
+
+    if (!work) {
+        errno = ENOMEM;
+        return 0;
     }
+    if (read_inode(volume, EXT2_ROOT_INO, &currentInode) <= 0) {
+        free(work);
+        errno = EIO;
+        return 0;
+    }
+
+    for (;;) {
+        while (*cursor == '/') cursor++;
+        if (!*cursor) break;
+
+        char *name = cursor;
+        cursor += strcspn(cursor, "/");
+        int last = cursor[strspn(cursor, "/")] == '\0';
+        if (*cursor) *cursor++ = '\0';
+
+        if (!inode_is_directory(&currentInode)) {
+            free(work);
+            errno = ENOTDIR;
+            return 0;
+        }
+
+        inode_t childInode;
+        int64_t childNode = lookup_in_directory(volume, currentNode, &currentInode, name);
+        if (childNode <= 0 || read_inode(volume, childNode, &childInode) <= 0) {
+            free(work);
+            errno = childNode == 0 ? ENOENT : EIO;
+            return 0;
+        }
+
+        if (inode_is_symlink(&childInode) && (flags & EXT2_RESOLVE_FOLLOW) &&
+            !(last && (flags & EXT2_RESOLVE_NOFOLLOW_LAST))) {
+
+            if (++followed > EXT2_MAX_SYMLINK_FOLLOWS) {
+                free(work);
+                errno = ELOOP;
+                return 0;
+            }
+
+            // Replace the link with its target in the remaining path
+            size_t targetSize = childInode.i_size + 1;
+            size_t restLen = strlen(cursor);
+            char *next = malloc(targetSize + 1 + restLen + 1);
+            if (!next || read_symlink_target(volume, &childInode, next, targetSize) <= 0) {
+                free(next); free(work);
+                errno = next ? EIO : ENOMEM;
+                return 0;
+            }
+            strcat(next, "/");
+            strcat(next, cursor);
+
+            if (next[0] == '/') {
+                currentNode = EXT2_ROOT_INO;
+                if (read_inode(volume, EXT2_ROOT_INO, &currentInode) <= 0) {
+                    free(next); free(work);
+                    errno = EIO;
+                    return 0;
+                }
+            }
+            free(work);
+            work = cursor = next;
+            continue;
+        }
+
+        currentNode = childNode;
+        currentInode = childInode;
+    }
+
+    free(work);
+    if (dest_inode) memcpy(dest_inode, &currentInode, sizeof(inode_t));
+    return currentNode;
+}
+
+// Number of directory entries read per batch by walk_directory_tree
+#define EXT2_WALK_BATCH 256
 
-    for (*tokenizer; tokenizer != NULL && currentNode > 0;tokenizer = strtok(NULL, "/"))
-    {
-        currentNode = find_file_in_directory(volume, sourceInode, tokenizer, directoryEntry);
+/* Visits the entries of one directory, and recursively of its
+   subdirectories. 'path' holds the path of the directory ('len'
+   characters) and has room for PATH_MAX characters. */
+static int walk_directory(volume_t *volume, uint32_t dir_no, inode_t *dir, char *path, size_t len,
+                          tree_visitor_t visit, void *ctx) {
 
-        if (currentNode == 0) return freeTriple(directoryEntry, sourcePath, sourceInode, 0);
+    dir_entry_t *entries = malloc(sizeof(dir_entry_t) * EXT2_WALK_BATCH);
+    inode_t *inodes = malloc(sizeof(inode_t) * EXT2_WALK_BATCH);
+    uint32_t inode_nos[EXT2_WALK_BATCH];
+    off_t offset = 0;
+    ssize_t count = 0;
+    int rv = 0;
 
-        read_inode(volume, currentNode, sourceInode);
-        if(!inode_is_directory(sourceInode)) return 0;
+    // Names are appended after a separator, except for the root directory "/"
+    size_t base = path[len - 1] == '/' ? len : len + 1;
+
+    if (!entries || !inodes) {
+        rv = -1;
+        goto done;
     }
 
-    if (currentNode) {
-        read_inode(volume, currentNode, sourceInode);
-        memcpy(dest_inode, sourceInode, volume->super.s_inode_size);
-        return freeTriple(directoryEntry, sourcePath, sourceInode, currentNode);
+    while (!rv && (count = read_directory_entries(volume, dir, &offset, entries, NULL, EXT2_WALK_BATCH)) > 0) {
+        for (ssize_t i = 0; i < count; i++)
+            inode_nos[i] = entries[i].de_inode_no;
+        if (read_inodes(volume, inode_nos, count, inodes) != count) {
+            rv = -1;
+            break;
+        }
+
+        for (ssize_t i = 0; i < count && !rv; i++) {
+            const char *name = entries[i].de_name;
+            size_t nameLen = strlen(name);
+
+            if (!strcmp(name, ".") || !strcmp(name, "..") || base + nameLen >= PATH_MAX)
+                continue;
+
+            path[base - 1] = '/';
+            memcpy(path + base, name, nameLen + 1);
+
+            rv = visit(ctx, path, inode_nos[i], &inodes[i]);
+            if (!rv && inode_is_directory(&inodes[i]))
+                rv = walk_directory(volume, inode_nos[i], &inodes[i], path, base + nameLen, visit, ctx);
+        }
+        path[len] = '\0';
     }
+    if (count < 0) rv = -1;
+
+done:
+    free(entries);
+    free(inodes);
+    return rv;
+}
+
+/* walk_directory_tree: Visits every file and directory under a path,
+   depth first. Symbolic links are visited but not followed. Inodes
+   are read in batches, one directory block's worth of entries at a
+   time.
+
+   Parameters:
+     volume: Pointer to volume.
+     root: Absolute path where the walk starts. The file or directory
+           at this path is visited first.
+     visit: Function called for each file, with parameters 'ctx', the
+            path of the file, its inode number and its inode. The path
+            is only valid during the call. If the function returns
+            non-zero, the walk stops.
+     ctx: Pointer passed to the visit function.
+
+   Returns:
+     0 if the whole tree was visited, the non-zero value returned by
+     the visit function if it stopped the walk, or -1 if the root does
+     not exist or a directory cannot be read.
+ */
+int walk_directory_tree(volume_t *volume, const char *root, tree_visitor_t visit, void *ctx) {
+
+    char *path = malloc(PATH_MAX);
+    inode_t inode;
+    int rv;
+
+    uint32_t inode_no = resolve_path(volume, root, &inode, EXT2_RESOLVE_FOLLOW);
+    if (!path || !inode_no || strlen(root) >= PATH_MAX) {
+        free(path);
+        return -1;
+    }
+
+    // Keep the root as given, without trailing slashes
+    size_t len = strlen(root);
+    memcpy(path, root, len + 1);
+    while (len > 1 && path[len - 1] == '/') path[--len] = '\0';
 
-    return freeTriple(directoryEntry, sourcePath, sourceInode, 0);
+    rv = visit(ctx, path, inode_no, &inode);
+    if (!rv && inode_is_directory(&inode))
+        rv = walk_directory(volume, inode_no, &inode, path, len, visit, ctx);
 
+    free(path);
+    return rv;
 }
@@ -0,0 +1,207 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Epoch-based reclamation lets the caches be read without locks.
+   A reader brackets its accesses with epoch_enter and epoch_exit,
+   which only publish the current epoch in the reader's own record.
+   A writer unlinks an object so that no new reader can reach it, and
+   hands it to epoch_retire, which stamps it with the current epoch.
+   The object is freed once every thread inside a critical section
+   entered it in a later epoch, as none of them can still hold a
+   pointer to it.
+
+   Retired objects are freed in batches, when EXT2_EPOCH_BATCH of them
+   have accumulated: the epoch is advanced and the thread records are
+   scanned once per batch, so neither cost is paid on every
+   retirement, and readers rarely see the epoch change under them.
+   Records are allocated the first time a thread enters a critical
+   section, and recycled when the thread exits.
+ */
+
+// Number of retired objects after which reclamation is attempted
+#define EXT2_EPOCH_BATCH 64
+
+typedef struct epoch_record {
+    _Alignas(64) _Atomic uint64_t active; // Epoch the thread entered in, 0 outside critical sections
+    _Atomic int in_use;
+    unsigned int nesting;
+    struct epoch_record *next;
+} epoch_record_t;
+
+typedef struct retired {
+    void *object;
+    uint64_t epoch;
+} retired_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_record_t *) records;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_t *retired;
+static size_t num_retired, max_retired, next_reclaim = EXT2_EPOCH_BATCH;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static __thread epoch_record_t *local;
+
+static void release_record(void *arg) {
+
+    epoch_record_t *record = arg;
+
+    atomic_store_explicit(&record->active, 0, memory_order_release);
+    record->nesting = 0;
+    atomic_store_explicit(&record->in_use, 0, memory_order_release);
+}
+
+static void create_key(void) {
+
+    pthread_key_create(&record_key, release_record);
+}
+
+/* Claims a record left by an exited thread, or adds a new one. */
+static epoch_record_t *acquire_record(void) {
+
+    epoch_record_t *record;
+
+    pthread_once(&key_once, create_key);
+
+    for (record = atomic_load(&records); record; record = record->next) {
+        int expected = 0;
+        if (!atomic_load_explicit(&record->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&record->in_use, &expected, 1))
+            break;
+    }
+
+    if (!record) {
+        // Records are never freed, so a failed allocation is fatal to lock-free readers
+        if (!(record = aligned_alloc(64, sizeof(epoch_record_t)))) abort();
+        atomic_init(&record->active, 0);
+        atomic_init(&record->in_use, 1);
+        record->nesting = 0;
+
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record));
+    }
+
+    pthread_setspecific(record_key, record);
+    local = record;
+    return record;
+}
+
+/* Returns the oldest epoch a thread inside a critical section entered
+   in, or UINT64_MAX if there is none. */
+static uint64_t oldest_active_epoch(void) {
+
+    uint64_t oldest = UINT64_MAX;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    for (epoch_record_t *record = atomic_load(&records); record; record = record->next) {
+        uint64_t epoch = atomic_load(&record->active);
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
+    return oldest;
+}
+
+/* Frees the retired objects no reader can hold. Must be called with
+   the retire lock held. */
+static void reclaim(void) {
+
+    // Readers entering from now on are in an epoch later than any stamp
+    atomic_fetch_add(&global_epoch, 1);
+
+    uint64_t oldest = oldest_active_epoch();
+    size_t kept = 0;
+
+    for (size_t i = 0; i < num_retired; i++) {
+        if (retired[i].epoch < oldest) free(retired[i].object);
+        else retired[kept++] = retired[i];
+    }
+    num_retired = kept;
+
+    // Readers stuck in old epochs must not make every retirement rescan the records
+    next_reclaim = num_retired + EXT2_EPOCH_BATCH;
+}
+
+/* epoch_enter: Starts a read-side critical section in the calling
+   thread. Objects reachable from a shared structure protected by
+   epochs remain valid until the matching epoch_exit, even if they are
+   retired in the meantime. Critical sections may be nested.
+ */
+void epoch_enter(void) {
+
+    epoch_record_t *record = local ? local : acquire_record();
+
+    if (record->nesting++ == 0) {
+        atomic_store_explicit(&record->active, atomic_load(&global_epoch), memory_order_relaxed);
+        // The epoch must be visible before any shared pointer is read
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+/* epoch_exit: Ends a read-side critical section started by
+   epoch_enter. Objects read inside the section must not be used after
+   it ends.
+ */
+void epoch_exit(void) {
+
+    epoch_record_t *record = local;
+
+    if (--record->nesting == 0)
+        atomic_store_explicit(&record->active, 0, memory_order_release);
+}
+
+/* epoch_retire: Frees an object allocated with malloc once no reader
+   can still hold a pointer to it. The object must already be
+   unreachable from every shared structure. Must not be called inside
+   a critical section.
+
+   Parameters:
+     object: Object to free. Nothing is done if NULL.
+ */
+void epoch_retire(void *object) {
+
+    if (!object) return;
+
+    pthread_mutex_lock(&retire_lock);
+
+    if (num_retired == max_retired) {
+        size_t capacity = max_retired ? max_retired * 2 : EXT2_EPOCH_BATCH * 2;
+        retired_t *grown = realloc(retired, sizeof(retired_t) * capacity);
+        if (!grown) {
+            // Without room to defer it, wait for the readers to move on
+            pthread_mutex_unlock(&retire_lock);
+            epoch_synchronize();
+            free(object);
+            return;
+        }
+        retired = grown;
+        max_retired = capacity;
+    }
+
+    retired[num_retired].object = object;
+    retired[num_retired].epoch = atomic_load(&global_epoch);
+    num_retired++;
+
+    if (num_retired >= next_reclaim) reclaim();
+    pthread_mutex_unlock(&retire_lock);
+}
+
+/* epoch_synchronize: Waits until every critical section active when
+   the function was called has ended, then frees the retired objects
+   no reader can hold. Must not be called inside a critical section.
+ */
+void epoch_synchronize(void) {
+
+    uint64_t epoch = atomic_fetch_add(&global_epoch, 1);
+
+    while (oldest_active_epoch() <= epoch)
+        sched_yield();
+
+    pthread_mutex_lock(&retire_lock);
+    reclaim();
+    pthread_mutex_unlock(&retire_lock);
+}
@@ -1,5 +1,61 @@
 #include "ext2.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* inode_location: Computes where an inode is stored on disk. The
+   block group is (inode - 1) / INODES_PER_GROUP and the index within
+   the group's inode table is (inode - 1) % INODES_PER_GROUP, taking
+   into account non-standard inode sizes.
+
+   Parameters:
+     volume: pointer to volume.
+     inode_no: Number of the inode.
+     table: Set to the first block of the group's inode table.
+     offset: Set to the byte offset of the inode from the start of
+             the inode table. May be larger than a block size.
+
+   Returns:
+     0 on success, or -1 if the inode number is out of range or the
+     group descriptor cannot be read.
+ */
+static int inode_location(volume_t *volume, uint32_t inode_no, uint32_t *table, uint32_t *offset) {
+
+    if (inode_no == 0 || inode_no > volume->super.s_inodes_count) return -1;
+
+    uint32_t groupNumber = (inode_no - 1) / volume->super.s_inodes_per_group;
+    uint32_t inodeIndex = (inode_no - 1) % volume->super.s_inodes_per_group;
+    const group_desc_t *desc = get_group_desc(volume, groupNumber);
+
+    if (!desc) return -1;
+    *table = desc->bg_inode_table;
+    *offset = inodeIndex * volume->inode_size;
+    return 0;
+}
+
+/* Reads the inode table block holding an inode into the volume's
+   inode table, so the inode and its neighbours are found there. */
+static int load_inode_block(volume_t *volume, uint32_t inode_no, char *block) {
+
+    uint32_t table, offset;
+
+    if (inode_location(volume, inode_no, &table, &offset) < 0) return -1;
+
+    uint32_t inodesPerBlock = volume->block_size / volume->inode_size;
+    uint32_t first = inode_no - (offset & (volume->block_size - 1)) / volume->inode_size;
+    uint32_t groupEnd = inode_no - (inode_no - 1) % volume->super.s_inodes_per_group + volume->super.s_inodes_per_group;
+
+    // The last block of a group's inode table may be partly used
+    if (first + inodesPerBlock > groupEnd) inodesPerBlock = groupEnd - first;
+
+    if (read_block(volume, table + (offset >> volume->block_bits), 0, volume->block_size, block)
+        != volume->block_size)
+        return -1;
+    inode_table_store(volume->inodes, first, block, inodesPerBlock, volume->inode_size);
+    return 0;
+}
+
 /* read_inode: Fills an inode data structure with the data from one
    inode in disk. Determines the block group number and index within
    the group from the inode number, then reads the inode from the
@@ -11,42 +67,218 @@
      inode_no: Number of the inode to read from disk.
      buffer: Pointer to location where data is to be stored.
 
+   For volumes with an inode table (EXT2_OPEN_INODE_TABLE), only the
+   hot fields of the inode are filled, and the others are set to 0
+   (zero); see read_inode_full.
+
    Returns:
      In case of success, returns a positive value. In case of error,
      returns -1.
  */
 ssize_t read_inode (volume_t *volume, uint32_t inode_no, inode_t *buffer) {
 
-//    if (inode_no <= EXT2_BAD_INO || inode_no >= EXT2_INVALID_BLOCK_NUMBER) {
-//        return -1;
-//    }
+    if (volume->profile) profile_record_inode(volume, inode_no);
 
-    if (inode_no == 0 || inode_no > volume->super.s_inodes_count) return -1;
+    if (volume->inodes) {
+        char *block;
 
-//    printf("%x\n", volume->super.s_inodes_per_group);
-//    block group = (inode – 1) / INODES_PER_GROUP
-    unsigned int blockNumber = (inode_no - 1) / volume->super.s_inodes_per_group;
-//    index = (inode – 1) % INODES_PER_GROUP
-    unsigned int inodeIndex = (inode_no - 1) % volume->super.s_inodes_per_group;
-//    printf("%d\n", blockNumber);
-    unsigned int containingBlock = (inodeIndex * volume->super.s_inode_size);
-//    From the Block Group Descriptor, extract the location of the block group's inode table.
-    unsigned int inodeTable = volume->groups[blockNumber].bg_inode_table;
-//    Determine the index of the inode in the inode table.
-//    Index the inode table (taking into account non-standard inode size).
-
-    /* TO BE COMPLETED BY THE STUDENT */
-    return read_block(volume, inodeTable, containingBlock, volume->super.s_inode_size, buffer);
+        if (inode_table_get(volume->inodes, inode_no, buffer)) return sizeof(inode_t);
+        if (!(block = malloc(volume->block_size))) return -1;
+        int rv = load_inode_block(volume, inode_no, block);
+        free(block);
+        if (rv < 0) return -1;
+        // Under a tight budget the chunk may already be evicted again
+        return inode_table_get(volume->inodes, inode_no, buffer) ? sizeof(inode_t) :
+               read_inode_full(volume, inode_no, buffer);
+    }
+
+    if (cache_lookup(volume, EXT2_CACHE_INODE, inode_no, buffer, sizeof(inode_t)))
+        return sizeof(inode_t);
+
+    return read_inode_full(volume, inode_no, buffer);
+}
+
+/* read_inode_full: Same as read_inode, but always fills every field
+   of the inode, reading it from disk (through the cache pool) if the
+   volume keeps its inodes in an inode table.
+ */
+ssize_t read_inode_full(volume_t *volume, uint32_t inode_no, inode_t *buffer) {
+
+    uint32_t inodeTable, containingBlock;
+
+    if (inode_location(volume, inode_no, &inodeTable, &containingBlock) < 0) return -1;
+
+    /* Only the fields known to inode_t are copied; any extra bytes of
+       a larger on-disk inode (s_inode_size > 128) are skipped. */
+    ssize_t rv = read_block(volume, inodeTable, containingBlock, sizeof(inode_t), buffer);
+    if (rv == sizeof(inode_t) && !volume->inodes)
+        cache_insert(volume, EXT2_CACHE_INODE, inode_no, buffer, sizeof(inode_t));
+    return rv == sizeof(inode_t) ? rv : -1;
+}
+
+/* Returns where an inode is stored in the write-back cache of a
+   writable volume, dropping the copies of the inode kept by the
+   volume's cache pool or inode table, or NULL (with errno set). */
+static char *writable_inode(volume_t *volume, uint32_t inode_no) {
+
+    uint32_t table, offset;
+
+    if (!volume->writeback) {
+        errno = EROFS;
+        return NULL;
+    }
+    if (inode_location(volume, inode_no, &table, &offset) < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    char *block = writeback_block(volume, table + (offset >> volume->block_bits), EXT2_WRITEBACK_META, 1);
+    if (!block) return NULL;
+
+    if (volume->inodes) inode_table_forget(volume->inodes, inode_no);
+    cache_invalidate(volume, EXT2_CACHE_INODE, inode_no);
+    return block + (offset & (volume->block_size - 1));
 }
 
-uint32_t readInode(volume_t *volume, uint32_t blockNumber, uint32_t offset) {
+/* write_inode: Stores an inode in its inode table block, in the
+   write-back cache of a writable volume. Only the fields known to
+   inode_t are written; any extra bytes of a larger on-disk inode are
+   left as they are.
 
-    uint32_t actualOffset = offset << 2;
-    uint32_t buffer;
+   Parameters:
+     volume: pointer to volume, opened with EXT2_OPEN_WRITE.
+     inode_no: Number of the inode to write.
+     inode: Inode to store. Must hold every field of the inode, as
+            filled by read_inode_full.
 
-    uint32_t iNodeIndex = read_block(volume, blockNumber, actualOffset, 1 << 2, &buffer);
+   Returns:
+     0 on success, or -1 in case of error, with errno set to EROFS if
+     the volume is not writable.
+ */
+int write_inode(volume_t *volume, uint32_t inode_no, const inode_t *inode) {
 
-    return (iNodeIndex > 0 && iNodeIndex != EXT2_INVALID_BLOCK_NUMBER) ? buffer : EXT2_INVALID_BLOCK_NUMBER;
+    char *slot = writable_inode(volume, inode_no);
+    if (!slot) return -1;
+    memcpy(slot, inode, sizeof(inode_t));
+    return 0;
+}
+
+/* clear_inode: Zeroes an inode on disk, extra bytes of a larger
+   on-disk inode included. Used on inodes just allocated.
+
+   Returns:
+     Same as write_inode.
+ */
+int clear_inode(volume_t *volume, uint32_t inode_no) {
+
+    char *slot = writable_inode(volume, inode_no);
+    if (!slot) return -1;
+    memset(slot, 0, volume->inode_size);
+    return 0;
+}
+
+typedef struct inode_request {
+    uint32_t block_no;
+    uint32_t offset;
+    size_t index;
+} inode_request_t;
+
+static int compareInodeRequest(const void *a, const void *b) {
+
+    const inode_request_t *x = a, *y = b;
+
+    if (x->block_no != y->block_no) return x->block_no < y->block_no ? -1 : 1;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+/* read_inodes: Reads a batch of inodes. The requests are sorted by
+   the inode table block they live in, so each inode table block is
+   read from disk only once, in increasing block order, no matter how
+   many of the requested inodes it holds. Inodes already cached (or
+   in the volume's inode table) are not read at all.
+
+   Parameters:
+     volume: pointer to volume.
+     inode_nos: Array of 'count' inode numbers to read. Numbers may
+                be repeated and may appear in any order.
+     count: Number of inodes to read.
+     buffers: Array of 'count' inodes where the data is to be
+              stored. buffers[i] receives inode inode_nos[i]. Invalid
+              inode numbers produce a zeroed inode.
+
+   Returns:
+     In case of success, returns the number of inodes that were
+     successfully read. In case of error, returns -1.
+ */
+ssize_t read_inodes(volume_t *volume, const uint32_t *inode_nos, size_t count, inode_t *buffers) {
+
+    inode_request_t *requests = malloc(sizeof(inode_request_t) * count);
+    char *blockBuffer = malloc(volume->block_size);
+    uint32_t cachedBlock = EXT2_INVALID_BLOCK_NUMBER;
+    size_t pending = 0;
+    ssize_t found = 0;
+
+    if (!requests || !blockBuffer) {
+        free(requests); free(blockBuffer);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t table, byteOffset;
+
+        memset(&buffers[i], 0, sizeof(inode_t));
+        if (inode_location(volume, inode_nos[i], &table, &byteOffset) < 0) continue;
+        if (volume->profile) profile_record_inode(volume, inode_nos[i]);
+
+        if (volume->inodes ? inode_table_get(volume->inodes, inode_nos[i], &buffers[i]) :
+            cache_lookup(volume, EXT2_CACHE_INODE, inode_nos[i], &buffers[i], sizeof(inode_t))) {
+            found++;
+            continue;
+        }
+
+        requests[pending].block_no = table + (byteOffset >> volume->block_bits);
+        requests[pending].offset = byteOffset & (volume->block_size - 1);
+        requests[pending].index = i;
+        pending++;
+    }
+
+    qsort(requests, pending, sizeof(inode_request_t), compareInodeRequest);
+
+    for (size_t i = 0; i < pending; i++) {
+        size_t index = requests[i].index;
+
+        if (volume->inodes) {
+            // The whole block goes into the table, so its other inodes need no read
+            if (requests[i].block_no != cachedBlock &&
+                load_inode_block(volume, inode_nos[index], blockBuffer) == 0)
+                cachedBlock = requests[i].block_no;
+            if (inode_table_get(volume->inodes, inode_nos[index], &buffers[index])) {
+                found++;
+            } else if (cachedBlock == requests[i].block_no) {
+                // Evicted again under a tight budget; the block read still holds the inode
+                memcpy(&buffers[index], blockBuffer + requests[i].offset, sizeof(inode_t));
+                found++;
+            }
+            continue;
+        }
+
+        if (requests[i].block_no != cachedBlock) {
+            if (read_block(volume, requests[i].block_no, 0, volume->block_size, blockBuffer)
+                != volume->block_size) {
+                cachedBlock = EXT2_INVALID_BLOCK_NUMBER;
+                continue;
+            }
+            cachedBlock = requests[i].block_no;
+        }
+        memcpy(&buffers[index], blockBuffer + requests[i].offset, sizeof(inode_t));
+        cache_insert(volume, EXT2_CACHE_INODE, inode_nos[index], &buffers[index], sizeof(inode_t));
+        found++;
+    }
+
+    free(requests);
+    free(blockBuffer);
+    return found;
 }
 
 /* read_inode_block_no: Returns the block number containing the data
@@ -65,53 +297,97 @@ uint32_t readInode(volume_t *volume, uint32_t blockNumber, uint32_t offset) {
      sparse files. In case of error, returns
      EXT2_INVALID_BLOCK_NUMBER.
  */
-uint32_t get_inode_block_no (volume_t *volume, inode_t *inode, uint64_t block_idx) {
+uint32_t get_inode_block_no(volume_t *volume, inode_t *inode, uint64_t block_idx) {
 
-    /* TO BE COMPLETED BY THE STUDENT */
-    uint32_t singly = volume->block_size >> 2; // 1024 entries
-    uint32_t doubly = singly * singly;
-    //Direct Block            Indirect Block       Doubly       Triply?
-    //[0      -           11][12                 ][13         ][14]
+    // The kernel is specialized for the volume's block size (see ext2blocks.c)
+    return volume->ops->map_block(volume, inode, block_idx);
+}
 
-    int startIndexOfIndirectBlk = (1 + 2) << 2;
-    uint32_t startIndexOfDoublyIndirectBlk = startIndexOfIndirectBlk + singly;
-    uint32_t startIndexOfTriplyIndirectBlk = startIndexOfDoublyIndirectBlk + doubly;
-    uint32_t EndIndexOfIndirectBlkRng = startIndexOfTriplyIndirectBlk + singly * doubly;
+/* walk_indirect: Visits an indirect block of the given level (1 for
+   singly, 2 for doubly and 3 for triply indirect) and, recursively,
+   every block it references. 'first_idx' is the index of the first
+   data block mapped by the indirect block, and 'span' the number of
+   data blocks it maps.
+ */
+static int walk_indirect(volume_t *volume, uint32_t block_no, int level, uint64_t first_idx,
+                         uint64_t span, block_visitor_t visit, void *ctx) {
 
-    //direct Block
-    if (block_idx < startIndexOfIndirectBlk) return inode->i_block[block_idx];
+    int rv = visit(ctx, first_idx, block_no, level);
+    if (rv) return rv;
 
-    //1-indirect
+    // Do not follow pointers stored in blocks outside the volume
+    if (block_no < volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count)
+        return 0;
 
-    if (block_idx >= startIndexOfIndirectBlk && block_idx < startIndexOfDoublyIndirectBlk) {
+    uint32_t perBlock = volume->block_size / sizeof(uint32_t);
+    uint32_t *pointers = malloc(volume->block_size);
+    if (!pointers) return -1;
 
-        uint32_t offset = block_idx - startIndexOfIndirectBlk;
-        return                 readInode(volume, inode->i_block_1ind,       offset);
+    if (read_block(volume, block_no, 0, volume->block_size, pointers) != volume->block_size) {
+        free(pointers);
+        return -1;
     }
 
-    //2-indirect
-    if (block_idx >= startIndexOfDoublyIndirectBlk && block_idx < startIndexOfTriplyIndirectBlk) {
-
-        uint32_t offset = block_idx - startIndexOfDoublyIndirectBlk;
-        uint32_t blockIndex1 = readInode(volume, inode->i_block_2ind, offset / singly);
-        return                 readInode(volume, blockIndex1,         offset % singly);
+    uint64_t childSpan = span / perBlock;
+    for (uint32_t i = 0; i < perBlock && !rv; i++) {
+        if (!pointers[i]) continue;
+        if (level == 1)
+            rv = visit(ctx, first_idx + i, pointers[i], 0);
+        else
+            rv = walk_indirect(volume, pointers[i], level - 1, first_idx + i * childSpan, childSpan, visit, ctx);
     }
 
-        //3-indirect
-    else if (block_idx >= startIndexOfTriplyIndirectBlk && block_idx < EndIndexOfIndirectBlkRng) {
+    free(pointers);
+    return rv;
+}
 
-        uint32_t offset = block_idx - startIndexOfTriplyIndirectBlk;
-        uint32_t blockIndex1 = readInode(volume, inode->i_block_3ind, offset / doubly);
+/* walk_inode_blocks: Visits every block allocated to an inode: its
+   data blocks, and the indirect blocks used to map them. Each
+   indirect block is read only once, so walking a whole file is much
+   cheaper than calling get_inode_block_no for each of its blocks.
+   Holes (block number 0) are not visited. Inodes without blocks (fast
+   symbolic links, devices, pipes and sockets) visit nothing.
 
-        uint32_t remainderOffset = (offset / singly) % singly;
-        uint32_t blockIndex2 = readInode(volume, blockIndex1,         remainderOffset);
-        return                 readInode(volume, blockIndex2,         offset % singly);
-    }
-    //Invalid
-    return EXT2_INVALID_BLOCK_NUMBER;
-}
+   Parameters:
+     volume: Pointer to volume.
+     inode: Pointer to inode structure of the file.
+     visit: Function called for each block, with parameters 'ctx',
+            the index of the (first) data block it maps, the block
+            number, and the level: 0 for data blocks, 1 to 3 for
+            singly to triply indirect blocks. Indirect blocks are
+            visited before the blocks they reference. Blocks are
+            visited in increasing order of index. If the function
+            returns non-zero, the walk stops.
+     ctx: Pointer passed to the visit function.
+
+   Returns:
+     0 if all blocks were visited, the non-zero value returned by the
+     visit function if it stopped the walk, or -1 if an indirect block
+     could not be read.
+ */
+int walk_inode_blocks(volume_t *volume, inode_t *inode, block_visitor_t visit, void *ctx) {
+
+    if (!inode_has_blocks(volume, inode)) return 0;
 
+    uint64_t perBlock = volume->block_size / sizeof(uint32_t);
+    uint64_t first = EXT2_NDIR_BLOCKS;
+    int rv = 0;
 
+    for (int i = 0; i < EXT2_NDIR_BLOCKS && !rv; i++)
+        if (inode->i_block[i])
+            rv = visit(ctx, i, inode->i_block[i], 0);
+
+    if (!rv && inode->i_block_1ind)
+        rv = walk_indirect(volume, inode->i_block_1ind, 1, first, perBlock, visit, ctx);
+    first += perBlock;
+    if (!rv && inode->i_block_2ind)
+        rv = walk_indirect(volume, inode->i_block_2ind, 2, first, perBlock * perBlock, visit, ctx);
+    first += perBlock * perBlock;
+    if (!rv && inode->i_block_3ind)
+        rv = walk_indirect(volume, inode->i_block_3ind, 3, first, perBlock * perBlock * perBlock, visit, ctx);
+
+    return rv;
+}
 
 /* read_file_block: Returns the content of a specific file, limited to
    a single block.
@@ -130,25 +406,26 @@ uint32_t get_inode_block_no (volume_t *volume, inode_t *inode, uint64_t block_id
  */
 ssize_t read_file_block (volume_t *volume, inode_t *inode, uint64_t offset, uint64_t max_size, void *buffer) {
 
-    uint64_t blockNumber = get_inode_block_no(volume, inode, offset / volume->block_size);
-    uint64_t actualOffset = offset % volume->block_size;
+    uint64_t blockNumber = get_inode_block_no(volume, inode, offset >> volume->block_bits);
+    uint64_t actualOffset = offset & (volume->block_size - 1);
     uint64_t fileLimit = inode_file_size(volume, inode);
 
-    if (offset + max_size > fileLimit) {
-        max_size = offset - fileLimit;
-
-        if (offset + max_size > volume->block_size)
-            max_size = volume->block_size - max_size;
-    }
+    if (offset >= fileLimit) return 0;
 
+    // Never read past the end of this block or past the end of the file
+    if (actualOffset + max_size > volume->block_size)
+        max_size = volume->block_size - actualOffset;
+    if (offset + max_size > fileLimit)
+        max_size = fileLimit - offset;
 
-//    if (actualOffset + max_size == inode_file_size(volume, inode)) return 0;
     return read_block(volume, blockNumber, actualOffset, max_size, buffer);
 }
 
 /* read_file_content: Returns the content of a specific file, limited
    to the size of the file only. May need to read more than one block,
-   with data not necessarily stored in contiguous blocks.
+   with data not necessarily stored in contiguous blocks. Blocks that
+   follow each other on the volume are read with a single call to
+   read_block, so they can be read (and verified) as one run.
 
    Parameters:
      volume: Pointer to volume.
@@ -164,14 +441,29 @@ ssize_t read_file_block (volume_t *volume, inode_t *inode, uint64_t offset, uint
  */
 ssize_t read_file_content (volume_t *volume, inode_t *inode, uint64_t offset, uint64_t max_size, void *buffer) {
 
-    uint32_t read_so_far = 0;
+    uint64_t read_so_far = 0;
 
+    if (offset >= inode_file_size(volume, inode)) return 0;
     if (offset + max_size > inode_file_size(volume, inode))
         max_size = inode_file_size(volume, inode) - offset;
 
     while (read_so_far < max_size) {
-        int rv = read_file_block(volume, inode, offset + read_so_far,
-                                 max_size - read_so_far, buffer + read_so_far);
+        uint64_t position = offset + read_so_far;
+        uint64_t blockIdx = position >> volume->block_bits;
+        uint32_t blockNumber = get_inode_block_no(volume, inode, blockIdx);
+        uint64_t length = volume->block_size - (position & (volume->block_size - 1));
+
+        // Extend the run while the next block of the file is the next block of the volume
+        if (blockNumber != 0 && blockNumber != EXT2_INVALID_BLOCK_NUMBER) {
+            for (uint32_t run = 1; length < max_size - read_so_far && length <= UINT32_MAX - volume->block_size &&
+                     get_inode_block_no(volume, inode, blockIdx + run) == blockNumber + run; run++)
+                length += volume->block_size;
+        }
+        if (length > max_size - read_so_far)
+            length = max_size - read_so_far;
+
+        ssize_t rv = read_block(volume, blockNumber, position & (volume->block_size - 1), length,
+                                buffer + read_so_far);
         if (rv <= 0) return rv;
         read_so_far += rv;
     }
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "ext2.h"
+
+/* ext2frag: Reports how the files of a volume file are laid out on
+   disk, as JSON: volume-wide totals and histograms, the worst laid out
+   files with their paths, and optionally every file with its extent
+   list. Images whose files have many extents, span many groups or
+   keep their indirect blocks far from the data stream poorly.
+ */
+
+static volume_t *volume;
+static int print_extents;
+static int first_file = 1;
+
+static void print_json_string(const char *s) {
+
+  putchar('"');
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') printf("\\%c", c);
+    else if (c < 0x20) printf("\\u%04x", c);
+    else putchar(c);
+  }
+  putchar('"');
+}
+
+static void print_file(file_layout_t *file, const char *path) {
+
+  printf("{\"inode\": %u, ", file->inode_no);
+  if (path) {
+    printf("\"path\": ");
+    print_json_string(path);
+    printf(", ");
+  }
+  printf("\"type\": \"%s\", \"size\": %" PRIu64 ", \"data_blocks\": %" PRIu64 ", \"indirect_blocks\": %" PRIu64
+         ", \"extents\": %u, \"avg_extent_blocks\": %.2f, \"groups\": %u, \"indirect_distance\": %.1f",
+         S_ISDIR(file->mode) ? "directory" : S_ISLNK(file->mode) ? "symlink" : "file", file->size,
+         file->data_blocks, file->indirect_blocks, file->num_extents,
+         file->num_extents ? (double) file->data_blocks / file->num_extents : 0.0, file->groups,
+         file->indirect_distance);
+
+  if (print_extents && file->extents) {
+    printf(", \"extent_list\": [");
+    for (uint32_t i = 0; i < file->num_extents; i++)
+      printf("%s[%" PRIu64 ", %u, %u]", i ? ", " : "", file->extents[i].logical, file->extents[i].physical,
+             file->extents[i].blocks);
+    printf("]");
+  }
+  printf("}");
+}
+
+static void print_each_file(void *ctx, file_layout_t *file) {
+
+  printf("%s\n    ", first_file ? "" : ",");
+  first_file = 0;
+  print_file(file, NULL);
+}
+
+static void print_histogram(const char *name, uint64_t *histogram, int last) {
+
+  int top = EXT2_LAYOUT_BUCKETS;
+  while (top > 0 && !histogram[top - 1]) top--;
+
+  printf("    \"%s\": [", name);
+  for (int i = 0; i < top; i++)
+    printf("%s{\"min\": %" PRIu64 ", \"max\": %" PRIu64 ", \"count\": %" PRIu64 "}", i ? ", " : "",
+           (uint64_t) 1 << i, ((uint64_t) 2 << i) - 1, histogram[i]);
+  printf("]%s\n", last ? "" : ",");
+}
+
+// Inodes whose paths are looked up, and where the paths are stored
+typedef struct path_lookup {
+  uint32_t *inode_nos;
+  char **paths;
+  size_t count;
+} path_lookup_t;
+
+static int record_path(void *ctx, const char *path, uint32_t inode_no, inode_t *inode) {
+
+  path_lookup_t *lookup = ctx;
+  for (size_t i = 0; i < lookup->count; i++)
+    if (lookup->inode_nos[i] == inode_no && !lookup->paths[i])
+      lookup->paths[i] = strdup(path);
+  return 0;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-t threads] [-n worst] [-a] [-e] volume_file\n"
+          "  -t threads number of threads (default: one per processor)\n"
+          "  -n worst   number of worst laid out files to list (default 20)\n"
+          "  -a         list every file\n"
+          "  -e         include extent lists ([logical, physical, blocks]) of listed files\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_worst = 20;
+  int all_files = 0, opt;
+
+  while ((opt = getopt(argc, argv, "t:n:ae")) != -1) {
+    switch (opt) {
+    case 't': num_threads = atol(optarg); break;
+    case 'n': max_worst = strtoul(optarg, NULL, 10); break;
+    case 'a': all_files = 1; break;
+    case 'e': print_extents = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 1 || num_threads < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+
+  layout_summary_t summary = { .worst = calloc(max_worst ? max_worst : 1, sizeof(file_layout_t)),
+                               .max_worst = max_worst };
+
+  printf("{\n  \"volume\": ");
+  print_json_string(argv[optind]);
+  printf(",\n  \"block_size\": %u,\n  \"groups\": %u,\n", volume->block_size, volume->num_groups);
+  if (all_files)
+    printf("  \"files\": [\n    ");
+
+  int rv = analyze_volume_layout(volume, num_threads, &summary, all_files ? print_each_file : NULL, NULL);
+  if (rv < 0)
+    fprintf(stderr, "Some files could not be analyzed: volume cannot be read or memory is exhausted.\n");
+
+  if (all_files)
+    printf("\n  ],\n");
+
+  printf("  \"summary\": {\n    \"files\": %" PRIu64 ",\n    \"fragmented_files\": %" PRIu64
+         ",\n    \"data_blocks\": %" PRIu64 ",\n    \"indirect_blocks\": %" PRIu64 ",\n    \"extents\": %" PRIu64
+         ",\n", summary.files, summary.fragmented_files, summary.data_blocks, summary.indirect_blocks, summary.extents);
+  print_histogram("extent_count_histogram", summary.extent_count_histogram, 0);
+  print_histogram("extent_length_histogram", summary.extent_length_histogram, 0);
+  print_histogram("groups_histogram", summary.groups_histogram, 1);
+  printf("  },\n  \"worst\": [");
+
+  // Paths are only looked up for the files listed as worst
+  uint32_t *inode_nos = calloc(summary.num_worst + 1, sizeof(uint32_t));
+  char **paths = calloc(summary.num_worst + 1, sizeof(char *));
+  path_lookup_t lookup = { inode_nos, paths, summary.num_worst };
+
+  for (size_t i = 0; i < summary.num_worst; i++)
+    inode_nos[i] = summary.worst[i].inode_no;
+  walk_directory_tree(volume, "/", record_path, &lookup);
+
+  for (size_t i = 0; i < summary.num_worst; i++) {
+    file_layout_t *file = &summary.worst[i];
+    printf("%s\n    ", i ? "," : "");
+
+    // The summary keeps no extent lists; recompute them if requested
+    inode_t inode;
+    file_layout_t full;
+    if (print_extents && read_inode(volume, file->inode_no, &inode) > 0 &&
+        analyze_file_layout(volume, file->inode_no, &inode, &full) == 0) {
+      print_file(&full, paths[i]);
+      free(full.extents);
+    } else {
+      print_file(file, paths[i]);
+    }
+    free(paths[i]);
+  }
+  printf("\n  ]\n}\n");
+
+  free(paths);
+  free(inode_nos);
+  free(summary.worst);
+  close_volume_file(volume);
+  return rv < 0 ? 1 : 0;
+}
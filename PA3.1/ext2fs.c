@@ -15,7 +15,105 @@
 #define _FILE_OFFSET_BITS  64
 #include <fuse.h>
 
-static volume_t *volume;
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <fcntl.h>
+
+// Number of directory entries decoded (and inodes fetched) per batch in readdir
+#define EXT2_READDIR_BATCH 256
+
+// Default memory budget shared by the caches of all volumes, in MiB
+#define EXT2FS_DEFAULT_CACHE_MB 256
+
+// Interval between checks of the volume manifest for changes, in seconds
+#define EXT2FS_MANIFEST_POLL_SECS 1
+
+// Interval between saves of the access profiles of the volumes, in seconds
+#define EXT2FS_PROFILE_SAVE_SECS 60
+
+// Default number of operations in progress at once (--sched-slots; 0 disables the scheduler)
+#define EXT2FS_SCHED_SLOTS 8
+
+// Default size of the pieces bulk reads are split into, in KiB (--sched-chunk)
+#define EXT2FS_SCHED_CHUNK_KB 128
+
+// Interval between writes of the scheduler statistics file, in seconds
+#define EXT2FS_SCHED_STATS_SECS 5
+
+// Interval between rebalances of the caches under --memory-limit, in seconds
+#define EXT2FS_MEMORY_REBALANCE_SECS 1
+
+// Interval between flushes of the changes to writable volumes (--write), in seconds
+#define EXT2FS_WRITEBACK_SECS 5
+
+/* A volume served by this process. In single-volume mode the volume
+   is the root of the mount; with a manifest (--volumes), each volume
+   appears as a top-level directory named after it.
+
+   Requests find their volume without locking: the list is changed
+   only under volumes_lock, with release stores, and read inside an
+   epoch critical section (see ext2epoch.c). A request then takes a
+   reference, unless the count already dropped to zero; the last
+   reference closes the volume and retires its structure.
+
+   With --write, requests also take the lock of the volume: shared to
+   read, and exclusive to change the volume, which nothing else may
+   use meanwhile (see ext2write.c). The lock is always taken after a
+   slot of the scheduler, if any, and never held while waiting for
+   one: bulk reads take it for each piece (see ext2sched.c), and
+   changes do not use the scheduler. */
+typedef struct mounted_volume {
+  char name[NAME_MAX + 1];
+  char *filename;
+  char *profile_file; // Where the volume's access profile is saved, or NULL
+  volume_t *volume;
+  _Atomic int refs; // Requests using the volume, plus one while it is attached
+  pthread_rwlock_t lock;
+  _Atomic(struct mounted_volume *) next;
+} mounted_volume_t;
+
+static pthread_mutex_t volumes_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes changes to the list
+static _Atomic(mounted_volume_t *) volumes;
+static cache_pool_t *cache_pool;
+
+static char *manifest;   // Absolute path of the manifest, NULL in single-volume mode
+static struct timespec manifest_mtime;
+static pthread_t manifest_thread;
+static volatile int manifest_stop;
+
+static char *trace_file; // Absolute path of the trace file, NULL if not tracing
+static int open_flags;   // EXT2_OPEN_* flags used for all volume files
+
+static char *profile_dir; // Absolute path of the directory of access profiles, NULL if not profiling
+static pthread_t profile_thread;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t profile_cond = PTHREAD_COND_INITIALIZER;
+static int profile_stop;
+static int serving; // Set once FUSE has started (and daemonized)
+
+static ext2_sched_t *scheduler; // Orders metadata operations and pieces of reads, NULL if disabled
+static char *sched_stats_file;  // Absolute path of the scheduler statistics file, NULL if not written
+static pthread_t sched_stats_thread;
+static pthread_mutex_t sched_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_stats_cond = PTHREAD_COND_INITIALIZER;
+static int sched_stats_stop;
+
+static mem_governor_t *governor; // Keeps the caches under --memory-limit, NULL if unlimited
+static pthread_t governor_thread;
+static sem_t governor_wakeup;    // Posted by SIGUSR1 to shrink the caches, and to stop the thread
+static volatile sig_atomic_t governor_shrink_requested;
+static volatile int governor_stop;
+
+static pthread_t writeback_thread; // Flushes the changes to writable volumes periodically
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+static int writeback_stop;
 
 static void *ext2_init(struct fuse_conn_info *conn);
 static void ext2_destroy(void *private_data);
@@ -25,6 +123,17 @@ static int ext2_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int ext2_read(const char *path, char *buf, size_t size, off_t offset,
 		     struct fuse_file_info *fi);
 static int ext2_readlink(const char *path, char *buf, size_t size);
+static int ext2_open(const char *path, struct fuse_file_info *fi);
+static int ext2_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+static int ext2_write(const char *path, const char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi);
+static int ext2_truncate(const char *path, off_t size);
+static int ext2_mkdir(const char *path, mode_t mode);
+static int ext2_unlink(const char *path);
+static int ext2_rmdir(const char *path);
+static int ext2_rename(const char *from, const char *to);
+static int ext2_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+static int ext2_release(const char *path, struct fuse_file_info *fi);
 
 static const struct fuse_operations ext2_operations = {
   .init = ext2_init,
@@ -33,20 +142,549 @@ static const struct fuse_operations ext2_operations = {
   .getattr = ext2_getattr,
   .readdir = ext2_readdir,
   .readlink = ext2_readlink,
+  .open = ext2_open,
+  .create = ext2_create,
+  .write = ext2_write,
+  .truncate = ext2_truncate,
+  .mkdir = ext2_mkdir,
+  .unlink = ext2_unlink,
+  .rmdir = ext2_rmdir,
+  .rename = ext2_rename,
+  .fsync = ext2_fsync,
+  .release = ext2_release,
 };
 
+/* start_warming: Starts reading ahead what the saved access profile
+   of a volume lists, if there is one. Warming threads must be started
+   once FUSE has daemonized, or they would not survive it. Writable
+   volumes are not warmed, as warming reads without the volume lock.
+ */
+static void start_warming(mounted_volume_t *mv) {
+
+  if (!(open_flags & EXT2_OPEN_WRITE) && mv->profile_file && access(mv->profile_file, R_OK) == 0 &&
+      profile_warm_start(mv->volume, mv->profile_file) < 0)
+    fprintf(stderr, "Cannot warm volume '%s' from '%s'.\n", mv->name, mv->profile_file);
+}
+
+/* attach_volume: Opens a volume file, attaches it to the shared
+   cache pool and makes it available under the given name. With
+   --profile, also records the accesses to the volume, and warms its
+   caches from the profile saved by a previous run.
+
+   Returns:
+     0 on success, or -1 if the volume file is invalid.
+ */
+static int attach_volume(const char *name, const char *filename) {
+
+  mounted_volume_t *mv = calloc(1, sizeof(mounted_volume_t));
+  if (!mv) return -1;
+
+  mv->volume = open_volume_file_flags(filename, open_flags);
+  if (!mv->volume) {
+    free(mv);
+    return -1;
+  }
+  cache_attach_volume(cache_pool, mv->volume);
+  mem_attach_volume(governor, mv->volume);
+
+  snprintf(mv->name, sizeof(mv->name), "%s", name);
+  mv->filename = strdup(filename);
+  atomic_init(&mv->refs, 1);
+  pthread_rwlock_init(&mv->lock, NULL);
+
+  // Profiles are named after the volume file, so they follow it across renames of the volume
+  if (profile_dir && profile_attach(mv->volume) == 0) {
+    char *copy = strdup(filename);
+    size_t size = strlen(profile_dir) + strlen(filename) + sizeof("/.profile");
+    if (copy && (mv->profile_file = malloc(size)))
+      snprintf(mv->profile_file, size, "%s/%s.profile", profile_dir, basename(copy));
+    free(copy);
+  }
+
+  pthread_mutex_lock(&volumes_lock);
+  atomic_init(&mv->next, atomic_load(&volumes));
+  atomic_store_explicit(&volumes, mv, memory_order_release);
+  if (serving)
+    start_warming(mv);
+  pthread_mutex_unlock(&volumes_lock);
+  return 0;
+}
+
+/* Saves the access profile of a volume, if it is profiled. */
+static void save_profile(mounted_volume_t *mv) {
+
+  if (mv->profile_file && profile_save(mv->volume, mv->profile_file) < 0)
+    fprintf(stderr, "Cannot save access profile '%s': %s.\n", mv->profile_file, strerror(errno));
+}
+
+/* Drops one reference to a volume, closing it when it was detached
+   and no request is using it anymore. */
+static void put_volume(mounted_volume_t *mv) {
+
+  if (atomic_fetch_sub(&mv->refs, 1) > 1) return;
+
+  save_profile(mv);
+  mem_detach_volume(governor, mv->volume);
+  close_volume_file(mv->volume);
+  pthread_rwlock_destroy(&mv->lock);
+  free(mv->profile_file);
+  free(mv->filename);
+  // Requests looking for their volume may still be reading the name
+  epoch_retire(mv);
+}
+
+/* detach_volume: Removes a volume from the mount. Requests already
+   using the volume complete normally; the volume is closed, and its
+   cached data released, once the last of them finishes. Must be
+   called with volumes_lock held.
+ */
+static void detach_volume(mounted_volume_t *mv) {
+
+  _Atomic(mounted_volume_t *) *link = &volumes;
+  while (atomic_load(link) != mv) link = &atomic_load(link)->next;
+  atomic_store_explicit(link, atomic_load(&mv->next), memory_order_release);
+  put_volume(mv);
+}
+
+/* acquire_volume: Finds the volume a path refers to, and holds a
+   reference to it until release_volume is called.
+
+   Parameters:
+     path: Path in the mount.
+     inner: Set to the path of the file within the volume.
+
+   Returns:
+     The volume, or NULL if the path does not belong to any volume
+     (including the top-level directory of a multi-volume mount).
+ */
+static mounted_volume_t *acquire_volume(const char *path, const char **inner) {
+
+  mounted_volume_t *mv;
+  const char *name = path + strspn(path, "/");
+  size_t len = strcspn(name, "/");
+
+  epoch_enter();
+  for (mv = atomic_load_explicit(&volumes, memory_order_acquire); mv;
+       mv = atomic_load_explicit(&mv->next, memory_order_acquire)) {
+    if (manifest && !(len && strlen(mv->name) == len && !strncmp(mv->name, name, len)))
+      continue;
+
+    // A volume whose count dropped to zero is being closed; a replacement may follow it
+    int refs = atomic_load(&mv->refs);
+    while (refs > 0 && !atomic_compare_exchange_weak(&mv->refs, &refs, refs + 1));
+    if (refs > 0)
+      break;
+  }
+  epoch_exit();
+
+  *inner = !manifest ? path : name[len] ? name + len : "/";
+  return mv;
+}
+
+static void release_volume(mounted_volume_t *mv) {
+
+  put_volume(mv);
+}
+
+// Takes the lock of a volume to read it; only writable volumes need it
+static void lock_shared(mounted_volume_t *mv) {
+
+  if (open_flags & EXT2_OPEN_WRITE)
+    pthread_rwlock_rdlock(&mv->lock);
+}
+
+static void lock_exclusive(mounted_volume_t *mv) {
+
+  pthread_rwlock_wrlock(&mv->lock);
+}
+
+static void unlock_volume(mounted_volume_t *mv) {
+
+  if (open_flags & EXT2_OPEN_WRITE)
+    pthread_rwlock_unlock(&mv->lock);
+}
+
+/* Checks if a path is the top-level directory of a multi-volume
+   mount, which lists the attached volumes. */
+static int is_volume_list(const char *path) {
+
+  return manifest && path[strspn(path, "/")] == '\0';
+}
+
+/* load_manifest: Reads the manifest and brings the set of attached
+   volumes in line with it. The manifest lists one volume per line as
+   a name followed by the path of its volume file; relative paths are
+   relative to the manifest's directory. Empty lines and lines
+   starting with '#' are ignored. Volumes no longer listed, or whose
+   file changed, are detached; newly listed volumes are attached.
+
+   Returns:
+     0 on success, or -1 if the manifest cannot be read, or memory
+     runs out while reading it; the attached volumes are then left
+     as they are, and the manifest is read again at the next poll.
+ */
+static int load_manifest(void) {
+
+  FILE *file = fopen(manifest, "r");
+  if (!file) return -1;
+
+  char *manifest_copy = strdup(manifest);
+  if (!manifest_copy) {
+    fclose(file);
+    return -1;
+  }
+  const char *dir = dirname(manifest_copy);
+  char line[2 * PATH_MAX], name[NAME_MAX + 1], path[PATH_MAX], filename[2 * PATH_MAX + 1];
+  struct stat st;
+  struct timespec mtime = manifest_mtime;
+
+  if (fstat(fileno(file), &st) == 0)
+    mtime = st.st_mtim;
+
+  // Names and files listed in the manifest, as pairs
+  char **listed = NULL;
+  size_t num_listed = 0;
+  int failed = 0;
+
+  while (!failed && fgets(line, sizeof(line), file)) {
+    if (sscanf(line, " %255s %4095s", name, path) != 2 || name[0] == '#' || strchr(name, '/'))
+      continue;
+    if (path[0] == '/')
+      snprintf(filename, sizeof(filename), "%s", path);
+    else
+      snprintf(filename, sizeof(filename), "%s/%s", dir, path);
+
+    char **grown = realloc(listed, sizeof(char *) * 2 * (num_listed + 1));
+    if (!grown) {
+      failed = 1;
+      break;
+    }
+    listed = grown;
+    listed[2 * num_listed] = strdup(name);
+    listed[2 * num_listed + 1] = strdup(filename);
+    num_listed++;
+    failed = !listed[2 * num_listed - 2] || !listed[2 * num_listed - 1];
+  }
+  fclose(file);
+  free(manifest_copy);
+
+  // A partial list would detach the volumes missing from it
+  if (failed) {
+    fprintf(stderr, "Not enough memory to reload the manifest.\n");
+    for (size_t i = 0; i < 2 * num_listed; i++)
+      free(listed[i]);
+    free(listed);
+    return -1;
+  }
+  manifest_mtime = mtime;
+
+  // Detach volumes that were removed or now point to another file
+  pthread_mutex_lock(&volumes_lock);
+  for (mounted_volume_t *mv = volumes, *next; mv; mv = next) {
+    next = mv->next;
+    size_t i;
+    for (i = 0; i < num_listed; i++)
+      if (!strcmp(listed[2 * i], mv->name) && !strcmp(listed[2 * i + 1], mv->filename))
+        break;
+    if (i == num_listed) {
+      fprintf(stderr, "Detaching volume '%s'.\n", mv->name);
+      detach_volume(mv);
+    }
+  }
+  pthread_mutex_unlock(&volumes_lock);
+
+  // Attach volumes that are new; opening a volume file does not block requests
+  for (size_t i = 0; i < num_listed; i++) {
+    const char *inner;
+    char path_in_mount[NAME_MAX + 2];
+
+    snprintf(path_in_mount, sizeof(path_in_mount), "/%s", listed[2 * i]);
+    mounted_volume_t *mv = acquire_volume(path_in_mount, &inner);
+    if (mv)
+      release_volume(mv);
+    else if (attach_volume(listed[2 * i], listed[2 * i + 1]) < 0)
+      fprintf(stderr, "Invalid volume file for '%s': '%s'.\n", listed[2 * i], listed[2 * i + 1]);
+
+    free(listed[2 * i]);
+    free(listed[2 * i + 1]);
+  }
+  free(listed);
+  return 0;
+}
+
+/* watch_manifest: Body of the thread that reloads the manifest
+   whenever it is modified, so volumes can be attached and detached
+   without restarting the process.
+ */
+static void *watch_manifest(void *arg) {
+
+  struct stat st;
+
+  while (!manifest_stop) {
+    sleep(EXT2FS_MANIFEST_POLL_SECS);
+    if (stat(manifest, &st) == 0 && (st.st_mtim.tv_sec != manifest_mtime.tv_sec ||
+                                     st.st_mtim.tv_nsec != manifest_mtime.tv_nsec))
+      load_manifest();
+  }
+  return NULL;
+}
+
+/* save_profiles: Body of the thread that saves the access profiles of
+   all volumes periodically, so a crash loses little of them.
+ */
+static void *save_profiles(void *arg) {
+
+  pthread_mutex_lock(&profile_lock);
+  while (!profile_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += EXT2FS_PROFILE_SAVE_SECS;
+    if (pthread_cond_timedwait(&profile_cond, &profile_lock, &deadline) == 0) continue;
+
+    // Volumes are saved without holding volumes_lock, so requests are not held up
+    pthread_mutex_lock(&volumes_lock);
+    size_t count = 0;
+    for (mounted_volume_t *mv = volumes; mv; mv = mv->next) count++;
+    mounted_volume_t **saving = malloc(sizeof(mounted_volume_t *) * (count + 1));
+    count = 0;
+    for (mounted_volume_t *mv = volumes; mv && saving; mv = mv->next) {
+      mv->refs++;
+      saving[count++] = mv;
+    }
+    pthread_mutex_unlock(&volumes_lock);
+
+    for (size_t i = 0; i < count; i++) {
+      save_profile(saving[i]);
+      release_volume(saving[i]);
+    }
+    free(saving);
+  }
+  pthread_mutex_unlock(&profile_lock);
+  return NULL;
+}
+
+/* write_sched_stats: Writes the queue depths and waiting times of each
+   class of operations to the statistics file, replacing it
+   atomically.
+ */
+static void write_sched_stats(void) {
+
+  static const char *class_names[EXT2_SCHED_CLASSES] = { "meta", "bulk" };
+  size_t size = strlen(sched_stats_file) + sizeof(".tmp");
+  char *temp = malloc(size);
+  FILE *file;
+
+  if (!temp) return;
+  snprintf(temp, size, "%s.tmp", sched_stats_file);
+  if (!(file = fopen(temp, "w"))) {
+    free(temp);
+    return;
+  }
+
+  fprintf(file, "%-5s %12s %12s %8s %8s %10s %12s %10s %10s %12s\n", "class", "granted", "waited", "running",
+          "queued", "max_queued", "mean_wait_us", "p50_us", "p99_us", "max_wait_us");
+  for (int class = 0; class < EXT2_SCHED_CLASSES; class++) {
+    sched_stats_t stats;
+    sched_stats(scheduler, class, &stats);
+    fprintf(file, "%-5s %12" PRIu64 " %12" PRIu64 " %8" PRIu32 " %8" PRIu32 " %10" PRIu32 " %12.1f %10.1f %10.1f %12.1f\n",
+            class_names[class], stats.granted, stats.waited, stats.running, stats.queued, stats.max_queued,
+            stats.granted ? stats.wait_ns / 1e3 / stats.granted : 0.0, sched_wait_percentile(&stats, 0.5) / 1e3,
+            sched_wait_percentile(&stats, 0.99) / 1e3, stats.max_wait_ns / 1e3);
+  }
+
+  if (fclose(file) != 0 || rename(temp, sched_stats_file) != 0)
+    unlink(temp);
+  free(temp);
+}
+
+/* watch_scheduler: Body of the thread that writes the scheduler
+   statistics file periodically.
+ */
+static void *watch_scheduler(void *arg) {
+
+  pthread_mutex_lock(&sched_stats_lock);
+  while (!sched_stats_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += EXT2FS_SCHED_STATS_SECS;
+    pthread_cond_timedwait(&sched_stats_cond, &sched_stats_lock, &deadline);
+    write_sched_stats();
+  }
+  pthread_mutex_unlock(&sched_stats_lock);
+  return NULL;
+}
+
+/* request_shrink: Handler of SIGUSR1, which asks the governor thread
+   to shrink the caches. Only async-signal-safe calls are made here.
+ */
+static void request_shrink(int signum) {
+
+  governor_shrink_requested = 1;
+  sem_post(&governor_wakeup);
+}
+
+/* govern_memory: Body of the thread that rebalances the caches under
+   the memory limit periodically, and shrinks them on SIGUSR1.
+ */
+static void *govern_memory(void *arg) {
+
+  while (!governor_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += EXT2FS_MEMORY_REBALANCE_SECS;
+    while (sem_timedwait(&governor_wakeup, &deadline) < 0 && errno == EINTR);
+
+    if (governor_stop) break;
+    if (governor_shrink_requested) {
+      governor_shrink_requested = 0;
+      mem_governor_shrink(governor);
+    } else {
+      mem_governor_rebalance(governor);
+    }
+  }
+  return NULL;
+}
+
+/* flush_volumes: Body of the thread that writes the changes to
+   writable volumes periodically, so a crash loses little of them.
+   Each volume is flushed under its exclusive lock.
+ */
+static void *flush_volumes(void *arg) {
+
+  pthread_mutex_lock(&writeback_lock);
+  while (!writeback_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += EXT2FS_WRITEBACK_SECS;
+    if (pthread_cond_timedwait(&writeback_cond, &writeback_lock, &deadline) == 0) continue;
+
+    pthread_mutex_lock(&volumes_lock);
+    size_t count = 0;
+    for (mounted_volume_t *mv = volumes; mv; mv = mv->next) count++;
+    mounted_volume_t **flushing = malloc(sizeof(mounted_volume_t *) * (count + 1));
+    count = 0;
+    for (mounted_volume_t *mv = volumes; mv && flushing; mv = mv->next) {
+      mv->refs++;
+      flushing[count++] = mv;
+    }
+    pthread_mutex_unlock(&volumes_lock);
+
+    for (size_t i = 0; i < count; i++) {
+      lock_exclusive(flushing[i]);
+      if (writeback_flush(flushing[i]->volume, 0) < 0)
+        fprintf(stderr, "Cannot write changes to volume '%s': %s.\n", flushing[i]->name, strerror(errno));
+      unlock_volume(flushing[i]);
+      release_volume(flushing[i]);
+    }
+    free(flushing);
+  }
+  pthread_mutex_unlock(&writeback_lock);
+  return NULL;
+}
+
+/* realpath_for_output: Returns the absolute path of a file that may
+   not exist yet, since FUSE changes the working directory when it
+   daemonizes. The result must be freed by the caller.
+ */
+static char *realpath_for_output(const char *filename) {
+
+  char cwd[PATH_MAX];
+
+  if (filename[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+    return strdup(filename);
+
+  size_t size = strlen(cwd) + strlen(filename) + 2;
+  char *result = malloc(size);
+  if (result)
+    snprintf(result, size, "%s/%s", cwd, filename);
+  return result;
+}
+
 int main(int argc, char *argv[]) {
   
-  char  *volumefile = argv[--argc];
-  volume = open_volume_file(volumefile);
+  uint64_t cache_mb = EXT2FS_DEFAULT_CACHE_MB, memory_mb = 0;
+  unsigned long sched_slots = EXT2FS_SCHED_SLOTS, sched_chunk_kb = EXT2FS_SCHED_CHUNK_KB, sched_bulk = 0;
+  int fuse_argc = 0;
+
+  // Options handled here are removed; everything else is passed on to FUSE
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "--volumes") && i + 1 < argc) {
+      manifest = realpath(argv[++i], NULL);
+      if (!manifest) {
+        fprintf(stderr, "Invalid manifest file: '%s'.\n", argv[i]);
+        exit(1);
+      }
+    } else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+      cache_mb = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--memory-limit") && i + 1 < argc) {
+      memory_mb = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--direct")) {
+      open_flags |= EXT2_OPEN_DIRECT;
+    } else if (!strcmp(argv[i], "--hugepages")) {
+      open_flags |= EXT2_OPEN_DIRECT | EXT2_OPEN_HUGEPAGES;
+    } else if (!strcmp(argv[i], "--inode-table")) {
+      open_flags |= EXT2_OPEN_INODE_TABLE;
+    } else if (!strcmp(argv[i], "--verify")) {
+      open_flags |= EXT2_OPEN_VERIFY;
+    } else if (!strcmp(argv[i], "--write")) {
+      open_flags |= EXT2_OPEN_WRITE;
+    } else if (!strcmp(argv[i], "--sched-slots") && i + 1 < argc) {
+      sched_slots = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--sched-bulk") && i + 1 < argc) {
+      sched_bulk = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--sched-chunk") && i + 1 < argc) {
+      sched_chunk_kb = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--sched-stats") && i + 1 < argc) {
+      sched_stats_file = realpath_for_output(argv[++i]);
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      trace_file = realpath_for_output(argv[++i]);
+    } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+      profile_dir = realpath(argv[++i], NULL);
+      if (!profile_dir) {
+        fprintf(stderr, "Invalid profile directory: '%s'.\n", argv[i]);
+        exit(1);
+      }
+    } else {
+      argv[fuse_argc++] = argv[i];
+    }
+  }
+  argc = fuse_argc;
   argv[argc] = NULL;
-  
-  if (!volume) {
-    fprintf(stderr, "Invalid volume file: '%s'.\n", volumefile);
+
+  // Writes go through the page cache, and the checksums are not updated
+  if ((open_flags & EXT2_OPEN_WRITE) && (open_flags & (EXT2_OPEN_DIRECT | EXT2_OPEN_VERIFY))) {
+    fprintf(stderr, "--write cannot be combined with --direct, --hugepages or --verify.\n");
     exit(1);
   }
+
+  // Under a memory limit, the governor sizes the pool along with the other caches
+  if (memory_mb) {
+    governor = mem_governor_create(memory_mb << 20);
+    cache_mb = memory_mb;
+  }
+  cache_pool = cache_pool_create(cache_mb << 20);
+  mem_attach_pool(governor, cache_pool);
+
+  // By default bulk reads may hold half of the slots; the rest are kept for metadata
+  if (sched_slots)
+    scheduler = sched_create(sched_slots, sched_bulk ? sched_bulk : sched_slots / 2, sched_chunk_kb << 10);
+
+  if (manifest) {
+    if (load_manifest() < 0) {
+      fprintf(stderr, "Invalid manifest file: '%s'.\n", manifest);
+      exit(1);
+    }
+  } else {
+    char  *volumefile = argv[--argc];
+    argv[argc] = NULL;
+
+    if (attach_volume("", volumefile) < 0) {
+      fprintf(stderr, "Invalid volume file: '%s'.\n", volumefile);
+      exit(1);
+    }
+  }
   
-  fuse_main(argc, argv, &ext2_operations, volume);
+  fuse_main(argc, argv, &ext2_operations, NULL);
   
   return 0;
 }
@@ -56,6 +694,37 @@ int main(int argc, char *argv[]) {
 static void *ext2_init(struct fuse_conn_info *conn) {
   
   printf("init()\n");
+
+  if (manifest)
+    pthread_create(&manifest_thread, NULL, watch_manifest, NULL);
+
+  // Tracing starts here, so the flusher thread survives FUSE daemonizing
+  if (trace_file && trace_start(trace_file) < 0)
+    fprintf(stderr, "Cannot create trace file: '%s'.\n", trace_file);
+
+  // Likewise for warming threads, and the thread saving profiles
+  if (profile_dir) {
+    pthread_mutex_lock(&volumes_lock);
+    serving = 1;
+    for (mounted_volume_t *mv = volumes; mv; mv = mv->next)
+      start_warming(mv);
+    pthread_mutex_unlock(&volumes_lock);
+    pthread_create(&profile_thread, NULL, save_profiles, NULL);
+  }
+
+  if (scheduler && sched_stats_file)
+    pthread_create(&sched_stats_thread, NULL, watch_scheduler, NULL);
+
+  if (governor) {
+    struct sigaction action = { .sa_handler = request_shrink };
+    sigemptyset(&action.sa_mask);
+    sem_init(&governor_wakeup, 0, 0);
+    sigaction(SIGUSR1, &action, NULL);
+    pthread_create(&governor_thread, NULL, govern_memory, NULL);
+  }
+
+  if (open_flags & EXT2_OPEN_WRITE)
+    pthread_create(&writeback_thread, NULL, flush_volumes, NULL);
   
   return NULL;
 }
@@ -66,8 +735,108 @@ static void *ext2_init(struct fuse_conn_info *conn) {
 static void ext2_destroy(void *private_data) {
   
   printf("destroy()\n");
+
+  if (trace_file) {
+    uint64_t dropped = trace_stop();
+    if (dropped)
+      fprintf(stderr, "%" PRIu64 " trace records dropped.\n", dropped);
+  }
+
+  if (manifest) {
+    manifest_stop = 1;
+    pthread_join(manifest_thread, NULL);
+  }
+
+  if (profile_dir) {
+    pthread_mutex_lock(&profile_lock);
+    profile_stop = 1;
+    pthread_cond_signal(&profile_cond);
+    pthread_mutex_unlock(&profile_lock);
+    pthread_join(profile_thread, NULL);
+  }
+
+  if (scheduler && sched_stats_file) {
+    pthread_mutex_lock(&sched_stats_lock);
+    sched_stats_stop = 1;
+    pthread_cond_signal(&sched_stats_cond);
+    pthread_mutex_unlock(&sched_stats_lock);
+    pthread_join(sched_stats_thread, NULL);
+  }
+  sched_destroy(scheduler);
+
+  if (governor) {
+    signal(SIGUSR1, SIG_IGN);
+    governor_stop = 1;
+    sem_post(&governor_wakeup);
+    pthread_join(governor_thread, NULL);
+    sem_destroy(&governor_wakeup);
+  }
+
+  // The volumes write what is left of their changes as they are closed
+  if (open_flags & EXT2_OPEN_WRITE) {
+    pthread_mutex_lock(&writeback_lock);
+    writeback_stop = 1;
+    pthread_cond_signal(&writeback_cond);
+    pthread_mutex_unlock(&writeback_lock);
+    pthread_join(writeback_thread, NULL);
+  }
+
+  pthread_mutex_lock(&volumes_lock);
+  while (volumes)
+    detach_volume(volumes);
+  pthread_mutex_unlock(&volumes_lock);
+
+  mem_governor_destroy(governor);
+  cache_pool_destroy(cache_pool);
+}
+
+/* fill_stat: Converts the metadata of an inode into the format
+   expected by FUSE (see man 2 fstat).
+ */
+static void fill_stat(volume_t *volume, uint32_t inode_no, inode_t *inode, struct stat *stbuf) {
+
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = inode_no;
+  stbuf->st_mode = inode->i_mode;
+  stbuf->st_nlink = inode->i_links_count;
+  stbuf->st_uid = inode->i_uid;
+  stbuf->st_gid = inode->i_gid;
+  stbuf->st_size = inode_file_size(volume, inode);
+  stbuf->st_blksize = volume->block_size;
+  stbuf->st_blocks = inode->i_blocks;
+
+  stbuf->st_atime = inode->i_atime;
+  stbuf->st_mtime = inode->i_mtime;
+  stbuf->st_ctime = inode->i_ctime;
+}
+
+/* getattr_path: Implementation of ext2_getattr. */
+static int getattr_path(const char *path, struct stat *stbuf) {
   
-  close_volume_file(volume);
+  if (is_volume_list(path)) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = EXT2_ROOT_INO;
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  const char *inner;
+  mounted_volume_t *mv = acquire_volume(path, &inner);
+  if (!mv)
+    return -ENOENT;
+
+  inode_t inode;
+  sched_enter(scheduler, EXT2_SCHED_META, 0);
+  lock_shared(mv);
+  uint32_t inode_no = find_file_from_path(mv->volume, inner, &inode);
+  if (inode_no)
+    fill_stat(mv->volume, inode_no, &inode, stbuf);
+  unlock_volume(mv);
+  sched_exit(scheduler, EXT2_SCHED_META);
+
+  release_volume(mv);
+  return inode_no ? 0 : -ENOENT;
 }
 
 /* ext2_getattr: Function called when a process requests the metadata
@@ -85,36 +854,120 @@ static void ext2_destroy(void *private_data) {
      return -ENOENT.
  */
 static int ext2_getattr(const char *path, struct stat *stbuf) {
-  
-  /* TO BE COMPLETED BY THE STUDENT */
 
-  // man 2 fstat >> fstat.txt
-  inode_t *sourceInode = malloc(sizeof(inode_t));
-  uint32_t iNodeNumber = find_file_from_path(volume, path, sourceInode);
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = getattr_path(path, stbuf);
+  trace_span_end(&span, EXT2_TRACE_GETATTR, path, rv ? 0 : stbuf->st_ino, 0, 0, rv);
+  return rv;
+}
+
+/* list_directory: Lists the entries of a directory, starting at
+   position 'offset' of its data, for ext2_readdir.
+
+   Attributes are read EXT2_READDIR_BATCH entries at a time, sorted by
+   inode table block within each batch, so a large directory sweeps
+   the inode tables once per batch rather than once overall. FUSE
+   fills a buffer of a few KiB per call and calls again at the next
+   offset, so sorting all the remaining entries instead would re-read
+   the rest of the directory on every call.
+ */
+static int list_directory(volume_t *volume, inode_t *dir_inode, void *buf,
+                          fuse_fill_dir_t filler, off_t offset) {
+
+  dir_entry_t *entries = malloc(sizeof(dir_entry_t) * EXT2_READDIR_BATCH);
+  inode_t *inodes = malloc(sizeof(inode_t) * EXT2_READDIR_BATCH);
+  off_t next_offsets[EXT2_READDIR_BATCH];
+  uint32_t inode_nos[EXT2_READDIR_BATCH];
+  ssize_t count;
+  int rv = 0;
+
+  if (!entries || !inodes) {
+    free(entries); free(inodes);
+    return -ENOMEM;
+  }
+
+  /* Offsets handed to the filler are positions in the directory
+     data, so a listing interrupted at any point resumes right at the
+     next entry without rescanning the directory. */
+  while ((count = read_directory_entries(volume, dir_inode, &offset, entries,
+                                         next_offsets, EXT2_READDIR_BATCH)) > 0) {
 
-  if (iNodeNumber > 2) {
-      //stbuf->st_dev
-      stbuf->st_ino = iNodeNumber;
-      stbuf->st_mode = sourceInode->i_mode;
-      stbuf->st_nlink = sourceInode->i_links_count;
-      stbuf->st_uid = sourceInode->i_uid;
-      stbuf->st_gid = sourceInode->i_gid;
-      stbuf->st_size = sourceInode->i_size;
-      stbuf->st_blksize = volume->block_size;
-      stbuf->st_blocks = sourceInode->i_blocks;
+    for (ssize_t i = 0; i < count; i++)
+      inode_nos[i] = entries[i].de_inode_no;
+    if (read_inodes(volume, inode_nos, count, inodes) != count) {
+      rv = -EIO;
+      goto done;
+    }
 
-      stbuf->st_atime = sourceInode->i_atime;
-      stbuf->st_mtime = sourceInode->i_mtime;
-      stbuf->st_ctime = sourceInode->i_ctime;
-      free(sourceInode);
-      return 0;
+    for (ssize_t i = 0; i < count; i++) {
+      struct stat st;
+      fill_stat(volume, inode_nos[i], &inodes[i], &st);
+      if (filler(buf, entries[i].de_name, &st, next_offsets[i]))
+        goto done;
+    }
   }
+  if (count < 0)
+    rv = -EIO;
 
-  free(sourceInode);
-  return -ENOENT;
+ done:
+  free(entries);
+  free(inodes);
+  return rv;
 }
 
+/* list_volumes: Lists the attached volumes as the entries of the
+   top-level directory of a multi-volume mount. Offsets are indices
+   in the list of volumes.
+ */
+static int list_volumes(void *buf, fuse_fill_dir_t filler, off_t offset) {
+
+  off_t index = 0;
+
+  if (offset < 1 && filler(buf, ".", NULL, 1))
+    return 0;
+  if (offset < 2 && filler(buf, "..", NULL, 2))
+    return 0;
+
+  pthread_mutex_lock(&volumes_lock);
+  for (mounted_volume_t *mv = volumes; mv; mv = mv->next, index++)
+    if (index + 2 >= offset && filler(buf, mv->name, NULL, index + 3))
+      break;
+  pthread_mutex_unlock(&volumes_lock);
+  return 0;
+}
+
+/* readdir_path: Implementation of ext2_readdir. */
+static int readdir_path(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset) {
+  
+  if (is_volume_list(path))
+    return list_volumes(buf, filler, offset);
+
+  const char *inner;
+  mounted_volume_t *mv = acquire_volume(path, &inner);
+  if (!mv)
+    return -ENOENT;
+
+  volume_t *volume = mv->volume;
+  inode_t dir_inode;
+  int rv = 0;
 
+  sched_enter(scheduler, EXT2_SCHED_META, 0);
+  lock_shared(mv);
+  uint32_t dir_inode_no = find_file_from_path(volume, inner, &dir_inode);
+
+  if (!dir_inode_no)
+    rv = -ENOENT;
+  else if (!inode_is_directory(&dir_inode))
+    rv = -ENOTDIR;
+  else
+    rv = list_directory(volume, &dir_inode, buf, filler, offset);
+  unlock_volume(mv);
+  sched_exit(scheduler, EXT2_SCHED_META);
+
+  release_volume(mv);
+  return rv;
+}
 
 /* ext2_readdir: Function called when a process requests the listing
    of a directory.
@@ -143,20 +996,43 @@ static int ext2_getattr(const char *path, struct stat *stbuf) {
  */
 static int ext2_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi) {
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  inode_t *sourceInode = malloc(sizeof(inode_t));
-  uint32_t iNodeNumber = find_file_from_path(volume, path, sourceInode);
-//    int64_t next_directory_entry(volume_t *volume, inode_t *dir_inode,
-//                                 off_t *offset, dir_entry_t *dir_entry) {
-  dir_entry_t nextDirectory;
-  read_inode(volume, iNodeNumber, sourceInode);
 
-  next_directory_entry(volume, sourceInode, 0, &nextDirectory);
-  filler(buf, nextDirectory.de_name, NULL, 0);
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = readdir_path(path, buf, filler, offset);
+  trace_span_end(&span, EXT2_TRACE_READDIR, path, 0, offset, 0, rv);
+  return rv;
+}
+
+/* read_path: Implementation of ext2_read. */
+static int read_path(const char *path, char *buf, size_t size, off_t offset) {
+
+  const char *inner;
+  mounted_volume_t *mv = acquire_volume(path, &inner);
+  if (!mv)
+    return is_volume_list(path) ? -EISDIR : -ENOENT;
+
+  inode_t inode;
+  int rv;
+
+  // The lookup is metadata; the data is read in pieces, taking turns with other files
+  sched_enter(scheduler, EXT2_SCHED_META, 0);
+  lock_shared(mv);
+  uint32_t inode_no = find_file_from_path(mv->volume, inner, &inode);
+  unlock_volume(mv);
+  sched_exit(scheduler, EXT2_SCHED_META);
+
+  uint64_t flow = (uintptr_t) mv->volume * 0x9E3779B97F4A7C15ULL + inode_no;
+  if (!inode_no)
+    rv = -ENOENT;
+  else if (inode_is_directory(&inode))
+    rv = -EISDIR;
+  else if ((rv = sched_read_file_content(scheduler, flow, mv->volume, inode_no, &inode, offset, size, buf,
+                                         open_flags & EXT2_OPEN_WRITE ? &mv->lock : NULL)) < 0)
+    rv = -EIO;
 
-  free(sourceInode);
-  return -ENOENT;
+  release_volume(mv);
+  return rv;
 }
 
 /* ext2_read: Function called when a process reads data from a file in
@@ -185,20 +1061,37 @@ static int ext2_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int ext2_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi) {
 
-    inode_t *sourceInode = malloc(sizeof(inode_t));
-    uint32_t iNodeNumber = find_file_from_path(volume, path, sourceInode);
-    int value = -EIO;
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = read_path(path, buf, size, offset);
+  trace_span_end(&span, EXT2_TRACE_READ, path, 0, offset, size, rv);
+  return rv;
+}
 
-    if ((sourceInode->i_mode >> 12) == 4) value = -EISDIR;
-    if (iNodeNumber == 0) value = -ENOENT;
+/* readlink_path: Implementation of ext2_readlink. */
+static int readlink_path(const char *path, char *buf, size_t size) {
 
-    int readBytes = read_file_content(volume, sourceInode, offset, size, buf);
-    if (readBytes) return readBytes;
+  const char *inner;
+  mounted_volume_t *mv = acquire_volume(path, &inner);
+  if (!mv)
+    return is_volume_list(path) ? -EINVAL : -ENOENT;
 
-    free(sourceInode);
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  return value;
+  inode_t inode;
+  int rv = 0;
+
+  sched_enter(scheduler, EXT2_SCHED_META, 0);
+  lock_shared(mv);
+  if (!find_file_from_path(mv->volume, inner, &inode))
+    rv = -ENOENT;
+  else if (!inode_is_symlink(&inode))
+    rv = -EINVAL;
+  else if (read_symlink_target(mv->volume, &inode, buf, size) <= 0)
+    rv = -EIO;
+  unlock_volume(mv);
+  sched_exit(scheduler, EXT2_SCHED_META);
+
+  release_volume(mv);
+  return rv;
 }
 
 /* ext2_readlink: Function called when FUSE needs to obtain the target of
@@ -220,6 +1113,328 @@ static int ext2_read(const char *path, char *buf, size_t size, off_t offset,
  */
 static int ext2_readlink(const char *path, char *buf, size_t size) {
 
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = readlink_path(path, buf, size);
+  trace_span_end(&span, EXT2_TRACE_READLINK, path, 0, 0, size, rv);
+  return rv;
+}
+
+/* begin_change: Finds the volume a path to be changed refers to, and
+   takes its lock exclusively, until end_change is called.
+
+   Returns:
+     0 on success, -EROFS if the mount is not writable (or the path
+     names a volume of a multi-volume mount), or -ENOENT.
+ */
+static int begin_change(const char *path, mounted_volume_t **mv, const char **inner) {
+
+  if (!(open_flags & EXT2_OPEN_WRITE))
+    return -EROFS;
+  if (!(*mv = acquire_volume(path, inner))) {
+    // Volumes are only added and removed through the manifest
+    const char *name = path + strspn(path, "/");
+    return name[strcspn(name, "/")] ? -ENOENT : -EROFS;
+  }
+  lock_exclusive(*mv);
+  return 0;
+}
+
+static void end_change(mounted_volume_t *mv) {
+
+  unlock_volume(mv);
+  release_volume(mv);
+}
+
+/* open_path: Implementation of ext2_open. */
+static int open_path(const char *path, struct fuse_file_info *fi) {
+
+  const char *inner;
+  mounted_volume_t *mv = acquire_volume(path, &inner);
+  if (!mv)
+    return is_volume_list(path) ? -EISDIR : -ENOENT;
+
+  inode_t inode;
+  int rv = 0, writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+
+  lock_shared(mv);
+  uint32_t inode_no = find_file_from_path(mv->volume, inner, &inode);
+  unlock_volume(mv);
 
-  return -ENOENT;
+  if (!inode_no)
+    rv = -ENOENT;
+  else if (writing && !(open_flags & EXT2_OPEN_WRITE))
+    rv = -EROFS;
+  else if (writing && inode_is_directory(&inode))
+    rv = -EISDIR;
+  else
+    fi->fh = inode_no;
+
+  release_volume(mv);
+  return rv;
+}
+
+/* ext2_open: Function called when a process opens a file. Opening
+   for writing fails with -EROFS unless the mount is writable
+   (--write). The inode number of the file is kept in fi->fh for the
+   writes that follow.
+ */
+static int ext2_open(const char *path, struct fuse_file_info *fi) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = open_path(path, fi);
+  trace_span_end(&span, EXT2_TRACE_OPEN, path, rv ? 0 : fi->fh, 0, 0, rv);
+  return rv;
+}
+
+/* create_path: Implementation of ext2_create. */
+static int create_path(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+  mounted_volume_t *mv;
+  const char *inner;
+  int rv = begin_change(path, &mv, &inner);
+  if (rv)
+    return rv;
+
+  struct fuse_context *context = fuse_get_context();
+  uint32_t inode_no = create_file(mv->volume, inner, mode, context->uid, context->gid);
+  if (inode_no)
+    fi->fh = inode_no;
+  else
+    rv = -errno;
+
+  end_change(mv);
+  return rv;
+}
+
+/* ext2_create: Function called when a process creates a regular file
+   and opens it. The file is owned by the calling process.
+ */
+static int ext2_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = create_path(path, mode, fi);
+  trace_span_end(&span, EXT2_TRACE_CREATE, path, rv ? 0 : fi->fh, 0, 0, rv);
+  return rv;
+}
+
+/* write_path: Implementation of ext2_write. */
+static int write_path(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+  mounted_volume_t *mv;
+  const char *inner;
+  int rv = begin_change(path, &mv, &inner);
+  if (rv)
+    return rv;
+
+  uint32_t inode_no = fi && fi->fh ? fi->fh : find_file_from_path(mv->volume, inner, NULL);
+  ssize_t written;
+  if (!inode_no)
+    rv = -ENOENT;
+  else if ((written = write_file_content(mv->volume, inode_no, offset, size, buf)) < 0)
+    rv = -errno;
+  else
+    rv = written;
+
+  end_change(mv);
+  return rv;
+}
+
+/* ext2_write: Function called when a process writes data to a file.
+   Writes are held in the write-back cache of the volume, and written
+   to the volume file in batches; mounting with -o big_writes lets
+   FUSE pass writes larger than 4 KiB, which are much cheaper.
+
+   Returns:
+     The number of bytes written, or a negative error code (-ENOSPC,
+     -EFBIG, -EIO, ...).
+ */
+static int ext2_write(const char *path, const char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = write_path(path, buf, size, offset, fi);
+  trace_span_end(&span, EXT2_TRACE_WRITE, path, fi ? fi->fh : 0, offset, size, rv);
+  return rv;
+}
+
+/* truncate_path: Implementation of ext2_truncate. */
+static int truncate_path(const char *path, off_t size) {
+
+  mounted_volume_t *mv;
+  const char *inner;
+  int rv = begin_change(path, &mv, &inner);
+  if (rv)
+    return rv;
+
+  uint32_t inode_no = find_file_from_path(mv->volume, inner, NULL);
+  if (!inode_no)
+    rv = -ENOENT;
+  else if (truncate_file(mv->volume, inode_no, size) < 0)
+    rv = -errno;
+
+  end_change(mv);
+  return rv;
+}
+
+/* ext2_truncate: Function called when a process changes the size of a
+   file.
+ */
+static int ext2_truncate(const char *path, off_t size) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = truncate_path(path, size);
+  trace_span_end(&span, EXT2_TRACE_TRUNCATE, path, 0, size, 0, rv);
+  return rv;
+}
+
+/* mkdir_path: Implementation of ext2_mkdir. */
+static int mkdir_path(const char *path, mode_t mode) {
+
+  mounted_volume_t *mv;
+  const char *inner;
+  int rv = begin_change(path, &mv, &inner);
+  if (rv)
+    return rv;
+
+  struct fuse_context *context = fuse_get_context();
+  if (!make_directory(mv->volume, inner, mode, context->uid, context->gid))
+    rv = -errno;
+
+  end_change(mv);
+  return rv;
+}
+
+/* ext2_mkdir: Function called when a process creates a directory. The
+   directory is owned by the calling process.
+ */
+static int ext2_mkdir(const char *path, mode_t mode) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = mkdir_path(path, mode);
+  trace_span_end(&span, EXT2_TRACE_MKDIR, path, 0, 0, 0, rv);
+  return rv;
+}
+
+/* remove_path: Implementation of ext2_unlink and ext2_rmdir. */
+static int remove_path(const char *path, int directory) {
+
+  mounted_volume_t *mv;
+  const char *inner;
+  int rv = begin_change(path, &mv, &inner);
+  if (rv)
+    return rv;
+
+  if ((directory ? remove_directory(mv->volume, inner) : unlink_file(mv->volume, inner)) < 0)
+    rv = -errno;
+
+  end_change(mv);
+  return rv;
+}
+
+/* ext2_unlink: Function called when a process removes a file. FUSE
+   renames files removed while open instead, and removes them once
+   closed, so the inode of an open file is never freed.
+ */
+static int ext2_unlink(const char *path) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = remove_path(path, 0);
+  trace_span_end(&span, EXT2_TRACE_UNLINK, path, 0, 0, 0, rv);
+  return rv;
+}
+
+/* ext2_rmdir: Function called when a process removes an empty
+   directory.
+ */
+static int ext2_rmdir(const char *path) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = remove_path(path, 1);
+  trace_span_end(&span, EXT2_TRACE_RMDIR, path, 0, 0, 0, rv);
+  return rv;
+}
+
+/* rename_path: Implementation of ext2_rename. */
+static int rename_path(const char *from, const char *to) {
+
+  mounted_volume_t *mv;
+  const char *inner_from, *inner_to;
+  int rv = begin_change(from, &mv, &inner_from);
+  if (rv)
+    return rv;
+
+  // Files cannot move between the volumes of a multi-volume mount
+  mounted_volume_t *target = acquire_volume(to, &inner_to);
+  if (target != mv)
+    rv = target || !manifest ? -EXDEV : -EROFS;
+  else if (rename_file(mv->volume, inner_from, inner_to) < 0)
+    rv = -errno;
+
+  if (target)
+    release_volume(target);
+  end_change(mv);
+  return rv;
+}
+
+/* ext2_rename: Function called when a process renames or moves a file
+   or directory, replacing what the new path named, if anything.
+ */
+static int ext2_rename(const char *from, const char *to) {
+
+  trace_span_t span;
+  trace_span_begin(&span);
+  int rv = rename_path(from, to);
+  trace_span_end(&span, EXT2_TRACE_RENAME, from, 0, 0, 0, rv);
+  return rv;
+}
+
+/* fsync_path: Implementation of ext2_fsync. */
+static int fsync_path(const char *path) {
+
+  mounted_volume_t *mv;
+  const char *inner;
+  int rv = begin_change(path, &mv, &inner);
+  if (rv)
+    return rv == -EROFS ? 0 : rv;
+
+  if (writeback_flush(mv->volume, 1) < 0)
+    rv = -EIO;
+
+  end_change(mv);
+  return rv;
+}
+
+/* ext2_fsync: Function called when a process forces the changes to a
+   file to disk. All changes to the volume are written, and forced to
+   disk in order (see ext2writeback.c). Nothing is done on read-only
+   mounts.
+ */
+static int ext2_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+
+  return fsync_path(path);
+}
+
+/* ext2_release: Function called when the last descriptor of an open
+   file is closed. The blocks reserved ahead for the file, if it was
+   opened for writing, are given back (see ext2alloc.c); closing a
+   file opened only to read it does not take the volume's lock.
+ */
+static int ext2_release(const char *path, struct fuse_file_info *fi) {
+
+  mounted_volume_t *mv;
+  const char *inner;
+
+  if (!fi->fh || (fi->flags & O_ACCMODE) == O_RDONLY || begin_change(path, &mv, &inner))
+    return 0;
+  alloc_release(mv->volume, fi->fh);
+  end_change(mv);
+  return 0;
 }
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2fsck: Checks the consistency of an ext2 volume file without
+   modifying it, using one thread per processor by default. Each
+   problem found is printed on its own line, followed by a summary.
+
+   Exit status: 0 if the volume is consistent, 1 if problems were
+   found, 2 if the volume could not be checked.
+ */
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-t threads] [-q] volume_file\n"
+          "  -t threads number of threads checking block groups (default: one per processor)\n"
+          "  -q         print only the summary, not each problem\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int quiet = 0, opt;
+
+  while ((opt = getopt(argc, argv, "t:q")) != -1) {
+    switch (opt) {
+    case 't': num_threads = atol(optarg); break;
+    case 'q': quiet = 1; break;
+    default: usage(argv[0]); return 2;
+    }
+  }
+  if (argc - optind != 1 || num_threads < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  volume_t *volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 2;
+  }
+
+  struct timespec start, end;
+  check_stats_t stats;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int rv = check_volume(volume, num_threads, quiet ? NULL : stdout, &stats);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (rv < 0)
+    fprintf(stderr, "Check could not be completed: volume cannot be read or memory is exhausted.\n");
+
+  printf("%s: %" PRIu64 " problem(s); %" PRIu64 " inodes, %" PRIu64 " directories, %" PRIu64
+         " blocks in %u groups checked in %.3f s with %ld thread(s)\n", argv[optind], stats.problems,
+         stats.inodes, stats.directories, stats.blocks, volume->num_groups,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, num_threads);
+
+  close_volume_file(volume);
+  return rv < 0 ? 2 : rv;
+}
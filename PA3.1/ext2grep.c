@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <regex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ext2.h"
+
+/* ext2grep: Searches the content of the files of a volume file without
+   mounting it, printing each matching line as path:offset:line, where
+   offset is the byte offset of the line in the file.
+
+   The tree is walked first, and files are then searched in the order
+   of their first data block, by several threads, so the volume is read
+   roughly front to back. Each file is read one run of contiguous
+   blocks at a time; holes are never read, and end the current line.
+   Files with a NUL byte in their first run are binary and skipped,
+   unless -a is given. Fixed strings are found with memmem, and the
+   start and end of matching lines with memrchr and memchr, which the C
+   library implements with vector instructions; other patterns use
+   POSIX regular expressions, run over a whole buffer at a time rather
+   than line by line.
+ */
+
+// Maximum number of bytes read at once
+#define GREP_CHUNK (1024 * 1024)
+
+// Lines longer than this are split
+#define GREP_MAX_LINE (64 * 1024)
+
+typedef struct grep_file {
+  char *path;
+  uint32_t inode_no;
+  uint32_t first_block; // First data block, for ordering reads
+  inode_t inode;
+} grep_file_t;
+
+typedef struct file_run {
+  uint64_t logical;
+  uint32_t physical;
+  uint32_t blocks;
+} file_run_t;
+
+// State of the search of one file
+typedef struct search {
+  grep_file_t *file;
+  FILE *out;
+  uint64_t matches;
+  file_run_t *runs;
+  size_t num_runs, capacity;
+  uint64_t num_blocks;
+} search_t;
+
+static volume_t *volume;
+static const char *pattern;
+static size_t pattern_len;
+static regex_t regex;
+static int use_regex, search_binary, count_only, files_only;
+
+static grep_file_t *files;
+static size_t num_files, files_capacity;
+static _Atomic size_t next_file;
+static _Atomic uint64_t total_matches;
+static _Atomic int read_failed;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int collect_file(void *ctx, const char *path, uint32_t inode_no, inode_t *inode) {
+
+  if (!inode_is_regular_file(inode) || !inode_file_size(volume, inode))
+    return 0;
+
+  if (num_files == files_capacity) {
+    files_capacity = files_capacity ? files_capacity * 2 : 1024;
+    files = realloc(files, files_capacity * sizeof(grep_file_t));
+    if (!files) return -1;
+  }
+
+  grep_file_t *file = &files[num_files++];
+  file->path = strdup(path);
+  file->inode_no = inode_no;
+  file->inode = *inode;
+  file->first_block = inode->i_block[0];
+  return file->path ? 0 : -1;
+}
+
+static int compare_first_block(const void *a, const void *b) {
+
+  const grep_file_t *x = a, *y = b;
+  return x->first_block < y->first_block ? -1 : x->first_block > y->first_block;
+}
+
+static int visit_run_block(void *ctx, uint64_t block_idx, uint32_t block_no, int level) {
+
+  search_t *search = ctx;
+  uint32_t max_blocks = GREP_CHUNK / volume->block_size;
+
+  if (level > 0 || block_idx >= search->num_blocks) return 0;
+
+  if (search->num_runs) {
+    file_run_t *last = &search->runs[search->num_runs - 1];
+    if (last->physical + last->blocks == block_no && last->logical + last->blocks == block_idx &&
+        last->blocks < max_blocks) {
+      last->blocks++;
+      return 0;
+    }
+  }
+
+  if (search->num_runs == search->capacity) {
+    size_t capacity = search->capacity ? search->capacity * 2 : 16;
+    file_run_t *runs = realloc(search->runs, capacity * sizeof(file_run_t));
+    if (!runs) return -1;
+    search->runs = runs;
+    search->capacity = capacity;
+  }
+  search->runs[search->num_runs++] = (file_run_t) { block_idx, block_no, 1 };
+  return 0;
+}
+
+static void report_line(search_t *search, const char *line, size_t len, uint64_t offset) {
+
+  search->matches++;
+  if (count_only || files_only) return;
+  fprintf(search->out, "%s:%" PRIu64 ":", search->file->path, offset);
+  fwrite(line, 1, len, search->out);
+  fputc('\n', search->out);
+}
+
+/* Searches complete lines. 'text' holds 'len' bytes starting at byte
+   'offset' of the file; the last line may lack its newline. */
+static void search_lines(search_t *search, const char *text, size_t len, uint64_t offset) {
+
+  size_t pos = 0;
+
+  while (pos < len) {
+    size_t match;
+
+    if (use_regex) {
+      regmatch_t m = { .rm_so = pos, .rm_eo = len };
+      if (regexec(&regex, text, 1, &m, REG_STARTEND) != 0) break;
+      match = m.rm_so;
+    } else {
+      const char *found = memmem(text + pos, len - pos, pattern, pattern_len);
+      if (!found) break;
+      match = found - text;
+    }
+
+    const char *start = match > pos ? memrchr(text + pos, '\n', match - pos) : NULL;
+    size_t line_start = start ? (size_t) (start - text) + 1 : pos;
+    const char *end = memchr(text + match, '\n', len - match);
+    size_t line_end = end ? (size_t) (end - text) : len;
+
+    report_line(search, text + line_start, line_end - line_start, offset + line_start);
+    if (files_only) return;
+    pos = line_end + 1;
+  }
+}
+
+static void search_file(grep_file_t *file, char *buffer) {
+
+  search_t search = { file };
+  uint64_t size = inode_file_size(volume, &file->inode);
+  char *output = NULL;
+  size_t output_size = 0;
+
+  search.num_blocks = (size + volume->block_size - 1) / volume->block_size;
+  search.out = open_memstream(&output, &output_size);
+  if (!search.out || walk_inode_blocks(volume, &file->inode, visit_run_block, &search) < 0) {
+    atomic_store(&read_failed, 1);
+    goto done;
+  }
+
+  // 'buffer' holds the unfinished line ('carry' bytes, starting at file offset 'carry_offset')
+  size_t carry = 0;
+  uint64_t carry_offset = 0;
+
+  for (size_t i = 0; i < search.num_runs && !(files_only && search.matches); i++) {
+    file_run_t *run = &search.runs[i];
+    uint64_t offset = run->logical * volume->block_size;
+    uint32_t bytes = run->blocks * volume->block_size;
+    if (bytes > size - offset) bytes = size - offset;
+
+    // A hole ends the current line
+    if (carry && carry_offset + carry != offset) {
+      search_lines(&search, buffer, carry, carry_offset);
+      carry = 0;
+    }
+    if (!carry) carry_offset = offset;
+
+    if (read_block(volume, run->physical, 0, bytes, buffer + carry) != bytes) {
+      atomic_store(&read_failed, 1);
+      break;
+    }
+    if (i == 0 && !search_binary && memchr(buffer, '\0', bytes))
+      break;
+
+    size_t len = carry + bytes;
+    const char *last = memrchr(buffer, '\n', len);
+    size_t complete = last ? (size_t) (last - buffer) + 1 : 0;
+    if (len - complete > GREP_MAX_LINE) complete = len;
+
+    search_lines(&search, buffer, complete, carry_offset);
+    memmove(buffer, buffer + complete, len - complete);
+    carry = len - complete;
+    carry_offset += complete;
+  }
+  if (carry && !(files_only && search.matches))
+    search_lines(&search, buffer, carry, carry_offset);
+
+  if (search.matches) {
+    if (files_only) fprintf(search.out, "%s\n", file->path);
+    else if (count_only) fprintf(search.out, "%s:%" PRIu64 "\n", file->path, search.matches);
+  }
+
+done:
+  if (search.out) fclose(search.out);
+  if (output_size) {
+    pthread_mutex_lock(&output_lock);
+    fwrite(output, 1, output_size, stdout);
+    pthread_mutex_unlock(&output_lock);
+  }
+  free(output);
+  free(search.runs);
+  atomic_fetch_add(&total_matches, search.matches);
+}
+
+static void *grep_worker(void *arg) {
+
+  char *buffer = malloc(GREP_CHUNK + GREP_MAX_LINE);
+  size_t index;
+
+  if (!buffer) {
+    atomic_store(&read_failed, 1);
+    return NULL;
+  }
+  while ((index = atomic_fetch_add(&next_file, 1)) < num_files)
+    search_file(&files[index], buffer);
+
+  free(buffer);
+  return NULL;
+}
+
+/* Builds a basic regular expression matching 'text' literally. */
+static char *escape_literal(const char *text) {
+
+  char *escaped = malloc(2 * strlen(text) + 1), *p = escaped;
+  if (!escaped) return NULL;
+  for (; *text; text++) {
+    if (strchr(".[]\\*^$", *text)) *p++ = '\\';
+    *p++ = *text;
+  }
+  *p = '\0';
+  return escaped;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-F | -E] [-i] [-a] [-c | -l] [-t threads] pattern volume_file [path...]\n"
+          "  -F         pattern is a fixed string (default: basic regular expression)\n"
+          "  -E         pattern is an extended regular expression\n"
+          "  -i         ignore case\n"
+          "  -a         search binary files too\n"
+          "  -c         print the number of matching lines of each file\n"
+          "  -l         print only the paths of matching files\n"
+          "  -t threads number of threads searching files (default: one per processor)\n"
+          "  path       files or directories to search (default: /)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int fixed = 0, extended = 0, icase = 0, opt;
+
+  while ((opt = getopt(argc, argv, "FEiaclt:")) != -1) {
+    switch (opt) {
+    case 'F': fixed = 1; break;
+    case 'E': extended = 1; break;
+    case 'i': icase = 1; break;
+    case 'a': search_binary = 1; break;
+    case 'c': count_only = 1; break;
+    case 'l': files_only = 1; break;
+    case 't': num_threads = atol(optarg); break;
+    default: usage(argv[0]); return 2;
+    }
+  }
+  if (argc - optind < 2 || num_threads < 1 || (fixed && extended)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  pattern = argv[optind];
+  pattern_len = strlen(pattern);
+
+  // Only case-sensitive fixed strings avoid the regular expression engine
+  use_regex = !fixed || icase;
+  if (use_regex) {
+    char *source = fixed ? escape_literal(pattern) : strdup(pattern);
+    int rv = source ? regcomp(&regex, source, REG_NEWLINE | (extended ? REG_EXTENDED : 0) |
+                                               (icase ? REG_ICASE : 0)) : REG_ESPACE;
+    free(source);
+    if (rv) {
+      char message[256];
+      regerror(rv, &regex, message, sizeof(message));
+      fprintf(stderr, "Invalid pattern: %s.\n", message);
+      return 2;
+    }
+  }
+
+  volume = open_volume_file(argv[optind + 1]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind + 1]);
+    return 2;
+  }
+
+  int status = 0;
+  for (int i = optind + 2; i <= argc; i++) {
+    const char *root = i < argc ? argv[i] : "/";
+    if (i == argc && argc > optind + 2) break;
+    if (walk_directory_tree(volume, root, collect_file, NULL) != 0) {
+      fprintf(stderr, "Cannot search %s.\n", root);
+      status = 2;
+    }
+  }
+
+  qsort(files, num_files, sizeof(grep_file_t), compare_first_block);
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  long started = 0;
+  if (threads)
+    for (; started + 1 < num_threads; started++)
+      if (pthread_create(&threads[started], NULL, grep_worker, NULL) != 0)
+        break;
+  grep_worker(NULL);
+  for (long i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (atomic_load(&read_failed)) {
+    fprintf(stderr, "Some files could not be read.\n");
+    status = 2;
+  }
+
+  for (size_t i = 0; i < num_files; i++)
+    free(files[i].path);
+  free(files);
+  if (use_regex) regfree(&regex);
+  close_volume_file(volume);
+
+  // Like grep: 0 if a line matched, 1 if none did, 2 on errors
+  return status ? status : atomic_load(&total_matches) ? 0 : 1;
+}
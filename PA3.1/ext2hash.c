@@ -0,0 +1,424 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Content hashing reads file data in physical block order rather than
+   file by file, so the volume is scanned front to back with large
+   reads no matter how the files are laid out. Every block is hashed
+   on its own, and the hash of a file is the hash of its size and the
+   sequence of its block hashes, in file order. Block hashes can thus
+   be computed in any order, by any thread. Holes are never read: they
+   get the precomputed hash of a block of zeros, so a sparse file
+   hashes the same as the same file written out in full.
+
+   The scan runs in two parallel passes. The first walks the inode
+   tables group by group and collects every run of physically and
+   logically contiguous data blocks. The runs are then sorted by block
+   number, and in the second pass the threads take them in that order,
+   read each one with a single read_block call and hash its blocks.
+ */
+
+// Maximum number of blocks read at once
+#define EXT2_HASH_RUN_BLOCKS 256
+
+// Number of inodes read at once from an inode table
+#define EXT2_HASH_INODE_BATCH 256
+
+// Seeds of block hashes and of file hashes
+#define EXT2_HASH_BLOCK_SEED 0
+#define EXT2_HASH_FILE_SEED  0x65787432 // "ext2"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct data_run {
+    uint32_t physical;
+    uint32_t blocks;
+    uint64_t logical;
+    size_t file;     // Index of the file in the result
+} data_run_t;
+
+typedef struct hasher {
+    volume_t *volume;
+    hash_result_t *result;
+    pthread_mutex_t lock;
+    unsigned int num_threads;
+    int pass;
+
+    size_t files_capacity;
+    data_run_t *runs;
+    size_t num_runs, runs_capacity;
+
+    _Atomic size_t next;          // Next group (first pass) or run (second pass)
+    _Atomic uint64_t bytes_read;
+    _Atomic int failed;
+    uint64_t zero_hash;           // Hash of a full block of zeros
+} hasher_t;
+
+// State of the walk of one file's blocks
+typedef struct hash_walk {
+    uint64_t num_blocks; // Number of blocks holding file data
+    data_run_t *runs;    // Runs of the file, added to the hasher once the walk is done
+    size_t num_runs, capacity;
+} hash_walk_t;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+
+    acc += input * PRIME64_2;
+    return rotl64(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* ext2_hash64: Computes the 64-bit hash of a buffer. The hash is
+   XXH64: the bulk of the data is consumed 32 bytes at a time by four
+   independent lanes, which the processor runs in parallel and the
+   compiler can vectorize.
+
+   Parameters:
+     data: Data to be hashed.
+     len: Number of bytes in 'data'.
+     seed: Seed of the hash.
+
+   Returns:
+     The hash of the data.
+ */
+uint64_t ext2_hash64(const void *data, size_t len, uint64_t seed) {
+
+    const uint8_t *p = data, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2, v2 = seed + PRIME64_2, v3 = seed, v4 = seed - PRIME64_1;
+        const uint8_t *limit = end - 32;
+
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge64(h, v1);
+        h = merge64(h, v2);
+        h = merge64(h, v3);
+        h = merge64(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+        h = rotl64(h ^ round64(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+    if (p + 4 <= end) {
+        h = rotl64(h ^ (read32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static int visit_hash_block(void *ctx, uint64_t block_idx, uint32_t block_no, int level) {
+
+    hash_walk_t *walk = ctx;
+
+    // Blocks past the end of the file hold no data
+    if (level > 0 || block_idx >= walk->num_blocks) return 0;
+
+    if (walk->num_runs) {
+        data_run_t *last = &walk->runs[walk->num_runs - 1];
+        if (last->physical + last->blocks == block_no && last->logical + last->blocks == block_idx &&
+            last->blocks < EXT2_HASH_RUN_BLOCKS) {
+            last->blocks++;
+            return 0;
+        }
+    }
+
+    if (walk->num_runs == walk->capacity) {
+        size_t capacity = walk->capacity ? walk->capacity * 2 : 16;
+        data_run_t *runs = realloc(walk->runs, capacity * sizeof(data_run_t));
+        if (!runs) return -1;
+        walk->runs = runs;
+        walk->capacity = capacity;
+    }
+    walk->runs[walk->num_runs++] = (data_run_t) { block_no, 1, block_idx, 0 };
+    return 0;
+}
+
+/* Adds a regular file to the result and collects its data runs. */
+static void collect_file(hasher_t *hasher, uint32_t inode_no, inode_t *inode) {
+
+    volume_t *volume = hasher->volume;
+    hash_result_t *result = hasher->result;
+    uint64_t size = inode_file_size(volume, inode);
+    hash_walk_t walk = { (size + volume->block_size - 1) / volume->block_size };
+    uint64_t *block_hashes = malloc(sizeof(uint64_t) * (walk.num_blocks ? walk.num_blocks : 1));
+
+    if (!block_hashes || walk_inode_blocks(volume, inode, visit_hash_block, &walk) < 0)
+        goto fail;
+
+    // Every block starts as a hole; the last one may be shorter than a block
+    for (uint64_t i = 0; i < walk.num_blocks; i++)
+        block_hashes[i] = hasher->zero_hash;
+    if (size % volume->block_size) {
+        char *zeros = calloc(1, volume->block_size);
+        if (!zeros) goto fail;
+        block_hashes[walk.num_blocks - 1] = ext2_hash64(zeros, size % volume->block_size, EXT2_HASH_BLOCK_SEED);
+        free(zeros);
+    }
+
+    pthread_mutex_lock(&hasher->lock);
+
+    if (result->num_files == hasher->files_capacity) {
+        size_t capacity = hasher->files_capacity ? hasher->files_capacity * 2 : 1024;
+        file_hash_t *files = realloc(result->files, capacity * sizeof(file_hash_t));
+        if (!files) goto fail_locked;
+        result->files = files;
+        hasher->files_capacity = capacity;
+    }
+    if (hasher->num_runs + walk.num_runs > hasher->runs_capacity) {
+        size_t capacity = hasher->runs_capacity ? hasher->runs_capacity : 1024;
+        while (capacity < hasher->num_runs + walk.num_runs) capacity *= 2;
+        data_run_t *runs = realloc(hasher->runs, capacity * sizeof(data_run_t));
+        if (!runs) goto fail_locked;
+        hasher->runs = runs;
+        hasher->runs_capacity = capacity;
+    }
+
+    size_t index = result->num_files++;
+    result->files[index] = (file_hash_t) { inode_no, size, 0, walk.num_blocks, block_hashes };
+    for (size_t i = 0; i < walk.num_runs; i++) {
+        walk.runs[i].file = index;
+        hasher->runs[hasher->num_runs++] = walk.runs[i];
+    }
+
+    pthread_mutex_unlock(&hasher->lock);
+    free(walk.runs);
+    return;
+
+fail_locked:
+    pthread_mutex_unlock(&hasher->lock);
+fail:
+    free(block_hashes);
+    free(walk.runs);
+    atomic_store(&hasher->failed, 1);
+}
+
+static void collect_group(hasher_t *hasher, uint32_t group, uint8_t *bitmap, uint32_t *inode_nos, inode_t *inodes) {
+
+    volume_t *volume = hasher->volume;
+    uint32_t ipg = volume->super.s_inodes_per_group;
+    const group_desc_t *desc = get_group_desc(volume, group);
+    size_t count = 0;
+
+    if (!desc || read_block(volume, desc->bg_inode_bitmap, 0, volume->block_size, bitmap) != volume->block_size) {
+        atomic_store(&hasher->failed, 1);
+        return;
+    }
+
+    for (uint32_t i = 0; i <= ipg; i++) {
+        uint32_t inode_no = group * ipg + i + 1;
+        int last = i == ipg || inode_no > volume->super.s_inodes_count;
+
+        if (!last && (bitmap[i >> 3] >> (i & 7)) & 1 && inode_no >= volume->super.s_first_ino)
+            inode_nos[count++] = inode_no;
+
+        if (count < EXT2_HASH_INODE_BATCH && !last) continue;
+
+        if (count && read_inodes(volume, inode_nos, count, inodes) != (ssize_t) count) {
+            atomic_store(&hasher->failed, 1);
+            return;
+        }
+        for (size_t j = 0; j < count; j++)
+            if (inode_is_regular_file(&inodes[j]))
+                collect_file(hasher, inode_nos[j], &inodes[j]);
+        count = 0;
+        if (last) break;
+    }
+}
+
+/* Reads one run of blocks and stores the hash of each block. */
+static void hash_run(hasher_t *hasher, data_run_t *run, char *buffer) {
+
+    volume_t *volume = hasher->volume;
+    file_hash_t *file = &hasher->result->files[run->file];
+    uint32_t size = run->blocks * volume->block_size;
+
+    if (read_block(volume, run->physical, 0, size, buffer) != size) {
+        atomic_store(&hasher->failed, 1);
+        return;
+    }
+    atomic_fetch_add_explicit(&hasher->bytes_read, size, memory_order_relaxed);
+
+    for (uint32_t i = 0; i < run->blocks; i++) {
+        uint64_t idx = run->logical + i;
+        uint64_t len = file->size - idx * volume->block_size;
+        if (len > volume->block_size) len = volume->block_size;
+        file->block_hashes[idx] = ext2_hash64(buffer + (size_t) i * volume->block_size, len, EXT2_HASH_BLOCK_SEED);
+    }
+}
+
+static void *hash_worker(void *arg) {
+
+    hasher_t *hasher = arg;
+    volume_t *volume = hasher->volume;
+    size_t next;
+
+    if (hasher->pass == 0) {
+        uint8_t *bitmap = malloc(volume->block_size);
+        uint32_t *inode_nos = malloc(sizeof(uint32_t) * EXT2_HASH_INODE_BATCH);
+        inode_t *inodes = malloc(sizeof(inode_t) * EXT2_HASH_INODE_BATCH);
+
+        if (!bitmap || !inode_nos || !inodes)
+            atomic_store(&hasher->failed, 1);
+        else
+            while ((next = atomic_fetch_add(&hasher->next, 1)) < volume->num_groups)
+                collect_group(hasher, next, bitmap, inode_nos, inodes);
+
+        free(bitmap);
+        free(inode_nos);
+        free(inodes);
+    } else {
+        char *buffer = malloc((size_t) EXT2_HASH_RUN_BLOCKS * volume->block_size);
+
+        if (!buffer)
+            atomic_store(&hasher->failed, 1);
+        else
+            while ((next = atomic_fetch_add(&hasher->next, 1)) < hasher->num_runs)
+                hash_run(hasher, &hasher->runs[next], buffer);
+
+        free(buffer);
+    }
+    return NULL;
+}
+
+/* Runs one pass with the worker threads. The calling thread is one of
+   the workers. */
+static void run_pass(hasher_t *hasher, int pass) {
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * hasher->num_threads);
+    unsigned int started = 0;
+
+    hasher->pass = pass;
+    atomic_store(&hasher->next, 0);
+
+    if (threads)
+        for (; started + 1 < hasher->num_threads; started++)
+            if (pthread_create(&threads[started], NULL, hash_worker, hasher) != 0)
+                break;
+
+    hash_worker(hasher);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+static int compare_runs(const void *a, const void *b) {
+
+    const data_run_t *x = a, *y = b;
+    return x->physical < y->physical ? -1 : x->physical > y->physical;
+}
+
+/* hash_volume_files: Hashes the content of every regular file of a
+   volume, reading the data in physical block order with several
+   threads. Files with the same content, holes included, have the same
+   hash, whatever their layout on disk.
+
+   Parameters:
+     volume: Pointer to volume.
+     num_threads: Number of threads used (at least 1).
+     flags: EXT2_HASH_BLOCKS to keep the hash of every block of every
+            file in the result.
+     result: Filled with one entry per regular file, in no particular
+             order, and statistics on the data read. Must be released
+             with hash_result_free, even if the function fails.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted or the volume cannot be
+     read.
+ */
+int hash_volume_files(volume_t *volume, unsigned int num_threads, int flags, hash_result_t *result) {
+
+    hasher_t hasher = { .volume = volume, .result = result, .num_threads = num_threads ? num_threads : 1 };
+    char *zeros = calloc(1, volume->block_size);
+
+    memset(result, 0, sizeof(hash_result_t));
+    if (!zeros) return -1;
+    hasher.zero_hash = ext2_hash64(zeros, volume->block_size, EXT2_HASH_BLOCK_SEED);
+    free(zeros);
+
+    pthread_mutex_init(&hasher.lock, NULL);
+
+    run_pass(&hasher, 0);
+    if (!atomic_load(&hasher.failed)) {
+        qsort(hasher.runs, hasher.num_runs, sizeof(data_run_t), compare_runs);
+        run_pass(&hasher, 1);
+    }
+
+    for (size_t i = 0; i < result->num_files; i++) {
+        file_hash_t *file = &result->files[i];
+        file->hash = ext2_hash64(file->block_hashes, file->num_blocks * sizeof(uint64_t),
+                                 EXT2_HASH_FILE_SEED + file->size);
+        result->total_blocks += file->num_blocks;
+        if (!(flags & EXT2_HASH_BLOCKS)) {
+            free(file->block_hashes);
+            file->block_hashes = NULL;
+        }
+    }
+    result->bytes_read = atomic_load(&hasher.bytes_read);
+
+    free(hasher.runs);
+    pthread_mutex_destroy(&hasher.lock);
+    return atomic_load(&hasher.failed) ? -1 : 0;
+}
+
+/* hash_result_free: Releases the memory held by a result of
+   hash_volume_files.
+ */
+void hash_result_free(hash_result_t *result) {
+
+    for (size_t i = 0; i < result->num_files; i++)
+        free(result->files[i].block_hashes);
+    free(result->files);
+    result->files = NULL;
+    result->num_files = 0;
+}
@@ -0,0 +1,341 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* The inode table keeps the inodes read from a volume in a compact
+   form, for volumes opened with EXT2_OPEN_INODE_TABLE. Only the hot
+   fields of an inode are kept: mode, link count, owner, size, times,
+   block count and block pointers, 96 bytes in all, against 128 bytes
+   of inode_t plus the bookkeeping of a cache pool entry. The cold
+   fields (flags, deletion time, generation, ACL block, fragment and
+   OS-dependent values) are left out, and read from disk by
+   read_inode_full when needed.
+
+   The table is indexed by inode number, and split in chunks of
+   EXT2_ITABLE_CHUNK inodes allocated the first time one of their
+   inodes is stored. Within a chunk each field is an array of its own,
+   so looking at the mode or size of many inodes only touches the
+   memory holding modes or sizes. Each entry is written once, under
+   the table lock, and then marked present in the chunk's bitmap, so
+   lookups take no lock.
+
+   The table holds as many chunks as its budget allows, which is
+   unlimited unless a memory governor (see ext2mem.c) sets one. Over
+   budget, whole chunks are evicted in CLOCK order, a chunk read since
+   the hand last passed getting a second chance. Lookups read chunks
+   inside an epoch critical section, and evicted chunks are retired
+   with epoch_retire. A lookup that misses because its chunk was
+   evicted counts a ghost hit.
+ */
+
+// Number of inodes in a chunk of the table
+#define EXT2_ITABLE_CHUNK 1024
+
+typedef struct inode_chunk {
+    _Atomic uint64_t present[EXT2_ITABLE_CHUNK / 64]; // Bit set once the entry is filled in
+    _Atomic uint8_t referenced;                       // Set by lookups, cleared by the clock hand
+    uint16_t mode[EXT2_ITABLE_CHUNK];
+    uint16_t links[EXT2_ITABLE_CHUNK];
+    uint32_t uid[EXT2_ITABLE_CHUNK];    // Including the high 16 bits (l_i_uid_high)
+    uint32_t gid[EXT2_ITABLE_CHUNK];    // Including the high 16 bits (l_i_gid_high)
+    uint64_t size[EXT2_ITABLE_CHUNK];   // i_size, with i_dir_acl as the high 32 bits
+    uint32_t atime[EXT2_ITABLE_CHUNK];
+    uint32_t ctime[EXT2_ITABLE_CHUNK];
+    uint32_t mtime[EXT2_ITABLE_CHUNK];
+    uint32_t blocks[EXT2_ITABLE_CHUNK]; // i_blocks
+    uint32_t block[EXT2_ITABLE_CHUNK][EXT2_NDIR_BLOCKS + 3]; // i_block, then the indirect blocks
+} inode_chunk_t;
+
+struct inode_table {
+    pthread_mutex_t lock; // Serializes stores and evictions
+    uint32_t num_inodes;
+    uint32_t num_chunks;
+    _Atomic uint64_t stored;
+    _Atomic(inode_chunk_t *) *chunks;
+
+    uint64_t budget;        // Bytes the table may use, UINT64_MAX if unlimited
+    uint32_t allocated;     // Chunks held
+    uint32_t hand;          // Next chunk considered for eviction
+    _Atomic uint8_t *evicted; // Per chunk, set while the chunk is evicted and not reloaded
+    uint32_t num_evicted;
+    _Atomic uint64_t ghost_hits;
+};
+
+// Memory used by a table without any chunk
+static inline uint64_t base_bytes(inode_table_t *table) {
+    return sizeof(inode_table_t) + table->num_chunks * (sizeof(*table->chunks) + sizeof(*table->evicted));
+}
+
+/* Evicts the first chunk not looked up since the hand last passed it,
+   clearing the reference bit of the chunks it passes. Must be called
+   with the table lock held, and outside any epoch critical section.
+
+   Returns:
+     0 on success, or -1 if the table holds no chunk. */
+static int evict_chunk(inode_table_t *table) {
+
+    if (!table->allocated) return -1;
+
+    // After one turn every bit is clear, so two turns always find a victim
+    for (uint64_t steps = 0; steps < 2ULL * table->num_chunks; steps++) {
+        uint32_t index = table->hand;
+        inode_chunk_t *chunk = atomic_load_explicit(&table->chunks[index], memory_order_relaxed);
+
+        table->hand = (index + 1) % table->num_chunks;
+        if (!chunk) continue;
+        if (atomic_load_explicit(&chunk->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&chunk->referenced, 0, memory_order_relaxed);
+            continue;
+        }
+
+        atomic_store_explicit(&table->chunks[index], NULL, memory_order_release);
+        atomic_store_explicit(&table->evicted[index], 1, memory_order_relaxed);
+        table->num_evicted++;
+        table->allocated--;
+        uint64_t present = 0;
+        for (int i = 0; i < EXT2_ITABLE_CHUNK / 64; i++)
+            present += __builtin_popcountll(atomic_load_explicit(&chunk->present[i], memory_order_relaxed));
+        atomic_fetch_sub_explicit(&table->stored, present, memory_order_relaxed);
+
+        // Lookups may still be copying from the chunk
+        epoch_retire(chunk);
+        return 0;
+    }
+    return -1;
+}
+
+/* inode_table_create: Allocates an empty inode table.
+
+   Parameters:
+     num_inodes: Number of inodes of the volume (s_inodes_count).
+
+   Returns:
+     A pointer to the new table, or NULL if memory is exhausted.
+ */
+inode_table_t *inode_table_create(uint32_t num_inodes) {
+
+    inode_table_t *table = calloc(1, sizeof(inode_table_t));
+    if (!table) return NULL;
+
+    table->num_inodes = num_inodes;
+    table->num_chunks = num_inodes / EXT2_ITABLE_CHUNK + 1;
+    table->budget = UINT64_MAX;
+    table->chunks = calloc(table->num_chunks, sizeof(*table->chunks));
+    table->evicted = calloc(table->num_chunks, sizeof(*table->evicted));
+    if (!table->chunks || !table->evicted) {
+        free(table->chunks);
+        free(table->evicted);
+        free(table);
+        return NULL;
+    }
+
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+/* inode_table_destroy: Frees a table and all the inodes it holds.
+ */
+void inode_table_destroy(inode_table_t *table) {
+
+    if (!table) return;
+    for (uint32_t i = 0; i < table->num_chunks; i++)
+        free(atomic_load(&table->chunks[i]));
+    pthread_mutex_destroy(&table->lock);
+    free(table->chunks);
+    free((void *) table->evicted);
+    free(table);
+}
+
+/* inode_table_get: Looks up an inode in the table.
+
+   Parameters:
+     table: Pointer to table.
+     inode_no: Number of the inode.
+     buffer: If the inode is present, filled with its hot fields; all
+             other fields are set to 0 (zero).
+
+   Returns:
+     1 if the inode is present, 0 (zero) otherwise.
+ */
+int inode_table_get(inode_table_t *table, uint32_t inode_no, inode_t *buffer) {
+
+    if (inode_no == 0 || inode_no > table->num_inodes) return 0;
+
+    uint32_t index = inode_no / EXT2_ITABLE_CHUNK, i = inode_no % EXT2_ITABLE_CHUNK;
+
+    epoch_enter();
+    inode_chunk_t *chunk = atomic_load_explicit(&table->chunks[index], memory_order_acquire);
+
+    if (!chunk || !(atomic_load_explicit(&chunk->present[i / 64], memory_order_acquire) & 1ULL << i % 64)) {
+        epoch_exit();
+        if (!chunk && atomic_load_explicit(&table->evicted[index], memory_order_relaxed))
+            atomic_fetch_add_explicit(&table->ghost_hits, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    memset(buffer, 0, sizeof(inode_t));
+    buffer->i_mode = chunk->mode[i];
+    buffer->i_links_count = chunk->links[i];
+    buffer->i_uid = chunk->uid[i];
+    buffer->l_i_uid_high = chunk->uid[i] >> 16;
+    buffer->i_gid = chunk->gid[i];
+    buffer->l_i_gid_high = chunk->gid[i] >> 16;
+    buffer->i_size = chunk->size[i];
+    buffer->i_dir_acl = chunk->size[i] >> 32;
+    buffer->i_atime = chunk->atime[i];
+    buffer->i_ctime = chunk->ctime[i];
+    buffer->i_mtime = chunk->mtime[i];
+    buffer->i_blocks = chunk->blocks[i];
+    memcpy(buffer->i_block, chunk->block[i], sizeof(chunk->block[i]));
+
+    if (!atomic_load_explicit(&chunk->referenced, memory_order_relaxed))
+        atomic_store_explicit(&chunk->referenced, 1, memory_order_relaxed);
+    epoch_exit();
+    return 1;
+}
+
+/* inode_table_store: Stores a run of consecutive on-disk inodes, such
+   as all the inodes of an inode table block. Inodes already present
+   are left untouched. Chunks are evicted as needed to stay within the
+   table's budget. Must not be called inside an epoch critical section.
+
+   Parameters:
+     table: Pointer to table.
+     first_inode_no: Number of the first inode of the run.
+     raw: Inodes as stored on disk, 'stride' bytes apart.
+     count: Number of inodes in the run. Inodes past the last inode of
+            the volume are ignored.
+     stride: Size of an on-disk inode, at least sizeof(inode_t).
+ */
+void inode_table_store(inode_table_t *table, uint32_t first_inode_no, const void *raw,
+                       uint32_t count, uint32_t stride) {
+
+    if (first_inode_no == 0) return;
+    if (first_inode_no > table->num_inodes) return;
+    if (count > table->num_inodes - first_inode_no + 1) count = table->num_inodes - first_inode_no + 1;
+
+    pthread_mutex_lock(&table->lock);
+
+    for (uint32_t n = 0; n < count; n++) {
+        uint32_t inode_no = first_inode_no + n, i = inode_no % EXT2_ITABLE_CHUNK;
+        _Atomic(inode_chunk_t *) *slot = &table->chunks[inode_no / EXT2_ITABLE_CHUNK];
+        inode_chunk_t *chunk = atomic_load_explicit(slot, memory_order_relaxed);
+
+        if (!chunk) {
+            uint32_t index = inode_no / EXT2_ITABLE_CHUNK;
+
+            while (base_bytes(table) + (table->allocated + 1ULL) * sizeof(inode_chunk_t) > table->budget &&
+                   evict_chunk(table) == 0);
+
+            chunk = calloc(1, sizeof(inode_chunk_t));
+            if (!chunk) break;
+            atomic_init(&chunk->referenced, 1);
+            atomic_store_explicit(slot, chunk, memory_order_release);
+            table->allocated++;
+            if (atomic_load_explicit(&table->evicted[index], memory_order_relaxed)) {
+                atomic_store_explicit(&table->evicted[index], 0, memory_order_relaxed);
+                table->num_evicted--;
+            }
+        }
+        if (atomic_load_explicit(&chunk->present[i / 64], memory_order_relaxed) & 1ULL << i % 64)
+            continue;
+
+        // The on-disk inode may be longer than inode_t, and need not be aligned
+        inode_t inode;
+        memcpy(&inode, (const char *) raw + (size_t) n * stride, sizeof(inode_t));
+
+        chunk->mode[i] = inode.i_mode;
+        chunk->links[i] = inode.i_links_count;
+        chunk->uid[i] = (uint32_t) inode.l_i_uid_high << 16 | inode.i_uid;
+        chunk->gid[i] = (uint32_t) inode.l_i_gid_high << 16 | inode.i_gid;
+        chunk->size[i] = (uint64_t) inode.i_dir_acl << 32 | inode.i_size;
+        chunk->atime[i] = inode.i_atime;
+        chunk->ctime[i] = inode.i_ctime;
+        chunk->mtime[i] = inode.i_mtime;
+        chunk->blocks[i] = inode.i_blocks;
+        memcpy(chunk->block[i], inode.i_block, sizeof(chunk->block[i]));
+
+        atomic_fetch_or_explicit(&chunk->present[i / 64], 1ULL << i % 64, memory_order_release);
+        atomic_fetch_add_explicit(&table->stored, 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* inode_table_forget: Removes an inode from the table, once it
+   changed on disk, so the next read_inode loads it again. A lookup
+   already reading the entry may still return the old copy; callers
+   changing a volume keep lookups out while they do (see ext2write.c).
+
+   Parameters:
+     table: Pointer to table.
+     inode_no: Number of the inode.
+ */
+void inode_table_forget(inode_table_t *table, uint32_t inode_no) {
+
+    if (inode_no == 0 || inode_no > table->num_inodes) return;
+
+    uint32_t i = inode_no % EXT2_ITABLE_CHUNK;
+
+    pthread_mutex_lock(&table->lock);
+    inode_chunk_t *chunk = atomic_load_explicit(&table->chunks[inode_no / EXT2_ITABLE_CHUNK], memory_order_relaxed);
+    if (chunk && (atomic_fetch_and_explicit(&chunk->present[i / 64], ~(1ULL << i % 64), memory_order_relaxed) &
+                  1ULL << i % 64))
+        atomic_fetch_sub_explicit(&table->stored, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* inode_table_usage: Reports how many inodes a table holds, and the
+   memory it uses.
+
+   Parameters:
+     table: Pointer to table.
+     inodes: Set to the number of inodes present (may be NULL).
+     bytes: Set to the number of bytes allocated (may be NULL).
+ */
+void inode_table_usage(inode_table_t *table, uint64_t *inodes, uint64_t *bytes) {
+
+    pthread_mutex_lock(&table->lock);
+    if (inodes) *inodes = atomic_load(&table->stored);
+    if (bytes) *bytes = base_bytes(table) + (uint64_t) table->allocated * sizeof(inode_chunk_t);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* inode_table_memory: Reports the memory used by a table, for a
+   memory governor.
+
+   Parameters:
+     table: Pointer to table.
+     usage: Filled with the bytes used by the table, its budget, and
+            the lookups that missed on evicted chunks.
+ */
+void inode_table_memory(inode_table_t *table, mem_usage_t *usage) {
+
+    pthread_mutex_lock(&table->lock);
+    usage->bytes = base_bytes(table) + (uint64_t) table->allocated * sizeof(inode_chunk_t);
+    usage->budget = table->budget;
+    usage->ghost_hits = atomic_load_explicit(&table->ghost_hits, memory_order_relaxed);
+    usage->ghost_bytes = (uint64_t) table->num_evicted * sizeof(inode_chunk_t);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* inode_table_resize: Changes the memory budget of a table, evicting
+   chunks until the table fits in it. Must not be called inside an
+   epoch critical section.
+
+   Parameters:
+     table: Pointer to table.
+     budget: Bytes the table may use, including its index of chunks;
+             UINT64_MAX for no limit.
+ */
+void inode_table_resize(inode_table_t *table, uint64_t budget) {
+
+    pthread_mutex_lock(&table->lock);
+    table->budget = budget;
+    while (base_bytes(table) + (uint64_t) table->allocated * sizeof(inode_chunk_t) > budget &&
+           evict_chunk(table) == 0);
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,309 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Layout analysis maps every file's data blocks to physical extents
+   and measures how badly reading it sequentially would seek. Worker
+   threads take block groups one at a time, read the group's inode
+   bitmap and the inodes in use in bulk (read_inodes reads each inode
+   table block once), and walk each file's block map. Per-file results
+   are merged into the volume summary under a lock.
+ */
+
+// Number of inodes read at once from an inode table
+#define EXT2_LAYOUT_INODE_BATCH 256
+
+typedef struct layout {
+    volume_t *volume;
+    layout_summary_t *summary;
+    layout_callback_t callback;
+    void *ctx;
+    pthread_mutex_t lock;
+    unsigned int num_threads;
+    _Atomic uint32_t next_group;
+    _Atomic int failed;
+} layout_t;
+
+// State of the walk of one file's blocks
+typedef struct layout_walk {
+    volume_t *volume;
+    file_layout_t *file;
+    size_t capacity;            // Allocated size of file->extents
+    uint32_t next_physical;     // Block following the last extent, or 0
+    uint32_t pending[4];        // Indirect block of each level waiting for its first child, or 0
+    uint64_t distance_sum;      // Sum of the distances of indirect blocks to their first child
+    uint32_t *groups;           // Groups of the extents, for counting distinct groups
+    size_t groups_capacity;
+} layout_walk_t;
+
+static inline uint32_t block_group(volume_t *volume, uint32_t block_no) {
+
+    return (block_no - volume->super.s_first_data_block) / volume->super.s_blocks_per_group;
+}
+
+static inline int log2_bucket(uint64_t value) {
+
+    int bucket = 0;
+    while (value >>= 1) bucket++;
+    return bucket < EXT2_LAYOUT_BUCKETS ? bucket : EXT2_LAYOUT_BUCKETS - 1;
+}
+
+static int compare_u32(const void *a, const void *b) {
+
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int visit_layout_block(void *ctx, uint64_t block_idx, uint32_t block_no, int level) {
+
+    layout_walk_t *walk = ctx;
+    file_layout_t *file = walk->file;
+
+    // Distance from an indirect block to the first block it references
+    if (level < 3 && walk->pending[level + 1]) {
+        uint32_t parent = walk->pending[level + 1];
+        walk->distance_sum += parent > block_no ? parent - block_no : block_no - parent;
+        walk->pending[level + 1] = 0;
+    }
+
+    if (level > 0) {
+        file->indirect_blocks++;
+        walk->pending[level] = block_no;
+        // Indirect blocks placed inline with the data do not break an extent
+        if (block_no == walk->next_physical && file->num_extents) {
+            file->extents[file->num_extents - 1].blocks++;
+            walk->next_physical++;
+        }
+        return 0;
+    }
+
+    file->data_blocks++;
+    if (file->num_extents && block_no == walk->next_physical) {
+        file->extents[file->num_extents - 1].blocks++;
+        walk->next_physical++;
+        return 0;
+    }
+
+    if (file->num_extents == walk->capacity) {
+        size_t capacity = walk->capacity ? walk->capacity * 2 : 16;
+        extent_t *extents = realloc(file->extents, capacity * sizeof(extent_t));
+        if (!extents) return -1;
+        file->extents = extents;
+        walk->capacity = capacity;
+    }
+    file->extents[file->num_extents++] = (extent_t) { block_idx, block_no, 1 };
+    walk->next_physical = block_no + 1;
+    return 0;
+}
+
+/* analyze_file_layout: Computes the physical layout of a file's data.
+
+   Parameters:
+     volume: Pointer to volume.
+     inode_no: Inode number of the file, stored in the result.
+     inode: Pointer to inode structure of the file.
+     layout: Filled with the layout of the file. Its extent list is
+             allocated by this function and must be released with
+             free(layout->extents).
+
+   Returns:
+     0 on success, or -1 if memory is exhausted or an indirect block
+     cannot be read.
+ */
+int analyze_file_layout(volume_t *volume, uint32_t inode_no, inode_t *inode, file_layout_t *layout) {
+
+    layout_walk_t walk = { volume, layout };
+
+    memset(layout, 0, sizeof(file_layout_t));
+    layout->inode_no = inode_no;
+    layout->mode = inode->i_mode;
+    layout->size = inode_file_size(volume, inode);
+
+    int rv = walk_inode_blocks(volume, inode, visit_layout_block, &walk);
+    if (rv) {
+        free(layout->extents);
+        layout->extents = NULL;
+        return -1;
+    }
+
+    // An extent may extend past a group boundary, so count the groups of both of its ends
+    if (layout->num_extents) {
+        uint32_t *groups = malloc(sizeof(uint32_t) * 2 * layout->num_extents);
+        if (!groups) {
+            free(layout->extents);
+            layout->extents = NULL;
+            return -1;
+        }
+        for (uint32_t i = 0; i < layout->num_extents; i++) {
+            groups[2 * i] = block_group(volume, layout->extents[i].physical);
+            groups[2 * i + 1] = block_group(volume, layout->extents[i].physical + layout->extents[i].blocks - 1);
+        }
+        qsort(groups, 2 * layout->num_extents, sizeof(uint32_t), compare_u32);
+        layout->groups = 1;
+        for (uint32_t i = 1; i < 2 * layout->num_extents; i++)
+            layout->groups += groups[i] != groups[i - 1];
+        free(groups);
+    }
+
+    layout->indirect_distance = layout->indirect_blocks ? (double) walk.distance_sum / layout->indirect_blocks : 0;
+    return 0;
+}
+
+/* Returns non-zero if file 'a' is laid out worse than file 'b': more
+   extents, then more groups, then indirect blocks further away. */
+static int worse_layout(const file_layout_t *a, const file_layout_t *b) {
+
+    if (a->num_extents != b->num_extents) return a->num_extents > b->num_extents;
+    if (a->groups != b->groups) return a->groups > b->groups;
+    return a->indirect_distance > b->indirect_distance;
+}
+
+/* Adds a file to the summary. Must be called with the lock held. */
+static void add_to_summary(layout_summary_t *summary, file_layout_t *file) {
+
+    summary->files++;
+    summary->data_blocks += file->data_blocks;
+    summary->indirect_blocks += file->indirect_blocks;
+    summary->extents += file->num_extents;
+    if (!file->data_blocks) return;
+
+    if (file->num_extents > 1) summary->fragmented_files++;
+    summary->extent_count_histogram[log2_bucket(file->num_extents)]++;
+    summary->groups_histogram[log2_bucket(file->groups)]++;
+    for (uint32_t i = 0; i < file->num_extents; i++)
+        summary->extent_length_histogram[log2_bucket(file->extents[i].blocks)]++;
+
+    // Keep the worst files sorted, worst first
+    size_t pos = summary->num_worst;
+    if (pos == summary->max_worst) {
+        if (!pos || !worse_layout(file, &summary->worst[pos - 1])) return;
+        pos--;
+    } else {
+        summary->num_worst++;
+    }
+    while (pos > 0 && worse_layout(file, &summary->worst[pos - 1])) {
+        summary->worst[pos] = summary->worst[pos - 1];
+        pos--;
+    }
+    summary->worst[pos] = *file;
+    summary->worst[pos].extents = NULL;
+}
+
+static void analyze_group(layout_t *layout, uint32_t group, uint8_t *bitmap, uint32_t *inode_nos, inode_t *inodes) {
+
+    volume_t *volume = layout->volume;
+    uint32_t ipg = volume->super.s_inodes_per_group;
+    const group_desc_t *desc = get_group_desc(volume, group);
+    size_t count = 0;
+
+    if (!desc || read_block(volume, desc->bg_inode_bitmap, 0, volume->block_size, bitmap) != volume->block_size) {
+        atomic_store(&layout->failed, 1);
+        return;
+    }
+
+    for (uint32_t i = 0; i <= ipg; i++) {
+        uint32_t inode_no = group * ipg + i + 1;
+        int last = i == ipg || inode_no > volume->super.s_inodes_count;
+
+        if (!last && (bitmap[i >> 3] >> (i & 7)) & 1 &&
+            (inode_no >= volume->super.s_first_ino || inode_no == EXT2_ROOT_INO))
+            inode_nos[count++] = inode_no;
+
+        if (count < EXT2_LAYOUT_INODE_BATCH && !last) continue;
+
+        if (count && read_inodes(volume, inode_nos, count, inodes) != (ssize_t) count) {
+            atomic_store(&layout->failed, 1);
+            return;
+        }
+        for (size_t j = 0; j < count; j++) {
+            file_layout_t file;
+            if (!inode_has_blocks(volume, &inodes[j])) continue;
+            if (analyze_file_layout(volume, inode_nos[j], &inodes[j], &file) < 0) {
+                atomic_store(&layout->failed, 1);
+                continue;
+            }
+            pthread_mutex_lock(&layout->lock);
+            add_to_summary(layout->summary, &file);
+            if (layout->callback) layout->callback(layout->ctx, &file);
+            pthread_mutex_unlock(&layout->lock);
+            free(file.extents);
+        }
+        count = 0;
+        if (last) break;
+    }
+}
+
+static void *layout_worker(void *arg) {
+
+    layout_t *layout = arg;
+    volume_t *volume = layout->volume;
+    uint8_t *bitmap = malloc(volume->block_size);
+    uint32_t *inode_nos = malloc(sizeof(uint32_t) * EXT2_LAYOUT_INODE_BATCH);
+    inode_t *inodes = malloc(sizeof(inode_t) * EXT2_LAYOUT_INODE_BATCH);
+    uint32_t group;
+
+    if (!bitmap || !inode_nos || !inodes)
+        atomic_store(&layout->failed, 1);
+    else
+        while ((group = atomic_fetch_add(&layout->next_group, 1)) < volume->num_groups)
+            analyze_group(layout, group, bitmap, inode_nos, inodes);
+
+    free(bitmap);
+    free(inode_nos);
+    free(inodes);
+    return NULL;
+}
+
+/* analyze_volume_layout: Computes the layout of every file and
+   directory of a volume, in parallel over block groups.
+
+   Parameters:
+     volume: Pointer to volume.
+     num_threads: Number of threads used (at least 1).
+     summary: Volume-wide results. The caller sets 'worst' to an array
+              of 'max_worst' entries (or NULL and 0), which is filled
+              with the worst laid out files, worst first, without
+              their extent lists. All other fields are set by this
+              function.
+     callback: If not NULL, called once for each file with 'ctx' and
+               its layout, which is only valid during the call. Calls
+               are serialized, but come from any of the threads and in
+               no particular order.
+     ctx: Pointer passed to the callback.
+
+   Returns:
+     0 on success, or -1 if some files could not be analyzed (memory
+     exhausted or read errors).
+ */
+int analyze_volume_layout(volume_t *volume, unsigned int num_threads, layout_summary_t *summary,
+                          layout_callback_t callback, void *ctx) {
+
+    layout_t layout = { volume, summary, callback, ctx };
+    file_layout_t *worst = summary->worst;
+    size_t max_worst = summary->max_worst;
+
+    memset(summary, 0, sizeof(layout_summary_t));
+    summary->worst = worst;
+    summary->max_worst = worst ? max_worst : 0;
+
+    pthread_mutex_init(&layout.lock, NULL);
+    layout.num_threads = num_threads ? num_threads : 1;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * layout.num_threads);
+    unsigned int started = 0;
+    if (threads)
+        for (; started + 1 < layout.num_threads; started++)
+            if (pthread_create(&threads[started], NULL, layout_worker, &layout) != 0)
+                break;
+
+    layout_worker(&layout);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    pthread_mutex_destroy(&layout.lock);
+    return atomic_load(&layout.failed) ? -1 : 0;
+}
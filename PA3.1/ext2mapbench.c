@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2mapbench: Measures the cost of mapping the block indices of a
+   file to block numbers, in sequential and random order, with three
+   implementations: a reference one that divides by the number of
+   pointers per indirect block and reads one pointer at a time (as
+   get_inode_block_no used to), the generic kernel of ext2blocks.c,
+   and the kernel specialized for the volume's block size. Every
+   result is compared with the reference one.
+ */
+
+typedef struct mapper {
+  const char *name;
+  uint32_t (*map_block)(volume_t *volume, inode_t *inode, uint64_t block_idx);
+} mapper_t;
+
+static uint32_t read_pointer(volume_t *volume, uint32_t block_no, uint32_t index) {
+
+  uint32_t pointer;
+
+  if (block_no == 0) return 0;
+  if (block_no == EXT2_INVALID_BLOCK_NUMBER) return EXT2_INVALID_BLOCK_NUMBER;
+  return read_block(volume, block_no, index * sizeof(pointer), sizeof(pointer), &pointer) == sizeof(pointer) ?
+         pointer : EXT2_INVALID_BLOCK_NUMBER;
+}
+
+static uint32_t map_block_reference(volume_t *volume, inode_t *inode, uint64_t block_idx) {
+
+  uint64_t singly = volume->block_size / sizeof(uint32_t);
+  uint64_t doubly = singly * singly;
+
+  if (block_idx < EXT2_NDIR_BLOCKS)
+    return inode->i_block[block_idx];
+  block_idx -= EXT2_NDIR_BLOCKS;
+
+  if (block_idx < singly)
+    return read_pointer(volume, inode->i_block_1ind, block_idx);
+  block_idx -= singly;
+
+  if (block_idx < doubly) {
+    uint32_t block_no = read_pointer(volume, inode->i_block_2ind, block_idx / singly);
+    return read_pointer(volume, block_no, block_idx % singly);
+  }
+  block_idx -= doubly;
+
+  if (block_idx < doubly * singly) {
+    uint32_t block_no = read_pointer(volume, inode->i_block_3ind, block_idx / doubly);
+    block_no = read_pointer(volume, block_no, block_idx / singly % singly);
+    return read_pointer(volume, block_no, block_idx % singly);
+  }
+  return EXT2_INVALID_BLOCK_NUMBER;
+}
+
+static double elapsed_since(struct timespec *start) {
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-r rounds] volume_file path\n"
+          "  -r rounds  number of times every block is mapped in each order (default: 1)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  long rounds = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    switch (opt) {
+    case 'r': rounds = atol(optarg); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 2 || rounds < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  volume_t *volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+
+  inode_t inode;
+  if (resolve_path(volume, argv[optind + 1], &inode, EXT2_RESOLVE_FOLLOW) == 0 || !inode_is_regular_file(&inode)) {
+    fprintf(stderr, "Not a regular file: %s.\n", argv[optind + 1]);
+    close_volume_file(volume);
+    return 1;
+  }
+
+  uint64_t num_blocks = (inode_file_size(volume, &inode) + volume->block_size - 1) >> volume->block_bits;
+  uint32_t *expected = malloc(sizeof(uint32_t) * (num_blocks + 1));
+  uint64_t *order = malloc(sizeof(uint64_t) * (num_blocks + 1));
+  if (!expected || !order) {
+    fprintf(stderr, "Not enough memory for %" PRIu64 " blocks.\n", num_blocks);
+    free(expected);
+    free(order);
+    close_volume_file(volume);
+    return 1;
+  }
+
+  for (uint64_t i = 0; i < num_blocks; i++) {
+    expected[i] = map_block_reference(volume, &inode, i);
+    order[i] = i;
+  }
+
+  // Fisher-Yates shuffle with a fixed seed, so runs are comparable
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+  for (uint64_t i = num_blocks; i > 1; i--) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    uint64_t j = seed % i, t = order[i - 1];
+    order[i - 1] = order[j];
+    order[j] = t;
+  }
+
+  mapper_t mappers[] = {
+    { "reference", map_block_reference },
+    { block_ops_generic.name, block_ops_generic.map_block },
+    { volume->ops->name, volume->ops->map_block },
+  };
+  int status = 0;
+
+  printf("%s: %" PRIu64 " blocks of %u bytes, %ld round(s)\n", argv[optind + 1], num_blocks, volume->block_size, rounds);
+  for (size_t m = 0; m < sizeof(mappers) / sizeof(mappers[0]); m++) {
+    double seconds[2];
+
+    for (int random = 0; random < 2; random++) {
+      uint64_t mismatches = 0;
+      struct timespec start;
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (long r = 0; r < rounds; r++)
+        for (uint64_t i = 0; i < num_blocks; i++) {
+          uint64_t block_idx = random ? order[i] : i;
+          mismatches += mappers[m].map_block(volume, &inode, block_idx) != expected[block_idx];
+        }
+      seconds[random] = elapsed_since(&start);
+
+      if (mismatches) {
+        fprintf(stderr, "%s: %" PRIu64 " blocks mapped differently from the reference.\n", mappers[m].name, mismatches);
+        status = 1;
+      }
+    }
+
+    double mapped = (double) num_blocks * rounds;
+    printf("  %-10s sequential %8.3f s (%7.1f ns/block)   random %8.3f s (%7.1f ns/block)\n", mappers[m].name,
+           seconds[0], seconds[0] * 1e9 / (mapped ? mapped : 1), seconds[1], seconds[1] * 1e9 / (mapped ? mapped : 1));
+  }
+
+  free(expected);
+  free(order);
+  close_volume_file(volume);
+  return status;
+}
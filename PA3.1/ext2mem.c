@@ -0,0 +1,374 @@
+#include "ext2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+
+/* The memory governor keeps the resident memory of the process under
+   one limit, shared by every cache that can be resized: the cache
+   pool (blocks, inodes and directory entries of all volumes), the
+   inode tables, and the decompressed chunks of compressed images,
+   which also serve as their read-ahead buffers. Each cache reports
+   its usage and its ghost hits, misses on data it dropped to stay
+   within its budget, which it would have hit with more memory.
+
+   mem_governor_rebalance is meant to be called periodically. It
+   measures the resident memory of the process, and gives the caches
+   what is left of the soft limit (EXT2_MEM_SOFT_PERCENT of the limit)
+   once the memory used outside the caches is taken out. Between calls,
+   a step of that memory moves from the cache with the lowest marginal
+   hit rate (ghost hits per byte of dropped data remembered) to the one
+   with the highest, so capacity follows whichever cache would gain the
+   most hits from it. When the process is over the soft limit, every
+   cache shrinks in proportion, and freed memory is returned to the
+   system. Large objects (chunks of inode tables, decompressed chunks)
+   are mapped on their own once a governor exists, so memory they free
+   is returned at once instead of lingering in the heap of the thread
+   that allocated them. mem_governor_shrink shrinks every cache to half its usage,
+   for callers reacting to memory pressure (ext2fs does on SIGUSR1).
+ */
+
+// Percentage of the limit the process is kept under, leaving room for growth between rebalances
+#define EXT2_MEM_SOFT_PERCENT 80
+
+// Fraction of the memory of the caches moved from one cache to another per rebalance
+#define EXT2_MEM_STEPS 32
+
+// Budget below which a cache is never shrunk by rebalancing
+#define EXT2_MEM_MIN_BUDGET (1 << 20)
+
+// Size from which allocations are mapped on their own (M_MMAP_THRESHOLD)
+#define EXT2_MEM_MMAP_THRESHOLD (64 << 10)
+
+typedef struct mem_consumer {
+    char name[32];
+    volume_t *owner;  // Volume the cache belongs to, NULL for the cache pool
+    void *cache;
+    void (*report)(void *cache, mem_usage_t *usage);
+    void (*resize)(void *cache, uint64_t budget);
+    uint64_t budget;          // Budget given at the last rebalance, 0 until the first one
+    uint64_t last_ghost_hits; // Ghost hits seen at the last rebalance
+    double rate;
+    struct mem_consumer *next;
+} mem_consumer_t;
+
+struct mem_governor {
+    pthread_mutex_t lock; // Serializes rebalancing and changes to the list of caches
+    uint64_t limit;
+    mem_consumer_t *consumers;
+    mem_governor_stats_t stats;
+};
+
+static void report_pool(void *cache, mem_usage_t *usage) { cache_pool_memory(cache, usage); }
+static void resize_pool(void *cache, uint64_t budget) { cache_pool_resize(cache, budget); }
+static void report_inodes(void *cache, mem_usage_t *usage) { inode_table_memory(cache, usage); }
+static void resize_inodes(void *cache, uint64_t budget) { inode_table_resize(cache, budget); }
+static void report_zimage(void *cache, mem_usage_t *usage) { zimage_memory(cache, usage); }
+static void resize_zimage(void *cache, uint64_t budget) { zimage_resize(cache, budget); }
+
+/* Adds a cache to the governor. Must be called with the governor lock
+   held.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted. */
+static int add_consumer(mem_governor_t *gov, const char *name, volume_t *owner, void *cache,
+                        void (*report)(void *, mem_usage_t *), void (*resize)(void *, uint64_t)) {
+
+    mem_consumer_t *consumer = calloc(1, sizeof(mem_consumer_t));
+    if (!consumer) return -1;
+
+    if (owner) snprintf(consumer->name, sizeof(consumer->name), "%s:%" PRIu32, name, owner->id);
+    else snprintf(consumer->name, sizeof(consumer->name), "%s", name);
+    consumer->owner = owner;
+    consumer->cache = cache;
+    consumer->report = report;
+    consumer->resize = resize;
+
+    // Ghost hits from before the cache was governed are not counted
+    mem_usage_t usage;
+    report(cache, &usage);
+    consumer->last_ghost_hits = usage.ghost_hits;
+
+    consumer->next = gov->consumers;
+    gov->consumers = consumer;
+    return 0;
+}
+
+/* mem_process_rss: Returns the resident memory of the process, in
+   bytes, or 0 (zero) if it cannot be read.
+ */
+uint64_t mem_process_rss(void) {
+
+    unsigned long long size, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (!file) return 0;
+    if (fscanf(file, "%llu %llu", &size, &resident) != 2) resident = 0;
+    fclose(file);
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+/* mem_governor_create: Allocates a memory governor with no cache.
+   Allocations of EXT2_MEM_MMAP_THRESHOLD bytes or more are mapped on
+   their own from then on, in the whole process.
+
+   Parameters:
+     limit: Maximum resident memory of the process, in bytes.
+
+   Returns:
+     A pointer to the new governor, or NULL if memory is exhausted.
+ */
+mem_governor_t *mem_governor_create(uint64_t limit) {
+
+    mem_governor_t *gov = calloc(1, sizeof(mem_governor_t));
+    if (!gov) return NULL;
+
+    gov->limit = limit;
+    gov->stats.limit = limit;
+    mallopt(M_MMAP_THRESHOLD, EXT2_MEM_MMAP_THRESHOLD);
+    pthread_mutex_init(&gov->lock, NULL);
+    return gov;
+}
+
+/* mem_governor_destroy: Frees a governor. The caches it governed keep
+   their last budget. Does nothing if gov is NULL.
+ */
+void mem_governor_destroy(mem_governor_t *gov) {
+
+    if (!gov) return;
+
+    while (gov->consumers) {
+        mem_consumer_t *consumer = gov->consumers;
+        gov->consumers = consumer->next;
+        free(consumer);
+    }
+    pthread_mutex_destroy(&gov->lock);
+    free(gov);
+}
+
+/* mem_attach_pool: Governs the budget of a cache pool. The pool must
+   be destroyed after the governor.
+
+   Parameters:
+     gov: Pointer to governor, or NULL to do nothing.
+     pool: Pointer to pool.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted.
+ */
+int mem_attach_pool(mem_governor_t *gov, cache_pool_t *pool) {
+
+    if (!gov) return 0;
+
+    pthread_mutex_lock(&gov->lock);
+    int rv = add_consumer(gov, "pool", NULL, pool, report_pool, resize_pool);
+    pthread_mutex_unlock(&gov->lock);
+    return rv;
+}
+
+/* mem_attach_volume: Governs the caches a volume owns: its inode
+   table, if opened with EXT2_OPEN_INODE_TABLE, and its cache of
+   decompressed chunks, if it is a compressed image. The volume's share
+   of a cache pool is governed with the pool.
+
+   Parameters:
+     gov: Pointer to governor, or NULL to do nothing.
+     volume: Pointer to volume. Must be detached with mem_detach_volume
+             before it is closed.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted.
+ */
+int mem_attach_volume(mem_governor_t *gov, volume_t *volume) {
+
+    int rv = 0;
+
+    if (!gov) return 0;
+
+    pthread_mutex_lock(&gov->lock);
+    if (volume->inodes)
+        rv = add_consumer(gov, "inodes", volume, volume->inodes, report_inodes, resize_inodes);
+    if (rv == 0 && volume->zimage)
+        rv = add_consumer(gov, "chunks", volume, volume->zimage, report_zimage, resize_zimage);
+    pthread_mutex_unlock(&gov->lock);
+
+    if (rv < 0) mem_detach_volume(gov, volume);
+    return rv;
+}
+
+/* mem_detach_volume: Stops governing the caches of a volume. Once it
+   returns, the governor no longer uses them. Does nothing if gov is
+   NULL or the volume is not attached.
+ */
+void mem_detach_volume(mem_governor_t *gov, volume_t *volume) {
+
+    if (!gov) return;
+
+    pthread_mutex_lock(&gov->lock);
+    for (mem_consumer_t **link = &gov->consumers; *link;) {
+        mem_consumer_t *consumer = *link;
+        if (consumer->owner == volume) {
+            *link = consumer->next;
+            free(consumer);
+        } else {
+            link = &consumer->next;
+        }
+    }
+    pthread_mutex_unlock(&gov->lock);
+}
+
+/* Gives every cache its new budget, and returns freed memory to the
+   system if the caches shrank. Must be called with the governor lock
+   held. */
+static void apply_budgets(mem_governor_t *gov, int shrinking) {
+
+    for (mem_consumer_t *consumer = gov->consumers; consumer; consumer = consumer->next)
+        consumer->resize(consumer->cache, consumer->budget);
+
+    // Evicted objects are freed once readers are done with them, then stay mapped by malloc until trimmed
+    epoch_synchronize();
+    malloc_trim(0);
+}
+
+/* mem_governor_rebalance: Measures the resident memory of the process
+   and the usage of every cache, moves budget towards the cache with
+   the highest marginal hit rate, and shrinks all caches if the process
+   is over its soft limit. Meant to be called periodically; the
+   marginal hit rates are measured between calls.
+
+   Parameters:
+     gov: Pointer to governor, or NULL to do nothing.
+ */
+void mem_governor_rebalance(mem_governor_t *gov) {
+
+    if (!gov) return;
+
+    pthread_mutex_lock(&gov->lock);
+
+    uint64_t rss = mem_process_rss(), tracked = 0, total = 0;
+    uint64_t soft = gov->limit / 100 * EXT2_MEM_SOFT_PERCENT;
+    unsigned int count = 0;
+    mem_consumer_t *best = NULL, *worst = NULL;
+
+    for (mem_consumer_t *consumer = gov->consumers; consumer; consumer = consumer->next) {
+        mem_usage_t usage;
+        consumer->report(consumer->cache, &usage);
+        tracked += usage.bytes;
+        count++;
+
+        uint64_t ghost_hits = usage.ghost_hits - consumer->last_ghost_hits;
+        consumer->last_ghost_hits = usage.ghost_hits;
+        consumer->rate = ghost_hits ? ghost_hits / ((double) (usage.ghost_bytes ? usage.ghost_bytes : 1) / (1 << 20)) : 0;
+
+        if (!consumer->budget) consumer->budget = usage.bytes;
+        total += consumer->budget;
+
+        if (ghost_hits && (!best || consumer->rate > best->rate)) best = consumer;
+        if (consumer->budget > EXT2_MEM_MIN_BUDGET && (!worst || consumer->rate < worst->rate)) worst = consumer;
+    }
+
+    // Memory outside the caches (code, stacks, buffers, requests, fragmentation) is not theirs to use
+    uint64_t outside = rss > tracked ? rss - tracked : 0;
+    uint64_t available = soft > outside ? soft - outside : 0;
+    int shrinking = rss > soft;
+
+    // A step of budget moves towards the cache that would gain the most hits from it
+    if (best && worst && best != worst && best->rate > worst->rate) {
+        uint64_t step = available / EXT2_MEM_STEPS;
+        if (step > worst->budget - EXT2_MEM_MIN_BUDGET) step = worst->budget - EXT2_MEM_MIN_BUDGET;
+        worst->budget -= step;
+        best->budget += step;
+        gov->stats.moved += step;
+    }
+
+    if (total < available && count) {
+        // Spare memory goes to the cache that asks for it, or is split evenly
+        uint64_t spare = available - total;
+        if (best) {
+            best->budget += spare;
+        } else {
+            for (mem_consumer_t *consumer = gov->consumers; consumer; consumer = consumer->next)
+                consumer->budget += spare / count;
+        }
+    } else if (total > available) {
+        // Over the soft limit, every cache gives back in proportion to its budget
+        double scale = (double) available / total;
+        for (mem_consumer_t *consumer = gov->consumers; consumer; consumer = consumer->next)
+            consumer->budget = consumer->budget * scale > 1 ? (uint64_t) (consumer->budget * scale) : 1;
+    }
+
+    apply_budgets(gov, shrinking);
+
+    gov->stats.rss = rss;
+    if (rss > gov->stats.max_rss) gov->stats.max_rss = rss;
+    gov->stats.available = available;
+    gov->stats.rebalances++;
+    if (shrinking) gov->stats.shrinks++;
+    pthread_mutex_unlock(&gov->lock);
+}
+
+/* mem_governor_shrink: Shrinks every cache to half the memory it uses,
+   and returns the freed memory to the system. Rebalancing grows the
+   caches back as hits are lost.
+
+   Parameters:
+     gov: Pointer to governor, or NULL to do nothing.
+ */
+void mem_governor_shrink(mem_governor_t *gov) {
+
+    if (!gov) return;
+
+    pthread_mutex_lock(&gov->lock);
+    for (mem_consumer_t *consumer = gov->consumers; consumer; consumer = consumer->next) {
+        mem_usage_t usage;
+        consumer->report(consumer->cache, &usage);
+        consumer->budget = usage.bytes / 2 ? usage.bytes / 2 : 1;
+    }
+    apply_budgets(gov, 1);
+    gov->stats.shrinks++;
+    pthread_mutex_unlock(&gov->lock);
+}
+
+/* mem_governor_stats: Reports the activity of a governor.
+
+   Parameters:
+     gov: Pointer to governor.
+     stats: Filled with the limit, the resident memory measured, and the
+            counts of rebalances and shrinks.
+ */
+void mem_governor_stats(mem_governor_t *gov, mem_governor_stats_t *stats) {
+
+    pthread_mutex_lock(&gov->lock);
+    *stats = gov->stats;
+    pthread_mutex_unlock(&gov->lock);
+}
+
+/* mem_governor_consumers: Reports the usage of the caches of a
+   governor.
+
+   Parameters:
+     gov: Pointer to governor.
+     consumers: Array filled with the usage of each cache.
+     max: Number of elements of the array.
+
+   Returns:
+     The number of caches governed, which may be larger than max.
+ */
+size_t mem_governor_consumers(mem_governor_t *gov, mem_consumer_stats_t *consumers, size_t max) {
+
+    size_t count = 0;
+
+    pthread_mutex_lock(&gov->lock);
+    for (mem_consumer_t *consumer = gov->consumers; consumer; consumer = consumer->next, count++) {
+        if (count >= max) continue;
+        snprintf(consumers[count].name, sizeof(consumers[count].name), "%s", consumer->name);
+        consumer->report(consumer->cache, &consumers[count].usage);
+        consumers[count].rate = consumer->rate;
+    }
+    pthread_mutex_unlock(&gov->lock);
+    return count;
+}
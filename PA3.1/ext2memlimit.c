@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ext2.h"
+
+/* ext2memlimit: Checks that a memory governor keeps the process under
+   its limit. The given volumes are opened with their caches (a shared
+   cache pool, inode tables with -i, and the chunk caches of compressed
+   images) under one governor, and a mixed workload runs on them for a
+   fixed time: a third of the threads look up random paths, a third
+   read small pieces of random files, and the rest read the largest
+   files sequentially. The governor rebalances periodically, and is
+   asked to shrink halfway through. The resident memory of the process
+   is sampled throughout; the check fails if it ever exceeds the
+   limit.
+ */
+
+// Default limit of the resident memory, in MiB
+#define DEFAULT_LIMIT_MB 128
+
+// Interval between samples of the resident memory, in milliseconds
+#define SAMPLE_MS 10
+
+// Size of the random reads and of the pieces of sequential reads
+#define RANDOM_READ_SIZE 4096
+#define SEQUENTIAL_READ_SIZE (128 << 10)
+
+// Number of largest files read sequentially
+#define SEQUENTIAL_FILES 8
+
+typedef struct file_entry {
+  int volume;
+  char *path;
+  uint32_t inode_no;
+  uint64_t size;
+  uint16_t mode;
+} file_entry_t;
+
+typedef struct worker {
+  _Alignas(64) pthread_t thread;
+  int role;
+  uint64_t seed;
+  uint64_t operations;
+  uint64_t errors;
+} worker_t;
+
+static volume_t **volumes;
+static int num_volumes, collecting;
+static file_entry_t *files;
+static size_t num_files, max_files;
+static size_t *regular, num_regular;    // Indices of regular files
+static size_t sequential[SEQUENTIAL_FILES], num_sequential;
+static _Atomic int stop;
+
+static int collect_file(void *ctx, const char *path, uint32_t inode_no, inode_t *inode) {
+
+  if (num_files == max_files) {
+    size_t capacity = max_files ? max_files * 2 : 1024;
+    file_entry_t *grown = realloc(files, sizeof(file_entry_t) * capacity);
+    if (!grown) return 1;
+    files = grown;
+    max_files = capacity;
+  }
+  if (!(files[num_files].path = strdup(path))) return 1;
+  files[num_files].volume = collecting;
+  files[num_files].inode_no = inode_no;
+  files[num_files].size = inode_file_size(volumes[collecting], inode);
+  files[num_files].mode = inode->i_mode;
+  num_files++;
+  return 0;
+}
+
+static inline uint64_t next_random(uint64_t *seed) {
+
+  *seed ^= *seed << 13; *seed ^= *seed >> 7; *seed ^= *seed << 17;
+  return *seed;
+}
+
+static void *workload(void *arg) {
+
+  worker_t *worker = arg;
+  char *buffer = malloc(SEQUENTIAL_READ_SIZE);
+  size_t current = worker->seed % num_sequential;
+  uint64_t offset = 0;
+
+  while (buffer && !atomic_load_explicit(&stop, memory_order_relaxed)) {
+    inode_t inode;
+
+    if (worker->role == 0) {
+      // Path lookups, as for getattr
+      file_entry_t *file = &files[next_random(&worker->seed) % num_files];
+      if (find_file_from_path(volumes[file->volume], file->path, &inode) != file->inode_no)
+        worker->errors++;
+    } else if (worker->role == 1) {
+      // Small reads at random places of random files
+      file_entry_t *file = &files[regular[next_random(&worker->seed) % num_regular]];
+      uint64_t at = file->size ? next_random(&worker->seed) % file->size : 0;
+      if (read_inode(volumes[file->volume], file->inode_no, &inode) < 0 ||
+          read_file_content(volumes[file->volume], &inode, at, RANDOM_READ_SIZE, buffer) < 0)
+        worker->errors++;
+    } else {
+      // Sequential reads of the largest files, one after the other
+      file_entry_t *file = &files[sequential[current]];
+      ssize_t rv = -1;
+      if (read_inode(volumes[file->volume], file->inode_no, &inode) >= 0)
+        rv = read_file_content(volumes[file->volume], &inode, offset, SEQUENTIAL_READ_SIZE, buffer);
+      if (rv < 0) worker->errors++;
+      offset += SEQUENTIAL_READ_SIZE;
+      if (rv < SEQUENTIAL_READ_SIZE || offset >= file->size) {
+        current = (current + 1) % num_sequential;
+        offset = 0;
+      }
+    }
+    worker->operations++;
+  }
+  free(buffer);
+  return NULL;
+}
+
+static void print_consumers(mem_governor_t *gov) {
+
+  mem_consumer_stats_t consumers[64];
+  size_t count = mem_governor_consumers(gov, consumers, 64);
+
+  for (size_t i = 0; i < count && i < 64; i++)
+    printf("  %-12s %10.1f MiB used %10.1f MiB budget %12" PRIu64 " ghost hits %10.1f per MiB\n",
+           consumers[i].name, consumers[i].usage.bytes / 1048576.0, consumers[i].usage.budget / 1048576.0,
+           consumers[i].usage.ghost_hits, consumers[i].rate);
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-m limit_mb] [-t threads] [-s seconds] [-r interval_ms] [-i] volume_file...\n"
+          "  -m limit_mb     limit of the resident memory, in MiB (default: %d)\n"
+          "  -t threads      number of threads of the workload (default: 6)\n"
+          "  -s seconds      duration of the workload (default: 10)\n"
+          "  -r interval_ms  interval between rebalances (default: 200)\n"
+          "  -i              keep inodes in inode tables\n", name, DEFAULT_LIMIT_MB);
+}
+
+int main(int argc, char *argv[]) {
+
+  int num_threads = 6, interval_ms = 200, flags = 0, opt, status = 0;
+  double seconds = 10;
+  long limit_mb = DEFAULT_LIMIT_MB;
+
+  while ((opt = getopt(argc, argv, "m:t:s:r:i")) != -1) {
+    switch (opt) {
+    case 'm': limit_mb = atol(optarg); break;
+    case 't': num_threads = atoi(optarg); break;
+    case 's': seconds = atof(optarg); break;
+    case 'r': interval_ms = atoi(optarg); break;
+    case 'i': flags |= EXT2_OPEN_INODE_TABLE; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (optind == argc || limit_mb < 1 || num_threads < 1 || seconds <= 0 || interval_ms < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  uint64_t limit = (uint64_t) limit_mb << 20;
+  mem_governor_t *gov = mem_governor_create(limit);
+  cache_pool_t *pool = cache_pool_create(limit / 2);
+  num_volumes = argc - optind;
+  volumes = calloc(num_volumes, sizeof(volume_t *));
+  worker_t *workers = calloc(num_threads, sizeof(worker_t));
+  if (!gov || !pool || !volumes || !workers || mem_attach_pool(gov, pool) < 0) {
+    fprintf(stderr, "Not enough memory.\n");
+    return 1;
+  }
+
+  for (int i = 0; i < num_volumes; i++) {
+    volumes[i] = open_volume_file_flags(argv[optind + i], flags);
+    if (!volumes[i]) {
+      fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind + i]);
+      status = 1;
+      goto finish;
+    }
+    if (cache_attach_volume(pool, volumes[i]) < 0 || mem_attach_volume(gov, volumes[i]) < 0) {
+      fprintf(stderr, "Not enough memory for the caches of %s.\n", argv[optind + i]);
+      status = 1;
+      goto finish;
+    }
+    collecting = i;
+    walk_directory_tree(volumes[i], "/", collect_file, NULL);
+  }
+
+  regular = malloc(sizeof(size_t) * (num_files ? num_files : 1));
+  for (size_t i = 0; regular && i < num_files; i++) {
+    if ((files[i].mode & 0xF000) != 0x8000) continue;
+    regular[num_regular++] = i;
+
+    // Keep the largest files, in decreasing size
+    size_t at = num_sequential < SEQUENTIAL_FILES ? num_sequential++ : SEQUENTIAL_FILES;
+    for (; at > 0 && files[sequential[at - 1]].size < files[i].size; at--)
+      if (at < SEQUENTIAL_FILES) sequential[at] = sequential[at - 1];
+    if (at < SEQUENTIAL_FILES) sequential[at] = i;
+  }
+  if (!num_regular) {
+    fprintf(stderr, "No regular files to read.\n");
+    status = 1;
+    goto finish;
+  }
+
+  mem_governor_rebalance(gov);
+  printf("%zu files, limit %ld MiB, %d threads, %.1f s, resident %.1f MiB before the workload\n", num_files,
+         limit_mb, num_threads, seconds, mem_process_rss() / 1048576.0);
+
+  int started = 0;
+  for (; started < num_threads; started++) {
+    workers[started] = (worker_t) { .role = started % 3, .seed = 0x9e3779b97f4a7c15ULL * (started + 1) };
+    if (pthread_create(&workers[started].thread, NULL, workload, &workers[started]) != 0)
+      break;
+  }
+
+  struct timespec start, now, pause = { 0, SAMPLE_MS * 1000000L };
+  uint64_t max_rss = 0, rss_before_shrink = 0, rss_after_shrink = 0;
+  double elapsed = 0, next_rebalance = interval_ms / 1e3, next_report = 1;
+  int shrunk = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (elapsed < seconds) {
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+    uint64_t rss = mem_process_rss();
+    if (rss > max_rss) max_rss = rss;
+
+    if (!shrunk && elapsed >= seconds / 2) {
+      // As ext2fs does on SIGUSR1
+      rss_before_shrink = rss;
+      mem_governor_shrink(gov);
+      rss_after_shrink = mem_process_rss();
+      printf("%6.1f s: shrink, resident %.1f MiB -> %.1f MiB\n", elapsed, rss_before_shrink / 1048576.0,
+             rss_after_shrink / 1048576.0);
+      shrunk = 1;
+    } else if (elapsed >= next_rebalance) {
+      mem_governor_rebalance(gov);
+      next_rebalance += interval_ms / 1e3;
+    }
+
+    if (elapsed >= next_report) {
+      printf("%6.1f s: resident %.1f MiB, largest %.1f MiB\n", elapsed, rss / 1048576.0, max_rss / 1048576.0);
+      next_report += 1;
+    }
+  }
+  atomic_store(&stop, 1);
+
+  uint64_t operations[3] = { 0 }, errors = 0;
+  for (int t = 0; t < started; t++) {
+    pthread_join(workers[t].thread, NULL);
+    operations[workers[t].role] += workers[t].operations;
+    errors += workers[t].errors;
+  }
+
+  mem_governor_stats_t stats;
+  mem_governor_stats(gov, &stats);
+  printf("%" PRIu64 " lookups, %" PRIu64 " random reads, %" PRIu64 " sequential reads, %" PRIu64 " errors\n",
+         operations[0], operations[1], operations[2], errors);
+  printf("%" PRIu64 " rebalances, %" PRIu64 " shrinks, %.1f MiB of budget moved\n", stats.rebalances,
+         stats.shrinks, stats.moved / 1048576.0);
+  print_consumers(gov);
+  printf("Largest resident memory: %.1f MiB of %ld MiB\n", max_rss / 1048576.0, limit_mb);
+
+  if (started < num_threads) {
+    fprintf(stderr, "Only %d of %d threads could be started.\n", started, num_threads);
+    status = 1;
+  }
+  if (errors) {
+    fprintf(stderr, "%" PRIu64 " operations failed.\n", errors);
+    status = 1;
+  }
+  if (max_rss > limit) {
+    fprintf(stderr, "The resident memory exceeded the limit.\n");
+    status = 1;
+  }
+
+ finish:
+  for (int i = 0; i < num_volumes; i++) {
+    if (!volumes[i]) continue;
+    mem_detach_volume(gov, volumes[i]);
+    cache_detach_volume(volumes[i]);
+    close_volume_file(volumes[i]);
+  }
+  mem_governor_destroy(gov);
+  cache_pool_destroy(pool);
+  for (size_t i = 0; i < num_files; i++)
+    free(files[i].path);
+  free(files);
+  free(regular);
+  free(volumes);
+  free(workers);
+  return status;
+}
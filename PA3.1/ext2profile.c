@@ -0,0 +1,429 @@
+// For gettid
+#define _GNU_SOURCE
+
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* An access profile records which inodes and which ranges of blocks
+   of a volume are used, and how often, so that a later process can
+   read them ahead of time. Recording counts every read_inode and
+   read_block in a fixed-size open-addressing table. Insertions do not
+   take locks, and keys that do not fit are dropped. Blocks are
+   counted in ranges of EXT2_PROFILE_RANGE_BLOCKS, so directories,
+   indirect blocks and data are all recorded as block ranges.
+
+   A saved profile keeps the EXT2_PROFILE_MAX_ENTRIES heaviest
+   entries. Warming replays them in a background thread, sorted by
+   physical location (inodes by the inode table block holding them),
+   so the volume is read front to back. The warming thread runs with
+   the lowest CPU and I/O priority. Before each step it also backs off
+   for as long as other threads keep reading the volume, so foreground
+   requests always come first.
+ */
+
+// Number of slots in the recording table (a power of two)
+#define EXT2_PROFILE_SLOTS (1 << 16)
+
+// Blocks are counted in aligned ranges of this many blocks (a power of two)
+#define EXT2_PROFILE_RANGE_BLOCKS 16
+
+// Maximum number of entries saved in a profile
+#define EXT2_PROFILE_MAX_ENTRIES 32768
+
+// Maximum number of blocks (and inodes) read by one warming step
+#define EXT2_PROFILE_STEP 64
+
+// Time the warming thread waits without foreground reads before each step
+#define EXT2_PROFILE_IDLE_MS 2
+
+// I/O priority class for ioprio_set (see linux/ioprio.h)
+#define EXT2_IOPRIO_CLASS_IDLE 3
+#define EXT2_IOPRIO_CLASS_SHIFT 13
+#define EXT2_IOPRIO_WHO_PROCESS 1
+
+struct profile {
+    _Atomic uint64_t keys[EXT2_PROFILE_SLOTS]; // kind << 32 | value, 0 if the slot is free
+    _Atomic uint32_t counts[EXT2_PROFILE_SLOTS];
+    _Atomic uint64_t dropped;                  // Accesses whose key did not fit
+    _Atomic uint64_t foreground;               // Reads by threads other than the warming thread
+
+    pthread_t warmer;
+    int warming;                               // The warming thread was started
+    _Atomic int stop;
+    char *warm_file;
+    profile_warm_stats_t warm_stats;
+};
+
+// Set in the warming thread, whose reads are neither recorded nor foreground
+static __thread int warming_thread;
+
+static inline uint64_t profile_key(uint32_t kind, uint32_t value) {
+    return (uint64_t) kind << 32 | value;
+}
+
+static void profile_count(profile_t *profile, uint64_t key) {
+
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    size_t slot = (h >> 32) & (EXT2_PROFILE_SLOTS - 1);
+
+    // Probe at most a few slots; the table is a sample, not an index
+    for (int probe = 0; probe < 8; probe++, slot = (slot + 1) & (EXT2_PROFILE_SLOTS - 1)) {
+        uint64_t current = atomic_load_explicit(&profile->keys[slot], memory_order_relaxed);
+
+        if (current == 0) {
+            if (atomic_compare_exchange_strong(&profile->keys[slot], &current, key))
+                current = key;
+        }
+        if (current == key) {
+            atomic_fetch_add_explicit(&profile->counts[slot], 1, memory_order_relaxed);
+            return;
+        }
+    }
+    atomic_fetch_add_explicit(&profile->dropped, 1, memory_order_relaxed);
+}
+
+/* profile_attach: Starts recording the accesses to a volume.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted.
+ */
+int profile_attach(volume_t *volume) {
+
+    if (volume->profile) return 0;
+    volume->profile = calloc(1, sizeof(profile_t));
+    return volume->profile ? 0 : -1;
+}
+
+/* profile_detach: Stops recording and warming, waiting for the
+   warming thread to finish, and releases the recorded profile. Does
+   nothing if the volume is not profiled.
+ */
+void profile_detach(volume_t *volume) {
+
+    profile_t *profile = volume->profile;
+    if (!profile) return;
+
+    if (profile->warming) {
+        atomic_store(&profile->stop, 1);
+        pthread_join(profile->warmer, NULL);
+    }
+    volume->profile = NULL;
+    free(profile->warm_file);
+    free(profile);
+}
+
+/* profile_record_inode: Counts one access to an inode. */
+void profile_record_inode(volume_t *volume, uint32_t inode_no) {
+
+    if (warming_thread) return;
+    profile_count(volume->profile, profile_key(EXT2_PROFILE_INODE, inode_no));
+}
+
+/* profile_record_blocks: Counts one access to 'count' consecutive
+   blocks starting at 'block_no', and notes foreground activity. */
+void profile_record_blocks(volume_t *volume, uint32_t block_no, uint32_t count) {
+
+    if (warming_thread) return;
+
+    profile_t *profile = volume->profile;
+    atomic_fetch_add_explicit(&profile->foreground, 1, memory_order_relaxed);
+
+    uint32_t last = (block_no + (count ? count - 1 : 0)) / EXT2_PROFILE_RANGE_BLOCKS;
+    for (uint32_t range = block_no / EXT2_PROFILE_RANGE_BLOCKS; range <= last; range++)
+        profile_count(profile, profile_key(EXT2_PROFILE_BLOCKS, range * EXT2_PROFILE_RANGE_BLOCKS));
+}
+
+static int compare_weight(const void *a, const void *b) {
+
+    const profile_entry_t *x = a, *y = b;
+    return x->weight > y->weight ? -1 : x->weight < y->weight;
+}
+
+static int compare_entry(const void *a, const void *b) {
+
+    const profile_entry_t *x = a, *y = b;
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+/* profile_save: Writes the profile recorded so far to a file,
+   replacing it atomically. Counts keep accumulating, so later saves
+   include the accesses of earlier ones.
+
+   Parameters:
+     volume: Pointer to a profiled volume.
+     filename: Name of the profile file.
+
+   Returns:
+     The number of entries saved, or -1 on error (with errno set).
+ */
+ssize_t profile_save(volume_t *volume, const char *filename) {
+
+    profile_t *profile = volume->profile;
+    profile_entry_t *entries = malloc(sizeof(profile_entry_t) * EXT2_PROFILE_SLOTS);
+    size_t count = 0;
+
+    if (!profile) {
+        errno = EINVAL;
+        free(entries);
+        return -1;
+    }
+    if (!entries) return -1;
+
+    for (size_t i = 0; i < EXT2_PROFILE_SLOTS; i++) {
+        uint64_t key = atomic_load_explicit(&profile->keys[i], memory_order_relaxed);
+        uint32_t weight = atomic_load_explicit(&profile->counts[i], memory_order_relaxed);
+
+        if (key && weight)
+            entries[count++] = (profile_entry_t) {
+                .value = (uint32_t) key, .weight = weight,
+                .length = (key >> 32) == EXT2_PROFILE_BLOCKS ? EXT2_PROFILE_RANGE_BLOCKS : 1,
+                .kind = key >> 32 };
+    }
+
+    // Keep the heaviest entries, then merge adjacent ranges
+    if (count > EXT2_PROFILE_MAX_ENTRIES) {
+        qsort(entries, count, sizeof(profile_entry_t), compare_weight);
+        count = EXT2_PROFILE_MAX_ENTRIES;
+    }
+    qsort(entries, count, sizeof(profile_entry_t), compare_entry);
+
+    size_t merged = 0;
+    for (size_t i = 0; i < count; i++) {
+        profile_entry_t *last = merged ? &entries[merged - 1] : NULL;
+        if (last && last->kind == EXT2_PROFILE_BLOCKS && entries[i].kind == EXT2_PROFILE_BLOCKS &&
+            last->value + last->length == entries[i].value &&
+            last->length + entries[i].length <= UINT16_MAX) {
+            last->length += entries[i].length;
+            last->weight = last->weight > UINT32_MAX - entries[i].weight ? UINT32_MAX : last->weight + entries[i].weight;
+        } else {
+            entries[merged++] = entries[i];
+        }
+    }
+
+    profile_header_t header = { .version = EXT2_PROFILE_VERSION, .block_size = volume->block_size,
+                                .num_entries = merged };
+    memcpy(header.magic, EXT2_PROFILE_MAGIC, sizeof(header.magic));
+    memcpy(header.uuid, volume->super.s_uuid, sizeof(header.uuid));
+
+    size_t len = strlen(filename);
+    char *temp = malloc(len + 5);
+    FILE *file = NULL;
+    int ok = 0;
+
+    if (temp) {
+        snprintf(temp, len + 5, "%s.tmp", filename);
+        file = fopen(temp, "wb");
+    }
+    if (file) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(entries, sizeof(profile_entry_t), merged, file) == merged;
+        ok = fclose(file) == 0 && ok && rename(temp, filename) == 0;
+        if (!ok) unlink(temp);
+    }
+
+    int saved_errno = errno;
+    free(temp);
+    free(entries);
+    errno = saved_errno;
+    return ok ? (ssize_t) merged : -1;
+}
+
+/* profile_load: Reads a profile file written by profile_save for the
+   same volume.
+
+   Parameters:
+     volume: Pointer to volume.
+     filename: Name of the profile file.
+     entries: Set to a newly allocated array of entries, to be freed
+              by the caller.
+
+   Returns:
+     The number of entries, or -1 if the file cannot be read or is
+     not a profile of this volume.
+ */
+ssize_t profile_load(volume_t *volume, const char *filename, profile_entry_t **entries) {
+
+    FILE *file = fopen(filename, "rb");
+    profile_header_t header;
+
+    *entries = NULL;
+    if (!file) return -1;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, EXT2_PROFILE_MAGIC, sizeof(header.magic)) ||
+        header.version != EXT2_PROFILE_VERSION || header.block_size != volume->block_size ||
+        memcmp(header.uuid, volume->super.s_uuid, sizeof(header.uuid)) ||
+        header.num_entries > EXT2_PROFILE_SLOTS ||
+        !(*entries = malloc(sizeof(profile_entry_t) * (header.num_entries + 1))) ||
+        fread(*entries, sizeof(profile_entry_t), header.num_entries, file) != header.num_entries) {
+        fclose(file);
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+
+    fclose(file);
+    return header.num_entries;
+}
+
+/* Physical block holding an entry, for ordering the reads. */
+static uint64_t entry_location(volume_t *volume, const profile_entry_t *entry) {
+
+    if (entry->kind == EXT2_PROFILE_BLOCKS) return entry->value;
+
+    uint32_t ipg = volume->super.s_inodes_per_group;
+    const group_desc_t *desc = get_group_desc(volume, (entry->value - 1) / ipg);
+    if (!desc) return UINT64_MAX;
+    return desc->bg_inode_table + (uint64_t) ((entry->value - 1) % ipg) * volume->inode_size / volume->block_size;
+}
+
+typedef struct warm_item {
+    uint64_t location;
+    uint32_t index;
+} warm_item_t;
+
+static int compare_location(const void *a, const void *b) {
+
+    const warm_item_t *x = a, *y = b;
+    return x->location < y->location ? -1 : x->location > y->location;
+}
+
+/* Returns once no foreground read happened for EXT2_PROFILE_IDLE_MS,
+   if any happened since the last call ('seen' is the foreground count
+   then), or -1 if warming must stop. */
+static int wait_for_idle(profile_t *profile, uint64_t *seen) {
+
+    struct timespec idle = { 0, EXT2_PROFILE_IDLE_MS * 1000000L };
+    uint64_t now = atomic_load_explicit(&profile->foreground, memory_order_relaxed);
+
+    while (now != *seen) {
+        profile->warm_stats.deferrals++;
+        *seen = now;
+        nanosleep(&idle, NULL);
+        now = atomic_load_explicit(&profile->foreground, memory_order_relaxed);
+    }
+    return atomic_load(&profile->stop) ? -1 : 0;
+}
+
+static void *warm_thread(void *arg) {
+
+    volume_t *volume = arg;
+    profile_t *profile = volume->profile;
+    profile_warm_stats_t *stats = &profile->warm_stats;
+    profile_entry_t *entries;
+    struct timespec start, end;
+
+    warming_thread = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Lowest CPU and I/O priority for this thread only; both are best effort
+    pid_t tid = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, EXT2_IOPRIO_WHO_PROCESS, tid, EXT2_IOPRIO_CLASS_IDLE << EXT2_IOPRIO_CLASS_SHIFT);
+
+    ssize_t count = profile_load(volume, profile->warm_file, &entries);
+    warm_item_t *order = count > 0 ? malloc(sizeof(warm_item_t) * count) : NULL;
+    uint32_t inode_nos[EXT2_PROFILE_STEP];
+    inode_t *inodes = malloc(sizeof(inode_t) * EXT2_PROFILE_STEP);
+    char *buffer = malloc((size_t) EXT2_PROFILE_STEP * volume->block_size);
+    uint64_t seen = atomic_load(&profile->foreground);
+
+    if (count < 0 || (count > 0 && !order) || !inodes || !buffer)
+        goto done;
+
+    for (ssize_t i = 0; i < count; i++)
+        order[i] = (warm_item_t) { entry_location(volume, &entries[i]), i };
+    qsort(order, count, sizeof(warm_item_t), compare_location);
+
+    size_t pending = 0;
+    for (ssize_t i = 0; i <= count; i++) {
+        profile_entry_t *entry = i < count ? &entries[order[i].index] : NULL;
+
+        // Inodes are read in batches, so each inode table block is read once
+        if (pending && (!entry || entry->kind != EXT2_PROFILE_INODE || pending == EXT2_PROFILE_STEP)) {
+            if (wait_for_idle(profile, &seen) < 0) goto done;
+            ssize_t found = read_inodes(volume, inode_nos, pending, inodes);
+            if (found > 0) stats->inodes += found;
+            pending = 0;
+        }
+        if (!entry) break;
+
+        if (entry->kind == EXT2_PROFILE_INODE) {
+            inode_nos[pending++] = entry->value;
+            continue;
+        }
+
+        for (uint32_t done = 0; done < entry->length; done += EXT2_PROFILE_STEP) {
+            uint32_t blocks = entry->length - done < EXT2_PROFILE_STEP ? entry->length - done : EXT2_PROFILE_STEP;
+
+            if (wait_for_idle(profile, &seen) < 0) goto done;
+            if (read_block(volume, entry->value + done, 0, blocks * volume->block_size, buffer) > 0)
+                stats->blocks += blocks;
+        }
+    }
+    stats->completed = 1;
+
+done:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    stats->entries = count > 0 ? count : 0;
+    free(entries);
+    free(order);
+    free(inodes);
+    free(buffer);
+    return NULL;
+}
+
+/* profile_warm_start: Starts reading, in the background, the inodes
+   and blocks listed in a profile file. The volume must be profiled
+   (see profile_attach); its own recording ignores the warming reads.
+
+   Parameters:
+     volume: Pointer to a profiled volume.
+     filename: Name of a profile file saved for this volume.
+
+   Returns:
+     0 if the warming thread was started, or -1 on error. A missing
+     or mismatched profile is only detected by the thread, and
+     reported by profile_warm_wait.
+ */
+int profile_warm_start(volume_t *volume, const char *filename) {
+
+    profile_t *profile = volume->profile;
+
+    if (!profile || profile->warming || !(profile->warm_file = strdup(filename))) return -1;
+    if (pthread_create(&profile->warmer, NULL, warm_thread, volume) != 0) return -1;
+    profile->warming = 1;
+    return 0;
+}
+
+/* profile_warm_wait: Waits for warming to finish.
+
+   Parameters:
+     volume: Pointer to a profiled volume.
+     stats: Filled with what the warming thread did (may be NULL).
+
+   Returns:
+     0 if warming ran to completion, or -1 if it was not started,
+     the profile could not be used or warming failed.
+ */
+int profile_warm_wait(volume_t *volume, profile_warm_stats_t *stats) {
+
+    profile_t *profile = volume->profile;
+
+    if (!profile || !profile->warming) return -1;
+    pthread_join(profile->warmer, NULL);
+    profile->warming = 0;
+    if (stats) *stats = profile->warm_stats;
+    return profile->warm_stats.completed ? 0 : -1;
+}
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include "ext2.h"
+
+/* ext2replay: Replays the operations of a trace recorded by ext2fs
+   (--trace) directly against the library, on any volume file. By
+   default operations are issued open-loop, each at the time it
+   started in the trace, and latency is measured from that time, so
+   queueing delays show up as they would in production. With -f
+   operations are issued back to back, as fast as possible. With -S
+   operations go through a scheduler, as in ext2fs (--sched-slots),
+   and the queueing of each class is reported.
+ */
+
+// Number of directory entries read per batch when replaying readdir
+#define REPLAY_READDIR_BATCH 256
+
+typedef struct replay_op {
+  trace_record_t record;
+  char *path;
+  uint64_t latency_ns; // Latency measured during the replay
+  int32_t result;      // Result of the replay
+} replay_op_t;
+
+static replay_op_t *ops;
+static size_t num_ops;
+static _Atomic size_t next_op;
+static volume_t *volume;
+static int as_fast_as_possible;
+static uint64_t replay_epoch;
+static size_t max_read_size;
+static _Atomic uint64_t total_blocks;
+static ext2_sched_t *scheduler;
+
+static const char *op_names[] = { "?", "getattr", "readdir", "read", "readlink" };
+
+static uint64_t now_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_start(const void *a, const void *b) {
+
+  const replay_op_t *x = a, *y = b;
+  return x->record.start_ns < y->record.start_ns ? -1 : x->record.start_ns > y->record.start_ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Executes an operation other than read on the inode found for its
+   path. */
+static int32_t replay_metadata(replay_op_t *op, inode_t *inode, char *buf, dir_entry_t *entries,
+                               inode_t *inodes) {
+
+  switch (op->record.op) {
+  case EXT2_TRACE_GETATTR:
+    return 0;
+
+  case EXT2_TRACE_READDIR: {
+    off_t offset = op->record.offset;
+    uint32_t inode_nos[REPLAY_READDIR_BATCH];
+    ssize_t count;
+
+    if (!inode_is_directory(inode))
+      return -ENOTDIR;
+    while ((count = read_directory_entries(volume, inode, &offset, entries, NULL,
+                                           REPLAY_READDIR_BATCH)) > 0) {
+      for (ssize_t i = 0; i < count; i++)
+        inode_nos[i] = entries[i].de_inode_no;
+      read_inodes(volume, inode_nos, count, inodes);
+    }
+    return count < 0 ? -EIO : 0;
+  }
+
+  case EXT2_TRACE_READLINK:
+    if (!inode_is_symlink(inode))
+      return -EINVAL;
+    return read_symlink_target(volume, inode, buf, op->record.size ? op->record.size : 1) > 0 ? 0 : -EIO;
+  }
+  return -EINVAL;
+}
+
+/* Executes one operation against the library, returning what ext2fs
+   would have returned to FUSE. As in ext2fs, the path lookup and
+   operations other than read are metadata, and the data of reads is
+   read in pieces. */
+static int32_t replay(replay_op_t *op, char *buf, dir_entry_t *entries, inode_t *inodes) {
+
+  inode_t inode;
+  int32_t rv = 0;
+
+  sched_enter(scheduler, EXT2_SCHED_META, 0);
+  uint32_t inode_no = find_file_from_path(volume, op->path, &inode);
+  if (!inode_no)
+    rv = -ENOENT;
+  else if (op->record.op != EXT2_TRACE_READ)
+    rv = replay_metadata(op, &inode, buf, entries, inodes);
+  sched_exit(scheduler, EXT2_SCHED_META);
+
+  if (!inode_no || op->record.op != EXT2_TRACE_READ)
+    return rv;
+  if (inode_is_directory(&inode))
+    return -EISDIR;
+  ssize_t read = sched_read_file_content(scheduler, inode_no, volume, inode_no, &inode, op->record.offset,
+                                         op->record.size, buf, NULL);
+  return read < 0 ? -EIO : read;
+}
+
+static void *replay_thread(void *arg) {
+
+  char *buf = malloc(max_read_size + 1);
+  dir_entry_t *entries = malloc(sizeof(dir_entry_t) * REPLAY_READDIR_BATCH);
+  inode_t *inodes = malloc(sizeof(inode_t) * REPLAY_READDIR_BATCH);
+  size_t index;
+
+  while ((index = atomic_fetch_add(&next_op, 1)) < num_ops) {
+    replay_op_t *op = &ops[index];
+    uint64_t start;
+
+    if (as_fast_as_possible) {
+      start = now_ns();
+    } else {
+      start = replay_epoch + op->record.start_ns;
+      struct timespec at = { start / 1000000000ULL, start % 1000000000ULL };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR);
+    }
+
+    uint64_t blocks = trace_blocks;
+    op->result = replay(op, buf, entries, inodes);
+    op->latency_ns = now_ns() - start;
+    atomic_fetch_add(&total_blocks, trace_blocks - blocks);
+  }
+
+  free(buf);
+  free(entries);
+  free(inodes);
+  return NULL;
+}
+
+static void print_latencies(const char *label, uint64_t *latencies, size_t count) {
+
+  qsort(latencies, count, sizeof(uint64_t), compare_u64);
+
+  uint64_t sum = 0;
+  for (size_t i = 0; i < count; i++)
+    sum += latencies[i];
+
+  printf("    %-8s mean %10.1f  p50 %10.1f  p99 %10.1f  max %10.1f us\n", label,
+         sum / 1e3 / count, latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3,
+         latencies[count - 1] / 1e3);
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-f] [-t threads] [-c cache_mib] [-i] [-S slots] [-k chunk_kib] [-s profile] [-w profile] [-p prefix] trace_file volume_file\n"
+          "  -f         issue operations as fast as possible instead of at their recorded times\n"
+          "  -t threads number of threads issuing operations (default 1)\n"
+          "  -c MiB     attach the volume to a cache pool of this size (default: no cache)\n"
+          "  -i         keep inodes in a compact inode table instead of the cache pool\n"
+          "  -S slots   schedule operations with this many slots, half of them for reads (default: unscheduled)\n"
+          "  -k KiB     with -S, size of the pieces reads are split into (default 128)\n"
+          "  -s profile save the access profile of the replay to this file\n"
+          "  -w profile warm the caches from this access profile while replaying\n"
+          "  -p prefix  replay only paths starting with prefix (e.g. /volume of a\n"
+          "             multi-volume mount), with the prefix removed\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  int num_threads = 1, flags = 0, sched_slots = 0, opt;
+  uint64_t cache_mib = 0, chunk_kib = 128;
+  const char *prefix = "", *save_file = NULL, *warm_file = NULL;
+
+  while ((opt = getopt(argc, argv, "ft:c:iS:k:s:w:p:")) != -1) {
+    switch (opt) {
+    case 'f': as_fast_as_possible = 1; break;
+    case 't': num_threads = atoi(optarg); break;
+    case 'c': cache_mib = strtoull(optarg, NULL, 10); break;
+    case 'i': flags |= EXT2_OPEN_INODE_TABLE; break;
+    case 'S': sched_slots = atoi(optarg); break;
+    case 'k': chunk_kib = strtoull(optarg, NULL, 10); break;
+    case 's': save_file = optarg; break;
+    case 'w': warm_file = optarg; break;
+    case 'p': prefix = optarg; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind != 2 || num_threads < 1 || sched_slots < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  trace_header_t header;
+  FILE *trace = trace_open(argv[optind], &header);
+  if (!trace) {
+    fprintf(stderr, "Invalid trace file: %s.\n", argv[optind]);
+    return 1;
+  }
+
+  volume = open_volume_file_flags(argv[optind + 1], flags);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind + 1]);
+    return 1;
+  }
+
+  cache_pool_t *pool = NULL;
+  if (cache_mib) {
+    pool = cache_pool_create(cache_mib << 20);
+    cache_attach_volume(pool, volume);
+  }
+
+  if (sched_slots && !(scheduler = sched_create(sched_slots, sched_slots / 2, chunk_kib << 10))) {
+    fprintf(stderr, "Not enough memory for the scheduler.\n");
+    return 1;
+  }
+
+  if ((save_file || warm_file) && profile_attach(volume) < 0) {
+    fprintf(stderr, "Not enough memory to record an access profile.\n");
+    return 1;
+  }
+
+  trace_record_t record;
+  char path[PATH_MAX];
+  size_t capacity = 0, prefix_len = strlen(prefix);
+  int rv;
+
+  while ((rv = trace_read_record(trace, &record, path, sizeof(path))) > 0) {
+    if (record.op < EXT2_TRACE_GETATTR || record.op > EXT2_TRACE_READLINK ||
+        strncmp(path, prefix, prefix_len))
+      continue;
+    if (num_ops == capacity) {
+      replay_op_t *grown = realloc(ops, (capacity ? capacity * 2 : 1024) * sizeof(replay_op_t));
+      if (!grown) {
+        fprintf(stderr, "Not enough memory to load the trace.\n");
+        return 1;
+      }
+      ops = grown;
+      capacity = capacity ? capacity * 2 : 1024;
+    }
+    ops[num_ops].record = record;
+    if (!(ops[num_ops].path = strdup(path[prefix_len] ? path + prefix_len : "/"))) {
+      fprintf(stderr, "Not enough memory to load the trace.\n");
+      return 1;
+    }
+    if (record.op == EXT2_TRACE_READ && record.size > max_read_size)
+      max_read_size = record.size;
+    num_ops++;
+  }
+  if (rv < 0)
+    fprintf(stderr, "Trace file is truncated; replaying the first %zu operations.\n", num_ops);
+  fclose(trace);
+
+  if (max_read_size < PATH_MAX)
+    max_read_size = PATH_MAX;
+
+  // Records are stored per thread; replay them in global time order
+  qsort(ops, num_ops, sizeof(replay_op_t), compare_start);
+  if (num_ops)
+    for (size_t i = num_ops; i-- > 0; )
+      ops[i].record.start_ns -= ops[0].record.start_ns;
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  if (!threads) {
+    fprintf(stderr, "Not enough memory for the replay threads.\n");
+    return 1;
+  }
+  uint64_t started = now_ns();
+  replay_epoch = started;
+  if (warm_file && profile_warm_start(volume, warm_file) < 0)
+    fprintf(stderr, "Cannot start warming from %s.\n", warm_file);
+  for (int i = 0; i < num_threads; i++)
+    pthread_create(&threads[i], NULL, replay_thread, NULL);
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+  uint64_t elapsed = now_ns() - started;
+
+  profile_warm_stats_t warm = { 0 };
+  if (warm_file && profile_warm_wait(volume, &warm) < 0)
+    fprintf(stderr, "Warming from %s did not complete.\n", warm_file);
+
+  printf("Replayed %zu operations in %.3f s (%.0f ops/s), %s, %d thread(s)\n", num_ops,
+         elapsed / 1e9, num_ops / (elapsed / 1e9), as_fast_as_possible ? "as fast as possible" : "open-loop",
+         num_threads);
+  printf("Blocks touched        : %" PRIu64 "\n", atomic_load(&total_blocks));
+
+  cache_stats_t stats;
+  if (cache_volume_stats(volume, &stats) == 0)
+    printf("Cache pool            : %" PRIu64 " bytes, %" PRIu64 " inode hits, %" PRIu64 " inode misses\n",
+           stats.used, stats.hits[EXT2_CACHE_INODE], stats.misses[EXT2_CACHE_INODE]);
+  if (volume->inodes) {
+    uint64_t inodes, bytes;
+    inode_table_usage(volume->inodes, &inodes, &bytes);
+    printf("Inode table           : %" PRIu64 " inodes in %" PRIu64 " bytes\n", inodes, bytes);
+  }
+  if (warm_file)
+    printf("Warming               : %" PRIu64 " entries, %" PRIu64 " inodes and %" PRIu64 " blocks read "
+           "in %.3f s, %" PRIu64 " deferrals\n", warm.entries, warm.inodes, warm.blocks, warm.seconds,
+           warm.deferrals);
+  if (save_file) {
+    ssize_t saved = profile_save(volume, save_file);
+    if (saved < 0)
+      fprintf(stderr, "Cannot save access profile %s.\n", save_file);
+    else
+      printf("Access profile        : %zd entries saved to %s\n", saved, save_file);
+  }
+
+  for (int class = 0; scheduler && class < EXT2_SCHED_CLASSES; class++) {
+    sched_stats_t stats;
+    sched_stats(scheduler, class, &stats);
+    printf("Scheduler (%s)      : %" PRIu64 " admitted, %" PRIu64 " queued (at most %" PRIu32 " at once), "
+           "wait mean %.1f p99 %.1f max %.1f us\n", class == EXT2_SCHED_META ? "meta" : "bulk", stats.granted,
+           stats.waited, stats.max_queued, stats.granted ? stats.wait_ns / 1e3 / stats.granted : 0.0,
+           sched_wait_percentile(&stats, 0.99) / 1e3, stats.max_wait_ns / 1e3);
+  }
+
+  uint64_t *replayed = malloc(sizeof(uint64_t) * (num_ops + 1));
+  uint64_t *recorded = malloc(sizeof(uint64_t) * (num_ops + 1));
+
+  for (int op = EXT2_TRACE_GETATTR; op <= EXT2_TRACE_READLINK; op++) {
+    size_t count = 0, mismatches = 0;
+    uint64_t recorded_blocks = 0;
+
+    for (size_t i = 0; i < num_ops; i++) {
+      if (ops[i].record.op != op) continue;
+      replayed[count] = ops[i].latency_ns;
+      recorded[count] = ops[i].record.latency_ns;
+      recorded_blocks += ops[i].record.blocks;
+      if (ops[i].result != ops[i].record.result) mismatches++;
+      count++;
+    }
+    if (!count) continue;
+
+    printf("\n%s: %zu operations, %zu with a result different from the trace, "
+           "%" PRIu64 " blocks touched in the trace\n", op_names[op], count, mismatches, recorded_blocks);
+    print_latencies("trace", recorded, count);
+    print_latencies("replay", replayed, count);
+  }
+
+  for (size_t i = 0; i < num_ops; i++)
+    free(ops[i].path);
+  free(ops);
+  free(replayed);
+  free(recorded);
+  free(threads);
+  sched_destroy(scheduler);
+  close_volume_file(volume);
+  cache_pool_destroy(pool);
+  return 0;
+}
@@ -0,0 +1,381 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Batched path resolution. The paths of a batch are merged into a
+   trie of their components, so a directory shared by many paths (the
+   root directory, to begin with) is searched once for the whole
+   batch. The trie is resolved one depth at a time: each directory
+   with wanted children is scanned once, matching every entry against
+   all the names wanted in it, and the inodes found are read together
+   with read_inodes. The directories of a depth are spread over the
+   threads of the batch.
+
+   Paths whose walk meets a symbolic link to follow leave the trie:
+   they are resolved on their own with resolve_path, once the trie is
+   done.
+ */
+
+// Number of directory entries matched per read_directory_entries call
+#define EXT2_RESOLVE_BATCH 64
+
+// Fewest directories (or paths) in a pass worth starting threads for
+#define EXT2_RESOLVE_PARALLEL_MIN 64
+
+typedef struct trie_node {
+    const char *name;     // Component, null-terminated (unused for the root)
+    uint32_t parent;
+    uint32_t first_child; // 0 if none (node 0 is the root, never a child)
+    uint32_t next_sibling;
+    uint32_t num_children;
+    uint32_t depth;
+    uint32_t inode_no;    // 0 until found
+    int error;            // errno value once the component is known not to resolve
+    int symlink;          // A symbolic link that the walk follows
+    int detached;         // Below a followed symbolic link: resolved with resolve_path
+    inode_t inode;
+} trie_node_t;
+
+typedef struct resolver {
+    volume_t *volume;
+    int flags;
+    trie_node_t *nodes;
+    uint32_t num_nodes;
+    uint32_t *slots;      // Hash table of node numbers + 1, keyed by parent and name
+    uint32_t slot_mask;
+
+    const char *const *paths;
+    uint32_t *terminal;   // Node of each path
+    path_result_t *results;
+    size_t count;
+
+    unsigned int num_threads;
+    int pass;             // 0 to resolve the directories in 'work', 1 to fill in the results
+    uint32_t *work;
+    size_t num_work;
+    _Atomic size_t next;
+} resolver_t;
+
+static uint64_t name_hash(uint32_t parent, const char *name, size_t len) {
+
+    // FNV-1a over the name, seeded with the parent node
+    uint64_t hash = 0xCBF29CE484222325ULL ^ parent;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Returns the slot holding the child 'name' of 'parent', or the free slot where it belongs
+static uint32_t *find_slot(resolver_t *resolver, uint32_t parent, const char *name, size_t len) {
+
+    uint32_t slot = name_hash(parent, name, len) & resolver->slot_mask;
+
+    for (;; slot = (slot + 1) & resolver->slot_mask) {
+        uint32_t node = resolver->slots[slot];
+        if (node == 0) return &resolver->slots[slot];
+
+        trie_node_t *n = &resolver->nodes[node - 1];
+        if (n->parent == parent && strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
+            return &resolver->slots[slot];
+    }
+}
+
+/* Splits a copy of each path in components and adds them to the trie.
+   'work' receives the copies, to be freed by the caller. */
+static int build_trie(resolver_t *resolver, char **work) {
+
+    size_t components = 1;
+
+    for (size_t i = 0; i < resolver->count; i++) {
+        work[i] = strdup(resolver->paths[i]);
+        if (!work[i]) return -1;
+        for (const char *c = work[i]; *c; c++)
+            components += *c == '/';
+        components++;
+    }
+    if (components >= UINT32_MAX / 2) return -1;
+
+    uint32_t num_slots = 16;
+    while (num_slots < components * 2) num_slots *= 2;
+
+    resolver->nodes = calloc(components, sizeof(trie_node_t));
+    resolver->slots = calloc(num_slots, sizeof(uint32_t));
+    if (!resolver->nodes || !resolver->slots) return -1;
+    resolver->slot_mask = num_slots - 1;
+    resolver->num_nodes = 1;
+
+    for (size_t i = 0; i < resolver->count; i++) {
+        char *cursor = work[i];
+        uint32_t node = 0;
+
+        for (;;) {
+            while (*cursor == '/') cursor++;
+            if (!*cursor) break;
+
+            char *name = cursor;
+            cursor += strcspn(cursor, "/");
+            if (*cursor) *cursor++ = '\0';
+
+            uint32_t *slot = find_slot(resolver, node, name, strlen(name));
+            if (*slot == 0) {
+                trie_node_t *child = &resolver->nodes[resolver->num_nodes];
+                trie_node_t *parent = &resolver->nodes[node];
+
+                child->name = name;
+                child->parent = node;
+                child->depth = parent->depth + 1;
+                child->next_sibling = parent->first_child;
+                parent->first_child = resolver->num_nodes;
+                parent->num_children++;
+                *slot = ++resolver->num_nodes;
+            }
+            node = *slot - 1;
+        }
+        resolver->terminal[i] = node;
+    }
+    return 0;
+}
+
+/* Finds the wanted children of a directory node, and reads their
+   inodes. Children of nodes that did not resolve, or that are left to
+   resolve_path, inherit their state. */
+static void resolve_children(resolver_t *resolver, uint32_t node_no, dir_entry_t *entries,
+                             uint32_t *inode_nos, inode_t *inodes) {
+
+    volume_t *volume = resolver->volume;
+    trie_node_t *node = &resolver->nodes[node_no];
+    uint32_t child;
+
+    if (node->error || node->detached || node->symlink) {
+        for (child = node->first_child; child; child = resolver->nodes[child].next_sibling) {
+            resolver->nodes[child].error = node->error;
+            resolver->nodes[child].detached = !node->error;
+        }
+        return;
+    }
+    if (!inode_is_directory(&node->inode)) {
+        for (child = node->first_child; child; child = resolver->nodes[child].next_sibling)
+            resolver->nodes[child].error = ENOTDIR;
+        return;
+    }
+
+    uint32_t remaining = node->num_children;
+    int failed = 0;
+
+    if (remaining == 1) {
+        // A single name gains nothing from a scan, and may be in the dentry cache
+        trie_node_t *only = &resolver->nodes[node->first_child];
+        int64_t inode_no = lookup_in_directory(volume, node->inode_no, &node->inode, only->name);
+        if (inode_no < 0) failed = 1;
+        else only->inode_no = inode_no;
+    } else {
+        off_t offset = 0;
+        ssize_t found = 0;
+
+        while (remaining && (found = read_directory_entries(volume, &node->inode, &offset, entries,
+                                                            NULL, EXT2_RESOLVE_BATCH)) > 0) {
+            for (ssize_t i = 0; i < found && remaining; i++) {
+                uint32_t *slot = find_slot(resolver, node_no, entries[i].de_name, entries[i].de_name_len);
+                if (*slot == 0 || resolver->nodes[*slot - 1].inode_no) continue;
+                resolver->nodes[*slot - 1].inode_no = entries[i].de_inode_no;
+                remaining--;
+            }
+        }
+        if (remaining && found < 0) failed = 1;
+    }
+
+    // Read the inodes found, EXT2_RESOLVE_BATCH at a time
+    child = node->first_child;
+    while (child) {
+        uint32_t batch[EXT2_RESOLVE_BATCH];
+        size_t count = 0;
+
+        for (; child && count < EXT2_RESOLVE_BATCH; child = resolver->nodes[child].next_sibling) {
+            trie_node_t *c = &resolver->nodes[child];
+            if (!c->inode_no) {
+                c->error = failed ? EIO : ENOENT;
+                continue;
+            }
+            inode_nos[count] = c->inode_no;
+            batch[count++] = child;
+        }
+        if (count == 0) continue;
+
+        if (read_inodes(volume, inode_nos, count, inodes) < 0) {
+            for (size_t i = 0; i < count; i++)
+                resolver->nodes[batch[i]].error = EIO;
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            trie_node_t *c = &resolver->nodes[batch[i]];
+
+            // Invalid inode numbers come back zeroed; tell them from free inodes as read_inode does
+            c->inode = inodes[i];
+            if (c->inode.i_mode == 0 && read_inode(volume, c->inode_no, &c->inode) <= 0) {
+                c->error = EIO;
+                continue;
+            }
+            c->symlink = inode_is_symlink(&c->inode) && (resolver->flags & EXT2_RESOLVE_FOLLOW);
+        }
+    }
+}
+
+static void fill_result(resolver_t *resolver, size_t index) {
+
+    trie_node_t *node = &resolver->nodes[resolver->terminal[index]];
+    path_result_t *result = &resolver->results[index];
+    int keep_link = resolver->flags & EXT2_RESOLVE_NOFOLLOW_LAST;
+
+    memset(result, 0, sizeof(path_result_t));
+
+    if (node->detached || (node->symlink && !keep_link)) {
+        result->inode_no = resolve_path(resolver->volume, resolver->paths[index], &result->inode, resolver->flags);
+        result->error = result->inode_no ? 0 : errno;
+    } else if (node->error) {
+        result->error = node->error;
+    } else {
+        result->inode_no = node->inode_no;
+        result->inode = node->inode;
+    }
+}
+
+static void *resolve_worker(void *arg) {
+
+    resolver_t *resolver = arg;
+    size_t next;
+
+    if (resolver->pass == 0) {
+        dir_entry_t *entries = malloc(sizeof(dir_entry_t) * EXT2_RESOLVE_BATCH);
+        uint32_t *inode_nos = malloc(sizeof(uint32_t) * EXT2_RESOLVE_BATCH);
+        inode_t *inodes = malloc(sizeof(inode_t) * EXT2_RESOLVE_BATCH);
+
+        while ((next = atomic_fetch_add(&resolver->next, 1)) < resolver->num_work) {
+            if (entries && inode_nos && inodes) {
+                resolve_children(resolver, resolver->work[next], entries, inode_nos, inodes);
+                continue;
+            }
+            trie_node_t *node = &resolver->nodes[resolver->work[next]];
+            for (uint32_t child = node->first_child; child; child = resolver->nodes[child].next_sibling)
+                resolver->nodes[child].error = ENOMEM;
+        }
+
+        free(entries);
+        free(inode_nos);
+        free(inodes);
+    } else {
+        while ((next = atomic_fetch_add(&resolver->next, 1)) < resolver->count)
+            fill_result(resolver, next);
+    }
+    return NULL;
+}
+
+/* Runs one pass, with threads if there is enough work for them. The
+   calling thread is one of the workers. */
+static void run_pass(resolver_t *resolver, int pass, size_t items) {
+
+    unsigned int num_threads = items >= EXT2_RESOLVE_PARALLEL_MIN ? resolver->num_threads : 1;
+    pthread_t *threads = num_threads > 1 ? malloc(sizeof(pthread_t) * num_threads) : NULL;
+    unsigned int started = 0;
+
+    resolver->pass = pass;
+    atomic_store(&resolver->next, 0);
+
+    if (threads)
+        for (; started + 1 < num_threads; started++)
+            if (pthread_create(&threads[started], NULL, resolve_worker, resolver) != 0)
+                break;
+
+    resolve_worker(resolver);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+/* resolve_paths: Resolves a batch of paths, as resolve_path would
+   resolve each of them, but reading each directory shared by several
+   paths only once for the whole batch (see above).
+
+   Parameters:
+     volume: Pointer to volume.
+     paths: Array of 'count' absolute paths, as in find_file_from_path.
+            Paths may be repeated and may appear in any order.
+     count: Number of paths.
+     flags: 0 (zero) or a combination of EXT2_RESOLVE_* flags, as in
+            resolve_path.
+     num_threads: Number of threads used (at least 1) for large batches.
+     results: Array of 'count' results; results[i] receives the inode
+              number and inode of paths[i] if it exists, or an inode
+              number of 0 (zero) and the errno value resolve_path would
+              set.
+
+   Returns:
+     The number of paths found, or -1 if memory is exhausted, in which
+     case the results are undefined.
+ */
+ssize_t resolve_paths(volume_t *volume, const char *const *paths, size_t count, int flags,
+                      unsigned int num_threads, path_result_t *results) {
+
+    resolver_t resolver = { .volume = volume, .flags = flags, .paths = paths, .results = results,
+                            .count = count, .num_threads = num_threads ? num_threads : 1 };
+    char **work = calloc(count ? count : 1, sizeof(char *));
+    uint32_t *by_depth = NULL;
+    ssize_t found = -1;
+
+    resolver.terminal = malloc(sizeof(uint32_t) * (count ? count : 1));
+    if (!work || !resolver.terminal || build_trie(&resolver, work) < 0) goto done;
+
+    // Order the nodes by depth, so each depth is a contiguous run
+    uint32_t max_depth = 0;
+    for (uint32_t i = 0; i < resolver.num_nodes; i++)
+        if (resolver.nodes[i].depth > max_depth) max_depth = resolver.nodes[i].depth;
+
+    size_t *starts = calloc(max_depth + 2, sizeof(size_t));
+    by_depth = malloc(sizeof(uint32_t) * resolver.num_nodes);
+    if (!starts || !by_depth) {
+        free(starts);
+        goto done;
+    }
+    for (uint32_t i = 0; i < resolver.num_nodes; i++)
+        if (resolver.nodes[i].num_children) starts[resolver.nodes[i].depth + 1]++;
+    for (uint32_t d = 1; d <= max_depth + 1; d++)
+        starts[d] += starts[d - 1];
+    for (uint32_t i = 0; i < resolver.num_nodes; i++)
+        if (resolver.nodes[i].num_children) by_depth[starts[resolver.nodes[i].depth]++] = i;
+    // After the fill, starts[d] is the end of depth d, which is where depth d + 1 begins
+    size_t begin = 0;
+
+    trie_node_t *root = &resolver.nodes[0];
+    root->inode_no = EXT2_ROOT_INO;
+    if (read_inode(volume, EXT2_ROOT_INO, &root->inode) <= 0) root->error = EIO;
+
+    for (uint32_t d = 0; d <= max_depth; d++) {
+        resolver.work = by_depth + begin;
+        resolver.num_work = starts[d] - begin;
+        begin = starts[d];
+        if (resolver.num_work) run_pass(&resolver, 0, resolver.num_work);
+    }
+    free(starts);
+
+    run_pass(&resolver, 1, count);
+
+    found = 0;
+    for (size_t i = 0; i < count; i++)
+        found += results[i].inode_no != 0;
+
+ done:
+    if (work)
+        for (size_t i = 0; i < count; i++)
+            free(work[i]);
+    free(work);
+    free(by_depth);
+    free(resolver.terminal);
+    free(resolver.nodes);
+    free(resolver.slots);
+    return found;
+}
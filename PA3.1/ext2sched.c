@@ -0,0 +1,353 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* The scheduler decides which operation runs next when more of them
+   compete for the volume than it has slots. Each slot is one
+   operation in progress; callers bracket their work with sched_enter
+   and sched_exit, and run it in their own thread once admitted.
+
+   Operations come in two classes. Metadata operations (getattr,
+   readdir, readlink, path lookups) are short and admitted before any
+   bulk work. Bulk reads are split by sched_read_file_content into
+   pieces of at most the scheduler's chunk size, each admitted on its
+   own, and may hold at most bulk_slots slots at once, so the rest are
+   always free for metadata. Waiting pieces are queued per flow (an
+   open file), and flows take turns one piece at a time, so a file
+   streamed by many threads gets the same share as one read by one.
+ */
+
+typedef struct sched_waiter {
+    pthread_cond_t granted_cond;
+    int granted;
+    uint64_t queued_at;
+    struct sched_waiter *next;
+} sched_waiter_t;
+
+typedef struct sched_flow {
+    uint64_t key;
+    sched_waiter_t *head, *tail;
+    struct sched_flow *next; // Next flow in the round-robin ring
+} sched_flow_t;
+
+struct ext2_sched {
+    pthread_mutex_t lock;
+    unsigned int slots;
+    unsigned int bulk_slots;
+    uint32_t chunk_size;
+    unsigned int running[EXT2_SCHED_CLASSES];
+    sched_waiter_t *meta_head, *meta_tail;
+    sched_flow_t *flows_head, *flows_tail; // Flows with waiting pieces, in turn order
+    sched_stats_t stats[EXT2_SCHED_CLASSES];
+};
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Accounts an admission that waited wait_ns. Must be called with the
+   scheduler lock held. */
+static void record_grant(ext2_sched_t *sched, int class, uint64_t wait_ns) {
+
+    sched_stats_t *stats = &sched->stats[class];
+    uint64_t us = wait_ns / 1000;
+    int bucket = 0;
+
+    while (us && bucket < EXT2_SCHED_HISTOGRAM - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    sched->running[class]++;
+    stats->granted++;
+    stats->wait_ns += wait_ns;
+    if (wait_ns > stats->max_wait_ns) stats->max_wait_ns = wait_ns;
+    stats->wait_histogram[bucket]++;
+}
+
+static void grant(ext2_sched_t *sched, int class, sched_waiter_t *waiter, uint64_t now) {
+
+    sched->stats[class].queued--;
+    record_grant(sched, class, now - waiter->queued_at);
+    waiter->granted = 1;
+    pthread_cond_signal(&waiter->granted_cond);
+}
+
+/* Admits waiting operations while slots are free: metadata first,
+   then the next piece of the flow whose turn it is. Must be called
+   with the scheduler lock held. */
+static void dispatch(ext2_sched_t *sched) {
+
+    uint64_t now = 0;
+
+    while (sched->running[EXT2_SCHED_META] + sched->running[EXT2_SCHED_BULK] < sched->slots) {
+        if (!now) now = now_ns();
+
+        if (sched->meta_head) {
+            sched_waiter_t *waiter = sched->meta_head;
+            if (!(sched->meta_head = waiter->next)) sched->meta_tail = NULL;
+            grant(sched, EXT2_SCHED_META, waiter, now);
+        } else if (sched->flows_head && sched->running[EXT2_SCHED_BULK] < sched->bulk_slots) {
+            sched_flow_t *flow = sched->flows_head;
+            sched_waiter_t *waiter = flow->head;
+
+            if (!(flow->head = waiter->next)) flow->tail = NULL;
+            sched->flows_head = flow->next;
+            if (!sched->flows_head) sched->flows_tail = NULL;
+
+            // The flow goes to the back of the ring, or leaves it if it has nothing left
+            if (flow->head) {
+                flow->next = NULL;
+                if (sched->flows_tail) sched->flows_tail->next = flow;
+                else sched->flows_head = flow;
+                sched->flows_tail = flow;
+            } else {
+                free(flow);
+            }
+            grant(sched, EXT2_SCHED_BULK, waiter, now);
+        } else {
+            break;
+        }
+    }
+}
+
+/* Queues a bulk waiter behind the other pieces of its flow, adding the
+   flow at the back of the ring if it had none waiting. Must be called
+   with the scheduler lock held.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted. */
+static int enqueue_bulk(ext2_sched_t *sched, uint64_t key, sched_waiter_t *waiter) {
+
+    sched_flow_t *flow;
+
+    for (flow = sched->flows_head; flow && flow->key != key; flow = flow->next);
+
+    if (!flow) {
+        if (!(flow = malloc(sizeof(sched_flow_t)))) return -1;
+        flow->key = key;
+        flow->head = flow->tail = NULL;
+        flow->next = NULL;
+        if (sched->flows_tail) sched->flows_tail->next = flow;
+        else sched->flows_head = flow;
+        sched->flows_tail = flow;
+    }
+
+    if (flow->tail) flow->tail->next = waiter;
+    else flow->head = waiter;
+    flow->tail = waiter;
+    return 0;
+}
+
+/* sched_create: Allocates a scheduler.
+
+   Parameters:
+     slots: Maximum number of operations in progress at once.
+     bulk_slots: Maximum number of pieces of bulk reads in progress at
+                 once. Limited to slots - 1 (but at least 1), so that
+                 metadata operations always find a slot.
+     chunk_size: Maximum number of bytes read by a piece of a bulk
+                 read; 0 (zero) does not split reads.
+
+   Returns:
+     A pointer to the new scheduler, or NULL if memory is exhausted.
+ */
+ext2_sched_t *sched_create(unsigned int slots, unsigned int bulk_slots, uint32_t chunk_size) {
+
+    ext2_sched_t *sched = calloc(1, sizeof(ext2_sched_t));
+    if (!sched) return NULL;
+
+    sched->slots = slots > 1 ? slots : 2;
+    sched->bulk_slots = bulk_slots < 1 ? 1 : bulk_slots < sched->slots ? bulk_slots : sched->slots - 1;
+    sched->chunk_size = chunk_size;
+    pthread_mutex_init(&sched->lock, NULL);
+    return sched;
+}
+
+/* sched_destroy: Frees a scheduler. No operation may be in progress
+   or waiting.
+ */
+void sched_destroy(ext2_sched_t *sched) {
+
+    if (!sched) return;
+    pthread_mutex_destroy(&sched->lock);
+    free(sched);
+}
+
+/* sched_enter: Waits until an operation may run, and takes a slot for
+   it. Every call must be matched by a call to sched_exit with the same
+   class once the operation is done.
+
+   Parameters:
+     sched: Pointer to scheduler, or NULL to run unscheduled.
+     class: EXT2_SCHED_META or EXT2_SCHED_BULK.
+     flow: For bulk operations, identifies the open file the operation
+           reads from; ignored for metadata.
+ */
+void sched_enter(ext2_sched_t *sched, int class, uint64_t flow) {
+
+    if (!sched) return;
+
+    pthread_mutex_lock(&sched->lock);
+
+    unsigned int running = sched->running[EXT2_SCHED_META] + sched->running[EXT2_SCHED_BULK];
+    int admit = class == EXT2_SCHED_META ?
+                running < sched->slots && !sched->meta_head :
+                running < sched->slots && !sched->meta_head && !sched->flows_head &&
+                sched->running[EXT2_SCHED_BULK] < sched->bulk_slots;
+
+    if (admit) {
+        record_grant(sched, class, 0);
+        pthread_mutex_unlock(&sched->lock);
+        return;
+    }
+
+    sched_waiter_t waiter = { .queued_at = now_ns() };
+    pthread_cond_init(&waiter.granted_cond, NULL);
+
+    if (class == EXT2_SCHED_META) {
+        if (sched->meta_tail) sched->meta_tail->next = &waiter;
+        else sched->meta_head = &waiter;
+        sched->meta_tail = &waiter;
+    } else if (enqueue_bulk(sched, flow, &waiter) < 0) {
+        // Without memory to queue it, the piece runs over the limit rather than fail the read
+        record_grant(sched, class, 0);
+        pthread_mutex_unlock(&sched->lock);
+        pthread_cond_destroy(&waiter.granted_cond);
+        return;
+    }
+
+    sched_stats_t *stats = &sched->stats[class];
+    stats->waited++;
+    if (++stats->queued > stats->max_queued) stats->max_queued = stats->queued;
+
+    while (!waiter.granted)
+        pthread_cond_wait(&waiter.granted_cond, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+    pthread_cond_destroy(&waiter.granted_cond);
+}
+
+/* sched_exit: Releases the slot taken by sched_enter, admitting the
+   next waiting operations.
+
+   Parameters:
+     sched: Pointer to scheduler, or NULL.
+     class: Class passed to sched_enter.
+ */
+void sched_exit(ext2_sched_t *sched, int class) {
+
+    if (!sched) return;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->running[class]--;
+    dispatch(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* sched_read_file_content: Reads data from a file like
+   read_file_content, as bulk work of the given flow: the read is
+   split in pieces of at most the scheduler's chunk size, each admitted
+   separately, so other files and metadata operations get their turn
+   between pieces.
+
+   A volume that may be changed meanwhile is read under the caller's
+   lock, taken shared for each piece once the piece is admitted, never
+   while waiting for a slot. Changes may run between pieces, so the
+   inode is read again before the first piece, and before any piece
+   that follows a change to the volume's metadata.
+
+   Parameters:
+     sched: Pointer to scheduler, or NULL to read in one piece,
+            unscheduled.
+     flow: Identifies the open file being read.
+     inode_no: Number of the inode, used to read it again.
+     lock: Lock held shared while reading each piece, or NULL for a
+           volume that does not change.
+     The other parameters are those of read_file_content.
+
+   Returns:
+     The number of bytes read, or -1 if an error occurs before any
+     data is read.
+ */
+ssize_t sched_read_file_content(ext2_sched_t *sched, uint64_t flow, volume_t *volume, uint32_t inode_no,
+                                inode_t *inode, uint64_t offset, uint64_t size, void *buffer,
+                                pthread_rwlock_t *lock) {
+
+    uint64_t chunk = sched && sched->chunk_size ? sched->chunk_size : size;
+    uint64_t done = 0;
+    uint32_t seen = 0;
+
+    do {
+        uint64_t piece = size - done < chunk ? size - done : chunk;
+        ssize_t rv = 0;
+
+        sched_enter(sched, EXT2_SCHED_BULK, flow);
+        if (lock) {
+            pthread_rwlock_rdlock(lock);
+            uint32_t generation = atomic_load_explicit(&volume->generation, memory_order_acquire);
+            if (!done || generation != seen) {
+                seen = generation;
+                rv = read_inode(volume, inode_no, inode);
+            }
+        }
+        if (rv >= 0)
+            rv = read_file_content(volume, inode, offset + done, piece, (char *) buffer + done);
+        if (lock) pthread_rwlock_unlock(lock);
+        sched_exit(sched, EXT2_SCHED_BULK);
+
+        if (rv < 0) return done ? (ssize_t) done : -1;
+        done += rv;
+        if ((uint64_t) rv < piece) break;
+    } while (done < size);
+    return done;
+}
+
+/* sched_stats: Reports the activity of a class of operations.
+
+   Parameters:
+     sched: Pointer to scheduler.
+     class: EXT2_SCHED_META or EXT2_SCHED_BULK.
+     stats: Filled with the counts, queue depths and waiting times of
+            the class since the scheduler was created.
+ */
+void sched_stats(ext2_sched_t *sched, int class, sched_stats_t *stats) {
+
+    pthread_mutex_lock(&sched->lock);
+    *stats = sched->stats[class];
+    stats->running = sched->running[class];
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* sched_wait_percentile: Estimates a percentile of the time spent
+   waiting for a slot from the histogram of a class.
+
+   Parameters:
+     stats: Statistics filled by sched_stats.
+     fraction: Percentile as a fraction, e.g. 0.99.
+
+   Returns:
+     An upper bound of the percentile, in nanoseconds, no larger than
+     the longest wait: 0 if at least that fraction of operations were
+     admitted without waiting more than a microsecond.
+ */
+uint64_t sched_wait_percentile(const sched_stats_t *stats, double fraction) {
+
+    double target = stats->granted * fraction;
+    uint64_t seen = 0;
+
+    for (int bucket = 0; bucket < EXT2_SCHED_HISTOGRAM; bucket++) {
+        seen += stats->wait_histogram[bucket];
+        if (seen >= target) {
+            uint64_t bound = bucket ? 1000ULL << bucket : 0;
+            return bound < stats->max_wait_ns ? bound : stats->max_wait_ns;
+        }
+    }
+    return stats->max_wait_ns;
+}
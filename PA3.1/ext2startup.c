@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2startup: Measures how long it takes to start serving a volume:
+   the time to open it, and the time from then to the first getattr
+   (resolving a path and reading its inode), as ext2fs would. Each
+   volume file is opened several times, and the median times are
+   reported. With -c, the host page cache is dropped for the volume
+   file before each run, so every run starts cold.
+
+   Large test volumes cost little disk space as sparse files, e.g.:
+     truncate -s 4T big.img && mke2fs -t ext2 -T largefile4 big.img
+ */
+
+static double now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int count) {
+
+  qsort(values, count, sizeof(double), compare_double);
+  return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/* Evicts the pages of a file from the host page cache. */
+static void drop_page_cache(const char *filename) {
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-r runs] [-c] [-p path] volume_file...\n"
+          "  -r runs    number of times each volume is opened (default: 5)\n"
+          "  -c         drop the host page cache for the volume file before each run\n"
+          "  -p path    path looked up by the first getattr (default: /)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *path = "/";
+  int runs = 5, cold = 0, opt, status = 0;
+
+  while ((opt = getopt(argc, argv, "r:cp:")) != -1) {
+    switch (opt) {
+    case 'r': runs = atoi(optarg); break;
+    case 'c': cold = 1; break;
+    case 'p': path = optarg; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (optind == argc || runs < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  double *open_times = malloc(sizeof(double) * runs);
+  double *getattr_times = malloc(sizeof(double) * runs);
+  if (!open_times || !getattr_times) {
+    fprintf(stderr, "Not enough memory.\n");
+    return 1;
+  }
+
+  printf("%-24s %12s %8s %12s %12s %12s\n", "volume", "size (MiB)", "groups", "open (us)", "getattr (us)",
+         "total (us)");
+
+  for (int v = optind; v < argc; v++) {
+    uint64_t size = 0;
+    uint32_t groups = 0;
+    int failed = 0;
+
+    for (int r = 0; r < runs && !failed; r++) {
+      inode_t inode;
+
+      if (cold) drop_page_cache(argv[v]);
+
+      double start = now();
+      volume_t *volume = open_volume_file(argv[v]);
+      double opened = now();
+
+      if (!volume) {
+        fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[v]);
+        failed = 1;
+        break;
+      }
+      if (resolve_path(volume, path, &inode, EXT2_RESOLVE_FOLLOW) == 0) {
+        fprintf(stderr, "%s: cannot find %s.\n", argv[v], path);
+        failed = 1;
+      }
+      double found = now();
+
+      size = volume->volume_size;
+      groups = volume->num_groups;
+      close_volume_file(volume);
+
+      open_times[r] = (opened - start) * 1e6;
+      getattr_times[r] = (found - opened) * 1e6;
+    }
+
+    if (failed) {
+      status = 1;
+      continue;
+    }
+
+    double open_us = median(open_times, runs), getattr_us = median(getattr_times, runs);
+    printf("%-24s %12" PRIu64 " %8" PRIu32 " %12.1f %12.1f %12.1f\n", argv[v], size >> 20, groups,
+           open_us, getattr_us, open_us + getattr_us);
+  }
+
+  free(open_times);
+  free(getattr_times);
+  return status;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2stat: Looks up a list of paths, one per line, read from a file
+   or from the standard input, in a single resolve_paths batch, and
+   prints the inode number, mode and size of each. With -c, the paths
+   are also looked up one at a time with resolve_path on a separately
+   opened volume; both times are reported, and any path resolved
+   differently is an error.
+ */
+
+static double now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char **read_paths(FILE *file, size_t *count) {
+
+  char **paths = NULL, *line = NULL;
+  size_t capacity = 0, size = 0;
+  ssize_t len;
+
+  *count = 0;
+  while ((len = getline(&line, &size, file)) >= 0) {
+    if (len && line[len - 1] == '\n') line[--len] = '\0';
+    if (!len) continue;
+
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      char **grown = realloc(paths, sizeof(char *) * capacity);
+      if (!grown) break;
+      paths = grown;
+    }
+    if (!(paths[*count] = strdup(line))) break;
+    (*count)++;
+  }
+  free(line);
+  return paths;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-t threads] [-L] [-q] [-c] volume_file [path_list]\n"
+          "  -t threads  number of threads resolving the batch (default: 1)\n"
+          "  -L          follow symbolic links\n"
+          "  -q          do not print the result of each path\n"
+          "  -c          also look up each path on its own, and compare\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+  int threads = 1, flags = 0, quiet = 0, compare = 0, opt, status = 0;
+
+  while ((opt = getopt(argc, argv, "t:Lqc")) != -1) {
+    switch (opt) {
+    case 't': threads = atoi(optarg); break;
+    case 'L': flags |= EXT2_RESOLVE_FOLLOW; break;
+    case 'q': quiet = 1; break;
+    case 'c': compare = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc - optind < 1 || argc - optind > 2 || threads < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *list = argc - optind == 2 ? fopen(argv[optind + 1], "r") : stdin;
+  if (!list) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  size_t count;
+  char **paths = read_paths(list, &count);
+  if (list != stdin) fclose(list);
+
+  volume_t *volume = open_volume_file(argv[optind]);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+    return 1;
+  }
+
+  path_result_t *results = malloc(sizeof(path_result_t) * (count ? count : 1));
+  if (!results) {
+    fprintf(stderr, "Not enough memory for %zu paths.\n", count);
+    close_volume_file(volume);
+    return 1;
+  }
+
+  double start = now();
+  ssize_t found = resolve_paths(volume, (const char *const *) paths, count, flags, threads, results);
+  double batch_seconds = now() - start;
+
+  if (found < 0) {
+    fprintf(stderr, "Cannot resolve the paths.\n");
+    status = 1;
+  } else if (!quiet) {
+    for (size_t i = 0; i < count; i++) {
+      if (results[i].inode_no)
+        printf("%s %" PRIu32 " %06o %" PRIu64 "\n", paths[i], results[i].inode_no, results[i].inode.i_mode,
+               inode_file_size(volume, &results[i].inode));
+      else
+        printf("%s: %s\n", paths[i], strerror(results[i].error));
+    }
+  }
+
+  if (found >= 0 && compare) {
+    volume_t *single = open_volume_file(argv[optind]);
+    size_t mismatches = 0;
+    double single_seconds = 0;
+
+    if (!single) {
+      fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", argv[optind]);
+      status = 1;
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        inode_t inode;
+
+        start = now();
+        errno = 0;
+        uint32_t inode_no = resolve_path(single, paths[i], &inode, flags);
+        int error = inode_no ? 0 : errno;
+        single_seconds += now() - start;
+
+        if (inode_no != results[i].inode_no || error != results[i].error ||
+            (inode_no && (inode.i_mode != results[i].inode.i_mode || inode.i_size != results[i].inode.i_size))) {
+          fprintf(stderr, "%s: resolved to %" PRIu32 " (%s) alone, %" PRIu32 " (%s) in the batch.\n", paths[i],
+                  inode_no, strerror(error), results[i].inode_no, strerror(results[i].error));
+          mismatches++;
+        }
+      }
+      close_volume_file(single);
+      if (mismatches) status = 1;
+    }
+    fprintf(stderr, "%zu paths, %zu found: batch %.3f s, one at a time %.3f s, %zu mismatch(es)\n", count,
+            (size_t) found, batch_seconds, single_seconds, mismatches);
+  } else if (found >= 0) {
+    fprintf(stderr, "%zu paths, %zu found in %.3f s\n", count, (size_t) found, batch_seconds);
+  }
+
+  for (size_t i = 0; i < count; i++)
+    free(paths[i]);
+  free(paths);
+  free(results);
+  close_volume_file(volume);
+  return status;
+}
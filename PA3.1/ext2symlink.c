@@ -1,6 +1,90 @@
 #include "ext2.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// Number of slots in the per-volume symlink target cache
+#define EXT2_SYMLINK_CACHE_SLOTS 1024
+
+typedef struct symlink_cache_entry {
+  uint32_t block_no; // First data block of the link
+  uint32_t length;   // Length of the target, not including the null byte
+  char target[];     // Null-terminated
+} symlink_cache_entry_t;
+
+/* Entries are immutable: a slot is updated by swapping in a new entry
+   and retiring the old one (see ext2epoch.c), so lookups take no
+   lock. */
+struct symlink_cache {
+  uint32_t num_slots;
+  _Atomic(symlink_cache_entry_t *) *slots; // NULL if the slot is empty
+};
+
+/* symlink_cache_create: Allocates an empty cache of symbolic link
+   targets. Only targets stored in data blocks are cached, and the
+   cache is direct-mapped by the first block of the target (inode_t
+   does not carry its own inode number). Its size is bounded by the
+   number of slots: caching a new target evicts whichever target
+   previously used the same slot.
+
+   Returns:
+     A pointer to the new cache, or NULL if memory is exhausted.
+ */
+symlink_cache_t *symlink_cache_create(void) {
+
+  symlink_cache_t *cache = malloc(sizeof(symlink_cache_t));
+  if (!cache) return NULL;
+
+  cache->num_slots = EXT2_SYMLINK_CACHE_SLOTS;
+  cache->slots = calloc(cache->num_slots, sizeof(*cache->slots));
+  if (!cache->slots) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/* symlink_cache_destroy: Frees a cache and all targets stored in it.
+ */
+void symlink_cache_destroy(symlink_cache_t *cache) {
+
+  if (!cache) return;
+  for (uint32_t i = 0; i < cache->num_slots; i++)
+    free(atomic_load(&cache->slots[i]));
+  free(cache->slots);
+  free(cache);
+}
+
+/* Copies a target into a caller's buffer, truncating as needed. */
+static void copy_target(const char *target, uint32_t length, char *buffer, size_t size) {
+
+  size_t copied = length < size ? length : size - 1;
+  memcpy(buffer, target, copied);
+  buffer[copied] = '\0';
+}
+
+static int symlink_cache_lookup(symlink_cache_t *cache, uint32_t block_no, char *buffer, size_t size,
+                                uint32_t *length) {
+
+  int found = 0;
+
+  epoch_enter();
+  symlink_cache_entry_t *entry = atomic_load_explicit(&cache->slots[block_no % cache->num_slots],
+                                                      memory_order_acquire);
+  if (entry && entry->block_no == block_no) {
+    copy_target(entry->target, entry->length, buffer, size);
+    *length = entry->length;
+    found = 1;
+  }
+  epoch_exit();
+  return found;
+}
+
+static void symlink_cache_insert(symlink_cache_t *cache, symlink_cache_entry_t *entry) {
+
+  epoch_retire(atomic_exchange(&cache->slots[entry->block_no % cache->num_slots], entry));
+}
 
 /* read_symlink_target: Reads the content of the target of a symbolic link.
    
@@ -24,25 +108,38 @@
  */
 int32_t read_symlink_target(volume_t *volume, inode_t *inode, char *buffer, size_t size) {
 
-  if (!inode_is_symlink(inode))
+  if (!inode_is_symlink(inode) || size == 0)
+    return 0;
+
+  uint32_t length = inode->i_size;
+
+  // Fast symlinks are served from the inode itself, with no block I/O
+  if (inode_is_fast_symlink(volume, inode)) {
+    copy_target(inode->i_symlink_target, length, buffer, size);
+    return length;
+  }
+
+  // Slow symlinks are cached by the block holding their target
+  uint32_t key = inode->i_block[0];
+  if (volume->symlinks && key && symlink_cache_lookup(volume->symlinks, key, buffer, size, &length))
+    return length;
+
+  symlink_cache_entry_t *entry = malloc(sizeof(symlink_cache_entry_t) + length + 1);
+  if (!entry)
+    return 0;
+
+  if (read_file_content(volume, inode, 0, length, entry->target) != length) {
+    free(entry);
     return 0;
+  }
+  entry->block_no = key;
+  entry->length = length;
+  entry->target[length] = '\0';
+  copy_target(entry->target, length, buffer, size);
 
-  int readBytes = read_file_content(volume, inode, 0, size, buffer);
-  printf("%s\n", inode->i_symlink_target);
-
-//  uint32_t inode_no;
-//  int stringLength = strlen(inode->i_symlink_target);
-//
-//  if (stringLength < 60) {
-//      if(!(inode_no = find_file_from_path(volume, inode->i_symlink_target, inode)))
-//        return 0;
-//  }
-//  else
-//  {
-//      buffer[size] = '\0';
-//      return stringLength;
-//  }
-
-  /* TO BE COMPLETED BY THE STUDENT */
-  return 0;
+  if (volume->symlinks && key)
+    symlink_cache_insert(volume->symlinks, entry);
+  else
+    free(entry);
+  return length;
 }
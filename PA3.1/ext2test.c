@@ -83,7 +83,7 @@ int main(int argc, char *argv[]) {
   printf("Status                : %" PRIu16 " - %s\n\n", volume->super.s_state,
 	 volume->super.s_state == EXT2_VALID_FS ? "Unmounted cleanly" : "Errors detected");
   
-  printf("Total size (in bytes) : %" PRIu32 "\n", volume->volume_size);
+  printf("Total size (in bytes) : %" PRIu64 "\n", volume->volume_size);
   printf("Block size (in bytes) : %" PRIu32 "\n", volume->block_size);
   printf("Total number of blocks: %" PRIu32 "\n", volume->super.s_blocks_count);
   printf("Total number of inodes: %" PRIu32 "\n", volume->super.s_inodes_count);
@@ -92,11 +92,13 @@ int main(int argc, char *argv[]) {
   printf("Inodes per group      : %" PRIu32 "\n", volume->super.s_inodes_per_group);
 
   for (int g = 0; g < volume->num_groups; g++) {
-    
+    const group_desc_t *desc = get_group_desc(volume, g);
+    if (!desc) continue;
+
     printf("\n== BLOCK GROUP %d ==\n", g);
-    printf("Number of free blocks : %" PRIu32 "\n", volume->groups[g].bg_free_blocks_count);
-    printf("Number of free inodes : %" PRIu32 "\n", volume->groups[g].bg_free_inodes_count);
-    printf("No of directory inodes: %" PRIu32 "\n", volume->groups[g].bg_used_dirs_count);
+    printf("Number of free blocks : %" PRIu32 "\n", desc->bg_free_blocks_count);
+    printf("Number of free inodes : %" PRIu32 "\n", desc->bg_free_inodes_count);
+    printf("No of directory inodes: %" PRIu32 "\n", desc->bg_used_dirs_count);
   }
 
   uint32_t inode_no;
@@ -186,18 +188,18 @@ int main(int argc, char *argv[]) {
   } else {
     print_inode_metadata(volume, inode_no, &inode);
   }
-//
-//  printf("\nSymlink ImageInst.txt:\n");
-//  if (!(inode_no = find_file_from_path(volume, "/ImageInst.txt", &inode))) {
-//    printf("  NOT FOUND!!!\n");
-//  } else {
-//    print_inode_metadata(volume, inode_no, &inode);
-//
-//    if (read_symlink_target(volume, &inode, content, sizeof(content)))
-//      printf("  Target       : %s\n", content);
-//    else
-//      printf("  Could not read target!!!\n");
-//  }
+
+  printf("\nSymlink ImageInst.txt:\n");
+  if (!(inode_no = find_file_from_path(volume, "/ImageInst.txt", &inode))) {
+    printf("  NOT FOUND!!!\n");
+  } else {
+    print_inode_metadata(volume, inode_no, &inode);
+
+    if (read_symlink_target(volume, &inode, content, sizeof(content)))
+      printf("  Target       : %s\n", content);
+    else
+      printf("  Could not read target!!!\n");
+  }
 //
 //  printf("\nFull list of files:\n");
 //  print_dir_entries_recursive(volume, "", EXT2_ROOT_INO, 0);
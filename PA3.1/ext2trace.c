@@ -0,0 +1,284 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Each thread that records an operation gets its own ring buffer, so
+   recording never takes a lock: the thread is the only producer of
+   its ring, and a background flusher thread is the only consumer,
+   which periodically appends the content of every ring to the trace
+   file. Records that do not fit in a full ring are dropped and
+   counted rather than blocking the operation being traced.
+ */
+
+// Size of the ring buffer of each thread, in bytes (a power of two)
+#define EXT2_TRACE_RING_SIZE (1 << 20)
+
+// Interval between flushes of the ring buffers to the trace file, in milliseconds
+#define EXT2_TRACE_FLUSH_MS 100
+
+typedef struct trace_ring {
+    _Atomic uint64_t head; // Bytes written by the producer
+    _Atomic uint64_t tail; // Bytes written to the file by the flusher
+    _Atomic uint64_t dropped;
+    struct trace_ring *next;
+    char data[EXT2_TRACE_RING_SIZE];
+} trace_ring_t;
+
+__thread uint64_t trace_blocks;
+
+int trace_enabled;
+
+static __thread trace_ring_t *thread_ring;
+static __thread int thread_ring_generation;
+
+static int trace_generation; // Incremented by trace_start, so stale rings are never reused
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+static pthread_t flusher;
+static volatile int flusher_stop;
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ring_write(trace_ring_t *ring, const void *data, size_t len, uint64_t head) {
+
+    size_t pos = head & (EXT2_TRACE_RING_SIZE - 1);
+    size_t first = EXT2_TRACE_RING_SIZE - pos < len ? EXT2_TRACE_RING_SIZE - pos : len;
+
+    memcpy(ring->data + pos, data, first);
+    memcpy(ring->data, (const char *) data + first, len - first);
+}
+
+/* Writes the unflushed content of a ring to the trace file. */
+static void ring_flush(trace_ring_t *ring) {
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (tail < head) {
+        size_t pos = tail & (EXT2_TRACE_RING_SIZE - 1);
+        size_t len = head - tail;
+        if (len > EXT2_TRACE_RING_SIZE - pos) len = EXT2_TRACE_RING_SIZE - pos;
+
+        ssize_t written = write(trace_fd, ring->data + pos, len);
+        if (written <= 0) break;
+        tail += written;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+static void flush_all(void) {
+
+    pthread_mutex_lock(&rings_lock);
+    for (trace_ring_t *ring = rings; ring; ring = ring->next)
+        ring_flush(ring);
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void *flush_periodically(void *arg) {
+
+    struct timespec interval = { 0, EXT2_TRACE_FLUSH_MS * 1000000L };
+
+    while (!flusher_stop) {
+        nanosleep(&interval, NULL);
+        flush_all();
+    }
+    return NULL;
+}
+
+/* trace_start: Starts recording operations into a trace file.
+
+   Parameters:
+     filename: Name of the trace file, created or truncated.
+
+   Returns:
+     0 on success, or -1 if the file cannot be created.
+ */
+int trace_start(const char *filename) {
+
+    trace_header_t header = { EXT2_TRACE_MAGIC, EXT2_TRACE_VERSION, 0 };
+    struct timespec ts;
+
+    trace_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return -1;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_realtime_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+
+    trace_epoch = now_ns();
+    trace_generation++;
+    flusher_stop = 0;
+    if (pthread_create(&flusher, NULL, flush_periodically, NULL) != 0) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    trace_enabled = 1;
+    return 0;
+}
+
+/* trace_stop: Stops recording, writes all pending records to the
+   trace file and closes it. Must not be called while operations are
+   being traced.
+
+   Returns:
+     The number of records that were dropped because a ring buffer
+     was full.
+ */
+uint64_t trace_stop(void) {
+
+    uint64_t dropped = 0;
+
+    if (!trace_enabled) return 0;
+    trace_enabled = 0;
+
+    flusher_stop = 1;
+    pthread_join(flusher, NULL);
+    flush_all();
+
+    pthread_mutex_lock(&rings_lock);
+    while (rings) {
+        trace_ring_t *ring = rings;
+        rings = ring->next;
+        dropped += atomic_load(&ring->dropped);
+        free(ring);
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    close(trace_fd);
+    trace_fd = -1;
+    return dropped;
+}
+
+/* trace_span_begin: Marks the start of an operation to be traced.
+ */
+void trace_span_begin(trace_span_t *span) {
+
+    if (!trace_enabled) return;
+    span->start_ns = now_ns();
+    span->blocks = trace_blocks;
+}
+
+/* trace_span_end: Records an operation started with
+   trace_span_begin in the calling thread's ring buffer. The number of
+   blocks touched is the number of blocks read_block accessed in this
+   thread since the span began.
+
+   Parameters:
+     span: Span passed to trace_span_begin.
+     op: Operation (EXT2_TRACE_*).
+     path: Path the operation was applied to.
+     inode_no: Inode number of the file, or 0 if unknown.
+     offset: Offset of the operation (read and readdir), or 0.
+     size: Size of the operation (read and readlink), or 0.
+     result: Return value of the operation.
+ */
+void trace_span_end(trace_span_t *span, int op, const char *path, uint32_t inode_no,
+                    uint64_t offset, uint64_t size, int32_t result) {
+
+    if (!trace_enabled) return;
+
+    trace_ring_t *ring = thread_ring;
+    if (!ring || thread_ring_generation != trace_generation) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (!ring) return;
+        pthread_mutex_lock(&rings_lock);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&rings_lock);
+        thread_ring = ring;
+        thread_ring_generation = trace_generation;
+    }
+
+    size_t path_len = strnlen(path, UINT16_MAX);
+    trace_record_t record = {
+        .start_ns = span->start_ns - trace_epoch,
+        .latency_ns = now_ns() - span->start_ns,
+        .offset = offset,
+        .size = size,
+        .inode_no = inode_no,
+        .blocks = trace_blocks - span->blocks,
+        .result = result,
+        .path_len = path_len,
+        .op = op,
+    };
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (EXT2_TRACE_RING_SIZE - (head - tail) < sizeof(record) + path_len) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ring_write(ring, &record, sizeof(record), head);
+    ring_write(ring, path, path_len, head + sizeof(record));
+    atomic_store_explicit(&ring->head, head + sizeof(record) + path_len, memory_order_release);
+}
+
+/* trace_open: Opens a trace file for reading and checks its header.
+
+   Returns:
+     The open file, positioned at the first record, or NULL if the file
+     cannot be opened or is not a trace file.
+ */
+FILE *trace_open(const char *filename, trace_header_t *header) {
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) return NULL;
+
+    if (fread(header, sizeof(trace_header_t), 1, file) != 1 ||
+        memcmp(header->magic, EXT2_TRACE_MAGIC, sizeof(header->magic)) ||
+        header->version != EXT2_TRACE_VERSION) {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+/* trace_read_record: Reads the next record of a trace file. Records
+   are stored in the order they were flushed, which is in time order
+   per thread but not across threads.
+
+   Parameters:
+     file: File returned by trace_open.
+     record: Where the record is stored.
+     path: Where the path of the record is stored, as a null-terminated
+           string, truncated to 'path_size' bytes.
+     path_size: Size of the path buffer.
+
+   Returns:
+     1 if a record was read, 0 (zero) at the end of the file, or -1 if
+     the file is truncated.
+ */
+int trace_read_record(FILE *file, trace_record_t *record, char *path, size_t path_size) {
+
+    if (fread(record, sizeof(trace_record_t), 1, file) != 1)
+        return feof(file) ? 0 : -1;
+
+    char full[UINT16_MAX + 1];
+    if (fread(full, 1, record->path_len, file) != record->path_len)
+        return -1;
+    full[record->path_len] = '\0';
+
+    snprintf(path, path_size, "%s", full);
+    return 1;
+}
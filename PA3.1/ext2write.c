@@ -0,0 +1,1148 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Changes to a volume opened with EXT2_OPEN_WRITE: creating, writing,
+   truncating, renaming and removing files and directories.
+
+   Every change is made in the write-back cache of the volume (see
+   ext2writeback.c), with blocks and inodes taken from the allocator
+   (see ext2alloc.c), and reaches the volume file when the cache is
+   flushed: by writeback_flush, when the volume is closed, or when an
+   operation finds more than EXT2_WRITEBACK_LIMIT bytes waiting. Reads
+   of the volume see the changes right away.
+
+   None of this takes a lock. While an operation of this file, an
+   allocation or a flush is under way, no other operation on the
+   volume, reads included, may run; reads may run concurrently with
+   each other. ext2fs keeps to this with a read-write lock per volume.
+
+   Directories are changed as plain lists of entries: an index (see
+   EXT2_INDEX_FL) is dropped from a directory when an entry is added
+   or removed, which leaves the directory valid.
+
+   Functions returning an inode number return 0 (zero) in case of
+   error; the others return -1. errno is then set to one of the values
+   of the matching system call: ENOENT, EEXIST, ENOTDIR, EISDIR,
+   ENOTEMPTY, ENAMETOOLONG, ENOSPC, EFBIG, EINVAL, EROFS or EIO.
+ */
+
+// Header of a block of extended attributes
+#define EXT2_XATTR_MAGIC 0xEA020000
+
+// Longest name of a directory entry
+#define EXT2_NAME_LEN 255
+
+// Space taken in a directory block by an entry with a name of 'len' characters
+#define EXT2_DIR_REC_LEN(len) ((EXT2_DIR_ENTRY_HEADER_LEN + (len) + 3) & ~3u)
+
+/* State of a file being extended: its inode, where its next block
+   should go, and the indirect blocks of the last block mapped. */
+typedef struct write_ctx {
+    uint32_t inode_no;
+    inode_t inode;
+    int kind;              // EXT2_WRITEBACK_DATA for files, EXT2_WRITEBACK_META for directories
+    int streaming;         // 1 if the file is written at its end (see alloc_blocks)
+    uint32_t goal;         // Where the next block should go
+    uint32_t wanted;       // Blocks the write still has to allocate, allocated together if streaming
+    uint32_t run_next;     // First block allocated and not used yet
+    uint32_t run_left;     // Number of blocks allocated and not used yet
+    uint32_t held_no[3];   // Indirect blocks of the last block mapped, by depth
+    uint32_t *held[3];     // Their copies in the write-back cache
+} write_ctx_t;
+
+// Blocks freed together, so adjacent blocks are freed with one call to free_blocks
+typedef struct free_run {
+    uint32_t start;
+    uint32_t count;
+    uint32_t freed; // Blocks freed so far
+} free_run_t;
+
+static int check_writable(volume_t *volume) {
+
+    if (volume->writeback && volume->allocator) return 0;
+    errno = EROFS;
+    return -1;
+}
+
+// Writes the changes held once they exceed the limit; they are kept for the next flush if that fails
+static void flush_if_over_limit(volume_t *volume) {
+
+    if (writeback_over_limit(volume)) writeback_flush(volume, 0);
+}
+
+static uint8_t file_type_of(volume_t *volume, uint16_t mode) {
+
+    if (!(volume->super.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)) return EXT2_FT_UNKNOWN;
+
+    switch (mode & S_IFMT) {
+    case S_IFREG:  return EXT2_FT_REG_FILE;
+    case S_IFDIR:  return EXT2_FT_DIR;
+    case S_IFCHR:  return EXT2_FT_CHRDEV;
+    case S_IFBLK:  return EXT2_FT_BLKDEV;
+    case S_IFIFO:  return EXT2_FT_FIFO;
+    case S_IFSOCK: return EXT2_FT_SOCK;
+    case S_IFLNK:  return EXT2_FT_SYMLINK;
+    default:       return EXT2_FT_UNKNOWN;
+    }
+}
+
+/* Sets the size of a file. Sizes of 2 GiB and more turn on the large
+   file feature of the volume if needed. */
+static int set_file_size(volume_t *volume, inode_t *inode, uint64_t size) {
+
+    if (size > INT32_MAX && inode_is_regular_file(inode) &&
+        !(volume->super.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+        if (!volume->super.s_rev_level) {
+            errno = EFBIG;
+            return -1;
+        }
+        volume->super.s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+        writeback_super(volume);
+    }
+    if (size > UINT32_MAX && !inode_is_regular_file(inode)) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    inode->i_size = (uint32_t) size;
+    if (inode_is_regular_file(inode)) inode->i_dir_acl = size >> 32;
+    return 0;
+}
+
+static int init_write_ctx(volume_t *volume, write_ctx_t *ctx, uint32_t inode_no) {
+
+    memset(ctx, 0, sizeof(write_ctx_t));
+    ctx->inode_no = inode_no;
+    if (read_inode_full(volume, inode_no, &ctx->inode) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    ctx->kind = inode_is_directory(&ctx->inode) ? EXT2_WRITEBACK_META : EXT2_WRITEBACK_DATA;
+    ctx->goal = alloc_goal(volume, inode_no);
+    return 0;
+}
+
+/* Aims the next allocation of a file right after the block before
+   'block_idx', so the file stays in one piece. */
+static void aim_after(volume_t *volume, write_ctx_t *ctx, uint64_t block_idx) {
+
+    uint32_t previous = block_idx ? get_inode_block_no(volume, &ctx->inode, block_idx - 1) : 0;
+
+    if (previous && previous != EXT2_INVALID_BLOCK_NUMBER && previous + 1 < volume->super.s_blocks_count)
+        ctx->goal = previous + 1;
+}
+
+static uint32_t allocate_block(volume_t *volume, write_ctx_t *ctx) {
+
+    // The blocks of a write are marked in the bitmap together
+    if (!ctx->run_left) {
+        ctx->run_next = alloc_blocks(volume, ctx->inode_no, ctx->goal, ctx->wanted ? ctx->wanted : 1,
+                                     ctx->streaming, &ctx->run_left);
+        if (!ctx->run_next) {
+            ctx->run_left = 0;
+            return 0;
+        }
+    }
+
+    uint32_t block_no = ctx->run_next++;
+    ctx->run_left--;
+    ctx->goal = block_no + 1;
+    ctx->inode.i_blocks += volume->block_size / 512;
+    return block_no;
+}
+
+/* Returns the block holding data block 'block_idx' of a file,
+   allocating it, and the indirect blocks leading to it, if it is a
+   hole. *fresh is set to 1 if the block was just allocated. The
+   indirect blocks on the way are changed in the write-back cache, and
+   held in the context for the blocks that follow. Returns 0 (zero)
+   with errno set in case of error. */
+static uint32_t map_for_write(volume_t *volume, write_ctx_t *ctx, uint64_t block_idx, int *fresh) {
+
+    uint64_t perBlock = volume->block_size / sizeof(uint32_t);
+    uint32_t offsets[3];
+    uint32_t *slot;
+    int levels;
+
+    if (block_idx < EXT2_NDIR_BLOCKS) {
+        slot = &ctx->inode.i_block[block_idx];
+        levels = 0;
+    } else if ((block_idx -= EXT2_NDIR_BLOCKS) < perBlock) {
+        slot = &ctx->inode.i_block_1ind;
+        levels = 1;
+        offsets[0] = block_idx;
+    } else if ((block_idx -= perBlock) < perBlock * perBlock) {
+        slot = &ctx->inode.i_block_2ind;
+        levels = 2;
+        offsets[0] = block_idx / perBlock;
+        offsets[1] = block_idx % perBlock;
+    } else if ((block_idx -= perBlock * perBlock) < perBlock * perBlock * perBlock) {
+        slot = &ctx->inode.i_block_3ind;
+        levels = 3;
+        offsets[0] = block_idx / (perBlock * perBlock);
+        offsets[1] = block_idx / perBlock % perBlock;
+        offsets[2] = block_idx % perBlock;
+    } else {
+        errno = EFBIG;
+        return 0;
+    }
+
+    for (int depth = 0;; depth++) {
+        int created = 0;
+
+        if (!*slot) {
+            // Indirect blocks go right before the data they map
+            if (!(*slot = allocate_block(volume, ctx))) return 0;
+            created = 1;
+        }
+        if (depth == levels) {
+            *fresh = created;
+            return *slot;
+        }
+
+        uint32_t block_no = *slot;
+        if (created || ctx->held_no[depth] != block_no) {
+            ctx->held[depth] = writeback_block(volume, block_no, EXT2_WRITEBACK_META, !created);
+            ctx->held_no[depth] = ctx->held[depth] ? block_no : 0;
+            if (!ctx->held[depth]) return 0;
+        }
+        slot = &ctx->held[depth][offsets[depth]];
+    }
+}
+
+/* Writes the inode of a file being extended and flushes the changes
+   held, if over the limit. The blocks held in the context are not
+   valid after a flush. */
+static void flush_write_ctx(volume_t *volume, write_ctx_t *ctx) {
+
+    if (!writeback_over_limit(volume) || write_inode(volume, ctx->inode_no, &ctx->inode) < 0) return;
+
+    writeback_flush(volume, 0);
+    memset(ctx->held_no, 0, sizeof(ctx->held_no));
+}
+
+/* Stores a run of whole blocks of file data: straight to the volume
+   file if the run is long, else in the write-back cache. */
+static int store_run(volume_t *volume, uint32_t block_no, uint32_t count, const char *data) {
+
+    if ((uint64_t) count << volume->block_bits >= EXT2_WRITE_THROUGH_MIN)
+        return writeback_write_through(volume, block_no, count, data);
+
+    for (uint32_t i = 0; i < count; i++, data += volume->block_size) {
+        char *copy = writeback_block(volume, block_no + i, EXT2_WRITEBACK_DATA, 0);
+        if (!copy) return -1;
+        memcpy(copy, data, volume->block_size);
+    }
+    return 0;
+}
+
+/* write_file_content: Writes data to a regular file, allocating the
+   blocks it needs, and extends the file if the data goes past its
+   end. Writes at the end of a file reserve blocks ahead in a
+   preallocation window (see ext2alloc.c), so files written
+   sequentially are stored in long runs of adjacent blocks. Long runs
+   of whole blocks are written straight from 'buffer' to the volume
+   file (see writeback_write_through); the rest goes to the write-back
+   cache.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     inode_no: Inode of the file.
+     offset: Position in the file to write at. The file reads as
+             zeros between its end and the offset.
+     size: Number of bytes to write.
+     buffer: Data to write.
+
+   Returns:
+     The number of bytes written, which is smaller than 'size' only if
+     an error stopped the write part of the way, or -1 if nothing was
+     written.
+ */
+ssize_t write_file_content(volume_t *volume, uint32_t inode_no, uint64_t offset, uint64_t size, const void *buffer) {
+
+    write_ctx_t ctx;
+    uint64_t done = 0;
+
+    if (check_writable(volume) < 0 || init_write_ctx(volume, &ctx, inode_no) < 0) return -1;
+    if (!inode_is_regular_file(&ctx.inode)) {
+        errno = inode_is_directory(&ctx.inode) ? EISDIR : EINVAL;
+        return -1;
+    }
+    if (size == 0) return 0;
+    if (offset + size < offset) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    uint64_t fileSize = inode_file_size(volume, &ctx.inode);
+    uint64_t endBlock = (fileSize + volume->block_size - 1) >> volume->block_bits;
+    uint64_t lastBlock = (offset + size - 1) >> volume->block_bits;
+    ctx.streaming = offset + size > fileSize;
+    aim_after(volume, &ctx, offset >> volume->block_bits);
+
+    // Whole blocks mapped and not stored yet: runCount blocks from runStart, holding the data at 'done'
+    uint32_t runStart = 0, runCount = 0;
+    uint64_t mapped = 0;
+
+    while (mapped < size) {
+        uint64_t position = offset + mapped;
+        uint32_t inBlock = position & (volume->block_size - 1);
+        uint64_t chunk = volume->block_size - inBlock;
+        if (chunk > size - mapped) chunk = size - mapped;
+
+        // Past the end of the file, every block up to the last one written is a hole
+        uint64_t blockIdx = position >> volume->block_bits;
+        ctx.wanted = ctx.streaming && blockIdx >= endBlock && lastBlock - blockIdx < UINT32_MAX ?
+                     lastBlock - blockIdx + 1 : 1;
+
+        int fresh;
+        uint32_t block_no = map_for_write(volume, &ctx, blockIdx, &fresh);
+        if (!block_no) break;
+
+        int whole = ctx.kind == EXT2_WRITEBACK_DATA && chunk == volume->block_size;
+        if (runCount && (!whole || block_no != runStart + runCount)) {
+            if (store_run(volume, runStart, runCount, (const char *) buffer + done) < 0) {
+                runCount = 0;
+                break;
+            }
+            done = mapped;
+            runCount = 0;
+        }
+        if (whole) {
+            if (!runCount) runStart = block_no;
+            runCount++;
+            mapped += chunk;
+            continue;
+        }
+
+        // Blocks wholly replaced, or just allocated, are not read first
+        char *data = writeback_block(volume, block_no, ctx.kind, !fresh && chunk < volume->block_size);
+        if (!data) break;
+        memcpy(data + inBlock, (const char *) buffer + done, chunk);
+        done = mapped += chunk;
+
+        if (done < size) flush_write_ctx(volume, &ctx);
+    }
+    if (runCount && store_run(volume, runStart, runCount, (const char *) buffer + done) == 0)
+        done += (uint64_t) runCount << volume->block_bits;
+
+    int error = errno;
+    // Blocks allocated for a write stopped by an error
+    if (ctx.run_left) free_blocks(volume, ctx.run_next, ctx.run_left);
+    if (done && offset + done > fileSize && set_file_size(volume, &ctx.inode, offset + done) < 0) {
+        error = errno;
+        done = 0;
+    }
+    ctx.inode.i_mtime = ctx.inode.i_ctime = time(NULL);
+
+    // Blocks may have been allocated even if nothing was written
+    if (write_inode(volume, inode_no, &ctx.inode) < 0) return -1;
+    flush_if_over_limit(volume);
+
+    if (!done) {
+        errno = error;
+        return -1;
+    }
+    return done;
+}
+
+static int release_block(volume_t *volume, free_run_t *run, uint32_t block_no) {
+
+    // Pointers outside the volume are dropped, not freed
+    if (block_no < volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count) return 0;
+
+    run->freed++;
+    if (run->count && block_no == run->start + run->count) {
+        run->count++;
+        return 0;
+    }
+    if (run->count && free_blocks(volume, run->start, run->count) < 0) return -1;
+    run->start = block_no;
+    run->count = 1;
+    return 0;
+}
+
+/* Frees a block and, for an indirect block ('level' 1 to 3), every
+   block it references. */
+static int free_subtree(volume_t *volume, free_run_t *run, uint32_t block_no, int level) {
+
+    if (level > 0 && block_no >= volume->super.s_first_data_block && block_no < volume->super.s_blocks_count) {
+        uint32_t perBlock = volume->block_size / sizeof(uint32_t);
+        uint32_t *pointers = malloc(volume->block_size);
+        if (!pointers) return -1;
+
+        if (read_block(volume, block_no, 0, volume->block_size, pointers) != volume->block_size) {
+            free(pointers);
+            errno = EIO;
+            return -1;
+        }
+        for (uint32_t i = 0; i < perBlock; i++) {
+            if (pointers[i] && free_subtree(volume, run, pointers[i], level - 1) < 0) {
+                free(pointers);
+                return -1;
+            }
+        }
+        free(pointers);
+    }
+    return release_block(volume, run, block_no);
+}
+
+/* Frees the blocks below '*slot' that map data blocks from 'keep' on,
+   clearing the pointers to them. The slot maps 'span' data blocks
+   starting at 'first', through 'level' levels of indirect blocks. */
+static int trim_subtree(volume_t *volume, free_run_t *run, uint32_t *slot, int level, uint64_t first,
+                        uint64_t span, uint64_t keep) {
+
+    if (!*slot || first + span <= keep) return 0;
+
+    if (first >= keep) {
+        if (free_subtree(volume, run, *slot, level) < 0) return -1;
+        *slot = 0;
+        return 0;
+    }
+
+    uint32_t perBlock = volume->block_size / sizeof(uint32_t);
+    uint64_t childSpan = span / perBlock;
+    uint32_t *pointers = writeback_block(volume, *slot, EXT2_WRITEBACK_META, 1);
+    if (!pointers) return -1;
+
+    for (uint32_t i = 0; i < perBlock; i++)
+        if (trim_subtree(volume, run, &pointers[i], level - 1, first + i * childSpan, childSpan, keep) < 0)
+            return -1;
+    return 0;
+}
+
+/* Frees the blocks of a file past its first 'keep' blocks, updating
+   the inode in memory. */
+static int free_file_blocks(volume_t *volume, inode_t *inode, uint64_t keep) {
+
+    uint64_t perBlock = volume->block_size / sizeof(uint32_t);
+    uint64_t first = EXT2_NDIR_BLOCKS;
+    free_run_t run = { 0, 0, 0 };
+    int rv = 0;
+
+    if (!inode_has_blocks(volume, inode)) return 0;
+
+    for (int i = 0; i < EXT2_NDIR_BLOCKS && !rv; i++)
+        rv = trim_subtree(volume, &run, &inode->i_block[i], 0, i, 1, keep);
+
+    if (!rv) rv = trim_subtree(volume, &run, &inode->i_block_1ind, 1, first, perBlock, keep);
+    first += perBlock;
+    if (!rv) rv = trim_subtree(volume, &run, &inode->i_block_2ind, 2, first, perBlock * perBlock, keep);
+    first += perBlock * perBlock;
+    if (!rv) rv = trim_subtree(volume, &run, &inode->i_block_3ind, 3, first, perBlock * perBlock * perBlock, keep);
+
+    if (run.count && free_blocks(volume, run.start, run.count) < 0) rv = -1;
+    inode->i_blocks -= run.freed * (volume->block_size / 512);
+    return rv;
+}
+
+/* Drops the reference of an inode to its block of extended
+   attributes, freeing the block once no inode references it. */
+static int release_xattr_block(volume_t *volume, inode_t *inode) {
+
+    if (!inode->i_file_acl) return 0;
+
+    uint32_t *header = writeback_block(volume, inode->i_file_acl, EXT2_WRITEBACK_META, 1);
+    if (!header) return -1;
+
+    // The header holds the magic number, then the number of inodes sharing the block
+    if (header[0] == EXT2_XATTR_MAGIC && header[1] > 1) {
+        header[1]--;
+    } else if (free_blocks(volume, inode->i_file_acl, 1) < 0) {
+        return -1;
+    }
+    inode->i_blocks -= volume->block_size / 512;
+    inode->i_file_acl = 0;
+    return 0;
+}
+
+/* Frees an inode whose last link was removed, with all its blocks. */
+static int delete_inode(volume_t *volume, uint32_t inode_no, inode_t *inode) {
+
+    int directory = inode_is_directory(inode);
+
+    alloc_release(volume, inode_no);
+    if (free_file_blocks(volume, inode, 0) < 0 || release_xattr_block(volume, inode) < 0) return -1;
+
+    inode->i_links_count = 0;
+    inode->i_size = 0;
+    if (inode_is_regular_file(inode)) inode->i_dir_acl = 0;
+    inode->i_dtime = time(NULL);
+    if (write_inode(volume, inode_no, inode) < 0) return -1;
+    return free_inode(volume, inode_no, directory);
+}
+
+/* truncate_file: Changes the size of a regular file. Blocks past the
+   new end are freed; a file made larger reads as zeros past its old
+   end, without blocks being allocated.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     inode_no: Inode of the file.
+     size: New size of the file, in bytes.
+
+   Returns:
+     0 on success, or -1 in case of error.
+ */
+int truncate_file(volume_t *volume, uint32_t inode_no, uint64_t size) {
+
+    inode_t inode;
+
+    if (check_writable(volume) < 0) return -1;
+    if (read_inode_full(volume, inode_no, &inode) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    if (!inode_is_regular_file(&inode)) {
+        errno = inode_is_directory(&inode) ? EISDIR : EINVAL;
+        return -1;
+    }
+
+    alloc_release(volume, inode_no);
+
+    if (size < inode_file_size(volume, &inode)) {
+        uint32_t tail = size & (volume->block_size - 1);
+
+        // The rest of the new last block must read as zeros if the file grows again
+        if (tail) {
+            uint32_t block_no = get_inode_block_no(volume, &inode, size >> volume->block_bits);
+            if (block_no == EXT2_INVALID_BLOCK_NUMBER) {
+                errno = EIO;
+                return -1;
+            }
+            if (block_no) {
+                char *data = writeback_block(volume, block_no, EXT2_WRITEBACK_DATA, 1);
+                if (!data) return -1;
+                memset(data + tail, 0, volume->block_size - tail);
+            }
+        }
+        if (free_file_blocks(volume, &inode, (size + volume->block_size - 1) >> volume->block_bits) < 0) {
+            // Pointers to the blocks freed so far are already cleared
+            write_inode(volume, inode_no, &inode);
+            return -1;
+        }
+    }
+
+    if (set_file_size(volume, &inode, size) < 0) return -1;
+    inode.i_mtime = inode.i_ctime = time(NULL);
+    if (write_inode(volume, inode_no, &inode) < 0) return -1;
+    flush_if_over_limit(volume);
+    return 0;
+}
+
+/* Position of an entry found in a directory */
+typedef struct entry_location {
+    uint32_t block_no; // Block holding the entry
+    uint32_t pos;      // Offset of the entry in the block
+    uint32_t prev;     // Offset of the entry before it in the block, or UINT32_MAX if it is the first
+} entry_location_t;
+
+static int valid_entry(volume_t *volume, const dir_entry_t *entry, uint32_t pos) {
+
+    return pos + EXT2_DIR_ENTRY_HEADER_LEN <= volume->block_size &&
+           entry->de_rec_len >= EXT2_DIR_ENTRY_HEADER_LEN && !(entry->de_rec_len & 3) &&
+           entry->de_rec_len <= volume->block_size - pos &&
+           EXT2_DIR_ENTRY_HEADER_LEN + entry->de_name_len <= entry->de_rec_len;
+}
+
+/* Finds the entry of a name in a directory. Returns its inode number,
+   0 (zero) if there is none, or -1 with errno set to EIO. */
+static int64_t find_entry(volume_t *volume, inode_t *dir, const char *name, entry_location_t *location) {
+
+    uint64_t numBlocks = inode_file_size(volume, dir) >> volume->block_bits;
+    size_t nameLen = strlen(name);
+    char *block = malloc(volume->block_size);
+    int64_t rv = 0;
+
+    if (!block) return -1;
+
+    for (uint64_t idx = 0; idx < numBlocks && !rv; idx++) {
+        uint32_t block_no = get_inode_block_no(volume, dir, idx);
+        if (!block_no || block_no == EXT2_INVALID_BLOCK_NUMBER ||
+            read_block(volume, block_no, 0, volume->block_size, block) != volume->block_size) {
+            rv = -1;
+            break;
+        }
+
+        uint32_t prev = UINT32_MAX;
+        for (uint32_t pos = 0; pos < volume->block_size;) {
+            const dir_entry_t *entry = (const dir_entry_t *) (block + pos);
+            if (!valid_entry(volume, entry, pos)) {
+                rv = -1;
+                break;
+            }
+            if (entry->de_inode_no && entry->de_name_len == nameLen && !memcmp(entry->de_name, name, nameLen)) {
+                location->block_no = block_no;
+                location->pos = pos;
+                location->prev = prev;
+                rv = entry->de_inode_no;
+                break;
+            }
+            prev = pos;
+            pos += entry->de_rec_len;
+        }
+    }
+
+    free(block);
+    if (rv < 0) errno = EIO;
+    return rv;
+}
+
+static void fill_entry(dir_entry_t *entry, const char *name, uint32_t inode_no, uint8_t type) {
+
+    entry->de_inode_no = inode_no;
+    entry->de_name_len = strlen(name);
+    entry->de_file_type = type;
+    memcpy(entry->de_name, name, entry->de_name_len);
+}
+
+/* Marks a directory as changed: its index, if any, no longer matches
+   its entries. */
+static void touch_directory(inode_t *dir) {
+
+    dir->i_flags &= ~EXT2_INDEX_FL;
+    dir->i_mtime = dir->i_ctime = time(NULL);
+}
+
+/* Adds an entry to a directory, in the first block with room for it,
+   or in a new block at the end of the directory. */
+static int add_entry(volume_t *volume, uint32_t dir_no, const char *name, uint32_t inode_no, uint8_t type) {
+
+    write_ctx_t ctx;
+    uint32_t needed = EXT2_DIR_REC_LEN(strlen(name));
+    int rv = -1;
+
+    if (init_write_ctx(volume, &ctx, dir_no) < 0) return -1;
+
+    uint64_t numBlocks = inode_file_size(volume, &ctx.inode) >> volume->block_bits;
+    char *block = malloc(volume->block_size);
+    if (!block) return -1;
+
+    for (uint64_t idx = 0; idx < numBlocks; idx++) {
+        uint32_t block_no = get_inode_block_no(volume, &ctx.inode, idx);
+        if (!block_no || block_no == EXT2_INVALID_BLOCK_NUMBER ||
+            read_block(volume, block_no, 0, volume->block_size, block) != volume->block_size) {
+            errno = EIO;
+            goto done;
+        }
+
+        for (uint32_t pos = 0; pos < volume->block_size;) {
+            dir_entry_t *entry = (dir_entry_t *) (block + pos);
+            if (!valid_entry(volume, entry, pos)) {
+                errno = EIO;
+                goto done;
+            }
+
+            uint32_t used = entry->de_inode_no ? EXT2_DIR_REC_LEN(entry->de_name_len) : 0;
+            if (entry->de_rec_len >= used + needed) {
+                char *data = writeback_block(volume, block_no, EXT2_WRITEBACK_META, 1);
+                if (!data) goto done;
+
+                // Split the slack off the entry, or reuse it if unused
+                entry = (dir_entry_t *) (data + pos);
+                if (used) {
+                    dir_entry_t *added = (dir_entry_t *) (data + pos + used);
+                    added->de_rec_len = entry->de_rec_len - used;
+                    entry->de_rec_len = used;
+                    entry = added;
+                }
+                fill_entry(entry, name, inode_no, type);
+                rv = 0;
+                goto done;
+            }
+            pos += entry->de_rec_len;
+        }
+    }
+
+    // No room: the entry takes a new block of its own
+    int fresh;
+    aim_after(volume, &ctx, numBlocks);
+    uint32_t block_no = map_for_write(volume, &ctx, numBlocks, &fresh);
+    dir_entry_t *entry = block_no ? writeback_block(volume, block_no, EXT2_WRITEBACK_META, 0) : NULL;
+    if (!entry || set_file_size(volume, &ctx.inode, (numBlocks + 1) << volume->block_bits) < 0) {
+        // Keep the blocks allocated on the way, so they are not lost
+        write_inode(volume, dir_no, &ctx.inode);
+        goto done;
+    }
+    entry->de_rec_len = volume->block_size;
+    fill_entry(entry, name, inode_no, type);
+    rv = 0;
+
+ done:
+    free(block);
+    if (rv == 0) {
+        forget_directory_entry(volume, dir_no, name);
+        touch_directory(&ctx.inode);
+        rv = write_inode(volume, dir_no, &ctx.inode);
+    }
+    return rv;
+}
+
+/* Removes the entry of a name from a directory, merging its space
+   into the entry before it. */
+static int remove_entry(volume_t *volume, uint32_t dir_no, const char *name) {
+
+    inode_t dir;
+    entry_location_t location;
+
+    if (read_inode_full(volume, dir_no, &dir) < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    int64_t found = find_entry(volume, &dir, name, &location);
+    if (found <= 0) {
+        if (found == 0) errno = ENOENT;
+        return -1;
+    }
+
+    char *data = writeback_block(volume, location.block_no, EXT2_WRITEBACK_META, 1);
+    if (!data) return -1;
+
+    dir_entry_t *entry = (dir_entry_t *) (data + location.pos);
+    if (location.prev != UINT32_MAX)
+        ((dir_entry_t *) (data + location.prev))->de_rec_len += entry->de_rec_len;
+    else
+        entry->de_inode_no = 0;
+
+    forget_directory_entry(volume, dir_no, name);
+    touch_directory(&dir);
+    return write_inode(volume, dir_no, &dir);
+}
+
+/* Points the entry of a name in a directory to another inode. */
+static int replace_entry(volume_t *volume, uint32_t dir_no, const char *name, uint32_t inode_no, uint8_t type) {
+
+    inode_t dir;
+    entry_location_t location;
+
+    if (read_inode_full(volume, dir_no, &dir) < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    int64_t found = find_entry(volume, &dir, name, &location);
+    if (found <= 0) {
+        if (found == 0) errno = ENOENT;
+        return -1;
+    }
+
+    char *data = writeback_block(volume, location.block_no, EXT2_WRITEBACK_META, 1);
+    if (!data) return -1;
+
+    dir_entry_t *entry = (dir_entry_t *) (data + location.pos);
+    entry->de_inode_no = inode_no;
+    entry->de_file_type = type;
+
+    forget_directory_entry(volume, dir_no, name);
+    touch_directory(&dir);
+    return write_inode(volume, dir_no, &dir);
+}
+
+/* Changes the link count of an inode by 'delta', and its change time. */
+static int adjust_links(volume_t *volume, uint32_t inode_no, int delta) {
+
+    inode_t inode;
+
+    if (read_inode_full(volume, inode_no, &inode) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    inode.i_links_count += delta;
+    inode.i_ctime = time(NULL);
+    return write_inode(volume, inode_no, &inode);
+}
+
+/* Checks if a directory holds nothing but "." and "..". Returns 1 if
+   so, 0 if not, or -1 in case of error. */
+static int directory_is_empty(volume_t *volume, inode_t *dir) {
+
+    off_t offset = 0;
+    dir_entry_t entry;
+    int64_t inode_no;
+
+    while ((inode_no = next_directory_entry(volume, dir, &offset, &entry)) > 0)
+        if (strcmp(entry.de_name, ".") && strcmp(entry.de_name, "..")) return 0;
+
+    if (inode_no < 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 1;
+}
+
+/* Resolves the directory a path is in, and copies the last component
+   of the path into 'name', which has room for EXT2_NAME_LEN + 1
+   characters. Returns the inode number of the directory, or 0 (zero)
+   with errno set. */
+static uint32_t resolve_parent(volume_t *volume, const char *path, char *name, inode_t *dir) {
+
+    char *work = strdup(path);
+    if (!work) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    size_t len = strlen(work);
+    while (len > 1 && work[len - 1] == '/') work[--len] = '\0';
+
+    char *slash = strrchr(work, '/');
+    char *last = slash ? slash + 1 : NULL;
+    if (!last || !*last || !strcmp(last, ".") || !strcmp(last, "..")) {
+        free(work);
+        errno = EINVAL;
+        return 0;
+    }
+    if (strlen(last) > EXT2_NAME_LEN) {
+        free(work);
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    strcpy(name, last);
+
+    // The parent of a name at the top is the root directory
+    slash[slash == work] = '\0';
+    uint32_t dir_no = resolve_path(volume, work, dir, 0);
+    free(work);
+
+    if (dir_no && !inode_is_directory(dir)) {
+        errno = ENOTDIR;
+        return 0;
+    }
+    return dir_no;
+}
+
+/* Allocates an inode for a new file or directory named by a path, and
+   checks that the name is free. */
+static uint32_t new_inode(volume_t *volume, const char *path, uint16_t mode, uint32_t uid, uint32_t gid,
+                          char *name, uint32_t *dir_no, inode_t *inode) {
+
+    inode_t dir;
+
+    if (check_writable(volume) < 0) return 0;
+    if (!(*dir_no = resolve_parent(volume, path, name, &dir))) return 0;
+
+    int64_t existing = lookup_in_directory(volume, *dir_no, &dir, name);
+    if (existing != 0) {
+        errno = existing > 0 ? EEXIST : EIO;
+        return 0;
+    }
+
+    uint32_t inode_no = alloc_inode(volume, *dir_no, S_ISDIR(mode));
+    if (!inode_no) return 0;
+
+    memset(inode, 0, sizeof(inode_t));
+    inode->i_mode = mode;
+    inode->i_uid = uid;
+    inode->l_i_uid_high = uid >> 16;
+    inode->i_gid = gid;
+    inode->l_i_gid_high = gid >> 16;
+    inode->i_atime = inode->i_ctime = inode->i_mtime = time(NULL);
+    inode->i_links_count = 1;
+    return inode_no;
+}
+
+/* create_file: Creates an empty regular file.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     path: Absolute path of the file, in an existing directory.
+     mode: Permissions of the file; the type bits, if any, must be
+           S_IFREG.
+     uid, gid: Owner of the file.
+
+   Returns:
+     The inode number of the file, or 0 (zero) in case of error.
+ */
+uint32_t create_file(volume_t *volume, const char *path, uint16_t mode, uint32_t uid, uint32_t gid) {
+
+    char name[EXT2_NAME_LEN + 1];
+    uint32_t dir_no;
+    inode_t inode;
+
+    if ((mode & S_IFMT) && !S_ISREG(mode)) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    uint32_t inode_no = new_inode(volume, path, S_IFREG | (mode & ~S_IFMT), uid, gid, name, &dir_no, &inode);
+    if (!inode_no) return 0;
+
+    if (write_inode(volume, inode_no, &inode) < 0 ||
+        add_entry(volume, dir_no, name, inode_no, file_type_of(volume, inode.i_mode)) < 0) {
+        int error = errno;
+        free_inode(volume, inode_no, 0);
+        errno = error;
+        return 0;
+    }
+
+    flush_if_over_limit(volume);
+    return inode_no;
+}
+
+/* make_directory: Creates an empty directory.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     path: Absolute path of the directory, in an existing directory.
+     mode: Permissions of the directory.
+     uid, gid: Owner of the directory.
+
+   Returns:
+     The inode number of the directory, or 0 (zero) in case of error.
+ */
+uint32_t make_directory(volume_t *volume, const char *path, uint16_t mode, uint32_t uid, uint32_t gid) {
+
+    char name[EXT2_NAME_LEN + 1];
+    uint32_t dir_no;
+    write_ctx_t ctx;
+    inode_t inode;
+    int fresh;
+
+    uint32_t inode_no = new_inode(volume, path, S_IFDIR | (mode & ~S_IFMT), uid, gid, name, &dir_no, &inode);
+    if (!inode_no) return 0;
+
+    // The first block holds "." and ".."
+    memset(&ctx, 0, sizeof(write_ctx_t));
+    ctx.inode_no = inode_no;
+    ctx.inode = inode;
+    ctx.inode.i_links_count = 2;
+    ctx.kind = EXT2_WRITEBACK_META;
+    ctx.goal = alloc_goal(volume, inode_no);
+
+    uint32_t block_no = map_for_write(volume, &ctx, 0, &fresh);
+    char *data = block_no ? writeback_block(volume, block_no, EXT2_WRITEBACK_META, 0) : NULL;
+    if (!data) {
+        int error = errno;
+        if (block_no) free_blocks(volume, block_no, 1);
+        free_inode(volume, inode_no, 1);
+        errno = error;
+        return 0;
+    }
+
+    dir_entry_t *dot = (dir_entry_t *) data;
+    dot->de_rec_len = EXT2_DIR_REC_LEN(1);
+    fill_entry(dot, ".", inode_no, file_type_of(volume, S_IFDIR));
+    dir_entry_t *dotdot = (dir_entry_t *) (data + dot->de_rec_len);
+    dotdot->de_rec_len = volume->block_size - dot->de_rec_len;
+    fill_entry(dotdot, "..", dir_no, file_type_of(volume, S_IFDIR));
+    ctx.inode.i_size = volume->block_size;
+
+    if (write_inode(volume, inode_no, &ctx.inode) < 0 ||
+        add_entry(volume, dir_no, name, inode_no, file_type_of(volume, S_IFDIR)) < 0) {
+        int error = errno;
+        free_blocks(volume, block_no, 1);
+        free_inode(volume, inode_no, 1);
+        errno = error;
+        return 0;
+    }
+    if (adjust_links(volume, dir_no, 1) < 0) return 0;
+
+    flush_if_over_limit(volume);
+    return inode_no;
+}
+
+/* Removes the entry of a file or directory, and the inode once its
+   last link is gone. */
+static int remove_path(volume_t *volume, const char *path, int directory) {
+
+    char name[EXT2_NAME_LEN + 1];
+    inode_t dir, inode;
+
+    if (check_writable(volume) < 0) return -1;
+
+    uint32_t dir_no = resolve_parent(volume, path, name, &dir);
+    if (!dir_no) return -1;
+
+    int64_t inode_no = lookup_in_directory(volume, dir_no, &dir, name);
+    if (inode_no <= 0 || read_inode_full(volume, inode_no, &inode) < 0) {
+        errno = inode_no == 0 ? ENOENT : EIO;
+        return -1;
+    }
+
+    if (directory) {
+        if (!inode_is_directory(&inode)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        int empty = directory_is_empty(volume, &inode);
+        if (empty <= 0) {
+            if (empty == 0) errno = ENOTEMPTY;
+            return -1;
+        }
+    } else if (inode_is_directory(&inode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if (remove_entry(volume, dir_no, name) < 0) return -1;
+
+    if (directory) {
+        // The ".." of the directory no longer links to the parent
+        if (adjust_links(volume, dir_no, -1) < 0) return -1;
+        inode.i_links_count = 0;
+    } else if (inode.i_links_count) {
+        inode.i_links_count--;
+    }
+
+    int rv;
+    if (inode.i_links_count) {
+        inode.i_ctime = time(NULL);
+        rv = write_inode(volume, inode_no, &inode);
+    } else {
+        rv = delete_inode(volume, inode_no, &inode);
+    }
+
+    flush_if_over_limit(volume);
+    return rv;
+}
+
+/* unlink_file: Removes the entry of a file that is not a directory,
+   and frees the file once its last link is gone.
+
+   Returns:
+     0 on success, or -1 in case of error.
+ */
+int unlink_file(volume_t *volume, const char *path) {
+
+    return remove_path(volume, path, 0);
+}
+
+/* remove_directory: Removes an empty directory.
+
+   Returns:
+     0 on success, or -1 in case of error.
+ */
+int remove_directory(volume_t *volume, const char *path) {
+
+    return remove_path(volume, path, 1);
+}
+
+/* Checks if directory 'dir_no' is 'ancestor_no' or below it. Returns
+   1 if so, 0 if not, or -1 in case of error. */
+static int is_below(volume_t *volume, uint32_t dir_no, uint32_t ancestor_no) {
+
+    inode_t dir;
+
+    // A directory tree deeper than the volume has inodes must hold a loop
+    for (uint32_t depth = 0; depth < volume->super.s_inodes_count; depth++) {
+        if (dir_no == ancestor_no) return 1;
+        if (dir_no == EXT2_ROOT_INO) return 0;
+
+        int64_t parent_no;
+        if (read_inode(volume, dir_no, &dir) <= 0 ||
+            (parent_no = find_file_in_directory(volume, &dir, "..", NULL)) <= 0) {
+            errno = EIO;
+            return -1;
+        }
+        dir_no = parent_no;
+    }
+    errno = EIO;
+    return -1;
+}
+
+/* rename_file: Moves a file or directory to another path, replacing
+   what the path named, as rename(2) does.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     from: Absolute path of the file or directory.
+     to: New absolute path. If it exists, it must be of the same kind
+         as 'from' (a directory, or not), and is removed, unless it is
+         a directory that is not empty.
+
+   Returns:
+     0 on success, or -1 in case of error (EINVAL if a directory would
+     be moved below itself).
+ */
+int rename_file(volume_t *volume, const char *from, const char *to) {
+
+    char fromName[EXT2_NAME_LEN + 1], toName[EXT2_NAME_LEN + 1];
+    inode_t fromDir, toDir, inode, target;
+
+    if (check_writable(volume) < 0) return -1;
+
+    uint32_t fromDir_no = resolve_parent(volume, from, fromName, &fromDir);
+    if (!fromDir_no) return -1;
+    uint32_t toDir_no = resolve_parent(volume, to, toName, &toDir);
+    if (!toDir_no) return -1;
+
+    int64_t inode_no = lookup_in_directory(volume, fromDir_no, &fromDir, fromName);
+    if (inode_no <= 0 || read_inode_full(volume, inode_no, &inode) < 0) {
+        errno = inode_no == 0 ? ENOENT : EIO;
+        return -1;
+    }
+    if (fromDir_no == toDir_no && !strcmp(fromName, toName)) return 0;
+
+    int directory = inode_is_directory(&inode);
+    if (directory) {
+        int below = is_below(volume, toDir_no, inode_no);
+        if (below) {
+            if (below > 0) errno = EINVAL;
+            return -1;
+        }
+    }
+
+    int64_t target_no = lookup_in_directory(volume, toDir_no, &toDir, toName);
+    if (target_no < 0) {
+        errno = EIO;
+        return -1;
+    }
+    // Both names already link to the same file
+    if (target_no == inode_no) return 0;
+
+    uint8_t type = file_type_of(volume, inode.i_mode);
+
+    if (target_no) {
+        if (read_inode_full(volume, target_no, &target) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (directory != inode_is_directory(&target)) {
+            errno = directory ? ENOTDIR : EISDIR;
+            return -1;
+        }
+        if (directory) {
+            int empty = directory_is_empty(volume, &target);
+            if (empty <= 0) {
+                if (empty == 0) errno = ENOTEMPTY;
+                return -1;
+            }
+        }
+
+        if (replace_entry(volume, toDir_no, toName, inode_no, type) < 0) return -1;
+
+        if (directory) {
+            // The ".." of the directory replaced no longer links to its parent
+            if (adjust_links(volume, toDir_no, -1) < 0) return -1;
+            target.i_links_count = 0;
+        } else if (target.i_links_count) {
+            target.i_links_count--;
+        }
+        if (target.i_links_count) {
+            target.i_ctime = time(NULL);
+            if (write_inode(volume, target_no, &target) < 0) return -1;
+        } else if (delete_inode(volume, target_no, &target) < 0) {
+            return -1;
+        }
+    } else if (add_entry(volume, toDir_no, toName, inode_no, type) < 0) {
+        return -1;
+    }
+
+    if (remove_entry(volume, fromDir_no, fromName) < 0) return -1;
+
+    if (directory && fromDir_no != toDir_no) {
+        if (replace_entry(volume, inode_no, "..", toDir_no, file_type_of(volume, S_IFDIR)) < 0 ||
+            adjust_links(volume, fromDir_no, -1) < 0 || adjust_links(volume, toDir_no, 1) < 0)
+            return -1;
+    }
+    if (adjust_links(volume, inode_no, 0) < 0) return -1;
+
+    flush_if_over_limit(volume);
+    return 0;
+}
@@ -0,0 +1,551 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/* The write-back cache holds the blocks of a writable volume that were
+   changed and not yet written: file data, bitmaps, inode table blocks,
+   indirect blocks and directories, along with the blocks of the group
+   descriptor table and the superblock, which are changed in place in
+   the copies the volume keeps in memory. Reads of the volume see the
+   changed blocks (see volume_pread), so nothing is written until a
+   flush.
+
+   A flush writes the changed blocks in increasing order, one kind of
+   block after the other: file data first, then bitmaps, then inode
+   tables, indirect blocks and directories, and the group descriptors
+   and superblock last. Blocks that follow each other on the volume
+   are written with a single system call, so a file written
+   sequentially, whose blocks the allocator placed together (see
+   ext2alloc.c), goes out in runs as long as the preallocation windows.
+   With 'sync', each kind is forced to disk before the next is written,
+   so a crash can leak blocks marked in the bitmaps, but never leave
+   an inode or directory pointing at blocks that were not written.
+
+   Long runs of whole blocks of file data skip the cache: they are
+   already in one piece in the buffer of the write, so they are written
+   from it right away, in one system call, and a flush with 'sync'
+   forces them to disk along with the data it holds, before the
+   metadata pointing to them.
+   Backup copies of the superblock and group descriptors are not
+   updated, as e2fsck only uses them when the primary copies are
+   damaged.
+
+   The cache takes no lock: like every change to a volume, callers
+   must keep all other operations on the volume out while they use it
+   (see ext2write.c).
+ */
+
+// Minimum number of slots of the index of a write-back cache (a power of two)
+#define EXT2_WRITEBACK_MIN_SLOTS 1024
+
+#define EXT2_OFFSET_SUPERBLOCK 1024
+
+// Most blocks written by one system call (IOV_MAX on Linux)
+#define EXT2_WRITEBACK_MAX_RUN 1024
+
+typedef struct dirty_block {
+    struct dirty_block *next; // Next spare copy
+    uint32_t block_no;
+    uint32_t kind;            // One of EXT2_WRITEBACK_*
+    char data[];
+} dirty_block_t;
+
+/* The index is probed linearly, and holds the block numbers, so a
+   lookup reads no copy of a block but the one it finds. */
+typedef struct writeback_slot {
+    uint32_t block_no;
+    dirty_block_t *block; // NULL if the slot is free
+} writeback_slot_t;
+
+struct writeback {
+    size_t num_slots;
+    writeback_slot_t *slots; // Index of the blocks held, at most half full
+    uint64_t count;          // Blocks held
+    uint8_t *dirty_descs;    // Per block of the group descriptor table, 1 if changed
+    int dirty_super;
+    int written_through;     // 1 if data skipped the cache since the last flush with 'sync'
+
+    // Copies freed by the last flush, reused so a stream of writes does not fault in new memory
+    dirty_block_t *spare;
+    uint64_t num_spare;
+
+    uint64_t flushes;
+    uint64_t blocks_written;
+    uint64_t writes;
+};
+
+static inline size_t slot_of(writeback_t *wb, uint32_t block_no) {
+
+    return (block_no * 0x9E3779B97F4A7C15ULL >> 32) & (wb->num_slots - 1);
+}
+
+// Returns the slot holding a block, or the free slot where it would go
+static size_t find_slot(writeback_t *wb, uint32_t block_no) {
+
+    size_t slot = slot_of(wb, block_no);
+    while (wb->slots[slot].block && wb->slots[slot].block_no != block_no) slot = (slot + 1) & (wb->num_slots - 1);
+    return slot;
+}
+
+static dirty_block_t *find_block(writeback_t *wb, uint32_t block_no) {
+
+    return wb->slots[find_slot(wb, block_no)].block;
+}
+
+/* Doubles the number of slots. Returns 0 on success, or -1 if memory
+   is exhausted; the index is then kept as it is. */
+static int grow_slots(writeback_t *wb) {
+
+    size_t old_count = wb->num_slots;
+    writeback_slot_t *old = wb->slots;
+    writeback_slot_t *slots = calloc(old_count * 2, sizeof(writeback_slot_t));
+    if (!slots) return -1;
+
+    wb->slots = slots;
+    wb->num_slots = old_count * 2;
+    for (size_t i = 0; i < old_count; i++)
+        if (old[i].block) wb->slots[find_slot(wb, old[i].block_no)] = old[i];
+    free(old);
+    return 0;
+}
+
+/* Frees a slot of the index, moving back the blocks after it that
+   would no longer be found past the free slot. */
+static void clear_slot(writeback_t *wb, size_t slot) {
+
+    size_t mask = wb->num_slots - 1;
+
+    for (size_t next = (slot + 1) & mask; wb->slots[next].block; next = (next + 1) & mask) {
+        size_t home = slot_of(wb, wb->slots[next].block_no);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            wb->slots[slot] = wb->slots[next];
+            slot = next;
+        }
+    }
+    wb->slots[slot].block = NULL;
+}
+
+// Keeps a copy for reuse, as long as fewer than 'keep' copies are kept
+static void put_spare(writeback_t *wb, dirty_block_t *block, uint64_t keep) {
+
+    if (wb->num_spare >= keep) {
+        free(block);
+        return;
+    }
+    block->next = wb->spare;
+    wb->spare = block;
+    wb->num_spare++;
+}
+
+/* Empties the cache, keeping as many copies for reuse as the cache
+   held, so the next batch of the same size allocates nothing. */
+static void drop_blocks(writeback_t *wb, int reuse) {
+
+    uint64_t keep = reuse ? wb->count : 0;
+
+    // Spares beyond what the last batch needed are released
+    while (wb->num_spare > keep) {
+        dirty_block_t *block = wb->spare;
+        wb->spare = block->next;
+        wb->num_spare--;
+        free(block);
+    }
+
+    for (size_t i = 0; i < wb->num_slots; i++)
+        if (wb->slots[i].block) put_spare(wb, wb->slots[i].block, keep);
+    memset(wb->slots, 0, sizeof(writeback_slot_t) * wb->num_slots);
+    wb->count = 0;
+}
+
+/* writeback_attach: Creates the write-back cache of a volume opened
+   with EXT2_OPEN_WRITE.
+
+   Returns:
+     0 on success, or -1 if memory is exhausted.
+ */
+int writeback_attach(volume_t *volume) {
+
+    writeback_t *wb = calloc(1, sizeof(writeback_t));
+    if (!wb) return -1;
+
+    wb->num_slots = EXT2_WRITEBACK_MIN_SLOTS;
+    wb->slots = calloc(wb->num_slots, sizeof(writeback_slot_t));
+    wb->dirty_descs = calloc((volume->num_groups - 1) / volume->descs_per_block + 1, 1);
+    if (!wb->slots || !wb->dirty_descs) {
+        free(wb->slots);
+        free(wb->dirty_descs);
+        free(wb);
+        return -1;
+    }
+
+    volume->writeback = wb;
+    return 0;
+}
+
+/* writeback_detach: Frees the write-back cache of a volume, dropping
+   the changes it holds; see writeback_flush. Does nothing if the
+   volume has no write-back cache.
+ */
+void writeback_detach(volume_t *volume) {
+
+    writeback_t *wb = volume->writeback;
+    if (!wb) return;
+
+    drop_blocks(wb, 0);
+    free(wb->slots);
+    free(wb->dirty_descs);
+    free(wb);
+    volume->writeback = NULL;
+}
+
+/* writeback_block: Returns the copy of a block to be changed, held
+   until the next flush. The copy of the block in the volume's cache
+   pool is dropped, and for metadata, the volume's generation changes,
+   so the indirect blocks remembered by the mapping kernels are read
+   again (see ext2blocks.c). Must be called again before each change:
+   the copy is only valid until the next flush.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     block_no: Number of the block.
+     kind: One of EXT2_WRITEBACK_*, which decides when the block is
+           written by a flush.
+     fill: 1 to start from the current contents of the block, or 0
+           (zero) for a block whose contents are all replaced; the
+           copy is then zeroed.
+
+   Returns:
+     A pointer to block_size bytes, or NULL with errno set to EINVAL
+     (the block is outside the volume, or holds the superblock), EIO
+     or ENOMEM.
+ */
+void *writeback_block(volume_t *volume, uint32_t block_no, int kind, int fill) {
+
+    writeback_t *wb = volume->writeback;
+
+    if (!wb || block_no <= volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t slot = find_slot(wb, block_no);
+    dirty_block_t *block = wb->slots[slot].block;
+    if (!block) {
+        // The index stays at most half full, and keeps a free slot if it cannot grow
+        if ((wb->count + 1) * 2 > wb->num_slots) {
+            if (grow_slots(wb) < 0 && wb->count + 2 > wb->num_slots) {
+                errno = ENOMEM;
+                return NULL;
+            }
+            slot = find_slot(wb, block_no);
+        }
+
+        if (wb->spare) {
+            block = wb->spare;
+            wb->spare = block->next;
+            wb->num_spare--;
+        } else if (!(block = malloc(sizeof(dirty_block_t) + volume->block_size))) {
+            return NULL;
+        }
+
+        if (fill) {
+            // Not changed yet, so the volume file holds the current contents
+            ssize_t rv = volume_pread(volume, block->data, volume->block_size,
+                                      (uint64_t) block_no << volume->block_bits);
+            if (rv < 0) {
+                free(block);
+                errno = EIO;
+                return NULL;
+            }
+            memset(block->data + rv, 0, volume->block_size - rv);
+        }
+
+        block->block_no = block_no;
+        wb->slots[slot].block_no = block_no;
+        wb->slots[slot].block = block;
+        wb->count++;
+    }
+    if (!fill) memset(block->data, 0, volume->block_size);
+
+    // A block freed and allocated again is written with its new use
+    block->kind = kind;
+
+    cache_invalidate(volume, EXT2_CACHE_BLOCK, block_no);
+    if (kind == EXT2_WRITEBACK_META)
+        atomic_fetch_add_explicit(&volume->generation, 1, memory_order_release);
+    return block->data;
+}
+
+/* writeback_forget: Drops the changes to a block that was freed, so
+   they are never written. Does nothing if the block was not changed.
+ */
+void writeback_forget(volume_t *volume, uint32_t block_no) {
+
+    writeback_t *wb = volume->writeback;
+    if (!wb) return;
+
+    size_t slot = find_slot(wb, block_no);
+    dirty_block_t *block = wb->slots[slot].block;
+    if (!block) return;
+
+    clear_slot(wb, slot);
+    put_spare(wb, block, wb->count);
+    wb->count--;
+}
+
+/* writeback_group_desc: Returns the descriptor of a block group, to be
+   changed. The block of the descriptor table holding it is written by
+   the next flush.
+
+   Returns:
+     A pointer to the descriptor, valid until the volume is closed, or
+     NULL as for get_group_desc.
+ */
+group_desc_t *writeback_group_desc(volume_t *volume, uint32_t group) {
+
+    // The descriptors read are kept in memory for good, and are the ones changed
+    group_desc_t *desc = (group_desc_t *) get_group_desc(volume, group);
+
+    if (desc && volume->writeback)
+        volume->writeback->dirty_descs[group / volume->descs_per_block] = 1;
+    return desc;
+}
+
+/* writeback_super: Marks the superblock kept in volume->super as
+   changed, so the next flush writes it.
+ */
+void writeback_super(volume_t *volume) {
+
+    if (volume->writeback) volume->writeback->dirty_super = 1;
+}
+
+/* writeback_overlay: Replaces the data read from a volume file with
+   the blocks changed since, where they overlap it.
+
+   Parameters:
+     volume: Pointer to volume.
+     buffer: Data read.
+     size: Number of bytes read.
+     offset: Position in the volume file the data was read from.
+ */
+void writeback_overlay(volume_t *volume, void *buffer, size_t size, off_t offset) {
+
+    writeback_t *wb = volume->writeback;
+    if (!wb || !wb->count || !size) return;
+
+    uint64_t first = (uint64_t) offset >> volume->block_bits;
+    uint64_t last = ((uint64_t) offset + size - 1) >> volume->block_bits;
+
+    for (uint64_t block_no = first; block_no <= last; block_no++) {
+        dirty_block_t *block = block_no < UINT32_MAX ? find_block(wb, block_no) : NULL;
+        if (!block) continue;
+
+        uint64_t start = block_no << volume->block_bits;
+        uint64_t from = start > (uint64_t) offset ? start : (uint64_t) offset;
+        uint64_t to = start + volume->block_size < (uint64_t) offset + size ?
+                      start + volume->block_size : (uint64_t) offset + size;
+        memcpy((char *) buffer + (from - offset), block->data + (from - start), to - from);
+    }
+}
+
+/* writeback_over_limit: Checks if a volume holds more changed data
+   than EXT2_WRITEBACK_LIMIT, and should be flushed.
+ */
+int writeback_over_limit(volume_t *volume) {
+
+    writeback_t *wb = volume->writeback;
+    return wb && (wb->count << volume->block_bits) > EXT2_WRITEBACK_LIMIT;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+
+    const dirty_block_t *x = *(dirty_block_t *const *) a, *y = *(dirty_block_t *const *) b;
+
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    if (x->block_no != y->block_no) return x->block_no < y->block_no ? -1 : 1;
+    return 0;
+}
+
+/* Writes a run of buffers to the volume file, in as many calls as
+   short writes make necessary. */
+static int write_run(volume_t *volume, struct iovec *iov, int count, uint64_t offset) {
+
+    while (count > 0) {
+        ssize_t rv = pwritev(volume->fd, iov, count, offset);
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv <= 0) {
+            if (rv == 0) errno = EIO;
+            return -1;
+        }
+        volume->writeback->writes++;
+        offset += rv;
+        while (count > 0 && (size_t) rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+    return 0;
+}
+
+/* Writes the blocks of the sorted array 'blocks', merging runs of
+   adjacent blocks of the same kind into single writes. With 'sync',
+   each kind is forced to disk before the next one is written. */
+static int write_blocks(volume_t *volume, dirty_block_t **blocks, size_t count, int sync) {
+
+    struct iovec iov[EXT2_WRITEBACK_MAX_RUN];
+
+    for (size_t i = 0; i < count;) {
+        size_t run = 1;
+        while (i + run < count && run < EXT2_WRITEBACK_MAX_RUN && blocks[i + run]->kind == blocks[i]->kind &&
+               blocks[i + run]->block_no == blocks[i]->block_no + run)
+            run++;
+
+        for (size_t j = 0; j < run; j++) {
+            iov[j].iov_base = blocks[i + j]->data;
+            iov[j].iov_len = volume->block_size;
+        }
+        if (write_run(volume, iov, run, (uint64_t) blocks[i]->block_no << volume->block_bits) < 0)
+            return -1;
+
+        i += run;
+        if (sync && (i == count || blocks[i]->kind != blocks[i - 1]->kind) && fdatasync(volume->fd) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* writeback_write_through: Writes a run of whole blocks of file data
+   straight to the volume file, and drops the changes held to them.
+   Used for runs of at least EXT2_WRITE_THROUGH_MIN bytes, which gain
+   nothing from the cache.
+
+   Parameters:
+     volume: Pointer to volume, opened with EXT2_OPEN_WRITE.
+     block_no: First block of the run.
+     count: Number of blocks.
+     data: Contents of the blocks, count * block_size bytes.
+
+   Returns:
+     0 on success, or -1 with errno set to EINVAL (the run is outside
+     the volume, or holds the superblock) or to the error of the write.
+ */
+int writeback_write_through(volume_t *volume, uint32_t block_no, uint32_t count, const void *data) {
+
+    writeback_t *wb = volume->writeback;
+
+    if (!wb || block_no <= volume->super.s_first_data_block || block_no >= volume->super.s_blocks_count ||
+        count > volume->super.s_blocks_count - block_no) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        writeback_forget(volume, block_no + i);
+        cache_invalidate(volume, EXT2_CACHE_BLOCK, block_no + i);
+    }
+
+    struct iovec iov = { (void *) data, (size_t) count << volume->block_bits };
+    if (write_run(volume, &iov, 1, (uint64_t) block_no << volume->block_bits) < 0) return -1;
+    wb->written_through = 1;
+    wb->blocks_written += count;
+    return 0;
+}
+
+/* writeback_flush: Writes the changes held by the write-back cache of
+   a volume, in the order described at the top of this file, and
+   empties the cache.
+
+   Parameters:
+     volume: Pointer to volume.
+     sync: 1 to force each kind of block to disk before the next kind
+           is written, and everything to disk before returning; 0
+           (zero) to leave the data in the host's page cache.
+
+   Returns:
+     0 on success, or if the volume has no write-back cache. -1 if
+     some change could not be written; the changes are then kept, and
+     written again by the next flush.
+ */
+int writeback_flush(volume_t *volume, int sync) {
+
+    writeback_t *wb = volume->writeback;
+    if (!wb) return 0;
+
+    uint32_t num_desc_blocks = (volume->num_groups - 1) / volume->descs_per_block + 1;
+    dirty_block_t **blocks = NULL;
+    size_t count = 0;
+
+    if (wb->count) {
+        if (!(blocks = malloc(sizeof(dirty_block_t *) * wb->count))) return -1;
+        for (size_t i = 0; i < wb->num_slots; i++)
+            if (wb->slots[i].block) blocks[count++] = wb->slots[i].block;
+        qsort(blocks, count, sizeof(dirty_block_t *), compare_blocks);
+    }
+
+    // Data written through goes to disk with the data held, or on its own if there is none
+    if (sync && wb->written_through && (!count || blocks[0]->kind != EXT2_WRITEBACK_DATA) &&
+        fdatasync(volume->fd) < 0) {
+        free(blocks);
+        return -1;
+    }
+    if (count && write_blocks(volume, blocks, count, sync) < 0) {
+        free(blocks);
+        return -1;
+    }
+    free(blocks);
+
+    // The table starts in the block after the superblock
+    for (uint32_t i = 0; i < num_desc_blocks; i++) {
+        if (!wb->dirty_descs[i]) continue;
+        struct iovec iov = { atomic_load(&volume->group_blocks[i]), volume->block_size };
+        if (write_run(volume, &iov, 1, (uint64_t) (volume->super.s_first_data_block + 1 + i) << volume->block_bits) < 0)
+            return -1;
+        wb->dirty_descs[i] = 0;
+        wb->blocks_written++;
+    }
+
+    if (wb->dirty_super) {
+        volume->super.s_wtime = time(NULL);
+        struct iovec iov = { &volume->super, sizeof(superblock_t) };
+        if (write_run(volume, &iov, 1, EXT2_OFFSET_SUPERBLOCK) < 0) return -1;
+        wb->dirty_super = 0;
+        wb->blocks_written++;
+    }
+
+    if (sync && fdatasync(volume->fd) < 0) return -1;
+
+    if (sync) wb->written_through = 0;
+    wb->blocks_written += count;
+    wb->flushes++;
+    drop_blocks(wb, 1);
+    return 0;
+}
+
+/* writeback_stats: Reports the activity of the write-back cache of a
+   volume.
+
+   Returns:
+     0 on success, or -1 if the volume has no write-back cache.
+ */
+int writeback_stats(volume_t *volume, writeback_stats_t *stats) {
+
+    writeback_t *wb = volume->writeback;
+    if (!wb) return -1;
+
+    stats->dirty_blocks = wb->count;
+    stats->flushes = wb->flushes;
+    stats->blocks_written = wb->blocks_written;
+    stats->writes = wb->writes;
+    return 0;
+}
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+
+/* ext2writebench: Measures write throughput through a volume opened
+   with EXT2_OPEN_WRITE. Files are created in a new directory of the
+   volume and written in writes of a fixed size, one file after the
+   other or, with -i, round-robin across the files, as concurrent
+   writers would; the time includes the final flush, forced to disk.
+   The same amount of data is then written sequentially to a scratch
+   file next to the volume file, for the raw bandwidth to compare
+   with. Finally, the volume is opened again, every file is read back
+   and checked, and the number of extents of the files is reported:
+   files written through the allocator should be in one piece, up to
+   the size of a block group.
+ */
+
+// Defaults for the options
+#define DEFAULT_FILES     4
+#define DEFAULT_SIZE_MIB  64
+#define DEFAULT_WRITE_KIB 128
+
+static double now(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills a buffer with the contents expected at 'offset' of file 'file'
+static void fill_pattern(uint64_t *buffer, size_t size, uint32_t file, uint64_t offset) {
+
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+    buffer[i] = ((uint64_t) file << 48) ^ (offset / sizeof(uint64_t) + i) * 0x9E3779B97F4A7C15ULL;
+}
+
+static int write_fully(int fd, const void *buffer, size_t size, off_t offset) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t rv = pwrite(fd, (const char *) buffer + done, size - done, offset + done);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv <= 0) return -1;
+    done += rv;
+  }
+  return 0;
+}
+
+/* Writes the files through the volume, and flushes them to disk.
+   Returns the time taken, or -1 in case of error. */
+static double write_files(volume_t *volume, const uint32_t *inode_nos, uint32_t files, uint64_t size,
+                          size_t write_size, int interleave, uint64_t *buffer) {
+
+  double start = now();
+  uint64_t writes = size / write_size;
+
+  for (uint64_t n = 0; n < writes * files; n++) {
+    // Round-robin across the files, or one file after the other
+    uint32_t file = interleave ? n % files : n / writes;
+    uint64_t offset = (interleave ? n / files : n % writes) * write_size;
+
+    fill_pattern(buffer, write_size, file, offset);
+    if (write_file_content(volume, inode_nos[file], offset, write_size, buffer) != (ssize_t) write_size) {
+      perror("write_file_content");
+      return -1;
+    }
+  }
+
+  for (uint32_t file = 0; file < files; file++)
+    alloc_release(volume, inode_nos[file]);
+  if (writeback_flush(volume, 1) < 0) {
+    perror("writeback_flush");
+    return -1;
+  }
+  return now() - start;
+}
+
+/* Writes the same amount of data to a scratch file, sequentially.
+   Returns the time taken, or -1 in case of error. */
+static double write_raw(const char *filename, uint64_t total, size_t write_size, uint64_t *buffer) {
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    perror(filename);
+    return -1;
+  }
+
+  double start = now();
+  for (uint64_t offset = 0; offset < total; offset += write_size) {
+    fill_pattern(buffer, write_size, 0, offset);
+    if (write_fully(fd, buffer, write_size, offset) < 0) {
+      perror(filename);
+      close(fd);
+      unlink(filename);
+      return -1;
+    }
+  }
+  int rv = fdatasync(fd);
+  double elapsed = now() - start;
+
+  close(fd);
+  unlink(filename);
+  return rv < 0 ? -1 : elapsed;
+}
+
+/* Reads the files back and checks their contents. Prints the number
+   of extents of the files. Returns the number of files that do not
+   match, or -1 in case of error. */
+static int check_files(volume_t *volume, const char *dir, uint32_t files, uint64_t size, size_t write_size,
+                       uint64_t *buffer, uint64_t *expected) {
+
+  uint32_t extents = 0, whole = 0, groups = 0;
+  int bad = 0;
+  char path[64];
+
+  for (uint32_t file = 0; file < files; file++) {
+    inode_t inode;
+    file_layout_t layout;
+
+    snprintf(path, sizeof(path), "%s/file%u", dir, file);
+    uint32_t inode_no = find_file_from_path(volume, path, &inode);
+    if (!inode_no || analyze_file_layout(volume, inode_no, &inode, &layout) < 0) {
+      fprintf(stderr, "Cannot read %s.\n", path);
+      return -1;
+    }
+    extents += layout.num_extents;
+    groups += layout.groups;
+    if (layout.num_extents <= 1) whole++;
+    free(layout.extents);
+
+    if (inode_file_size(volume, &inode) != size) {
+      printf("%s: size %" PRIu64 ", expected %" PRIu64 "\n", path, inode_file_size(volume, &inode), size);
+      bad++;
+      continue;
+    }
+    for (uint64_t offset = 0; offset < size; offset += write_size) {
+      fill_pattern(expected, write_size, file, offset);
+      if (read_file_content(volume, &inode, offset, write_size, buffer) != (ssize_t) write_size ||
+          memcmp(buffer, expected, write_size)) {
+        printf("%s: contents differ at offset %" PRIu64 "\n", path, offset);
+        bad++;
+        break;
+      }
+    }
+  }
+
+  printf("layout: %u extents over %u files (%u in one piece), %.2f groups per file\n", extents, files, whole,
+         (double) groups / files);
+  return bad;
+}
+
+static int remove_files(const char *filename, const char *dir, uint32_t files) {
+
+  volume_t *volume = open_volume_file_flags(filename, EXT2_OPEN_WRITE);
+  char path[64];
+  int rv = 0;
+
+  if (!volume) return -1;
+  for (uint32_t file = 0; file < files; file++) {
+    snprintf(path, sizeof(path), "%s/file%u", dir, file);
+    if (unlink_file(volume, path) < 0) rv = -1;
+  }
+  if (remove_directory(volume, dir) < 0) rv = -1;
+  if (writeback_flush(volume, 1) < 0) rv = -1;
+  close_volume_file(volume);
+  return rv;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr, "Usage: %s [-n files] [-s size_mib] [-w write_kib] [-i] [-d] volume_file\n"
+          "  -n files      number of files written (default: %d)\n"
+          "  -s size_mib   size of each file, in MiB (default: %d)\n"
+          "  -w write_kib  size of each write, in KiB (default: %d)\n"
+          "  -i            interleave the writes of all files, instead of one file after the other\n"
+          "  -d            delete the files afterwards\n", name, DEFAULT_FILES, DEFAULT_SIZE_MIB,
+          DEFAULT_WRITE_KIB);
+}
+
+int main(int argc, char *argv[]) {
+
+  long files = DEFAULT_FILES, size_mib = DEFAULT_SIZE_MIB, write_kib = DEFAULT_WRITE_KIB;
+  int interleave = 0, delete = 0, opt, status = 0;
+
+  while ((opt = getopt(argc, argv, "n:s:w:id")) != -1) {
+    switch (opt) {
+    case 'n': files = atol(optarg); break;
+    case 's': size_mib = atol(optarg); break;
+    case 'w': write_kib = atol(optarg); break;
+    case 'i': interleave = 1; break;
+    case 'd': delete = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  // Files are a whole number of writes
+  if (argc - optind != 1 || files < 1 || size_mib < 1 || write_kib < 1 || write_kib > (size_mib << 10) ||
+      (size_mib << 10) % write_kib) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *filename = argv[optind];
+  uint64_t size = (uint64_t) size_mib << 20;
+  size_t write_size = (size_t) write_kib << 10;
+  uint64_t *buffer = malloc(write_size), *expected = malloc(write_size);
+  uint32_t *inode_nos = calloc(files, sizeof(uint32_t));
+  char dir[32], path[64], *scratch = malloc(strlen(filename) + sizeof(".writebench"));
+
+  if (!buffer || !expected || !inode_nos || !scratch) {
+    fprintf(stderr, "Not enough memory.\n");
+    return 1;
+  }
+  snprintf(dir, sizeof(dir), "/writebench.%d", (int) getpid());
+  sprintf(scratch, "%s.writebench", filename);
+
+  volume_t *volume = open_volume_file_flags(filename, EXT2_OPEN_WRITE);
+  if (!volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", filename);
+    return 1;
+  }
+
+  if (!make_directory(volume, dir, 0755, getuid(), getgid())) {
+    perror(dir);
+    close_volume_file(volume);
+    return 1;
+  }
+  for (long file = 0; file < files; file++) {
+    snprintf(path, sizeof(path), "%s/file%ld", dir, file);
+    if (!(inode_nos[file] = create_file(volume, path, 0644, getuid(), getgid()))) {
+      perror(path);
+      close_volume_file(volume);
+      return 1;
+    }
+  }
+
+  double total_mib = (double) size * files / 1048576.0;
+  double elapsed = write_files(volume, inode_nos, files, size, write_size, interleave, buffer);
+  writeback_stats_t stats;
+  writeback_stats(volume, &stats);
+  close_volume_file(volume);
+  if (elapsed < 0) return 1;
+
+  printf("volume: %.0f MiB in %ld files, %zu KiB writes%s: %.1f MiB/s\n", total_mib, files, write_size >> 10,
+         interleave ? " interleaved" : "", total_mib / elapsed);
+  printf("write-back: %" PRIu64 " flushes, %" PRIu64 " blocks in %" PRIu64 " writes (%.1f blocks per write)\n",
+         stats.flushes, stats.blocks_written, stats.writes,
+         stats.writes ? (double) stats.blocks_written / stats.writes : 0.0);
+
+  double raw = write_raw(scratch, size * files, write_size, buffer);
+  if (raw > 0)
+    printf("raw sequential: %.1f MiB/s (volume at %.1f%%)\n", total_mib / raw, 100 * raw / elapsed);
+
+  if (!(volume = open_volume_file(filename))) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", filename);
+    return 1;
+  }
+  int bad = check_files(volume, dir, files, size, write_size, buffer, expected);
+  close_volume_file(volume);
+  if (bad) {
+    if (bad > 0) printf("%d files do not match\n", bad);
+    status = 1;
+  }
+
+  if (delete && remove_files(filename, dir, files) < 0) {
+    fprintf(stderr, "Cannot delete %s.\n", dir);
+    status = 1;
+  }
+
+  free(buffer);
+  free(expected);
+  free(inode_nos);
+  free(scratch);
+  return status;
+}
@@ -0,0 +1,492 @@
+#include "ext2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* A compressed image holds the content of a volume file cut in chunks
+   of chunk_size bytes, each compressed on its own with zlib, so any
+   part of the volume can be read by decompressing only the chunks
+   holding it. The file is a zimage_header_t, followed by the chunks,
+   followed by the index: num_chunks + 1 offsets in the file, chunk i
+   taking the bytes from index[i] to index[i + 1]. A chunk taking no
+   bytes is all zeros, and a chunk taking as many bytes as it holds is
+   stored as is (compressing it did not help).
+
+   Decompressed chunks are kept in a cache of EXT2_ZIMAGE_SLOTS slots,
+   chunk i going to slot i % EXT2_ZIMAGE_SLOTS, so runs of consecutive
+   chunks never evict each other. When chunks are read in order, the
+   next EXT2_ZIMAGE_READAHEAD chunks are queued for a few worker
+   threads, so sequential scans decompress in parallel ahead of the
+   reader. Workers never wait: a chunk whose slot is in use is simply
+   not read ahead.
+
+   The buffers of the slots may be limited by a budget, set by a memory
+   governor (see ext2mem.c). Once the budget is used up, a slot being
+   loaded takes the buffer of an idle slot, in CLOCK order, and read-
+   ahead stops if there is none. The chunk that lost its buffer stays
+   remembered in its slot, and a reader missing on it counts a ghost
+   hit.
+ */
+
+// Number of slots in the cache of decompressed chunks
+#define EXT2_ZIMAGE_SLOTS 64
+
+// Number of chunks read ahead of a sequential reader (less than EXT2_ZIMAGE_SLOTS)
+#define EXT2_ZIMAGE_READAHEAD 8
+
+// Maximum number of worker threads decompressing chunks ahead of readers
+#define EXT2_ZIMAGE_MAX_WORKERS 4
+
+#define SLOT_EMPTY   0
+#define SLOT_LOADING 1
+#define SLOT_READY   2
+
+typedef struct zimage_slot {
+    int64_t chunk; // Chunk held or being loaded, -1 if none
+    int64_t ghost; // Chunk whose buffer was taken to stay within the budget, -1 if none
+    int state;     // One of SLOT_*
+    int users;     // Readers copying from data
+    char *data;    // chunk_size bytes, allocated the first time the slot is used
+} zimage_slot_t;
+
+struct zimage {
+    int fd;
+    zimage_header_t header;
+    uint64_t *index;
+
+    pthread_mutex_t lock;   // Protects slots, the read-ahead queue and the workers
+    pthread_cond_t changed; // A slot finished loading or lost its last user
+    pthread_cond_t work;    // Chunks were queued, or the image is closing
+    zimage_slot_t slots[EXT2_ZIMAGE_SLOTS];
+    unsigned int num_buffers; // Slots with a buffer, allocated or being allocated
+    unsigned int max_buffers; // Buffers the budget allows
+    unsigned int hand;        // Next slot considered when taking a buffer
+    unsigned int num_ghosts;
+
+    int64_t queue[EXT2_ZIMAGE_READAHEAD * 2];
+    unsigned int queue_head, queue_count;
+    int64_t last_chunk;     // Chunk of the last read, to detect sequential readers
+    int64_t queued_until;   // Chunks below this one were already queued
+    pthread_t workers[EXT2_ZIMAGE_MAX_WORKERS];
+    unsigned int num_workers;
+    int stop;
+
+    _Atomic uint64_t hits, misses, prefetched, ghost_hits;
+};
+
+static int read_fully(int fd, void *buffer, size_t size, off_t offset) {
+
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t rv = pread(fd, (char *) buffer + done, size - done, offset + done);
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv <= 0) return -1;
+        done += rv;
+    }
+    return 0;
+}
+
+static inline uint64_t chunk_bytes(zimage_t *image, uint64_t chunk) {
+
+    uint64_t start = chunk * image->header.chunk_size;
+    uint64_t left = image->header.image_size - start;
+    return left < image->header.chunk_size ? left : image->header.chunk_size;
+}
+
+/* zimage_open: Checks if a file is a compressed image, and if so,
+   reads its header and index.
+
+   Parameters:
+     fd: Open file descriptor of the file. The descriptor is used, but
+         not owned, by the image.
+     image: Set to the opened image, if the file is a compressed image.
+
+   Returns:
+     1 if the file is a valid compressed image, 0 (zero) if it is not a
+     compressed image (it does not start with EXT2_ZIMAGE_MAGIC), or -1
+     if it is an invalid or incomplete compressed image, or memory is
+     exhausted.
+ */
+int zimage_open(int fd, zimage_t **image) {
+
+    zimage_header_t header;
+    struct stat st;
+
+    *image = NULL;
+    if (fstat(fd, &st) == -1) return -1;
+    if (st.st_size < sizeof(header) || read_fully(fd, &header, sizeof(header), 0) < 0) return 0;
+    if (memcmp(header.magic, EXT2_ZIMAGE_MAGIC, sizeof(header.magic))) return 0;
+
+    if (header.version != EXT2_ZIMAGE_VERSION) return -1;
+    if (header.chunk_size < EXT2_ZIMAGE_MIN_CHUNK || header.chunk_size > EXT2_ZIMAGE_MAX_CHUNK ||
+        (header.chunk_size & (header.chunk_size - 1)))
+        return -1;
+    if (header.num_chunks != (header.image_size + header.chunk_size - 1) / header.chunk_size) return -1;
+
+    // The index must fit in the file, which also bounds its size in memory
+    uint64_t index_size = (header.num_chunks + 1) * sizeof(uint64_t);
+    if (header.index_offset < sizeof(header) || header.index_offset > st.st_size ||
+        index_size > st.st_size - header.index_offset)
+        return -1;
+
+    zimage_t *zimage = calloc(1, sizeof(zimage_t));
+    if (!zimage) return -1;
+    zimage->fd = fd;
+    zimage->header = header;
+    zimage->index = malloc(index_size);
+    if (!zimage->index || read_fully(fd, zimage->index, index_size, header.index_offset) < 0) goto fail;
+
+    if (zimage->index[0] < sizeof(header) || zimage->index[header.num_chunks] > header.index_offset) goto fail;
+    for (uint64_t i = 0; i < header.num_chunks; i++)
+        if (zimage->index[i + 1] < zimage->index[i] || zimage->index[i + 1] - zimage->index[i] > chunk_bytes(zimage, i))
+            goto fail;
+
+    pthread_mutex_init(&zimage->lock, NULL);
+    pthread_cond_init(&zimage->changed, NULL);
+    pthread_cond_init(&zimage->work, NULL);
+    for (int i = 0; i < EXT2_ZIMAGE_SLOTS; i++)
+        zimage->slots[i].chunk = zimage->slots[i].ghost = -1;
+    zimage->max_buffers = EXT2_ZIMAGE_SLOTS;
+    zimage->last_chunk = -2;
+
+    *image = zimage;
+    return 1;
+
+ fail:
+    free(zimage->index);
+    free(zimage);
+    return -1;
+}
+
+/* zimage_close: Stops the worker threads of an image, and frees all
+   its resources. The file descriptor is not closed. Does nothing if
+   image is NULL.
+ */
+void zimage_close(zimage_t *image) {
+
+    if (!image) return;
+
+    pthread_mutex_lock(&image->lock);
+    image->stop = 1;
+    pthread_cond_broadcast(&image->work);
+    pthread_mutex_unlock(&image->lock);
+
+    for (unsigned int i = 0; i < image->num_workers; i++)
+        pthread_join(image->workers[i], NULL);
+
+    for (int i = 0; i < EXT2_ZIMAGE_SLOTS; i++)
+        free(image->slots[i].data);
+    pthread_cond_destroy(&image->work);
+    pthread_cond_destroy(&image->changed);
+    pthread_mutex_destroy(&image->lock);
+    free(image->index);
+    free(image);
+}
+
+/* zimage_size: Returns the size of the volume file held by an image.
+ */
+uint64_t zimage_size(zimage_t *image) {
+
+    return image->header.image_size;
+}
+
+// Reads and decompresses a chunk into a buffer of chunk_size bytes
+static int load_chunk(zimage_t *image, uint64_t chunk, char *data) {
+
+    uint64_t start = image->index[chunk], stored = image->index[chunk + 1] - start;
+    uint64_t size = chunk_bytes(image, chunk);
+
+    if (stored == 0) {
+        memset(data, 0, size);
+        return 0;
+    }
+    if (stored == size)
+        return read_fully(image->fd, data, size, start);
+
+    Bytef *compressed = malloc(stored);
+    if (!compressed) return -1;
+
+    uLongf length = size;
+    int rv = read_fully(image->fd, compressed, stored, start);
+    if (rv == 0 && (uncompress((Bytef *) data, &length, compressed, stored) != Z_OK || length != size))
+        rv = -1;
+
+    free(compressed);
+    return rv;
+}
+
+/* Drops the buffer of an idle slot, remembering the chunk it held as a
+   ghost. Must be called with the image lock held.
+
+   Returns:
+     The buffer, or NULL if no slot other than 'except' is idle. */
+static char *take_buffer(zimage_t *image, zimage_slot_t *except) {
+
+    for (int i = 0; i < EXT2_ZIMAGE_SLOTS; i++) {
+        zimage_slot_t *slot = &image->slots[image->hand];
+        image->hand = (image->hand + 1) % EXT2_ZIMAGE_SLOTS;
+
+        if (slot == except || slot->state == SLOT_LOADING || slot->users || !slot->data) continue;
+
+        char *data = slot->data;
+        if (slot->state == SLOT_READY) {
+            if (slot->ghost < 0) image->num_ghosts++;
+            slot->ghost = slot->chunk;
+        }
+        slot->chunk = -1;
+        slot->state = SLOT_EMPTY;
+        slot->data = NULL;
+        return data;
+    }
+    return NULL;
+}
+
+/* Finds the slot holding a chunk, loading the chunk if needed. For
+   readers (prefetch is 0), waits for the slot to be free, and returns
+   it with one more user, to be released with release_slot. For
+   read-ahead, returns immediately, without a user, if the slot is
+   busy. Returns NULL if the chunk cannot be read, or on read-ahead if
+   the slot is busy. */
+static zimage_slot_t *acquire_slot(zimage_t *image, uint64_t chunk, int prefetch) {
+
+    zimage_slot_t *slot = &image->slots[chunk % EXT2_ZIMAGE_SLOTS];
+
+    pthread_mutex_lock(&image->lock);
+    for (;;) {
+        if (slot->chunk == (int64_t) chunk && slot->state == SLOT_READY) {
+            if (!prefetch) {
+                slot->users++;
+                atomic_fetch_add_explicit(&image->hits, 1, memory_order_relaxed);
+            }
+            pthread_mutex_unlock(&image->lock);
+            return slot;
+        }
+        if (slot->state != SLOT_LOADING && slot->users == 0) break;
+        if (prefetch) {
+            pthread_mutex_unlock(&image->lock);
+            return NULL;
+        }
+        pthread_cond_wait(&image->changed, &image->lock);
+    }
+
+    // Over budget, the slot takes the buffer of an idle one; read-ahead gives up if there is none
+    int allocate = 0;
+    if (!slot->data && image->num_buffers >= image->max_buffers) {
+        if (!(slot->data = take_buffer(image, slot)) && prefetch) {
+            pthread_mutex_unlock(&image->lock);
+            return NULL;
+        }
+    }
+    if (!slot->data) {
+        allocate = 1;
+        image->num_buffers++;
+    }
+
+    // A chunk loaded in place of a ghost displaces it, as a larger budget would have
+    if (slot->ghost >= 0) {
+        if (slot->ghost == (int64_t) chunk && !prefetch)
+            atomic_fetch_add_explicit(&image->ghost_hits, 1, memory_order_relaxed);
+        slot->ghost = -1;
+        image->num_ghosts--;
+    }
+
+    // Claim the slot, and load the chunk without holding the lock
+    slot->chunk = chunk;
+    slot->state = SLOT_LOADING;
+    char *data = slot->data;
+    pthread_mutex_unlock(&image->lock);
+
+    if (allocate) data = malloc(image->header.chunk_size);
+    int rv = data ? load_chunk(image, chunk, data) : -1;
+
+    pthread_mutex_lock(&image->lock);
+    slot->data = data;
+    if (!data) image->num_buffers--;
+    if (rv < 0) {
+        slot->chunk = -1;
+        slot->state = SLOT_EMPTY;
+        slot = NULL;
+    } else {
+        slot->state = SLOT_READY;
+        if (!prefetch) slot->users++;
+        atomic_fetch_add_explicit(prefetch ? &image->prefetched : &image->misses, 1, memory_order_relaxed);
+    }
+    pthread_cond_broadcast(&image->changed);
+    pthread_mutex_unlock(&image->lock);
+    return slot;
+}
+
+static void release_slot(zimage_t *image, zimage_slot_t *slot) {
+
+    pthread_mutex_lock(&image->lock);
+    if (--slot->users == 0) pthread_cond_broadcast(&image->changed);
+    pthread_mutex_unlock(&image->lock);
+}
+
+static void *worker_thread(void *arg) {
+
+    zimage_t *image = arg;
+
+    pthread_mutex_lock(&image->lock);
+    for (;;) {
+        while (!image->queue_count && !image->stop)
+            pthread_cond_wait(&image->work, &image->lock);
+        if (image->stop) break;
+
+        int64_t chunk = image->queue[image->queue_head];
+        image->queue_head = (image->queue_head + 1) % (EXT2_ZIMAGE_READAHEAD * 2);
+        image->queue_count--;
+        pthread_mutex_unlock(&image->lock);
+
+        acquire_slot(image, chunk, 1);
+
+        pthread_mutex_lock(&image->lock);
+    }
+    pthread_mutex_unlock(&image->lock);
+    return NULL;
+}
+
+/* Queues the chunks following 'chunk' for read-ahead if the chunk
+   directly follows the one read last, starting the worker threads the
+   first time. */
+static void read_ahead(zimage_t *image, uint64_t chunk) {
+
+    pthread_mutex_lock(&image->lock);
+
+    int sequential = image->last_chunk + 1 == (int64_t) chunk;
+    image->last_chunk = chunk;
+
+    if (sequential && !image->stop) {
+        if (image->num_workers == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            unsigned int wanted = cpus < 1 ? 1 : cpus > EXT2_ZIMAGE_MAX_WORKERS ? EXT2_ZIMAGE_MAX_WORKERS : cpus;
+
+            while (image->num_workers < wanted &&
+                   pthread_create(&image->workers[image->num_workers], NULL, worker_thread, image) == 0)
+                image->num_workers++;
+        }
+
+        // Chunks already queued ahead of this one are not queued again
+        int64_t next = chunk + 1, end = next + EXT2_ZIMAGE_READAHEAD;
+        if (image->queued_until > next && image->queued_until <= end) next = image->queued_until;
+        if (end > (int64_t) image->header.num_chunks) end = image->header.num_chunks;
+
+        for (; next < end && image->queue_count < EXT2_ZIMAGE_READAHEAD * 2; next++) {
+            image->queue[(image->queue_head + image->queue_count) % (EXT2_ZIMAGE_READAHEAD * 2)] = next;
+            image->queue_count++;
+        }
+        image->queued_until = next;
+        if (image->num_workers) pthread_cond_broadcast(&image->work);
+    }
+
+    pthread_mutex_unlock(&image->lock);
+}
+
+/* zimage_pread: Reads data from the volume file held by an image,
+   decompressing the chunks holding it if they are not cached.
+
+   Parameters:
+     image: Pointer to image.
+     buffer: Pointer to location where data is to be stored.
+     size: Number of bytes to read.
+     offset: Position in the volume file to read from.
+
+   Returns:
+     The number of bytes read, which is smaller than size only at the
+     end of the volume file, or -1 in case of error.
+ */
+ssize_t zimage_pread(zimage_t *image, void *buffer, size_t size, off_t offset) {
+
+    size_t done = 0;
+
+    if (offset < 0) return -1;
+    if ((uint64_t) offset >= image->header.image_size) return 0;
+    if (size > image->header.image_size - offset) size = image->header.image_size - offset;
+
+    while (done < size) {
+        uint64_t position = offset + done;
+        uint64_t chunk = position / image->header.chunk_size;
+        size_t skip = position % image->header.chunk_size;
+        size_t length = image->header.chunk_size - skip;
+        if (length > size - done) length = size - done;
+
+        read_ahead(image, chunk);
+
+        zimage_slot_t *slot = acquire_slot(image, chunk, 0);
+        if (!slot) return -1;
+        memcpy((char *) buffer + done, slot->data + skip, length);
+        release_slot(image, slot);
+
+        done += length;
+    }
+    return done;
+}
+
+/* zimage_stats: Reports how chunks of an image were read.
+
+   Parameters:
+     image: Pointer to image.
+     stats: Filled with the counts and the memory used by the cache.
+ */
+void zimage_stats(zimage_t *image, zimage_stats_t *stats) {
+
+    stats->hits = atomic_load(&image->hits);
+    stats->misses = atomic_load(&image->misses);
+    stats->prefetched = atomic_load(&image->prefetched);
+
+    pthread_mutex_lock(&image->lock);
+    stats->cache_bytes = (uint64_t) image->num_buffers * image->header.chunk_size;
+    pthread_mutex_unlock(&image->lock);
+}
+
+/* zimage_memory: Reports the memory used by the cache of an image,
+   for a memory governor.
+
+   Parameters:
+     image: Pointer to image.
+     usage: Filled with the bytes used by decompressed chunks, the
+            budget, and the reads that missed on chunks dropped to stay
+            within it.
+ */
+void zimage_memory(zimage_t *image, mem_usage_t *usage) {
+
+    pthread_mutex_lock(&image->lock);
+    usage->bytes = (uint64_t) image->num_buffers * image->header.chunk_size;
+    usage->budget = (uint64_t) image->max_buffers * image->header.chunk_size;
+    usage->ghost_hits = atomic_load_explicit(&image->ghost_hits, memory_order_relaxed);
+    usage->ghost_bytes = (uint64_t) image->num_ghosts * image->header.chunk_size;
+    pthread_mutex_unlock(&image->lock);
+}
+
+/* zimage_resize: Changes the memory budget of the cache of an image,
+   freeing the buffers of idle slots until the cache fits in it.
+   Buffers in use are kept until a later load takes them.
+
+   Parameters:
+     image: Pointer to image.
+     budget: Bytes the decompressed chunks may use. Rounded down to a
+             number of chunks, at most EXT2_ZIMAGE_SLOTS. With a budget
+             below one chunk, readers still get a buffer, but no chunk
+             is read ahead or kept once idle buffers can be taken.
+ */
+void zimage_resize(zimage_t *image, uint64_t budget) {
+
+    uint64_t buffers = budget / image->header.chunk_size;
+
+    pthread_mutex_lock(&image->lock);
+    image->max_buffers = buffers < EXT2_ZIMAGE_SLOTS ? buffers : EXT2_ZIMAGE_SLOTS;
+    while (image->num_buffers > image->max_buffers) {
+        char *data = take_buffer(image, NULL);
+        if (!data) break;
+        free(data);
+        image->num_buffers--;
+    }
+    pthread_mutex_unlock(&image->lock);
+}